@@ -52,6 +52,9 @@ public:
     virtual ~CLWBuffer() = default;
     
     size_t GetElementCount() const { return elementCount_; }
+
+    // Same memory object seen as holding its first elementCount elements
+    CLWBuffer<T> CreateView(size_t elementCount) const;
     
     operator ParameterHolder() const
     {
@@ -115,6 +118,12 @@ template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateFromClBuffer(cl_mem buffe
     return CLWBuffer(buffer, bufferSize / sizeof(T));
 }
 
+template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateView(size_t elementCount) const
+{
+    assert(elementCount <= elementCount_);
+    return CLWBuffer<T>(static_cast<cl_mem>(*this), elementCount);
+}
+
 template <typename T> CLWBuffer<T>::CLWBuffer(cl_mem buffer, size_t elementCount)
 : ReferenceCounter<cl_mem, clRetainMemObject, clReleaseMemObject>(buffer)
 , elementCount_(elementCount)
@@ -101,7 +101,7 @@ CLWEvent CLWContext::Launch1D(unsigned int idx, size_t globalSize, size_t localS
     for (unsigned i = 0; i < events.size(); ++i)
         eventsToWait[i] = events[i];
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 1, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -239,6 +239,12 @@ CLWDevice CLWContext::GetDevice(unsigned int idx) const
     return devices_[idx];
 }
 
+unsigned int CLWContext::AddCommandQueue(CLWDevice device)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(device, *this));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
 void CLWContext::InitCL()
 {
     std::for_each(devices_.begin(), devices_.end(),
@@ -281,3 +287,12 @@ void CLWContext::Flush(unsigned int idx) const
     cl_int status = clFlush(commandQueues_[idx]);
     ThrowIf(status != CL_SUCCESS, status, "clFlush failed");
 }
+
+CLWEvent CLWContext::EnqueueMarker(unsigned int idx) const
+{
+    cl_event event = nullptr;
+    cl_int status = clEnqueueMarkerWithWaitList(commandQueues_[idx], 0, nullptr, &event);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueMarkerWithWaitList failed");
+
+    return CLWEvent::Create(event);
+}
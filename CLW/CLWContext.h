@@ -91,12 +91,17 @@ public:
 
     void Finish(unsigned int idx) const;
     void Flush(unsigned int idx) const;
+    // Event completing once all the commands submitted to the queue so far are done
+    CLWEvent EnqueueMarker(unsigned int idx) const;
 
     // GL interop 
     void AcquireGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
     void ReleaseGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
 
     CLWCommandQueue GetCommandQueue(unsigned int idx) const { return commandQueues_[idx]; }
+    unsigned int GetCommandQueueCount() const { return (unsigned int)commandQueues_.size(); }
+    // Create one more queue on the device, its index is returned
+    unsigned int AddCommandQueue(CLWDevice device);
 
 private:
     void InitCL();
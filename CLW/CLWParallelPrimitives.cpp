@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <fstream>
 #include <algorithm>
 #include <cstring>
+#include <iterator>
 
 #ifdef RR_EMBED_KERNELS
 #if USE_OPENCL
@@ -39,9 +40,17 @@ THE SOFTWARE.
 #define NUM_SEG_SCAN_ELEMS_PER_WI 1
 #define NUM_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SCAN_ELEMS_PER_WI)
 #define NUM_SEG_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SEG_SCAN_ELEMS_PER_WI)
+// Smallest scratch buffer in elements
+#define MIN_TEMP_BUFFER_SIZE 64
+
+CLWParallelPrimitives::CLWParallelPrimitives()
+    : mutex_(new std::recursive_mutex)
+{
+}
 
 CLWParallelPrimitives::CLWParallelPrimitives(CLWContext context, char const* buildopts)
     : context_(context)
+    , mutex_(new std::recursive_mutex)
 {
 #ifndef RR_EMBED_KERNELS
     program_ = CLWProgram::CreateFromFile("../CLW/CL/CLW.cl", buildopts, context_);
@@ -64,7 +73,7 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddWG(unsigned int deviceIdx, CLWBu
     topLevelScan.SetArg(2, (cl_uint)numElems);
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
 
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
+    return context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, topLevelScan);
 }
 
 
@@ -78,7 +87,7 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx,
 
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSums = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSums = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
 
     CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_int4");
@@ -90,21 +99,23 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx,
     bottomLevelScan.SetArg(2, numElems);
     bottomLevelScan.SetArg(3, devicePartSums);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     topLevelScan.SetArg(0, devicePartSums);
     topLevelScan.SetArg(1, devicePartSums);
     topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSums.SetArg(0, devicePartSums);
     distributeSums.SetArg(1, output);
     distributeSums.SetArg(2, (cl_uint)numElems);
 
-    ReclaimTempIntBuffer(devicePartSums);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSums);
+
+    return event;
 }
 
 
@@ -118,8 +129,8 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     int NUM_GROUPS_BOTTOM_LEVEL_SCAN = (numElems + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
     int NUM_GROUPS_TOP_LEVEL_SCAN = (NUM_GROUPS_BOTTOM_LEVEL_SCAN + GROUP_BLOCK_SIZE_SCAN - 1) / GROUP_BLOCK_SIZE_SCAN;
 
-    auto devicePartSums = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlags = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSums = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlags = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
@@ -133,7 +144,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     bottomLevelScan.SetArg(4, devicePartSums);
     bottomLevelScan.SetArg(5, devicePartFlags);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     //std::vector<cl_int> hostPartSums(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //std::vector<cl_int> hostPartFlags(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
@@ -149,7 +160,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
     topLevelScan.SetArg(3, devicePartSums);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSums, &hostPartSums[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
 
@@ -157,7 +168,12 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddTwoLevel(unsigned int d
     distributeSums.SetArg(1, inputHeads);
     distributeSums.SetArg(2, numElems);
     distributeSums.SetArg(3, devicePartSums);
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, distributeSums);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, distributeSums);
+
+    ReclaimTempIntBuffer(deviceIdx, devicePartSums);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlags);
+
+    return event;
 
     //context_.ReadBuffer(0,  output, &hostResult[0], numElems).Wait();
 
@@ -186,10 +202,10 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlagsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
-    auto devicePartFlagsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartSumsBottomLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlagsBottomLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartFlagsMidLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
     CLWKernel midLevelScan = program_.GetKernel("segmented_scan_exclusive_int_nocut_part");
@@ -204,7 +220,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     bottomLevelScan.SetArg(4, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(5, devicePartFlagsBottomLevel);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     //std::vector<cl_int> hostPartSumsBL(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //std::vector<cl_int> hostPartFlagsBL(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
@@ -224,7 +240,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, midLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSumsMidLevel, &hostPartSumsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsMidLevel, &hostPartFlagsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
@@ -234,7 +250,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
     topLevelScan.SetArg(3, devicePartSumsMidLevel);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     //context_.ReadBuffer(0,  devicePartSumsMidLevel, &hostPartSumsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsMidLevel, &hostPartFlagsML[0], NUM_GROUPS_MID_LEVEL_SCAN).Wait();
@@ -244,7 +260,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     //context_.ReadBuffer(0,  devicePartSumsBottomLevel, &hostPartSumsBL[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
     //context_.ReadBuffer(0,  devicePartFlagsBottomLevel, &hostPartFlagsBL[0], NUM_GROUPS_BOTTOM_LEVEL_SCAN).Wait();
@@ -254,7 +270,14 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddThreeLevel(unsigned int
     distributeSumsBottomLevel.SetArg(2, numElems);
     distributeSumsBottomLevel.SetArg(3, devicePartSumsBottomLevel);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsBottomLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlagsBottomLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsMidLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlagsMidLevel);
+
+    return event;
 }
 
 
@@ -274,12 +297,12 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 = (NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartFlagsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel1 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_1);
-    auto devicePartFlagsMidLevel1 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_1);
-    auto devicePartSumsMidLevel2 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_2);
-    auto devicePartFlagsMidLevel2 = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN_2);
+    auto devicePartSumsBottomLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartFlagsBottomLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel1 = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_1);
+    auto devicePartFlagsMidLevel1 = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_1);
+    auto devicePartSumsMidLevel2 = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_2);
+    auto devicePartFlagsMidLevel2 = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_2);
 
     CLWKernel bottomLevelScan = program_.GetKernel("segmented_scan_exclusive_int_part");
     CLWKernel midLevelScan = program_.GetKernel("segmented_scan_exclusive_int_nocut_part");
@@ -294,7 +317,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     bottomLevelScan.SetArg(4, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(5, devicePartFlagsBottomLevel);
     bottomLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     midLevelScan.SetArg(0, devicePartSumsBottomLevel);
     midLevelScan.SetArg(1, devicePartFlagsBottomLevel);
@@ -304,7 +327,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel1);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN_1 * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_1 * WG_SIZE, WG_SIZE, midLevelScan);
 
     midLevelScan.SetArg(0, devicePartSumsMidLevel1);
     midLevelScan.SetArg(1, devicePartFlagsMidLevel1);
@@ -314,35 +337,44 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddFourLevel(unsigned int
     midLevelScan.SetArg(5, devicePartFlagsMidLevel2);
 
     midLevelScan.SetArg(6, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN_2 * WG_SIZE, WG_SIZE, midLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN_2 * WG_SIZE, WG_SIZE, midLevelScan);
 
     topLevelScan.SetArg(0, devicePartSumsMidLevel2);
     topLevelScan.SetArg(1, devicePartFlagsMidLevel2);
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel2.GetElementCount());
     topLevelScan.SetArg(3, devicePartSumsMidLevel2);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSumsMidLevel.SetArg(0, devicePartSumsMidLevel1);
     distributeSumsMidLevel.SetArg(1, devicePartFlagsMidLevel1);
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_MID_LEVEL_SCAN_1);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel2);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_2 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     distributeSumsMidLevel.SetArg(0, devicePartSumsBottomLevel);
     distributeSumsMidLevel.SetArg(1, devicePartFlagsBottomLevel);
     distributeSumsMidLevel.SetArg(2, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     distributeSumsMidLevel.SetArg(3, devicePartSumsMidLevel1);
 
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE_1 * WG_SIZE, WG_SIZE, distributeSumsMidLevel);
 
     distributeSumsBottomLevel.SetArg(0, output);
     distributeSumsBottomLevel.SetArg(1, inputHeads);
     distributeSumsBottomLevel.SetArg(2, numElems);
     distributeSumsBottomLevel.SetArg(3, devicePartSumsBottomLevel);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSumsBottomLevel);
+
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsBottomLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlagsBottomLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsMidLevel1);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlagsMidLevel1);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsMidLevel2);
+    ReclaimTempIntBuffer(deviceIdx, devicePartFlagsMidLevel2);
+
+    return event;
 }
 
 
@@ -360,8 +392,8 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceId
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempIntBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempIntBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartSumsBottomLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel = GetTempIntBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN);
 
     CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_int4");
     CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_int4");
@@ -372,34 +404,36 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceId
     bottomLevelScan.SetArg(2, numElems);
     bottomLevelScan.SetArg(3, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     bottomLevelScan.SetArg(0, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(1, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
     bottomLevelScan.SetArg(3, devicePartSumsMidLevel);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     topLevelScan.SetArg(0, devicePartSumsMidLevel);
     topLevelScan.SetArg(1, devicePartSumsMidLevel);
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSums.SetArg(0, devicePartSumsMidLevel);
     distributeSums.SetArg(1, devicePartSumsBottomLevel);
     distributeSums.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
     distributeSums.SetArg(0, devicePartSumsBottomLevel);
     distributeSums.SetArg(1, output);
     distributeSums.SetArg(2, (cl_uint)numElems);
 
-    ReclaimTempIntBuffer(devicePartSumsMidLevel);
-    ReclaimTempIntBuffer(devicePartSumsBottomLevel);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsMidLevel);
+    ReclaimTempIntBuffer(deviceIdx, devicePartSumsBottomLevel);
+
+    return event;
 }
 
 
@@ -413,7 +447,7 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddWG(unsigned int deviceIdx, CLWBu
     topLevelScan.SetArg(2, (cl_uint)numElems);
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
 
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
+    return context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, topLevelScan);
 }
 
 CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddWG(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output)
@@ -428,7 +462,7 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAddWG(unsigned int deviceI
     topLevelScan.SetArg(3, output);
     topLevelScan.SetArg(4, SharedMemory(WG_SIZE * (sizeof(cl_int) + sizeof(cl_char))));
 
-    return context_.Launch1D(0, WG_SIZE, WG_SIZE, topLevelScan);
+    return context_.Launch1D(deviceIdx, WG_SIZE, WG_SIZE, topLevelScan);
 }
 
 
@@ -442,7 +476,7 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx,
 
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSums = GetTempFloatBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSums = GetTempFloatBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
     //context_.CreateBuffer<cl_int>(NUM_GROUPS_BOTTOM_LEVEL);
 
     CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_float4");
@@ -454,21 +488,23 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddTwoLevel(unsigned int deviceIdx,
     bottomLevelScan.SetArg(2, numElems);
     bottomLevelScan.SetArg(3, devicePartSums);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     topLevelScan.SetArg(0, devicePartSums);
     topLevelScan.SetArg(1, devicePartSums);
     topLevelScan.SetArg(2, (cl_uint)devicePartSums.GetElementCount());
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSums.SetArg(0, devicePartSums);
     distributeSums.SetArg(1, output);
     distributeSums.SetArg(2, (cl_uint)numElems);
 
-    ReclaimTempFloatBuffer(devicePartSums);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    ReclaimTempFloatBuffer(deviceIdx, devicePartSums);
+
+    return event;
 }
 
 CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
@@ -483,8 +519,8 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceId
     int NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE = (numElems + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
     int NUM_GROUPS_MID_LEVEL_DISTRIBUTE = (NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE + GROUP_BLOCK_SIZE_DISTRIBUTE - 1) / GROUP_BLOCK_SIZE_DISTRIBUTE;
 
-    auto devicePartSumsBottomLevel = GetTempFloatBuffer(NUM_GROUPS_BOTTOM_LEVEL_SCAN);
-    auto devicePartSumsMidLevel = GetTempFloatBuffer(NUM_GROUPS_MID_LEVEL_SCAN);
+    auto devicePartSumsBottomLevel = GetTempFloatBuffer(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN);
+    auto devicePartSumsMidLevel = GetTempFloatBuffer(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN);
 
     CLWKernel bottomLevelScan = program_.GetKernel("scan_exclusive_part_float4");
     CLWKernel topLevelScan = program_.GetKernel("scan_exclusive_float4");
@@ -495,38 +531,42 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAddThreeLevel(unsigned int deviceId
     bottomLevelScan.SetArg(2, numElems);
     bottomLevelScan.SetArg(3, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     bottomLevelScan.SetArg(0, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(1, devicePartSumsBottomLevel);
     bottomLevelScan.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
     bottomLevelScan.SetArg(3, devicePartSumsMidLevel);
     bottomLevelScan.SetArg(4, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_SCAN * WG_SIZE, WG_SIZE, bottomLevelScan);
 
     topLevelScan.SetArg(0, devicePartSumsMidLevel);
     topLevelScan.SetArg(1, devicePartSumsMidLevel);
     topLevelScan.SetArg(2, (cl_uint)devicePartSumsMidLevel.GetElementCount());
     topLevelScan.SetArg(3, SharedMemory(WG_SIZE * sizeof(cl_int)));
-    context_.Launch1D(0, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_TOP_LEVEL_SCAN * WG_SIZE, WG_SIZE, topLevelScan);
 
     distributeSums.SetArg(0, devicePartSumsMidLevel);
     distributeSums.SetArg(1, devicePartSumsBottomLevel);
     distributeSums.SetArg(2, (cl_uint)devicePartSumsBottomLevel.GetElementCount());
-    context_.Launch1D(0, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    context_.Launch1D(deviceIdx, NUM_GROUPS_MID_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
     distributeSums.SetArg(0, devicePartSumsBottomLevel);
     distributeSums.SetArg(1, output);
     distributeSums.SetArg(2, (cl_uint)numElems);
 
-    ReclaimTempFloatBuffer(devicePartSumsMidLevel);
-    ReclaimTempFloatBuffer(devicePartSumsBottomLevel);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
 
-    return context_.Launch1D(0, NUM_GROUPS_BOTTOM_LEVEL_DISTRIBUTE * WG_SIZE, WG_SIZE, distributeSums);
+    ReclaimTempFloatBuffer(deviceIdx, devicePartSumsMidLevel);
+    ReclaimTempFloatBuffer(deviceIdx, devicePartSumsBottomLevel);
+
+    return event;
 }
 
 CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     if (numElems < NUM_SCAN_ELEMS_PER_WG)
     {
         return ScanExclusiveAddWG(deviceIdx, input, output, numElems);
@@ -549,6 +589,8 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuff
 
 CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     if (numElems <= NUM_SCAN_ELEMS_PER_WG)
     {
         return ScanExclusiveAddWG(deviceIdx, input, output, numElems);
@@ -572,6 +614,8 @@ CLWEvent CLWParallelPrimitives::ScanExclusiveAdd(unsigned int deviceIdx, CLWBuff
 
 CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     assert(input.GetElementCount() == output.GetElementCount());
 
     cl_uint numElems = (cl_uint)input.GetElementCount();
@@ -600,24 +644,26 @@ CLWEvent CLWParallelPrimitives::SegmentedScanExclusiveAdd(unsigned int deviceIdx
     return CLWEvent::Create(nullptr);
 }
 
-CLWBuffer<cl_int> CLWParallelPrimitives::GetTempIntBuffer(size_t size)
+CLWBuffer<cl_int> CLWParallelPrimitives::GetTempIntBuffer(unsigned int deviceIdx, size_t size)
 {
-    return GetTempBuffer<cl_int>(intBufferCache_, size);
+    return GetTempBuffer<cl_int>(intBufferCache_, deviceIdx, size);
 }
 
-CLWBuffer<char> CLWParallelPrimitives::GetTempCharBuffer(size_t size)
+CLWBuffer<char> CLWParallelPrimitives::GetTempCharBuffer(unsigned int deviceIdx, size_t size)
 {
-    return GetTempBuffer<char>(charBufferCache_, size);
+    return GetTempBuffer<char>(charBufferCache_, deviceIdx, size);
 }
 
-CLWBuffer<cl_float> CLWParallelPrimitives::GetTempFloatBuffer(size_t size)
+CLWBuffer<cl_float> CLWParallelPrimitives::GetTempFloatBuffer(unsigned int deviceIdx, size_t size)
 {
-    return GetTempBuffer<cl_float>(floatBufferCache_, size);
+    return GetTempBuffer<cl_float>(floatBufferCache_, deviceIdx, size);
 }
 
 CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys,
     CLWBuffer<cl_int> inputValues, CLWBuffer<cl_int> outputValues, int numElems)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     assert(inputKeys.GetElementCount() == outputKeys.GetElementCount());
     assert(inputValues.GetElementCount() == inputValues.GetElementCount());
 
@@ -626,9 +672,9 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
     int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
     int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
 
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeysBuffer = GetTempIntBuffer(numElems);
-    auto deviceTempValsBuffer = GetTempIntBuffer(numElems);
+    auto deviceHistograms = GetTempIntBuffer(deviceIdx, NUM_BLOCKS * 16);
+    auto deviceTempKeysBuffer = GetTempIntBuffer(deviceIdx, numElems);
+    auto deviceTempValsBuffer = GetTempIntBuffer(deviceIdx, numElems);
 
     auto fromKeys = &inputKeys;
     auto fromVals = &inputValues;
@@ -648,10 +694,10 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
         histogramKernel.SetArg(2, numElems);
         histogramKernel.SetArg(3, deviceHistograms);
 
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
+        context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
 
         // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, numElems);
+        ScanExclusiveAdd(deviceIdx, deviceHistograms, deviceHistograms, NUM_BLOCKS * 16);
 
         //context_.ReadBuffer(0, deviceHistograms, &hist[0], 16).Wait();
 
@@ -664,7 +710,7 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
         scatterKeysAndVals.SetArg(5, *toKeys);
         scatterKeysAndVals.SetArg(6, *toVals);
 
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
+        event = context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
 
         //context_.ReadBuffer(0, *toKeys, &keys[0], 64).Wait();
 
@@ -680,9 +726,9 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
     }
 
     // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempIntBuffer(deviceTempKeysBuffer);
-    ReclaimTempIntBuffer(deviceTempValsBuffer);
+    ReclaimTempIntBuffer(deviceIdx, deviceHistograms);
+    ReclaimTempIntBuffer(deviceIdx, deviceTempKeysBuffer);
+    ReclaimTempIntBuffer(deviceIdx, deviceTempValsBuffer);
 
     return event;
 }
@@ -690,12 +736,14 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
 CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
     CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
     int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
 
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeysBuffer = GetTempCharBuffer(numElems * 4);
-    auto deviceTempValsBuffer = GetTempCharBuffer(numElems * 4);
+    auto deviceHistograms = GetTempIntBuffer(deviceIdx, NUM_BLOCKS * 16);
+    auto deviceTempKeysBuffer = GetTempCharBuffer(deviceIdx, numElems * 4);
+    auto deviceTempValsBuffer = GetTempCharBuffer(deviceIdx, numElems * 4);
 
     auto fromKeys = &inputKeys;
     auto fromVals = &inputValues;
@@ -715,10 +763,10 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char
         histogramKernel.SetArg(2, numElems);
         histogramKernel.SetArg(3, deviceHistograms);
 
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
+        context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
 
         // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, numElems);
+        ScanExclusiveAdd(deviceIdx, deviceHistograms, deviceHistograms, NUM_BLOCKS * 16);
 
         //context_.ReadBuffer(0, deviceHistograms, &hist[0], 16).Wait();
 
@@ -731,7 +779,7 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char
         scatterKeysAndVals.SetArg(5, *toKeys);
         scatterKeysAndVals.SetArg(6, *toVals);
 
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
+        event = context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeysAndVals);
 
         //context_.ReadBuffer(0, *toKeys, &keys[0], 64).Wait();
 
@@ -747,9 +795,9 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char
     }
 
     // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempCharBuffer(deviceTempKeysBuffer);
-    ReclaimTempCharBuffer(deviceTempValsBuffer);
+    ReclaimTempIntBuffer(deviceIdx, deviceHistograms);
+    ReclaimTempCharBuffer(deviceIdx, deviceTempKeysBuffer);
+    ReclaimTempCharBuffer(deviceIdx, deviceTempValsBuffer);
 
     return event;
 }
@@ -757,6 +805,8 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char
 
 CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     assert(inputKeys.GetElementCount() == outputKeys.GetElementCount());
 
     cl_uint numElems = (cl_uint)inputKeys.GetElementCount();
@@ -764,8 +814,8 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
     int GROUP_BLOCK_SIZE = (WG_SIZE * 4 * 8);
     int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
 
-    auto deviceHistograms = GetTempIntBuffer(NUM_BLOCKS * 16);
-    auto deviceTempKeys = GetTempIntBuffer(numElems);
+    auto deviceHistograms = GetTempIntBuffer(deviceIdx, NUM_BLOCKS * 16);
+    auto deviceTempKeys = GetTempIntBuffer(deviceIdx, numElems);
 
     auto fromKeys = &inputKeys;
     auto toKeys = &deviceTempKeys;
@@ -783,10 +833,10 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
         histogramKernel.SetArg(2, numElems);
         histogramKernel.SetArg(3, deviceHistograms);
 
-        context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
+        context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, histogramKernel);
 
         // Scan histograms
-        ScanExclusiveAdd(0, deviceHistograms, deviceHistograms, static_cast<int>(deviceHistograms.GetElementCount()));
+        ScanExclusiveAdd(deviceIdx, deviceHistograms, deviceHistograms, static_cast<int>(deviceHistograms.GetElementCount()));
 
         // Scatter keys
         scatterKeys.SetArg(0, offset);
@@ -795,7 +845,7 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
         scatterKeys.SetArg(3, deviceHistograms);
         scatterKeys.SetArg(4, *toKeys);
 
-        event = context_.Launch1D(0, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeys);
+        event = context_.Launch1D(deviceIdx, NUM_BLOCKS*WG_SIZE, WG_SIZE, scatterKeys);
 
         if (offset == 0)
         {
@@ -807,8 +857,8 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
     }
 
     // Return buffers to memory manager
-    ReclaimTempIntBuffer(deviceHistograms);
-    ReclaimTempIntBuffer(deviceTempKeys);
+    ReclaimTempIntBuffer(deviceIdx, deviceHistograms);
+    ReclaimTempIntBuffer(deviceIdx, deviceTempKeys);
 
     // Return last copy event back to the user
     return event;
@@ -816,31 +866,39 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_i
 
 void CLWParallelPrimitives::ReclaimDeviceMemory()
 {
-    intBufferCache_.clear();
-    floatBufferCache_.clear();
-    charBufferCache_.clear();
-    float3_BufferCache_.clear();
+    // Moved from
+    if (!mutex_)
+    {
+        return;
+    }
+
+    TrimTempBuffers(intBufferCache_);
+    TrimTempBuffers(floatBufferCache_);
+    TrimTempBuffers(charBufferCache_);
+    TrimTempBuffers(float3_BufferCache_);
 }
 
-void CLWParallelPrimitives::ReclaimTempIntBuffer(CLWBuffer<cl_int> buffer)
+void CLWParallelPrimitives::ReclaimTempIntBuffer(unsigned int deviceIdx, CLWBuffer<cl_int> buffer)
 {
-    ReclaimTempBuffer<cl_int>(intBufferCache_, buffer);
+    ReclaimTempBuffer<cl_int>(intBufferCache_, deviceIdx, buffer);
 }
 
-void CLWParallelPrimitives::ReclaimTempCharBuffer(CLWBuffer<char> buffer)
+void CLWParallelPrimitives::ReclaimTempCharBuffer(unsigned int deviceIdx, CLWBuffer<char> buffer)
 {
-    ReclaimTempBuffer<char>(charBufferCache_, buffer);
+    ReclaimTempBuffer<char>(charBufferCache_, deviceIdx, buffer);
 }
 
-void CLWParallelPrimitives::ReclaimTempFloatBuffer(CLWBuffer<cl_float> buffer)
+void CLWParallelPrimitives::ReclaimTempFloatBuffer(unsigned int deviceIdx, CLWBuffer<cl_float> buffer)
 {
-    ReclaimTempBuffer<cl_float>(floatBufferCache_, buffer);
+    ReclaimTempBuffer<cl_float>(floatBufferCache_, deviceIdx, buffer);
 }
 
 CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, cl_int& newSize)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     /// Scan predicate array first to temp buffer
-    CLWBuffer<cl_int> addresses = GetTempIntBuffer(numElems);
+    CLWBuffer<cl_int> addresses = GetTempIntBuffer(deviceIdx, numElems);
 
     ScanExclusiveAdd(deviceIdx, predicate, addresses, numElems).Wait();
 
@@ -862,16 +920,20 @@ CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int
     compactKernel.SetArg(3, (cl_uint)numElems);
     compactKernel.SetArg(4, output);
 
-    /// TODO: unsafe as it is used in the kernel, may have problems on DMA devices
-    ReclaimTempIntBuffer(addresses);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
 
-    return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
+    /// Safe to reuse now, the next user of the buffer is on the same queue
+    ReclaimTempIntBuffer(deviceIdx, addresses);
+
+    return event;
 }
 
 CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, CLWBuffer<cl_int> newSize)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     /// Scan predicate array first to temp buffer
-    CLWBuffer<cl_int> addresses = GetTempIntBuffer(numElems);
+    CLWBuffer<cl_int> addresses = GetTempIntBuffer(deviceIdx, numElems);
 
     ScanExclusiveAdd(deviceIdx, predicate, addresses, numElems);
 
@@ -886,42 +948,120 @@ CLWEvent CLWParallelPrimitives::Compact(unsigned int deviceIdx, CLWBuffer<cl_int
     compactKernel.SetArg(4, output);
     compactKernel.SetArg(5, newSize);
 
-    /// TODO: unsafe as it is used in the kernel, may have problems on DMA devices
-    ReclaimTempIntBuffer(addresses);
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
+
+    /// Safe to reuse now, the next user of the buffer is on the same queue
+    ReclaimTempIntBuffer(deviceIdx, addresses);
 
-    return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, compactKernel);
+    return event;
 }
 
 template <class T>
-CLWBuffer<T> CLWParallelPrimitives::GetTempBuffer(std::map<size_t, CLWBuffer<T> > collection, size_t size)
+CLWBuffer<T> CLWParallelPrimitives::GetTempBuffer(TempBufferCache<T>& cache, unsigned int deviceIdx, size_t size)
 {
-    auto iter = collection.find(size);
+    // Size classes: 4 per power of two
+    size_t capacity = MIN_TEMP_BUFFER_SIZE;
+    if (size > capacity)
+    {
+        size_t pow2 = capacity;
+        while (pow2 * 2 < size)
+        {
+            pow2 *= 2;
+        }
 
-    if (iter != collection.end())
+        size_t step = pow2 / 4;
+        capacity = (size + step - 1) / step * step;
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
+    CLWBuffer<T> buffer;
+
+    // Only buffers released on the same queue are reused, in-order
+    // execution guarantees the commands using them are done by then
+    auto& free = cache.free[deviceIdx];
+    auto iter = free.find(capacity);
+    if (iter != free.end())
+    {
+        buffer = iter->second;
+        free.erase(iter);
+        cache.freeSize -= capacity;
+    }
+    else
     {
-        CLWBuffer<T> tmp = iter->second;
-        collection.erase(iter);
-        return tmp;
+        buffer = context_.CreateBuffer<T>(capacity, CL_MEM_READ_WRITE);
     }
 
-    return context_.CreateBuffer<T>(size, CL_MEM_READ_WRITE);
+    cache.used[buffer] = buffer;
+    cache.usedSize += capacity;
+    cache.highWaterMark = std::max(cache.highWaterMark, cache.usedSize);
+
+    // Kernels take the element count from the buffer
+    return buffer.CreateView(size);
 }
 
 template <class T>
-void CLWParallelPrimitives::ReclaimTempBuffer(std::map<size_t, CLWBuffer<T> > collection, CLWBuffer<T> buffer)
+void CLWParallelPrimitives::ReclaimTempBuffer(TempBufferCache<T>& cache, unsigned int deviceIdx, CLWBuffer<T> buffer)
 {
-    auto iter = collection.find(buffer.GetElementCount());
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
 
-    if (iter != collection.end())
+    auto iter = cache.used.find(buffer);
+
+    if (iter == cache.used.end())
     {
         return;
     }
 
-    collection[buffer.GetElementCount()] = buffer;
+    CLWBuffer<T> full = iter->second;
+    size_t capacity = full.GetElementCount();
+
+    cache.used.erase(iter);
+    cache.usedSize -= capacity;
+
+    // Keep no more than the peak usage, largest buffers go first
+    while (cache.freeSize + capacity > cache.highWaterMark)
+    {
+        auto largest = cache.free.end();
+        for (auto queue = cache.free.begin(); queue != cache.free.end(); ++queue)
+        {
+            if (!queue->second.empty() &&
+                (largest == cache.free.end() || std::prev(queue->second.end())->first > std::prev(largest->second.end())->first))
+            {
+                largest = queue;
+            }
+        }
+
+        if (largest == cache.free.end())
+        {
+            break;
+        }
+
+        auto last = std::prev(largest->second.end());
+        cache.freeSize -= last->first;
+        largest->second.erase(last);
+    }
+
+    if (cache.freeSize + capacity <= cache.highWaterMark)
+    {
+        cache.free[deviceIdx].emplace(capacity, full);
+        cache.freeSize += capacity;
+    }
+}
+
+template <class T>
+void CLWParallelPrimitives::TrimTempBuffers(TempBufferCache<T>& cache)
+{
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
+    cache.free.clear();
+    cache.freeSize = 0;
+    cache.highWaterMark = cache.usedSize;
 }
 
 CLWEvent CLWParallelPrimitives::Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
 {
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
     int ELEMS_PER_WI = 4;
     int GROUP_BLOCK_SIZE = (WG_SIZE * ELEMS_PER_WI);
     int NUM_BLOCKS = (numElems + GROUP_BLOCK_SIZE - 1) / GROUP_BLOCK_SIZE;
@@ -932,7 +1072,7 @@ CLWEvent CLWParallelPrimitives::Copy(unsigned int deviceIdx, CLWBuffer<cl_int> i
     copyKernel.SetArg(1, numElems);
     copyKernel.SetArg(2, output);
 
-    return context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, copyKernel);
+    return context_.Launch1D(deviceIdx, NUM_BLOCKS * WG_SIZE, WG_SIZE, copyKernel);
 }
 
 const float epsilon = 0.001f;
@@ -1049,7 +1189,9 @@ CLWEvent CLWParallelPrimitives::Normalize(const char* normalizeKernelName,
 
 CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
 {
-    CLWBuffer<cl_int> cache = GetTempIntBuffer(2);
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
+    CLWBuffer<cl_int> cache = GetTempIntBuffer(deviceIdx, 2);
 
     CLWEvent event = Normalize("buffer_normalization_int",
                                "reduction_min_int",
@@ -1060,13 +1202,15 @@ CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_i
                                numElems,
                                cache);
 
-    ReclaimTempIntBuffer(cache);
+    ReclaimTempIntBuffer(deviceIdx, cache);
     return event;
 }
 
 CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
 {
-    CLWBuffer<cl_float> cache = GetTempFloatBuffer(2);
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
+    CLWBuffer<cl_float> cache = GetTempFloatBuffer(deviceIdx, 2);
 
     CLWEvent event = Normalize("buffer_normalization_float",
                                "reduction_min_float",
@@ -1077,13 +1221,15 @@ CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_f
                                numElems,
                                cache);
 
-    ReclaimTempFloatBuffer(cache);
+    ReclaimTempFloatBuffer(deviceIdx, cache);
     return event;
 }
 
 CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_float3> input, CLWBuffer<cl_float3> output, int numElems)
 {
-    CLWBuffer<cl_float3> cache = GetTempBuffer<cl_float3>(float3_BufferCache_, 2);
+    std::lock_guard<std::recursive_mutex> lock(*mutex_);
+
+    CLWBuffer<cl_float3> cache = GetTempBuffer<cl_float3>(float3_BufferCache_, deviceIdx, 2);
 
     CLWEvent event = Normalize("buffer_normalization_float3",
                                "reduction_min_float3",
@@ -1094,6 +1240,6 @@ CLWEvent CLWParallelPrimitives::Normalize(unsigned int deviceIdx, CLWBuffer<cl_f
                                numElems,
                                cache);
 
-    ReclaimTempBuffer(float3_BufferCache_, cache);
+    ReclaimTempBuffer(float3_BufferCache_, deviceIdx, cache);
     return event;
 }
\ No newline at end of file
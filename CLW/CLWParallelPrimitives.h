@@ -27,14 +27,24 @@ THE SOFTWARE.
 #include "CLWEvent.h"
 #include "CLWBuffer.h"
 
+#include <map>
+#include <memory>
+#include <mutex>
+
 class CLWParallelPrimitives
 {
 public:
     // Create primitive instances for the context
     CLWParallelPrimitives(CLWContext context, char const* buildopts = nullptr);
-    CLWParallelPrimitives() = default;
+    CLWParallelPrimitives();
     ~CLWParallelPrimitives();
 
+    CLWParallelPrimitives(CLWParallelPrimitives&&) = default;
+    CLWParallelPrimitives& operator = (CLWParallelPrimitives&&) = default;
+
+    // Calls from several threads are serialized: each one sets kernel arguments
+    // and enqueues all its commands to the queue deviceIdx under a single lock
+
     ///  TODO: Make these templates at some point
     CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
     CLWEvent SegmentedScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> inputHeads, CLWBuffer<cl_int> output);
@@ -53,6 +63,7 @@ public:
     CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, CLWBuffer<cl_int> newSize);
     CLWEvent Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
 
+    // Release cached scratch memory, buffers in use are kept
     void ReclaimDeviceMemory();
 
     CLWEvent Normalize(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
@@ -75,20 +86,44 @@ protected:
     CLWEvent ScanExclusiveAddTwoLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
     CLWEvent ScanExclusiveAddThreeLevel(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
 
-    CLWBuffer<cl_int> GetTempIntBuffer(size_t size);
-    void              ReclaimTempIntBuffer(CLWBuffer<cl_int> buffer);
-    CLWBuffer<char> GetTempCharBuffer(size_t size);
-    void              ReclaimTempCharBuffer(CLWBuffer<char> buffer);
-    CLWBuffer<cl_float> GetTempFloatBuffer(size_t size);
-    void               ReclaimTempFloatBuffer(CLWBuffer<cl_float> buffer);
+    // Scratch buffers for the commands enqueued to the queue deviceIdx,
+    // a buffer can be reclaimed once the last command using it is enqueued
+    CLWBuffer<cl_int> GetTempIntBuffer(unsigned int deviceIdx, size_t size);
+    void              ReclaimTempIntBuffer(unsigned int deviceIdx, CLWBuffer<cl_int> buffer);
+    CLWBuffer<char> GetTempCharBuffer(unsigned int deviceIdx, size_t size);
+    void              ReclaimTempCharBuffer(unsigned int deviceIdx, CLWBuffer<char> buffer);
+    CLWBuffer<cl_float> GetTempFloatBuffer(unsigned int deviceIdx, size_t size);
+    void               ReclaimTempFloatBuffer(unsigned int deviceIdx, CLWBuffer<cl_float> buffer);
 
 private:
+    // Scratch buffers of one element type. Requests are rounded up to size classes
+    // and served with views of cached buffers. Released buffers are kept until
+    // they exceed the largest amount of scratch memory used at once so far.
+    // Released buffers are kept per queue: commands on an in-order queue
+    // complete before the ones enqueued later, so the buffer is not
+    // overwritten while the commands it was reclaimed after still run.
+    template <class T>
+    struct TempBufferCache
+    {
+        // Released buffers by queue and capacity
+        std::map<unsigned int, std::multimap<size_t, CLWBuffer<T>>> free;
+        // Buffers handed out by memory object
+        std::map<cl_mem, CLWBuffer<T>> used;
+        // Number of elements in free and used buffers
+        size_t freeSize = 0;
+        size_t usedSize = 0;
+        // Max usedSize seen
+        size_t highWaterMark = 0;
+    };
+
+    template <class T>
+    CLWBuffer<T> GetTempBuffer(TempBufferCache<T>& cache, unsigned int deviceIdx, size_t size);
 
     template <class T>
-    CLWBuffer<T> GetTempBuffer(std::map<size_t, CLWBuffer<T> > collection, size_t size);
+    void ReclaimTempBuffer(TempBufferCache<T>& cache, unsigned int deviceIdx, CLWBuffer<T> buffer);
 
     template <class T>
-    void ReclaimTempBuffer(std::map<size_t, CLWBuffer<T>> collection, CLWBuffer<T> buffer);
+    void TrimTempBuffers(TempBufferCache<T>& cache);
 
     template <class T>
     CLWEvent Reduction(const char* kernelName,
@@ -117,10 +152,14 @@ private:
     CLWContext context_;
     CLWProgram program_;
 
-    std::map<size_t, CLWBuffer<cl_int>> intBufferCache_;
-    std::map<size_t, CLWBuffer<char>> charBufferCache_;
-    std::map<size_t, CLWBuffer<cl_float>> floatBufferCache_;
-    std::map<size_t, CLWBuffer<cl_float3>> float3_BufferCache_;
+    TempBufferCache<cl_int> intBufferCache_;
+    TempBufferCache<char> charBufferCache_;
+    TempBufferCache<cl_float> floatBufferCache_;
+    TempBufferCache<cl_float3> float3_BufferCache_;
+    // Held by every public call from the first SetArg to the last enqueue:
+    // kernels from program_ are shared, so concurrent calls would race on
+    // their arguments. Also guards the caches, calls nest (Compact scans)
+    std::unique_ptr<std::recursive_mutex> mutex_;
 };
 
 
@@ -225,6 +225,37 @@ CLWProgram CLWProgram::CreateFromBinary(std::uint8_t** binaries, std::size_t* bi
 
 }
 
+CLWProgram CLWProgram::CreateFromBinary(std::uint8_t const* binary, std::size_t binary_size, CLWDevice device, CLWContext context)
+{
+    cl_int status = CL_SUCCESS;
+    cl_int binary_status = CL_SUCCESS;
+    cl_device_id device_id = device.GetID();
+
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, &binary_size, &binary, &binary_status, &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateProgramWithBinary failed");
+
+    if (binary_status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        throw CLWException(binary_status, "clCreateProgramWithBinary failed: invalid binary");
+    }
+
+    status = clBuildProgram(program, 1, &device_id, nullptr, nullptr, nullptr);
+
+    if (status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        throw CLWException(status, "clBuildProgram failed for program binary");
+    }
+
+    CLWProgram prg(program);
+
+    clReleaseProgram(program);
+
+    return prg;
+}
+
 CLWProgram CLWProgram::CreateFromFile(char const* filename, char const* buildopts, CLWContext context)
 {
     std::vector<char> sourcecode;
@@ -344,7 +375,7 @@ void CLWProgram::GetBinaries(int device, std::vector<std::uint8_t>& data) const
     }
 
     status = clGetProgramInfo(*this, CL_PROGRAM_BINARIES,
-        sizeof(char*),
+        sizeof(char*) * num_devices,
         temp,
         nullptr);
 
@@ -355,7 +386,7 @@ void CLWProgram::GetBinaries(int device, std::vector<std::uint8_t>& data) const
     {
         if (i != device)
         {
-            delete temp[i];
+            delete [] temp[i];
         }
     }
 
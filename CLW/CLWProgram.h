@@ -39,6 +39,7 @@ THE SOFTWARE.
 #include "ReferenceCounter.h"
 
 class CLWContext;
+class CLWDevice;
 
 class CLWProgram : public ReferenceCounter<cl_program, clRetainProgram, clReleaseProgram>
 {
@@ -64,6 +65,8 @@ public:
                                      CLWContext context);
 
     static CLWProgram CreateFromBinary(std::uint8_t** binaries, std::size_t* binary_sizes, CLWContext context);
+    // Create the program for a single device of the context
+    static CLWProgram CreateFromBinary(std::uint8_t const* binary, std::size_t binary_size, CLWDevice device, CLWContext context);
 
     CLWProgram() = default;
     virtual ~CLWProgram() = default;
@@ -55,6 +55,20 @@ namespace Calc
         bool has_fp16;
     };
 
+    // Device buffer pool occupancy
+    struct PoolStatistics
+    {
+        // Bytes and number of buffers handed out
+        std::size_t used_size;
+        std::size_t num_used;
+        // Bytes and number of released buffers kept for reuse
+        std::size_t retained_size;
+        std::size_t num_retained;
+        // Requests served from retained buffers and by the driver
+        std::size_t num_hits;
+        std::size_t num_allocations;
+    };
+
     // Main interface to control compute device
     //    * Can create buffers
     //    * Move data from system memory and back
@@ -75,7 +89,13 @@ namespace Calc
         virtual Buffer* CreateBuffer(std::size_t size, std::uint32_t flags) = 0;
         // Create buffer having initial data
         virtual Buffer* CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata) = 0;
+        // Released buffers are kept for reuse by later requests once the work already
+        // submitted to the device queues is complete, so a buffer can be deleted right
+        // after the commands using it are enqueued, GetSize returns its allocated size
         virtual void DeleteBuffer(Buffer* buffer) = 0;
+        // Memory kept in released buffers (bytes), 0 frees released buffers right away
+        virtual void SetBufferPoolLimit(std::size_t limit) = 0;
+        virtual void GetBufferPoolStatistics(PoolStatistics& stats) const = 0;
 
         // Data movement
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
@@ -99,10 +119,14 @@ namespace Calc
         // Executable management
         virtual size_t GetExecutableBinarySize(Executable const* executable) const = 0;
         virtual void GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const = 0;
+        // Directory to keep compiled executables in across runs, empty path disables caching
+        virtual void SetExecutableCachePath(char const* path) = 0;
 
         // Execution
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
         virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) = 0;
+        // Same, execution starts once wait_event is resolved (nullptr for no dependency)
+        virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event const* wait_event, Event** e) = 0;
 
         // Events handling
         virtual void WaitForEvent(Event* e) = 0;
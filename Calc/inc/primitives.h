@@ -34,6 +34,9 @@ namespace Calc
         virtual ~Primitives() = default;
 
         virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Copy input elements with non-zero predicate to the beginning of output keeping their order,
+        // their number is written into new_size buffer, so the host doesn't need to wait for the result
+        virtual void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* input, Buffer* output, std::size_t size, Buffer* new_size) = 0;
 
 
     private:
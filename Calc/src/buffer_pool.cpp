@@ -0,0 +1,253 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "buffer_pool.h"
+
+#include <iterator>
+
+// Smallest size class in bytes
+#define MIN_CLASS_SIZE 256
+// Default amount of memory kept in released buffers
+#define DEFAULT_RETAIN_LIMIT (256u << 20)
+
+namespace Calc
+{
+    BufferPool::BufferPool(CreateFunc create, DestroyFunc destroy)
+        : m_create(create)
+        , m_destroy(destroy)
+        , m_retain_limit(DEFAULT_RETAIN_LIMIT)
+        , m_stats()
+    {
+    }
+
+    BufferPool::~BufferPool()
+    {
+        Trim();
+    }
+
+    std::size_t BufferPool::GetClassSize(std::size_t size)
+    {
+        if (size <= MIN_CLASS_SIZE)
+        {
+            return MIN_CLASS_SIZE;
+        }
+
+        // Split each power of two range into 4 classes
+        std::size_t pow2 = MIN_CLASS_SIZE;
+        while (pow2 * 2 < size)
+        {
+            pow2 *= 2;
+        }
+
+        auto step = pow2 / 4;
+        return (size + step - 1) / step * step;
+    }
+
+    Buffer* BufferPool::Acquire(std::size_t size, std::uint32_t flags)
+    {
+        Key key(GetClassSize(size), flags);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        Collect();
+
+        auto iter = m_free.find(key);
+        if (iter != m_free.end())
+        {
+            auto buffer = iter->second.back();
+            iter->second.pop_back();
+
+            if (iter->second.empty())
+            {
+                m_free.erase(iter);
+            }
+
+            m_used.emplace(buffer, key);
+
+            m_stats.retained_size -= key.first;
+            --m_stats.num_retained;
+            m_stats.used_size += key.first;
+            ++m_stats.num_used;
+            ++m_stats.num_hits;
+
+            return buffer;
+        }
+
+        // Creation might be slow, do not block other threads
+        lock.unlock();
+
+        Buffer* buffer = nullptr;
+        try
+        {
+            buffer = m_create(key.first, flags);
+        }
+        catch (...)
+        {
+            // Out of memory most likely, give the retained memory back and retry once
+            Trim();
+            buffer = m_create(key.first, flags);
+        }
+
+        lock.lock();
+
+        m_used.emplace(buffer, key);
+
+        m_stats.used_size += key.first;
+        ++m_stats.num_used;
+        ++m_stats.num_allocations;
+
+        return buffer;
+    }
+
+    void BufferPool::Release(Buffer* buffer, Fence fence)
+    {
+        if (!buffer)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto iter = m_used.find(buffer);
+        if (iter == m_used.end())
+        {
+            lock.unlock();
+            m_destroy(buffer);
+            return;
+        }
+
+        auto key = iter->second;
+        m_used.erase(iter);
+
+        m_stats.used_size -= key.first;
+        --m_stats.num_used;
+
+        if (key.first > m_retain_limit)
+        {
+            lock.unlock();
+            m_destroy(buffer);
+            return;
+        }
+
+        Evict(key.first);
+
+        if (fence)
+        {
+            m_pending.push_back(Pending{ buffer, key, std::move(fence) });
+        }
+        else
+        {
+            m_free[key].push_back(buffer);
+        }
+
+        m_stats.retained_size += key.first;
+        ++m_stats.num_retained;
+    }
+
+    void BufferPool::Collect()
+    {
+        // Queues are independent, so fences do not necessarily complete in order
+        auto iter = m_pending.begin();
+        while (iter != m_pending.end())
+        {
+            if (iter->fence())
+            {
+                m_free[iter->key].push_back(iter->buffer);
+                iter = m_pending.erase(iter);
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+    }
+
+    void BufferPool::Evict(std::size_t extra)
+    {
+        // Largest classes go first
+        while (!m_free.empty() && m_stats.retained_size + extra > m_retain_limit)
+        {
+            auto iter = std::prev(m_free.end());
+            auto buffer = iter->second.back();
+            iter->second.pop_back();
+
+            m_stats.retained_size -= iter->first.first;
+            --m_stats.num_retained;
+
+            if (iter->second.empty())
+            {
+                m_free.erase(iter);
+            }
+
+            m_destroy(buffer);
+        }
+
+        // Then the ones still in flight, oldest first
+        while (!m_pending.empty() && m_stats.retained_size + extra > m_retain_limit)
+        {
+            auto& pending = m_pending.front();
+
+            m_stats.retained_size -= pending.key.first;
+            --m_stats.num_retained;
+
+            m_destroy(pending.buffer);
+            m_pending.pop_front();
+        }
+    }
+
+    void BufferPool::Trim()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto& free : m_free)
+        {
+            for (auto buffer : free.second)
+            {
+                m_destroy(buffer);
+            }
+        }
+
+        for (auto& pending : m_pending)
+        {
+            m_destroy(pending.buffer);
+        }
+
+        m_free.clear();
+        m_pending.clear();
+        m_stats.retained_size = 0;
+        m_stats.num_retained = 0;
+    }
+
+    void BufferPool::SetRetainLimit(std::size_t limit)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_retain_limit = limit;
+        Evict(0);
+    }
+
+    void BufferPool::GetStatistics(PoolStatistics& stats) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        stats = m_stats;
+    }
+}
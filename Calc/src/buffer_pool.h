@@ -0,0 +1,109 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "device.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Calc
+{
+    class Buffer;
+
+    // Keeps released device buffers around for reuse, so the same sizes
+    // requested over and over (e.g. on every scene commit) do not hit the driver.
+    // Requests are rounded up to size classes (4 classes per power of two),
+    // released buffers are kept per class and creation flags until
+    // the retain limit is reached, the largest ones are dropped first.
+    // A buffer released with a fence is not handed out again until the fence
+    // reports the device is done with it, destroying it earlier must be safe.
+    // Buffers are created and destroyed by device supplied callbacks.
+    class BufferPool
+    {
+    public:
+        using CreateFunc = std::function<Buffer*(std::size_t size, std::uint32_t flags)>;
+        using DestroyFunc = std::function<void(Buffer* buffer)>;
+        // Returns true once the work submitted before the release is complete
+        using Fence = std::function<bool()>;
+
+        BufferPool(CreateFunc create, DestroyFunc destroy);
+        ~BufferPool();
+
+        // Get a buffer of at least size bytes
+        Buffer* Acquire(std::size_t size, std::uint32_t flags);
+        // Return the buffer to the pool, buffers not coming from
+        // the pool (e.g. created from native handles) are destroyed
+        void Release(Buffer* buffer, Fence fence = Fence());
+
+        // Destroy all retained buffers
+        void Trim();
+        // Maximum amount of memory kept in released buffers, 0 disables retention
+        void SetRetainLimit(std::size_t limit);
+        void GetStatistics(PoolStatistics& stats) const;
+
+        // Size actually allocated for a request
+        static std::size_t GetClassSize(std::size_t size);
+
+        BufferPool(BufferPool const&) = delete;
+        BufferPool& operator = (BufferPool const&) = delete;
+
+    private:
+        // Class size and creation flags
+        using Key = std::pair<std::size_t, std::uint32_t>;
+
+        // Buffer waiting for its fence
+        struct Pending
+        {
+            Buffer* buffer;
+            Key key;
+            Fence fence;
+        };
+
+        // Drop retained buffers until extra bytes more fit into the limit
+        void Evict(std::size_t extra);
+        // Move pending buffers with completed fences to the free lists
+        void Collect();
+
+        CreateFunc m_create;
+        DestroyFunc m_destroy;
+
+        // Buffers handed out
+        std::unordered_map<Buffer*, Key> m_used;
+        // Released buffers ready for reuse
+        std::map<Key, std::vector<Buffer*>> m_free;
+        // Released buffers possibly still in use by the device, oldest first
+        std::deque<Pending> m_pending;
+
+        std::size_t m_retain_limit;
+        PoolStatistics m_stats;
+
+        mutable std::mutex m_mutex;
+    };
+}
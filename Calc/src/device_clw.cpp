@@ -28,6 +28,17 @@ THE SOFTWARE.
 #include "executable.h"
 #include "except_clw.h"
 #include "calc_clw_common.h"
+#include "file_utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <vector>
 
 namespace Calc
 {    
@@ -59,6 +70,7 @@ namespace Calc
         bool IsComplete() const override;
 
         void SetEvent(CLWEvent event);
+        CLWEvent GetEvent() const { return m_event; }
 
     private:
         CLWEvent m_event;
@@ -176,6 +188,8 @@ namespace Calc
         Function* CreateFunction(char const* name) override;
         void DeleteFunction(Function* func) override;
 
+        CLWProgram GetProgram() const { return m_program; }
+
     private:
         CLWProgram m_program;
     };
@@ -207,23 +221,67 @@ namespace Calc
     DeviceClw::DeviceClw(CLWDevice device)
         : m_device(device)
         , m_context(CLWContext::Create(device))
+        , m_buffer_pool(
+            [this](std::size_t size, std::uint32_t flags) { return CreateBufferClw(size, flags); },
+            [](Buffer* buffer) { delete buffer; })
     {
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
             m_event_pool.push(new EventClw());
         }
+
+        // Program cache can be enabled for the whole process
+        if (auto path = std::getenv("RR_KERNEL_CACHE_PATH"))
+        {
+            m_cache_path = path;
+        }
+
+        // Additional queues for work which can overlap
+        try
+        {
+            for (auto i = m_context.GetCommandQueueCount(); i < NUM_QUEUES; ++i)
+            {
+                m_context.AddCommandQueue(m_device);
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
     
     DeviceClw::DeviceClw(CLWDevice device, CLWContext context)
     : m_device(device)
     , m_context(context)
+    , m_buffer_pool(
+        [this](std::size_t size, std::uint32_t flags) { return CreateBufferClw(size, flags); },
+        [](Buffer* buffer) { delete buffer; })
     {
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
             m_event_pool.push(new EventClw());
         }
+
+        // Program cache can be enabled for the whole process
+        if (auto path = std::getenv("RR_KERNEL_CACHE_PATH"))
+        {
+            m_cache_path = path;
+        }
+
+        // Additional queues for work which can overlap
+        try
+        {
+            for (auto i = m_context.GetCommandQueueCount(); i < NUM_QUEUES; ++i)
+            {
+                m_context.AddCommandQueue(m_device);
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     DeviceClw::~DeviceClw()
@@ -251,9 +309,10 @@ namespace Calc
         spec.max_local_size = m_device.GetMaxWorkGroupSize();
 
         spec.has_fp16 = (m_device.GetExtensions().find("cl_khr_fp16") != std::string::npos);
+        spec.max_num_queues = m_context.GetCommandQueueCount();
     }
 
-    Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
+    Buffer* DeviceClw::CreateBufferClw(std::size_t size, std::uint32_t flags)
     {
         try
         {
@@ -265,21 +324,74 @@ namespace Calc
         }
     }
 
+    Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
+    {
+        return m_buffer_pool.Acquire(size, flags);
+    }
+
     Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata)
     {
+        auto buffer = m_buffer_pool.Acquire(size, flags);
+
         try
         {
-            return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | CL_MEM_COPY_HOST_PTR, initdata));
+            m_context.WriteBuffer(0, static_cast<BufferClw*>(buffer)->GetData(), static_cast<char*>(initdata), 0, size).Wait();
         }
         catch (CLWException& e)
         {
+            m_buffer_pool.Release(buffer);
             throw ExceptionClw(e.what());
         }
+
+        return buffer;
     }
 
     void DeviceClw::DeleteBuffer(Buffer* buffer)
     {
-        delete buffer;
+        if (!buffer)
+        {
+            return;
+        }
+
+        // Commands already enqueued might still use the buffer, it is recycled
+        // only after markers on all the queues complete
+        std::vector<CLWEvent> markers;
+        try
+        {
+            for (auto i = 0u; i < m_context.GetCommandQueueCount(); ++i)
+            {
+                markers.push_back(m_context.EnqueueMarker(i));
+                m_context.Flush(i);
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+
+        m_buffer_pool.Release(buffer, [markers]()
+        {
+            for (auto const& marker : markers)
+            {
+                // Failed commands do not touch the buffer either
+                if (marker.GetCommandExecutionStatus() > CL_COMPLETE)
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        });
+    }
+
+    void DeviceClw::SetBufferPoolLimit(std::size_t limit)
+    {
+        m_buffer_pool.SetRetainLimit(limit);
+    }
+
+    void DeviceClw::GetBufferPoolStatistics(PoolStatistics& stats) const
+    {
+        m_buffer_pool.GetStatistics(stats);
     }
 
     void DeviceClw::ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const
@@ -366,42 +478,237 @@ namespace Calc
         }
     }
 
-    Executable* DeviceClw::CompileExecutable(char const* source_code, std::size_t size, char const* options)
+    // Program cache file header
+    struct ProgramCacheHeader
     {
-        try
+        char magic[8];
+        std::uint64_t key;
+        std::uint64_t size;
+    };
+
+    static char const kProgramCacheMagic[8] = { 'R', 'R', 'C', 'L', 'P', 'R', 'G', '1' };
+
+    // FNV-1a, sources are small enough for a bytewise hash
+    static std::uint64_t HashString(std::uint64_t h, std::string const& str)
+    {
+        for (auto c : str)
         {
-            std::string buildopts = options ? options : "";
+            h ^= static_cast<unsigned char>(c);
+            h *= 0x100000001b3ull;
+        }
 
-            buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
+        // Separate consecutive strings
+        h ^= str.size();
+        h *= 0x100000001b3ull;
+        return h;
+    }
+
+    static bool LoadFile(char const* filename, std::string& contents)
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
 
-            bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
-                m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
 
-            bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
+    // Append the file along with everything it includes to source, each file once.
+    // Includes are looked up the way the compiler does with "-I .": relative
+    // to the working directory first and to the including file then.
+    // Returns false if any of the files could not be found.
+    static bool LoadFileWithIncludes(std::string const& filename, std::set<std::string>& loaded, std::string& source)
+    {
+        if (!loaded.insert(filename).second)
+        {
+            return true;
+        }
 
-            if (isamd)
+        std::string contents;
+        if (!LoadFile(filename.c_str(), contents))
+        {
+            return false;
+        }
+
+        source.append(filename).append(contents);
+
+        auto slash = filename.find_last_of("/\\");
+        auto dir = slash == std::string::npos ? std::string() : filename.substr(0, slash + 1);
+
+        std::istringstream lines(contents);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            auto pos = line.find_first_not_of(" \t");
+            if (pos == std::string::npos || line[pos] != '#')
             {
-                buildopts.append(" -D AMD ");
+                continue;
             }
 
-            if (has_mediaops)
+            pos = line.find_first_not_of(" \t", pos + 1);
+            if (pos == std::string::npos || line.compare(pos, 7, "include") != 0)
             {
-                buildopts.append(" -D AMD_MEDIA_OPS ");
+                continue;
             }
 
-            buildopts.append(
+            auto first = line.find_first_of("<\"", pos + 7);
+            if (first == std::string::npos)
+            {
+                continue;
+            }
+
+            auto last = line.find(line[first] == '<' ? '>' : '"', first + 1);
+            if (last == std::string::npos)
+            {
+                return false;
+            }
+
+            auto name = line.substr(first + 1, last - first - 1);
+            std::ifstream probe(name);
+            auto path = probe ? name : dir + name;
+
+            if (!LoadFileWithIncludes(path, loaded, source))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::string DeviceClw::GetBuildOptions(char const* options) const
+    {
+        std::string buildopts = options ? options : "";
+
+        buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
+
+        bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
+            m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
+
+        bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
+
+        if (isamd)
+        {
+            buildopts.append(" -D AMD ");
+        }
+
+        if (has_mediaops)
+        {
+            buildopts.append(" -D AMD_MEDIA_OPS ");
+        }
+
+        buildopts.append(
 #if defined(__APPLE__)
-                "-D APPLE "
+            "-D APPLE "
 #elif defined(_WIN32) || defined (WIN32)
-                "-D WIN32 "
+            "-D WIN32 "
 #elif defined(__linux__)
-                "-D __linux__ "
+            "-D __linux__ "
 #else
-                ""
+            ""
 #endif
-                );
+            );
+
+        return buildopts;
+    }
+
+    int DeviceClw::GetDeviceIndex() const
+    {
+        for (auto i = 0u; i < m_context.GetDeviceCount(); ++i)
+        {
+            if (m_context.GetDevice(i).GetID() == m_device.GetID())
+            {
+                return static_cast<int>(i);
+            }
+        }
+
+        return 0;
+    }
+
+    CLWProgram DeviceClw::CompileCached(std::string const& source, std::string const& buildopts,
+        std::function<CLWProgram()> const& compile) const
+    {
+        if (m_cache_path.empty())
+        {
+            return compile();
+        }
+
+        // Binaries are only valid for the same device and driver
+        auto key = HashString(0xcbf29ce484222325ull, source);
+        key = HashString(key, buildopts);
+        key = HashString(key, m_device.GetName());
+        key = HashString(key, m_device.GetVendor());
+        key = HashString(key, m_device.GetVersion());
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.clbin", static_cast<unsigned long long>(key));
+        auto filename = m_cache_path + "/" + name;
 
-            return new ExecutableClw(CLWProgram::CreateFromSource(source_code, size, buildopts.c_str(), m_context));
+        std::string contents;
+        if (LoadFile(filename.c_str(), contents) && contents.size() > sizeof(ProgramCacheHeader))
+        {
+            ProgramCacheHeader header;
+            std::memcpy(&header, contents.data(), sizeof(header));
+
+            if (std::memcmp(header.magic, kProgramCacheMagic, sizeof(kProgramCacheMagic)) == 0 &&
+                header.key == key &&
+                header.size == contents.size() - sizeof(header))
+            {
+                try
+                {
+                    return CLWProgram::CreateFromBinary(
+                        reinterpret_cast<std::uint8_t const*>(contents.data()) + sizeof(header),
+                        static_cast<std::size_t>(header.size), m_device, m_context);
+                }
+                catch (CLWException&)
+                {
+                    // Driver rejected the binary, rebuild it from source
+                }
+            }
+        }
+
+        auto program = compile();
+
+        // Failing to store the binary only costs a compile next time
+        try
+        {
+            std::vector<std::uint8_t> binary;
+            program.GetBinaries(GetDeviceIndex(), binary);
+
+            if (!binary.empty())
+            {
+                ProgramCacheHeader header;
+                std::memcpy(header.magic, kProgramCacheMagic, sizeof(kProgramCacheMagic));
+                header.key = key;
+                header.size = binary.size();
+
+                // Concurrent processes never load a partially written binary
+                WriteFileAtomic(filename, [&](std::ostream& out)
+                {
+                    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                    out.write(reinterpret_cast<char const*>(binary.data()), binary.size());
+                });
+            }
+        }
+        catch (CLWException&)
+        {
+        }
+
+        return program;
+    }
+
+    Executable* DeviceClw::CompileExecutable(char const* source_code, std::size_t size, char const* options)
+    {
+        try
+        {
+            auto buildopts = GetBuildOptions(options);
+
+            return new ExecutableClw(CompileCached(std::string(source_code, size), buildopts, [&]()
+            {
+                return CLWProgram::CreateFromSource(source_code, size, buildopts.c_str(), m_context);
+            }));
         }
         catch (CLWException& e)
         {
@@ -418,40 +725,25 @@ namespace Calc
     {
         try
         {
-            std::string buildopts = options ? options : "";
+            auto buildopts = GetBuildOptions(options);
 
-            buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
-
-            bool isamd = m_device.GetVendor().find("AMD") != std::string::npos ||
-                m_device.GetVendor().find("Advanced Micro Devices") != std::string::npos;
-
-            bool has_mediaops = m_device.GetExtensions().find("cl_amd_media_ops2") != std::string::npos;
-
-            if (isamd)
+            auto compile = [&]()
             {
-                buildopts.append(" -D AMD ");
-            }
+                return CLWProgram::CreateFromFile(filename, headernames, numheaders, buildopts.c_str(), m_context);
+            };
 
-            if (has_mediaops)
+            // Headers and included files are part of the source as far as the cache
+            // is concerned, the program is not cached if any of them is missing
+            std::string source;
+            std::set<std::string> files;
+            bool loaded = LoadFileWithIncludes(filename, files, source);
+
+            for (int i = 0; i < numheaders && loaded; ++i)
             {
-                buildopts.append(" -D AMD_MEDIA_OPS ");
+                loaded = LoadFileWithIncludes(headernames[i], files, source);
             }
 
-            buildopts.append(
-#if defined(__APPLE__)
-                "-D APPLE " 
-#elif defined(_WIN32) || defined (WIN32)
-                "-D WIN32 "
-#elif defined(__linux__)
-                "-D __linux__ "
-#else
-                ""
-#endif
-                );
-
-            return new ExecutableClw(
-                                     CLWProgram::CreateFromFile(filename, headernames, numheaders, buildopts.c_str(), m_context)
-                                     );
+            return new ExecutableClw(loaded ? CompileCached(source, buildopts, compile) : compile());
         }
         catch (CLWException& e)
         {
@@ -461,7 +753,14 @@ namespace Calc
 
     Executable* DeviceClw::CompileExecutable(std::uint8_t const* binary_code, std::size_t size, char const* options)
     {
-        return nullptr;
+        try
+        {
+            return new ExecutableClw(CLWProgram::CreateFromBinary(binary_code, size, m_device, m_context));
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::DeleteExecutable(Executable* executable)
@@ -471,12 +770,35 @@ namespace Calc
 
     size_t DeviceClw::GetExecutableBinarySize(Executable const* executable) const
     {
-        return 0;
+        try
+        {
+            std::vector<std::uint8_t> binary;
+            static_cast<ExecutableClw const*>(executable)->GetProgram().GetBinaries(GetDeviceIndex(), binary);
+            return binary.size();
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const
     {
+        try
+        {
+            std::vector<std::uint8_t> data;
+            static_cast<ExecutableClw const*>(executable)->GetProgram().GetBinaries(GetDeviceIndex(), data);
+            std::copy(data.begin(), data.end(), binary);
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
 
+    void DeviceClw::SetExecutableCachePath(char const* path)
+    {
+        m_cache_path = path ? path : "";
     }
 
     void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
@@ -500,6 +822,35 @@ namespace Calc
         }
     }
 
+    void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event const* wait_event, Event** e)
+    {
+        if (!wait_event)
+        {
+            Execute(func, queue, global_size, local_size, e);
+            return;
+        }
+
+        auto func_clw = static_cast<FunctionClw const*>(func);
+        auto wait_event_clw = static_cast<EventClw const*>(wait_event);
+
+        try
+        {
+            // Dependency is resolved on the device, so the host does not block
+            CLWEvent event = m_context.Launch1D(queue, global_size, local_size, func_clw->GetKernel(), wait_event_clw->GetEvent());
+
+            if (e)
+            {
+                auto event_clw = CreateEventClw();
+                event_clw->SetEvent(event);
+                *e = event_clw;
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
     void DeviceClw::WaitForEvent(Event* e)
     {
         e->Wait();
@@ -624,6 +975,22 @@ namespace Calc
             m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size);
         }
 
+        void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* input, Buffer* output, std::size_t size, Buffer* new_size) override
+        {
+            auto predicate_clw = static_cast<BufferClw const*>(predicate);
+            auto input_clw = static_cast<BufferClw const*>(input);
+            auto output_clw = static_cast<BufferClw*>(output);
+            auto new_size_clw = static_cast<BufferClw*>(new_size);
+
+            // Compaction works on int buffers, views share the memory objects
+            m_pp.Compact(queueidx,
+                CLWBuffer<cl_int>::CreateFromClBuffer(predicate_clw->GetData()),
+                CLWBuffer<cl_int>::CreateFromClBuffer(input_clw->GetData()),
+                CLWBuffer<cl_int>::CreateFromClBuffer(output_clw->GetData()),
+                (int)size,
+                CLWBuffer<cl_int>::CreateFromClBuffer(new_size_clw->GetData()));
+        }
+
     private:
         CLWParallelPrimitives m_pp;
     };
@@ -23,9 +23,12 @@ THE SOFTWARE.
 
 #include "device.h"
 #include "device_cl.h"
+#include "buffer_pool.h"
 #include "CLW.h"
 
+#include <functional>
 #include <queue>
+#include <string>
 
 namespace Calc
 {
@@ -47,6 +50,8 @@ namespace Calc
         Buffer* CreateBuffer(std::size_t size, std::uint32_t flags) override;
         Buffer* CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata) override;
         void DeleteBuffer(Buffer* buffer) override;
+        void SetBufferPoolLimit(std::size_t limit) override;
+        void GetBufferPoolStatistics(PoolStatistics& stats) const override;
 
         // Data movement
         void ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const override;
@@ -66,9 +71,11 @@ namespace Calc
         // Executable management
         size_t GetExecutableBinarySize(Executable const* executable) const override;
         void GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const override;
+        void SetExecutableCachePath(char const* path) override;
 
         // Execution
         void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) override;
+        void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event const* wait_event, Event** e) override;
 
         // Events handling
         void WaitForEvent(Event* e) override;
@@ -94,12 +101,29 @@ namespace Calc
         void      ReleaseEventClw(EventClw* e) const;
 
     private:
+        // Append device specific options to user build options
+        std::string GetBuildOptions(char const* options) const;
+        // Load program binary from the cache or build it with compile and store the binary,
+        // source should contain everything the program is compiled from
+        CLWProgram CompileCached(std::string const& source, std::string const& buildopts,
+            std::function<CLWProgram()> const& compile) const;
+        // Index of the device within the context
+        int GetDeviceIndex() const;
+        // Allocate a new buffer bypassing the pool
+        Buffer* CreateBufferClw(std::size_t size, std::uint32_t flags);
+
         CLWDevice m_device;
         CLWContext m_context;
 
         // Initial number of events in the pool
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
+        // Number of queues to create on the device for independent work
+        static const std::uint32_t NUM_QUEUES = 4;
         // Event pool
         mutable std::queue<EventClw*> m_event_pool;
+        // Program binary cache directory, empty if caching is disabled
+        std::string m_cache_path;
+        // Released buffers kept for reuse
+        BufferPool m_buffer_pool;
     };
 }
\ No newline at end of file
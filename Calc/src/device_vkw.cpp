@@ -57,6 +57,8 @@ namespace Calc
          , m_use_compute_pipe( in_use_compute_pipe )
          , m_cpu_fence_id( 0 )
          , m_gpu_known_fence_id( 1 )
+         , m_buffer_pool( [this]( std::size_t size, std::uint32_t flags ) { return CreateBufferVulkan( size, flags, nullptr ); }
+                        , []( Buffer* buffer ) { delete buffer; } )
     {
         m_anvil_device->retain();
 
@@ -69,6 +71,9 @@ namespace Calc
     // dtor
     DeviceVulkanw::~DeviceVulkanw()
     {
+        // Retained buffers have to go before the device
+        m_buffer_pool.Trim();
+
         m_command_buffer.reset();
 
         for (auto& fence : m_anvil_fences) { fence.reset(); }
@@ -134,15 +139,35 @@ namespace Calc
         spec.max_local_size = static_cast< std::size_t >(localMemory);
 
         spec.has_fp16 = device->is_device_extension_supported("GL_AMD_gpu_shader_half_float");
+        spec.max_num_queues = 1;
     }
 
     // Buffer creation and deletion
     Buffer* DeviceVulkanw::CreateBuffer( std::size_t size, std::uint32_t flags )
     {
-        return CreateBuffer( size, flags, nullptr );
+        if(size == 0 )
+        {
+            throw ExceptionVk("Buffer size of 0 isn't valid" );
+            return nullptr;
+        }
+
+        return m_buffer_pool.Acquire( size, flags );
     }
 
     Buffer* DeviceVulkanw::CreateBuffer( std::size_t size, std::uint32_t flags, void* initdata )
+    {
+        Buffer* buffer = CreateBuffer( size, flags );
+
+        if ( nullptr != initdata )
+        {
+            // waits for the GPU to stop using a reused buffer
+            WriteBuffer( buffer, 0, 0, size, initdata, nullptr );
+        }
+
+        return buffer;
+    }
+
+    Buffer* DeviceVulkanw::CreateBufferVulkan( std::size_t size, std::uint32_t flags, void* initdata )
     {
         if(size == 0 )
         {
@@ -167,10 +192,17 @@ namespace Calc
 
     void DeviceVulkanw::DeleteBuffer( Buffer* buffer )
     {
-        if ( nullptr != buffer )
-        {
-            delete buffer;
-        }
+        m_buffer_pool.Release( buffer );
+    }
+
+    void DeviceVulkanw::SetBufferPoolLimit( std::size_t limit )
+    {
+        m_buffer_pool.SetRetainLimit( limit );
+    }
+
+    void DeviceVulkanw::GetBufferPoolStatistics( PoolStatistics& stats ) const
+    {
+        m_buffer_pool.GetStatistics( stats );
     }
 
     // Data movement
@@ -299,6 +331,11 @@ namespace Calc
         VK_EMPTY_IMPLEMENTATION;
     }
 
+    void DeviceVulkanw::SetExecutableCachePath( char const* /*path*/ )
+    {
+        // Vulkan has no program cache
+    }
+
     // Get queue, the execution of vulkan shaders can be done through the compute queue or the graphic queue
     Anvil::Queue* DeviceVulkanw::GetQueue() const
     {
@@ -454,6 +491,17 @@ namespace Calc
     }
 
     // Events handling
+    void DeviceVulkanw::Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event const* wait_event, Event** e )
+    {
+        // There is a single queue, so the dependency is resolved on the host
+        if ( nullptr != wait_event )
+        {
+            WaitForEvent( const_cast<Event*>( wait_event ) );
+        }
+
+        Execute( func, queue, global_size, local_size, e );
+    }
+
     void DeviceVulkanw::WaitForEvent( Event* e )
     {
         e->Wait();
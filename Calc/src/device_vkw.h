@@ -22,6 +22,7 @@ THE SOFTWARE.
 #pragma once
 
 #include "device.h"
+#include "buffer_pool.h"
 #include "wrappers/command_buffer.h"
 #include "wrappers/device.h"
 #include "wrappers/fence.h"
@@ -53,6 +54,8 @@ namespace Calc
         Buffer* CreateBuffer( std::size_t size, std::uint32_t flags ) override;
         Buffer* CreateBuffer( std::size_t size, std::uint32_t flags, void* initdata ) override;
         void DeleteBuffer( Buffer* buffer ) override;
+        void SetBufferPoolLimit( std::size_t limit ) override;
+        void GetBufferPoolStatistics( PoolStatistics& stats ) const override;
 
         // Data movement
         void ReadBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e ) const override;
@@ -74,9 +77,11 @@ namespace Calc
         // Executable management
         size_t GetExecutableBinarySize( Executable const* executable ) const override;
         void GetExecutableBinary( Executable const* executable, std::uint8_t* binary ) const override;
+        void SetExecutableCachePath( char const* path ) override;
 
         // Execution
         void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e ) override;
+        void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event const* wait_event, Event** e ) override;
 
         // Events handling
         void WaitForEvent( Event* e ) override;
@@ -124,6 +129,9 @@ namespace Calc
 
         Anvil::Queue* GetQueue() const;
 
+        // Allocate a new buffer bypassing the pool
+        Buffer* CreateBufferVulkan( std::size_t size, std::uint32_t flags, void* initdata );
+
         // Anvil device
         Anvil::Device* m_anvil_device;
 
@@ -141,6 +149,9 @@ namespace Calc
         std::atomic<uint64_t> m_cpu_fence_id;
         mutable std::atomic<uint64_t> m_gpu_known_fence_id;
 
+        // Released buffers kept for reuse
+        BufferPool m_buffer_pool;
+
     };
 
 }
@@ -0,0 +1,76 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "file_utils.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+namespace Calc
+{
+    bool WriteFileAtomic(std::string const& filename, std::function<void(std::ostream&)> const& write)
+    {
+        // Thread id and time make the name unique among concurrent writers
+        auto tmpname = filename + "." + std::to_string(
+            std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+            static_cast<std::size_t>(std::chrono::steady_clock::now().time_since_epoch().count())) + ".tmp";
+
+        bool written = false;
+        try
+        {
+            std::ofstream out(tmpname, std::ios::binary | std::ios::trunc);
+            if (out)
+            {
+                write(out);
+                out.close();
+                written = static_cast<bool>(out);
+            }
+        }
+        catch (...)
+        {
+            std::remove(tmpname.c_str());
+            throw;
+        }
+
+#ifdef _WIN32
+        // rename does not replace existing files on Windows
+        bool moved = written && MoveFileExA(tmpname.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        bool moved = written && std::rename(tmpname.c_str(), filename.c_str()) == 0;
+#endif
+
+        if (!moved)
+        {
+            std::remove(tmpname.c_str());
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -50,7 +50,7 @@ namespace RadeonRays
     struct Intersection;
 
     /// Represents a device, which can be used by API for intersection purposes.
-    /// API is distributing the work across multiple devices itsels, so
+    /// API can distribute the work across multiple devices itself, so
     /// this structure is only used to query devices configuration and
     /// limit the number of devices available for the API.
     struct RRAPI DeviceInfo
@@ -68,6 +68,7 @@ namespace RadeonRays
             kOpenCL = 0x1,
             kVulkan = 0x2,
             kEmbree = 0x4,
+            kNative = 0x8,
 
             kAny = 0xFF
         };
@@ -107,6 +108,12 @@ namespace RadeonRays
         // ID of a shape
         virtual void SetId(Id id) = 0;
         virtual Id GetId() const = 0;
+
+        // Update vertex positions of a mesh in place, topology is preserved,
+        // so vnum must match the number of vertices the mesh was created with.
+        // Intersectors supporting "bvh.refit" only refit the hierarchy on next Commit.
+        // Shapes implemented outside of the library throw by default.
+        virtual void UpdateVertices(float const* vertices, int vnum, int vstride);
     };
 
     // Buffer represents a chunk of memory hosted inside the API
@@ -198,6 +205,11 @@ namespace RadeonRays
         API lifetime management
         ******************************************/
         static IntersectionApi* Create(std::uint32_t devidx);
+        // Create API spreading the queries over several devices. The scene is
+        // built on each of them and every batch is split between the devices
+        // according to their measured throughput, the results are gathered in
+        // the hit buffer. Buffers of such API reside in host memory.
+        static IntersectionApi* Create(std::uint32_t const* devidx, std::uint32_t numdevices);
 
         // Deallocation
         static void Delete(IntersectionApi* api);
@@ -222,6 +234,20 @@ namespace RadeonRays
             int  numfaces
             ) const = 0;
 
+        // Create a triangle mesh referencing application owned vertex and index data
+        // instead of copying it. Both arrays have to stay valid and unchanged until
+        // the shape is deleted. To change vertex positions either modify them in place
+        // or point the mesh to another array, calling Shape::UpdateVertices in both cases.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateMeshShared(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices, 3 indices per face
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const = 0;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateInstance(Shape const* shape) const = 0;
@@ -276,15 +302,50 @@ namespace RadeonRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
 
+        // Number of device queues queries can be issued to, at least 1.
+        virtual std::uint32_t GetQueueCount() const = 0;
+        // Same queries issued to the queue [0, GetQueueCount()), the ones above use queue 0.
+        // Queries on different queues might execute concurrently, so pass the event
+        // of a query as waitevent of a dependent one to order them on the device.
+        virtual void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+
         /******************************************
         Utility
         ******************************************/
         // Supported options:
         // option "bvh.type" values {"bvh" (regular bvh, default), "qbvh" (4 branching factor), "hlbvh" (fast builds)}
+        //         "qbvh" stores node boxes in half precision with "fatbvh", it is used on OpenCL devices with fp16 support
+        //         unless quantization loosens the boxes too much, fp32 nodes are used otherwise
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
-        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
+        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default),
+        //         "lbvh" (sort primitives along Morton curve, fastest to build, lower quality)}
+        // option "bvh.lbvh.morton_bits" values {30, 63(default)} (Morton code length used by "lbvh" builder)
+        // option "bvh.optimize.ms" values {0(default), time in milliseconds} (restructure treelets of a built hierarchy
+        //         to lower its SAH cost, the pass stops when the time budget is exceeded, best after "median" or "lbvh" builds)
+        // option "bvh.max_leaf_size" values {1(default), 2..15} (maximum number of triangles per leaf, with "sah" builder
+        //         a leaf is only created if its cost is lower than the cost of the best split, "bvh" and "bvh.force2level" only)
+        // option "bvh.width" values {2(default), 4, 8} (collapse binary hierarchy into 4 or 8 wide one with quantized
+        //         child boxes, native CPU device and "fatbvh" on OpenCL devices only)
+        // option "bvh.refit" values {0(default), 1} (refit existing hierarchy instead of rebuilding it if only
+        //         vertices or transforms of attached shapes have been changed, quality degrades with deformation)
+        // option "bvh.cache.path" values {directory path, not set by default} (store built hierarchies in the directory
+        //         and map them on next Commit of identical geometry and build options instead of rebuilding)
+        // option "kernel.cache.path" values {directory path, not set by default} (keep compiled OpenCL programs in the directory,
+        //         so that subsequent runs skip driver compilation; set it before the first Commit, programs already built
+        //         are kept; RR_KERNEL_CACHE_PATH environment variable sets the default)
+        // option "query.max_stack_memory" values {float, megabytes, not set by default} (limit for traversal stack memory
+        //         of a device queue, larger batches are processed in tiles by "fatbvh" and "hlbvh" OpenCL kernels)
+        // option "query.sort_rays" values {0(default), 1} (traverse batches of 4096 rays and more in the order of ray
+        //         direction and origin Morton codes, hits are returned in the original order; native CPU and OpenCL devices)
+        // option "query.compact_rays" values {0(default), 1} (traverse only active rays of batches of 4096 rays and more,
+        //         hits of inactive rays are left untouched; native CPU and OpenCL devices)
+        // option "device.buffer_pool.max_retained" values {float, megabytes, default = 256} (memory kept in released
+        //         device buffers for reuse by later allocations, e.g. structures built on the next Commit; 0 disables reuse)
         // option "bvh.sah.use_splits" values {0(default),1} (allow spatial splits for BVH)
         // option "bvh.sah.traversal_cost" values {float, default = 10.f for GPU } (cost of node traversal vs triangle intersection)
         // option "bvh.sah.min_overlap" values { float < 1.f, default = 0.005f } 
@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvh.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
 #include <thread>
@@ -31,24 +32,96 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
-    static int constexpr kMaxPrimitivesPerLeaf = 1;
+    // Requests smaller than this are always processed on a single thread
+    static int constexpr kMinParallelPrimitives = 4096;
 
     static bool is_nan(float v)
     {
         return v != v;
     }
 
+    static int GetNumThreads()
+    {
+        return task_scheduler::instance().num_threads();
+    }
+
+    // Number of tasks to use for a request at a given tree level:
+    // 2^level subtrees are already processed concurrently at this level,
+    // so only top levels need to split the work further.
+    static int GetNumTasks(int numprims, int level)
+    {
+        if (numprims < kMinParallelPrimitives || level >= 31)
+        {
+            return 1;
+        }
+
+        int num_tasks = GetNumThreads() >> level;
+        return std::max(1, std::min(num_tasks, numprims / kMinParallelPrimitives));
+    }
+
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
-        for (int i = 0; i < numbounds; ++i)
+        // Calc bbox: min/max reduction is order independent,
+        // so chunked result is the same as the serial one
+        int const num_tasks = GetNumTasks(numbounds, 0);
+        std::vector<bbox> partial(num_tasks);
+
+        parallel_for(0, numbounds, num_tasks, [&partial, bounds](int task, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                partial[task].grow(bounds[i]);
+            }
+        });
+
+        for (auto const& b : partial)
         {
-            // Calc bbox
-            m_bounds.grow(bounds[i]);
+            m_bounds.grow(b);
         }
 
         BuildImpl(bounds, numbounds);
     }
 
+    void Bvh::Refit(bbox const* bounds, int numbounds)
+    {
+        assert(m_root);
+        (void)numbounds;
+
+        RefitNode(m_root, 0, bounds);
+        m_bounds = m_root->bounds;
+    }
+
+    void Bvh::RefitNode(Node* node, int level, bbox const* bounds)
+    {
+        if (node->type == kLeaf)
+        {
+            node->bounds = bbox();
+            for (int i = 0; i < node->numprims; ++i)
+            {
+                node->bounds.grow(bounds[m_packed_indices[node->startidx + i]]);
+            }
+            return;
+        }
+
+        // 2^level subtrees are already refitted concurrently at this level
+        if (level < 31 && (1 << level) < GetNumThreads())
+        {
+            auto& scheduler = task_scheduler::instance();
+            task_group group;
+
+            scheduler.run(group, [this, node, level, bounds]() { RefitNode(node->lc, level + 1, bounds); });
+            RefitNode(node->rc, level + 1, bounds);
+            scheduler.wait(group);
+        }
+        else
+        {
+            RefitNode(node->lc, level + 1, bounds);
+            RefitNode(node->rc, level + 1, bounds);
+        }
+
+        node->bounds = bboxunion(node->lc->bounds, node->rc->bounds);
+    }
+
     bbox const& Bvh::Bounds() const
     {
         return m_bounds;
@@ -65,31 +138,31 @@ namespace RadeonRays
         return &m_nodes[m_nodecnt++];
     }
 
-    void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
+    int Bvh::BuildNode(SplitRequest const& req, int nodeidx, bbox const* bounds, float3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
-
-        Node* node = AllocateNode();
+        // Leaves keep primitive ranges in place, so depth-first layout
+        // gives each subtree of n primitives exactly 2n - 1 node slots
+        // and leaf primitives end up at request start index. Both only
+        // depend on the tree itself, so parallel build is identical to serial.
+        Node* node = &m_nodes[nodeidx];
         node->bounds = req.bounds;
         node->index = req.index;
+        ++m_nodecnt;
+
+        int height = req.level;
 
-        // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        // Create leaf node if we have enough prims,
+        // with SAH it is decided against the best split below
+        if (req.numprims < 2 || (!m_usesah && req.numprims <= m_max_leaf_size))
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
             node->type = kLeaf;
-            node->startidx = static_cast<int>(m_packed_indices.size());
+            node->startidx = req.startidx;
             node->numprims = req.numprims;
 
             for (auto i = 0; i < req.numprims; ++i)
             {
-                m_packed_indices.push_back(primindices[req.startidx + i]);
+                m_packed_indices[req.startidx + i] = primindices[req.startidx + i];
             }
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
         }
         else
         {
@@ -101,25 +174,29 @@ namespace RadeonRays
             {
                 SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
 
-                if (!is_nan(ss.split))
+                // Leaf cost is the number of primitives to intersect, split cost
+                // includes traversal. Nodes above the leaf size limit are split even
+                // without a SAH split, at the centroid bounds center or in half.
+                if (req.numprims <= m_max_leaf_size &&
+                    (is_nan(ss.split) || req.numprims < ss.sah))
                 {
-                    axis = ss.dim;
-                    border = ss.split;
+                    node->type = kLeaf;
+                    node->startidx = req.startidx;
+                    node->numprims = req.numprims;
 
-                    if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
+                    for (auto i = 0; i < req.numprims; ++i)
                     {
-                        node->type = kLeaf;
-                        node->startidx = static_cast<int>(m_packed_indices.size());
-                        node->numprims = req.numprims;
+                        m_packed_indices[req.startidx + i] = primindices[req.startidx + i];
+                    }
 
-                        for (auto i = 0; i < req.numprims; ++i)
-                        {
-                            m_packed_indices.push_back(primindices[req.startidx + i]);
-                        }
+                    if (req.ptr) *req.ptr = node;
+                    return height;
+                }
 
-                        if (req.ptr) *req.ptr = node;
-                        return;
-                    }
+                if (!is_nan(ss.split))
+                {
+                    axis = ss.dim;
+                    border = ss.split;
                 }
             }
 
@@ -228,18 +305,36 @@ namespace RadeonRays
             // Right request
             SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
 
+            int const leftidx = nodeidx + 1;
+            int const rightidx = nodeidx + 2 * leftrequest.numprims;
+
+            // Children work on disjoint ranges, so large ones go to a separate task
+            if (GetNumTasks(req.numprims, req.level) > 1)
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
-            }
+                auto& scheduler = task_scheduler::instance();
+                int left_height = 0;
+                task_group group;
+
+                scheduler.run(group, [&]()
+                {
+                    left_height = BuildNode(leftrequest, leftidx, bounds, centroids, primindices);
+                });
 
+                height = BuildNode(rightrequest, rightidx, bounds, centroids, primindices);
+                scheduler.wait(group);
+                height = std::max(height, left_height);
+            }
+            else
             {
-                BuildNode(rightrequest, bounds, centroids, primindices);
+                height = BuildNode(leftrequest, leftidx, bounds, centroids, primindices);
+                height = std::max(height, BuildNode(rightrequest, rightidx, bounds, centroids, primindices));
             }
         }
 
         // Set parent ptr if any
         if (req.ptr) *req.ptr = node;
+
+        return height;
     }
 
     Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const
@@ -283,33 +378,66 @@ namespace RadeonRays
         // Precompute min point
         float3 rootmin = req.centroid_bounds.pmin;
 
-        // Evaluate all dimensions
+        // Calc primitive refs histogram for all dimensions.
+        // Large requests are binned in chunks into private bins which are
+        // merged afterwards: counts and bounds are order independent
+        // so the result does not depend on the number of tasks.
+        int const num_tasks = GetNumTasks(req.numprims, req.level);
+        std::vector<std::vector<Bin> > partial_bins(3 * (num_tasks - 1), std::vector<Bin>(m_num_bins, Bin{ bbox(), 0 }));
+
         for (int axis = 0; axis < 3; ++axis)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
-
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
-
-            // Initialize bins
             for (int i = 0; i < m_num_bins; ++i)
             {
                 bins[axis][i].count = 0;
                 bins[axis][i].bounds = bbox();
             }
+        }
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        parallel_for(req.startidx, req.startidx + req.numprims, num_tasks, [&](int task, int first, int last)
+        {
+            for (int axis = 0; axis < 3; ++axis)
             {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((centroids[idx][axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
+                // If the box is degenerate in that dimension skip it
+                if (centroid_extents[axis] == 0.f) continue;
+
+                auto& task_bins = task == 0 ? bins[axis] : partial_bins[3 * (task - 1) + axis];
+                float rootminc = rootmin[axis];
+                float invcentroid_rng = 1.f / centroid_extents[axis];
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
+                for (int i = first; i < last; ++i)
+                {
+                    int idx = primindices[i];
+                    int binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((centroids[idx][axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
+
+                    ++task_bins[binidx].count;
+                    task_bins[binidx].bounds.grow(bounds[idx]);
+                }
             }
+        });
+
+        for (int task = 1; task < num_tasks; ++task)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                auto const& task_bins = partial_bins[3 * (task - 1) + axis];
+
+                for (int i = 0; i < m_num_bins; ++i)
+                {
+                    bins[axis][i].count += task_bins[i].count;
+                    bins[axis][i].bounds.grow(task_bins[i].bounds);
+                }
+            }
+        }
+
+        // Evaluate all dimensions
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Range for histogram
+            float centroid_rng = centroid_extents[axis];
+
+            // If the box is degenerate in that dimension skip it
+            if (centroid_rng == 0.f) continue;
 
             std::vector<bbox> rightbounds(m_num_bins - 1);
 
@@ -366,13 +494,26 @@ namespace RadeonRays
         m_indices.resize(numbounds);
         std::iota(m_indices.begin(), m_indices.end(), 0);
 
-        // Calc bbox
+        m_packed_indices.resize(numbounds);
+
+        // Calc centroids and centroid bbox
+        int const num_tasks = GetNumTasks(numbounds, 0);
+        std::vector<bbox> partial(num_tasks);
+
+        parallel_for(0, numbounds, num_tasks, [&](int task, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                float3 c = bounds[i].center();
+                partial[task].grow(c);
+                centroids[i] = c;
+            }
+        });
+
         bbox centroid_bounds;
-        for (size_t i = 0; i < static_cast<size_t>(numbounds); ++i)
+        for (auto const& b : partial)
         {
-            float3 c = bounds[i].center();
-            centroid_bounds.grow(c);
-            centroids[i] = c;
+            centroid_bounds.grow(b);
         }
 
         SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
@@ -484,7 +625,7 @@ namespace RadeonRays
             if (req.ptr) *req.ptr = node;
         }
 #else
-        BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        m_height = BuildNode(init, 0, bounds, &centroids[0], &m_indices[0]);
 #endif
 
         // Set root_ pointer
@@ -39,16 +39,19 @@ namespace RadeonRays
     class Bvh
     {
     public:
-        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false)
+        // Leaves hold up to max_leaf_size primitives, with SAH enabled
+        // a leaf is only created if it is cheaper than the best split
+        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false, int max_leaf_size = 1)
             : m_root(nullptr)
             , m_num_bins(num_bins)
             , m_usesah(usesah)
             , m_height(0)
             , m_traversal_cost(traversal_cost)
+            , m_max_leaf_size(max_leaf_size < 1 ? 1 : max_leaf_size)
         {
         }
 
-        ~Bvh() = default;
+        virtual ~Bvh() = default;
 
         // World space bounding box
         bbox const& Bounds() const;
@@ -57,6 +60,10 @@ namespace RadeonRays
         // bounds is an array of bounding boxes
         void Build(bbox const* bounds, int numbounds);
 
+        // Recalculate node bounds keeping the topology of the last build,
+        // bounds should describe the same primitives in the same order
+        void Refit(bbox const* bounds, int numbounds);
+
         // Get tree height
         int GetHeight() const;
 
@@ -105,10 +112,17 @@ namespace RadeonRays
             float overlap;
         };
 
-        void BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices);
+        // Build subtree for the request into m_nodes[nodeidx] and following slots
+        // (depth-first layout, unused slots are left behind leaves with several
+        // primitives), returns subtree height.
+        // Subtrees of large requests are built in parallel.
+        int BuildNode(SplitRequest const& req, int nodeidx, bbox const* bounds, float3 const* centroids, int* primindices);
 
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
 
+        // Recalculate bounds of the subtree, top levels are processed in parallel
+        void RefitNode(Node* node, int level, bbox const* bounds);
+
         // Enum for node type
         enum NodeType
         {
@@ -138,6 +152,8 @@ namespace RadeonRays
         float m_traversal_cost;
         // Number of spatial bins to use for SAH
         int m_num_bins;
+        // Maximum number of primitives in a leaf
+        int m_max_leaf_size;
 
 
     private:
@@ -146,6 +162,7 @@ namespace RadeonRays
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class BvhOptimizer;
     };
 
     struct Bvh::Node
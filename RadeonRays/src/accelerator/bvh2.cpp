@@ -21,9 +21,11 @@ THE SOFTWARE.
 ********************************************************************/
 #include "bvh2.h"
 
-#include <atomic>
-#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <numeric>
+#include <ostream>
 
 #define PARALLEL_BUILD
 
@@ -132,6 +134,18 @@ namespace RadeonRays
         std::uint32_t index;
     };
 
+    void Bvh2::PrintStatistics(std::ostream& os) const
+    {
+        os << "Class name: " << "Bvh2\n";
+        os << "SAH: " << (m_usesah ? "enabled\n" : "disabled\n");
+        os << "SAH bins: " << m_num_bins << "\n";
+        os << "Number of nodes: " << m_nodecount << "\n";
+        os << "Build tasks: " << m_build_stats.num_tasks << "\n";
+        os << "Build threads: " << m_build_stats.num_threads << "\n";
+        os << "Build time: " << m_build_stats.wall_time_ms << "ms\n";
+        os << "Thread utilization: " << m_build_stats.utilization() * 100.f << "%\n";
+    }
+
     void Bvh2::Clear()
     {
         for (auto i = 0u; i < m_nodecount; ++i)
@@ -139,6 +153,69 @@ namespace RadeonRays
         Deallocate(m_nodes);
         m_nodes = nullptr;
         m_nodecount = 0;
+        m_leaf_refs.clear();
+    }
+
+    int Bvh2::GetHeight() const
+    {
+        if (m_nodecount == 0)
+        {
+            return 0;
+        }
+
+        // Walk the tree keeping the level of each pending node
+        std::vector<std::pair<std::uint32_t, int>> stack;
+        stack.emplace_back(0u, 0);
+
+        int height = 0;
+        while (!stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            auto const& node = m_nodes[entry.first];
+            if (IsInternal(node))
+            {
+                stack.emplace_back(node.addr_left, entry.second + 1);
+                stack.emplace_back(node.addr_right, entry.second + 1);
+            }
+            else
+            {
+                height = std::max(height, entry.second);
+            }
+        }
+
+        return height;
+    }
+
+    bool Bvh2::Load(BvhCache::Entry const& entry)
+    {
+        std::size_t size = 0;
+        auto nodes = entry.GetSection(BvhCache::kNodes, size);
+        auto count = size / sizeof(Node);
+
+        auto refs = entry.GetSection<std::uint32_t>(BvhCache::kLeafRefs, count);
+        if (!nodes || !refs || count == 0 || size % sizeof(Node) != 0)
+        {
+            return false;
+        }
+
+        Clear();
+
+        m_nodecount = count;
+        m_nodes = reinterpret_cast<Node*>(
+            Allocate(sizeof(Node) * m_nodecount, 16u));
+
+        std::memcpy(m_nodes, nodes, sizeof(Node) * m_nodecount);
+        m_leaf_refs.assign(refs, refs + m_nodecount);
+        return true;
+    }
+
+    bool Bvh2::Store(BvhCache const& cache, std::uint64_t key) const
+    {
+        return cache.Store(key, {
+            { BvhCache::kNodes, m_nodes, GetSizeInBytes() },
+            { BvhCache::kLeafRefs, m_leaf_refs.data(), m_leaf_refs.size() * sizeof(std::uint32_t) } });
     }
 
     void Bvh2::BuildImpl(
@@ -162,6 +239,8 @@ namespace RadeonRays
         for (auto i = 0u; i < m_nodecount; ++i)
             new (&m_nodes[i]) Node;
 
+        m_leaf_refs.assign(m_nodecount, kInvalidId);
+
         auto constexpr inf = std::numeric_limits<float>::infinity();
         auto m128_plus_inf = _mm_set_ps(inf, inf, inf, inf);
         auto m128_minus_inf = _mm_set_ps(-inf, -inf, -inf, -inf);
@@ -217,114 +296,73 @@ namespace RadeonRays
             }
         }
 #else
-        // Parallel build variables
-        // Global requests stack
-        std::stack<SplitRequest> requests;
-        // Condition to wait on the global stack
-        std::condition_variable cv;
-        // Mutex to guard cv
-        std::mutex mutex;
-        // Indicates if we need to shutdown all the threads
-        std::atomic<bool> shutdown;
-        // Number of primitives processed so far
-        std::atomic<std::uint32_t> num_refs_processed;
-
-        num_refs_processed.store(0);
-        shutdown.store(false);
-
-        requests.push(SplitRequest{
-            scene_min,
-            scene_max,
-            centroid_scene_min,
-            centroid_scene_max,
-            0,
-            num_aabbs,
-            0u,
-            0u
-        });
-
-        auto worker_thread = [&]()
+        auto& scheduler = task_scheduler::instance();
+        task_group group;
+
+        // Each task builds a subtree depth-first using a local stack,
+        // large right subtrees are handed over to the scheduler
+        // where idle workers can steal them.
+        std::function<void(SplitRequest const&)> build_subtree;
+        build_subtree = [&](SplitRequest const& root)
         {
-            thread_local std::stack<SplitRequest> local_requests;
+            std::stack<SplitRequest> local_requests;
+            local_requests.push(root);
 
-            for (;;)
+            _MM_ALIGN16 SplitRequest request;
+            _MM_ALIGN16 SplitRequest request_left;
+            _MM_ALIGN16 SplitRequest request_right;
+
+            while (!local_requests.empty())
             {
-                // Wait for signal
+                request = local_requests.top();
+                local_requests.pop();
+
+                auto node_type = HandleRequest(
+                    request,
+                    aabb_min,
+                    aabb_max,
+                    aabb_centroid,
+                    metadata,
+                    refs,
+                    num_aabbs,
+                    request_left,
+                    request_right);
+
+                if (node_type == kLeaf)
                 {
-                    std::unique_lock<std::mutex> lock(mutex);
-                    cv.wait(lock, [&]() { return !requests.empty() || shutdown; });
-
-                    if (shutdown) return;
-
-                    local_requests.push(requests.top());
-                    requests.pop();
+                    continue;
                 }
 
-                _MM_ALIGN16 SplitRequest request;
-                _MM_ALIGN16 SplitRequest request_left;
-                _MM_ALIGN16 SplitRequest request_right;
-
-                // Process local requests
-                while (!local_requests.empty())
+                if (request_right.num_refs > kMinParallelPrimitives)
                 {
-                    request = local_requests.top();
-                    local_requests.pop();
-
-                    auto node_type = HandleRequest(
-                        request,
-                        aabb_min,
-                        aabb_max,
-                        aabb_centroid,
-                        metadata,
-                        refs,
-                        num_aabbs,
-                        request_left,
-                        request_right);
-
-                    if (node_type == kLeaf)
-                    {
-                        num_refs_processed += static_cast<std::uint32_t>(request.num_refs);
-                        continue;
-                    }
-
-                    if (request_right.num_refs > 4096u)
-                    {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        requests.push(request_right);
-                        cv.notify_one();
-                    }
-                    else
-                    {
-                        local_requests.push(request_right);
-                    }
-
-                    local_requests.push(request_left);
+                    scheduler.run(group, [&build_subtree, request_right]() { build_subtree(request_right); });
                 }
+                else
+                {
+                    local_requests.push(request_right);
+                }
+
+                local_requests.push(request_left);
             }
         };
 
-        auto num_threads = std::thread::hardware_concurrency();
-        std::vector<std::thread> threads(num_threads);
-
-        for (auto i = 0u; i < num_threads; ++i)
+        scheduler.run(group, [&]()
         {
-            threads[i] = std::thread(worker_thread);
-        }
-
-        while (num_refs_processed != num_aabbs)
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
-        }
+            build_subtree(SplitRequest{
+                scene_min,
+                scene_max,
+                centroid_scene_min,
+                centroid_scene_max,
+                0,
+                num_aabbs,
+                0u,
+                0u
+            });
+        });
 
-         // Signal shutdown and wake up all the threads
-        shutdown.store(true);
-        cv.notify_all();
-            
-        // Wait for all the threads to finish
-        for (auto i = 0u; i < num_threads; ++i)
-        {
-            threads[i].join();
-        }
+        // Calling thread takes part in the build until all subtrees are done
+        scheduler.wait(group);
+        m_build_stats = group.get_statistics();
 #endif
     }
 
@@ -514,6 +552,7 @@ namespace RadeonRays
                     i,
                     face_data);
             }
+            m_leaf_refs[request.index] = refs[request.start_index];
             return kLeaf;
         }
 
@@ -21,7 +21,9 @@ THE SOFTWARE.
 ********************************************************************/
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <iosfwd>
 #include <stack>
 #include <utility>
 #include <vector>
@@ -31,8 +33,11 @@ THE SOFTWARE.
 #include <xmmintrin.h>
 #include <smmintrin.h>
 
+#include "bvh_cache.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../async/task_scheduler.h"
+#include "../except/except.h"
 
 #ifndef WIN32
 #define _MM_ALIGN16
@@ -54,17 +59,42 @@ namespace RadeonRays
             , m_traversal_cost(traversal_cost)
             , m_nodes(nullptr)
             , m_nodecount(0)
+            , m_build_stats()
         {
         }
 
+        // [first, last) range of nodes
+        using NodeRange = std::pair<std::size_t, std::size_t>;
+
         // Build function
         template <typename Iter>
         void Build(Iter begin, Iter end);
 
+        // Update leaf vertices of changed shapes and recalculate bounds
+        // keeping the topology, shapes should be the same as for the last build.
+        // Ranges of nodes which have been changed are returned.
+        template <typename Iter>
+        void Refit(Iter begin, Iter end, std::vector<NodeRange>& changed);
+
         void Clear();
 
+        // Restore the hierarchy stored by Store, returns false
+        // if the entry does not contain a valid hierarchy
+        bool Load(BvhCache::Entry const& entry);
+        // Store nodes and leaf references to the cache
+        bool Store(BvhCache const& cache, std::uint64_t key) const;
+
         inline std::size_t GetSizeInBytes() const;
 
+        // Number of edges on the longest root to leaf path
+        int GetHeight() const;
+
+        // Statistics of the last parallel build
+        task_group::statistics const& GetBuildStatistics() const { return m_build_stats; }
+
+        // Print BVH statistics
+        void PrintStatistics(std::ostream& os) const;
+
     protected:
         using RefArray = std::vector<std::uint32_t>;
         using MetaDataArray = std::vector<std::pair<const Shape *, std::size_t> >;
@@ -79,7 +109,9 @@ namespace RadeonRays
             // Threshold number of primitives to disable SAH split
             kMinSAHPrimitives = 8u,
             // Maximum stack size for non-parallel builds
-            kStackSize = 1024u
+            kStackSize = 1024u,
+            // Subtrees with more primitives are scheduled as separate tasks
+            kMinParallelPrimitives = 4096u
         };
 
         // Enum for node type
@@ -168,18 +200,26 @@ namespace RadeonRays
         static inline bool IsInternal(const Node &node);
         static inline std::uint32_t GetChildIndex(const Node &node, std::uint8_t idx);
         static inline void PropagateBounds(Bvh2 &bvh);
+        static inline void GetNodeBounds(const Node &node, float *aabb_min, float *aabb_max);
 
     private:
         Bvh2(const Bvh2 &) = delete;
         Bvh2 &operator = (const Bvh2 &) = delete;
 
         friend class QBvhTranslator;
+        template <std::uint32_t Width> friend class WideBvhTranslator;
         friend class IntersectorLDS;
+        friend class CpuIntersectionDevice;
+        friend class BvhOptimizer;
 
         // Buffer of encoded nodes
         Node *m_nodes;
         // Number of encoded nodes
         std::size_t m_nodecount;
+        // Primitive reference for each leaf node, kInvalidId for internal nodes
+        RefArray m_leaf_refs;
+        // Parallel build statistics
+        task_group::statistics m_build_stats;
     };
 
     // Encoded node format
@@ -314,6 +354,95 @@ namespace RadeonRays
         PropagateBounds(*this);
     }
 
+    template <typename Iter>
+    void Bvh2::Refit(Iter begin, Iter end, std::vector<NodeRange>& changed)
+    {
+        changed.clear();
+
+        // Shapes along with their first reference in the order of the build
+        MetaDataArray shapes;
+        std::vector<std::uint8_t> shape_changed;
+
+        std::size_t num_items = 0;
+        for (auto iter = begin; iter != end; ++iter)
+        {
+            auto shape = static_cast<const ShapeImpl *>(*iter);
+            auto mesh = static_cast<const Mesh *>(shape->is_instance() ? static_cast<const Instance *>(shape)->GetBaseShape() : shape);
+
+            shapes.push_back(std::make_pair(shape, num_items));
+            shape_changed.push_back(
+                shape->GetStateChange() != ShapeImpl::kStateChangeNone ||
+                mesh->GetStateChange() != ShapeImpl::kStateChangeNone);
+
+            num_items += mesh->num_faces();
+        }
+
+        ThrowIf(m_nodecount != 2 * num_items - 1, "Refit requires the same set of shapes as the last build");
+
+        std::vector<std::uint8_t> node_changed(m_nodecount, 0);
+
+        // Leaves are independent, so they are updated in parallel
+        auto const num_nodes = static_cast<int>(m_nodecount);
+        auto const num_tasks = std::max(1, std::min(task_scheduler::instance().num_threads(), num_nodes / static_cast<int>(kMinParallelPrimitives)));
+
+        parallel_for(0, num_nodes, num_tasks, [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                auto ref = m_leaf_refs[i];
+                if (ref == kInvalidId)
+                {
+                    continue;
+                }
+
+                // Find the shape the reference belongs to
+                auto shape_iter = std::upper_bound(shapes.cbegin(), shapes.cend(), ref,
+                    [](std::size_t value, std::pair<const Shape *, std::size_t> const& item) { return value < item.second; });
+                auto shape_index = std::distance(shapes.cbegin(), shape_iter) - 1;
+
+                if (shape_changed[shape_index])
+                {
+                    SetPrimitive(m_nodes[i], 0, std::make_pair(shapes[shape_index].first, ref - shapes[shape_index].second));
+                    node_changed[i] = 1;
+                }
+            }
+        });
+
+        // Children always follow their parent in memory,
+        // so reverse order visits them before the parent
+        for (auto i = m_nodecount; i-- > 0;)
+        {
+            auto &node = m_nodes[i];
+
+            if (!IsInternal(node) ||
+                !(node_changed[node.addr_left] || node_changed[node.addr_right]))
+            {
+                continue;
+            }
+
+            GetNodeBounds(m_nodes[node.addr_left], node.aabb_left_min_or_v0, node.aabb_left_max_or_v1);
+            GetNodeBounds(m_nodes[node.addr_right], node.aabb_right_min_or_v2, node.aabb_right_max);
+            node_changed[i] = 1;
+        }
+
+        for (auto i = 0u; i < m_nodecount; ++i)
+        {
+            if (!node_changed[i])
+            {
+                continue;
+            }
+
+            if (!changed.empty() && changed.back().second == i)
+            {
+                ++changed.back().second;
+            }
+            else
+            {
+                changed.push_back(std::make_pair(i, i + 1));
+            }
+        }
+    }
+
     std::size_t Bvh2::GetSizeInBytes() const
     {
         return m_nodecount * sizeof(Node);
@@ -351,10 +480,10 @@ namespace RadeonRays
         matrix worldmat, worldmatinv;
         shape->GetTransform(worldmat, worldmatinv);
         auto mesh = static_cast<const Mesh *>(static_cast<const ShapeImpl *>(shape)->is_instance() ? static_cast<const Instance *>(shape)->GetBaseShape() : shape);
-        auto face = mesh->GetFaceData()[ref.second];
-        auto v0 = transform_point(mesh->GetVertexData()[face.idx[0]], worldmat);
-        auto v1 = transform_point(mesh->GetVertexData()[face.idx[1]], worldmat);
-        auto v2 = transform_point(mesh->GetVertexData()[face.idx[2]], worldmat);
+        auto face = mesh->GetFace(static_cast<int>(ref.second));
+        auto v0 = transform_point(mesh->GetVertex(face.idx[0]), worldmat);
+        auto v1 = transform_point(mesh->GetVertex(face.idx[1]), worldmat);
+        auto v2 = transform_point(mesh->GetVertex(face.idx[2]), worldmat);
         node.aabb_left_min_or_v0[0] = v0.x;
         node.aabb_left_min_or_v0[1] = v0.y;
         node.aabb_left_min_or_v0[2] = v0.z;
@@ -382,6 +511,27 @@ namespace RadeonRays
             : kInvalidId);
     }
 
+    void Bvh2::GetNodeBounds(const Node &node, float *aabb_min, float *aabb_max)
+    {
+        for (auto i = 0; i < 3; ++i)
+        {
+            // Internal node keeps bounds of both children,
+            // leaf node keeps triangle vertices
+            if (IsInternal(node))
+            {
+                aabb_min[i] = std::min(node.aabb_left_min_or_v0[i], node.aabb_right_min_or_v2[i]);
+                aabb_max[i] = std::max(node.aabb_left_max_or_v1[i], node.aabb_right_max[i]);
+            }
+            else
+            {
+                aabb_min[i] = std::min(node.aabb_left_min_or_v0[i],
+                    std::min(node.aabb_left_max_or_v1[i], node.aabb_right_min_or_v2[i]));
+                aabb_max[i] = std::max(node.aabb_left_min_or_v0[i],
+                    std::max(node.aabb_left_max_or_v1[i], node.aabb_right_min_or_v2[i]));
+            }
+        }
+    }
+
     void Bvh2::PropagateBounds(Bvh2 &bvh)
     {
         // Traversal stack
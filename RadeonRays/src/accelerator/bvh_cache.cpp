@@ -0,0 +1,467 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_cache.h"
+#include "../async/task_scheduler.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+#include "file_utils.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RadeonRays
+{
+    // Bump the version each time the layout of any cached section changes
+    static std::uint32_t constexpr kCacheVersion = 2;
+    static char const kCacheMagic[8] = { 'R', 'R', 'B', 'V', 'H', 'C', 'A', 'C' };
+    // Section data alignment within the file
+    static std::uint64_t constexpr kSectionAlignment = 64;
+    static std::uint32_t constexpr kMaxSections = 64;
+    // Number of elements hashed by a single task
+    static std::size_t constexpr kHashChunkSize = 1 << 16;
+
+    struct FileHeader
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t num_sections;
+        std::uint64_t key;
+        // Detects truncated files without touching section data
+        std::uint64_t file_size;
+        // Hash of the header and the section table, calculated with this field zeroed
+        std::uint64_t checksum;
+    };
+
+    struct SectionHeader
+    {
+        std::uint32_t type;
+        std::uint32_t padding;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    static std::uint64_t Rotl(std::uint64_t v, int r)
+    {
+        return (v << r) | (v >> (64 - r));
+    }
+
+    static std::uint64_t HashCombine(std::uint64_t h, std::uint64_t v)
+    {
+        v *= 0x87c37b91114253d5ull;
+        v = Rotl(v, 31);
+        v *= 0x4cf5ad432745937full;
+        h ^= v;
+        return Rotl(h, 27) * 5 + 0x52dce729;
+    }
+
+    static std::uint64_t HashFinalize(std::uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static std::uint64_t HashBytes(std::uint64_t h, void const* data, std::size_t size)
+    {
+        auto bytes = static_cast<char const*>(data);
+
+        std::size_t i = 0;
+        for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t))
+        {
+            std::uint64_t v;
+            std::memcpy(&v, bytes + i, sizeof(v));
+            h = HashCombine(h, v);
+        }
+
+        std::uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, size - i);
+        return HashCombine(HashCombine(h, tail), size);
+    }
+
+    static std::uint64_t HashString(std::string const& str)
+    {
+        return HashBytes(0, str.data(), str.size());
+    }
+
+    static std::uint64_t HashHeader(FileHeader header, SectionHeader const* sections)
+    {
+        header.checksum = 0;
+        auto h = HashBytes(0, &header, sizeof(header));
+        return header.num_sections ? HashBytes(h, sections, header.num_sections * sizeof(SectionHeader)) : h;
+    }
+
+    static std::uint64_t HashFaces(std::uint64_t h, Mesh const* mesh, std::size_t first, std::size_t last)
+    {
+        // Unused indices are not initialized, so faces can't be hashed as raw memory
+        for (std::size_t i = first; i < last; ++i)
+        {
+            auto face = mesh->GetFace(static_cast<int>(i));
+            h = HashCombine(h, (std::uint64_t(std::uint32_t(face.i0)) << 32) | std::uint32_t(face.i1));
+            h = HashCombine(h, (std::uint64_t(std::uint32_t(face.i2)) << 32) |
+                std::uint32_t(face.type_ == Mesh::QUAD ? face.i3 : -1));
+        }
+
+        return h;
+    }
+
+    static std::uint64_t HashVertices(std::uint64_t h, Mesh const* mesh, std::size_t first, std::size_t last)
+    {
+        // Shared meshes might be strided, so vertices are hashed one by one
+        for (std::size_t i = first; i < last; ++i)
+        {
+            auto v = mesh->GetVertex(static_cast<int>(i));
+            float xyz[3] = { v.x, v.y, v.z };
+            h = HashBytes(h, xyz, sizeof(xyz));
+        }
+
+        return h;
+    }
+
+    BvhCache::BvhCache(World const& world)
+    {
+        auto path = world.options_.GetOption("bvh.cache.path");
+
+        if (path)
+        {
+            m_path = path->AsString();
+        }
+    }
+
+    std::uint64_t BvhCache::CalcKey(World const& world, char const* tag,
+        std::vector<char const*> const& options)
+    {
+        // Scene description: everything apart from the geometry itself
+        std::vector<std::uint64_t> header;
+        header.push_back(kCacheVersion);
+        header.push_back(HashString(tag));
+
+        for (auto name : options)
+        {
+            header.push_back(HashString(name));
+
+            auto option = world.options_.GetOption(name);
+            if (!option)
+            {
+                header.push_back(0);
+            }
+            else if (!option->AsString().empty())
+            {
+                header.push_back(1);
+                header.push_back(HashString(option->AsString()));
+            }
+            else
+            {
+                float value = option->AsFloat();
+                std::uint32_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                header.push_back(2);
+                header.push_back(bits);
+            }
+        }
+
+        // Meshes shared by several instances are hashed once
+        std::vector<Mesh const*> meshes;
+        std::unordered_map<Mesh const*, std::size_t> mesh_indices;
+
+        header.push_back(world.GetShapes().size());
+        for (auto shape : world.GetShapes())
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            auto mesh = static_cast<Mesh const*>(shapeimpl->is_instance() ?
+                static_cast<Instance const*>(shapeimpl)->GetBaseShape() : shapeimpl);
+
+            auto iter = mesh_indices.find(mesh);
+            if (iter == mesh_indices.end())
+            {
+                iter = mesh_indices.emplace(mesh, meshes.size()).first;
+                meshes.push_back(mesh);
+            }
+
+            matrix m, minv;
+            shape->GetTransform(m, minv);
+
+            header.push_back(shapeimpl->is_instance() ? 1 : 0);
+            header.push_back(std::uint32_t(shape->GetId()));
+            header.push_back(iter->second);
+            header.push_back(HashBytes(0, &m.m[0][0], sizeof(float) * 16));
+        }
+
+        for (auto mesh : meshes)
+        {
+            header.push_back(mesh->num_vertices());
+            header.push_back(mesh->num_faces());
+        }
+
+        // Geometry is split into chunks hashed in parallel
+        // and combined in order, so the key does not depend on threading
+        struct Chunk
+        {
+            Mesh const* mesh;
+            bool faces;
+            std::size_t first;
+            std::size_t last;
+        };
+
+        std::vector<Chunk> chunks;
+        for (auto mesh : meshes)
+        {
+            for (std::size_t i = 0; i < std::size_t(mesh->num_vertices()); i += kHashChunkSize)
+            {
+                chunks.push_back(Chunk{ mesh, false, i, std::min(i + kHashChunkSize, std::size_t(mesh->num_vertices())) });
+            }
+
+            for (std::size_t i = 0; i < std::size_t(mesh->num_faces()); i += kHashChunkSize)
+            {
+                chunks.push_back(Chunk{ mesh, true, i, std::min(i + kHashChunkSize, std::size_t(mesh->num_faces())) });
+            }
+        }
+
+        std::vector<std::uint64_t> chunk_hashes(chunks.size());
+        auto const num_chunks = static_cast<int>(chunks.size());
+        auto const num_tasks = std::max(1, std::min(task_scheduler::instance().num_threads(), num_chunks));
+
+        parallel_for(0, num_chunks, num_tasks, [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                auto const& chunk = chunks[i];
+                if (chunk.faces)
+                {
+                    chunk_hashes[i] = HashFaces(0, chunk.mesh, chunk.first, chunk.last);
+                }
+                else
+                {
+                    chunk_hashes[i] = HashVertices(0, chunk.mesh, chunk.first, chunk.last);
+                }
+            }
+        });
+
+        auto key = HashBytes(0, header.data(), header.size() * sizeof(std::uint64_t));
+        for (auto h : chunk_hashes)
+        {
+            key = HashCombine(key, h);
+        }
+
+        return HashFinalize(key);
+    }
+
+    std::string BvhCache::GetFileName(std::uint64_t key) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.rrbvh", static_cast<unsigned long long>(key));
+        return m_path + "/" + name;
+    }
+
+    std::unique_ptr<BvhCache::Entry> BvhCache::Load(std::uint64_t key) const
+    {
+        if (!IsEnabled())
+        {
+            return nullptr;
+        }
+
+        auto filename = GetFileName(key);
+        std::unique_ptr<Entry> entry(new Entry);
+
+#ifdef WIN32
+        auto file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return nullptr;
+        }
+
+        entry->m_file = file;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart < static_cast<LONGLONG>(sizeof(FileHeader)))
+        {
+            return nullptr;
+        }
+
+        entry->m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!entry->m_mapping)
+        {
+            return nullptr;
+        }
+
+        entry->m_data = MapViewOfFile(entry->m_mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!entry->m_data)
+        {
+            return nullptr;
+        }
+
+        entry->m_size = static_cast<std::size_t>(size.QuadPart);
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(FileHeader)))
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        // Mapping stays valid after the descriptor is closed
+        auto data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        entry->m_data = data;
+        entry->m_size = static_cast<std::size_t>(st.st_size);
+#endif
+
+        // Validate the header and the section table only, section data is
+        // left untouched so that a hit does not page in the whole file
+        FileHeader header;
+        std::memcpy(&header, entry->m_data, sizeof(header));
+
+        if (std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+            header.version != kCacheVersion ||
+            header.key != key ||
+            header.file_size != entry->m_size ||
+            header.num_sections > kMaxSections ||
+            sizeof(FileHeader) + header.num_sections * sizeof(SectionHeader) > entry->m_size)
+        {
+            return nullptr;
+        }
+
+        auto sections = reinterpret_cast<SectionHeader const*>(static_cast<char const*>(entry->m_data) + sizeof(FileHeader));
+        if (HashHeader(header, sections) != header.checksum)
+        {
+            return nullptr;
+        }
+
+        for (auto i = 0u; i < header.num_sections; ++i)
+        {
+            if (sections[i].offset > entry->m_size || sections[i].size > entry->m_size - sections[i].offset)
+            {
+                return nullptr;
+            }
+        }
+
+        return entry;
+    }
+
+    bool BvhCache::Store(std::uint64_t key, std::vector<Section> const& sections) const
+    {
+        if (!IsEnabled() || sections.size() > kMaxSections)
+        {
+            return false;
+        }
+
+        auto align = [](std::uint64_t offset)
+        {
+            return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+        };
+
+        FileHeader header;
+        std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+        header.version = kCacheVersion;
+        header.num_sections = static_cast<std::uint32_t>(sections.size());
+        header.key = key;
+
+        std::vector<SectionHeader> table(sections.size());
+        std::uint64_t offset = align(sizeof(FileHeader) + table.size() * sizeof(SectionHeader));
+
+        for (auto i = 0u; i < sections.size(); ++i)
+        {
+            table[i].type = sections[i].type;
+            table[i].padding = 0;
+            table[i].offset = offset;
+            table[i].size = sections[i].size;
+            offset = align(offset + sections[i].size);
+        }
+
+        header.file_size = sections.empty() ? sizeof(FileHeader) : table.back().offset + table.back().size;
+        header.checksum = HashHeader(header, table.data());
+
+        // Concurrent readers never observe a partially written entry
+        return Calc::WriteFileAtomic(GetFileName(key), [&](std::ostream& out)
+        {
+            char const padding[kSectionAlignment] = {};
+            std::uint64_t position = sizeof(FileHeader) + table.size() * sizeof(SectionHeader);
+
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            out.write(reinterpret_cast<char const*>(table.data()), table.size() * sizeof(SectionHeader));
+
+            for (auto i = 0u; i < sections.size(); ++i)
+            {
+                out.write(padding, static_cast<std::streamsize>(table[i].offset - position));
+                out.write(static_cast<char const*>(sections[i].data), static_cast<std::streamsize>(sections[i].size));
+                position = table[i].offset + table[i].size;
+            }
+        });
+    }
+
+    BvhCache::Entry::~Entry()
+    {
+#ifdef WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file) CloseHandle(m_file);
+#else
+        if (m_data) munmap(m_data, m_size);
+#endif
+    }
+
+    void const* BvhCache::Entry::GetSection(std::uint32_t type, std::size_t& size) const
+    {
+        FileHeader header;
+        std::memcpy(&header, m_data, sizeof(header));
+
+        auto sections = reinterpret_cast<SectionHeader const*>(static_cast<char const*>(m_data) + sizeof(FileHeader));
+        for (auto i = 0u; i < header.num_sections; ++i)
+        {
+            if (sections[i].type == type)
+            {
+                size = static_cast<std::size_t>(sections[i].size);
+                return static_cast<char const*>(m_data) + sections[i].offset;
+            }
+        }
+
+        return nullptr;
+    }
+}
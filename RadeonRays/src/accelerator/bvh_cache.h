@@ -0,0 +1,124 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    class World;
+
+    ///< Persistent cache of translated acceleration structures.
+    ///< Each entry is a single file holding a set of sections
+    ///< (nodes, faces, vertices, ...) laid out exactly as they are
+    ///< uploaded to the device, so a cache hit is served straight
+    ///< from a read-only memory mapping of the file.
+    ///< Entries are keyed by a hash of the scene geometry, shape ids,
+    ///< transforms and build options, so any change of those results
+    ///< in a cache miss rather than in a stale hierarchy.
+    ///< Cache failures are never fatal: a missing, truncated or
+    ///< outdated entry is reported as a miss and writes are best effort.
+    ///<
+    class BvhCache
+    {
+    public:
+        // Section types
+        enum SectionType : std::uint32_t
+        {
+            kNodes = 1,
+            kFaces,
+            kVertices,
+            kLeafRefs
+        };
+
+        // Section to store
+        struct Section
+        {
+            std::uint32_t type;
+            void const* data;
+            std::size_t size;
+        };
+
+        // Memory mapped cache entry
+        class Entry;
+
+        // Cache directory is taken from "bvh.cache.path" option,
+        // caching is disabled if the option is not set
+        explicit BvhCache(World const& world);
+
+        bool IsEnabled() const { return !m_path.empty(); }
+
+        // Calculate the key for the world built by the accelerator
+        // identified by tag, values of the options listed affect the key
+        static std::uint64_t CalcKey(World const& world, char const* tag,
+            std::vector<char const*> const& options);
+
+        // Map the entry for the key, nullptr is returned on a miss
+        std::unique_ptr<Entry> Load(std::uint64_t key) const;
+
+        // Write the entry for the key, returns false if failed
+        bool Store(std::uint64_t key, std::vector<Section> const& sections) const;
+
+    private:
+        std::string GetFileName(std::uint64_t key) const;
+
+        // Cache directory
+        std::string m_path;
+    };
+
+    class BvhCache::Entry
+    {
+    public:
+        ~Entry();
+
+        // Get section data, nullptr is returned if there is no such section
+        void const* GetSection(std::uint32_t type, std::size_t& size) const;
+
+        // Get section data if its size matches expected one
+        template <typename T>
+        T const* GetSection(std::uint32_t type, std::size_t count) const
+        {
+            std::size_t size = 0;
+            auto data = GetSection(type, size);
+            return (data && size == count * sizeof(T)) ? static_cast<T const*>(data) : nullptr;
+        }
+
+    private:
+        friend class BvhCache;
+
+        Entry() = default;
+        Entry(Entry const&) = delete;
+        Entry& operator = (Entry const&) = delete;
+
+        // Mapped file
+        void* m_data = nullptr;
+        std::size_t m_size = 0;
+#ifdef WIN32
+        void* m_file = nullptr;
+        void* m_mapping = nullptr;
+#endif
+    };
+}
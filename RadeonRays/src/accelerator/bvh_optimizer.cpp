@@ -0,0 +1,440 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_optimizer.h"
+#include "bvh.h"
+#include "bvh2.h"
+#include "../async/task_scheduler.h"
+#include "../world/world.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace RadeonRays
+{
+    // Max number of subtrees in a treelet, optimal topology search is O(3^n)
+    static int constexpr kTreeletSize = 7;
+    static int constexpr kNumSubsets = 1 << kTreeletSize;
+    // Passes over the tree, later ones rarely improve the cost
+    static int constexpr kMaxPasses = 3;
+    // Stop if the pass improved the cost by less than that
+    static float constexpr kMinPassImprovement = 0.01f;
+    // Treelets are replaced only if they get better by more than that
+    static float constexpr kMinTreeletImprovement = 1e-5f;
+
+    static int GetNumThreads()
+    {
+        return task_scheduler::instance().num_threads();
+    }
+
+    // Time budget set for the world, 0 if the pass is disabled
+    static float GetTimeBudget(World const& world)
+    {
+        auto optimize = world.options_.GetOption("bvh.optimize.ms");
+        return optimize ? optimize->AsFloat() : 0.f;
+    }
+
+    void BvhOptimizer::Process(World const& world, Bvh& bvh)
+    {
+        auto budget = GetTimeBudget(world);
+        if (budget > 0.f)
+        {
+            BvhOptimizer(budget).Process(bvh);
+        }
+    }
+
+    void BvhOptimizer::Process(World const& world, Bvh2& bvh)
+    {
+        auto budget = GetTimeBudget(world);
+        if (budget > 0.f)
+        {
+            BvhOptimizer(budget).Process(bvh);
+        }
+    }
+
+    void BvhOptimizer::Process(Bvh& bvh)
+    {
+        // Conversion of the tree counts towards the budget too
+        auto deadline = clock::now() + std::chrono::microseconds(static_cast<long long>(m_time_budget_ms * 1000.f));
+
+        if (!bvh.m_root || bvh.m_root->type == Bvh::kLeaf)
+        {
+            return;
+        }
+
+        // Flatten the tree, pointers keep the order of the flat nodes
+        std::vector<Bvh::Node*> ptrs;
+        std::vector<Node> nodes;
+        // Node to visit along with its parent slot
+        std::vector<std::pair<Bvh::Node*, int> > stack;
+        ptrs.reserve(bvh.m_nodecnt);
+        nodes.reserve(bvh.m_nodecnt);
+        stack.emplace_back(bvh.m_root, -1);
+
+        while (!stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            int idx = static_cast<int>(nodes.size());
+            if (entry.second >= 0)
+            {
+                nodes[entry.second >> 1].child[entry.second & 1] = idx;
+            }
+
+            ptrs.push_back(entry.first);
+            nodes.push_back(Node{ entry.first->bounds, { -1, -1 } });
+
+            if (entry.first->type == Bvh::kInternal)
+            {
+                stack.emplace_back(entry.first->rc, (idx << 1) + 1);
+                stack.emplace_back(entry.first->lc, idx << 1);
+            }
+        }
+
+        Optimize(nodes, deadline);
+
+        // Rewire internal nodes, recalculate complete tree indices and height
+        std::vector<std::pair<int, int> > levels;
+        levels.emplace_back(0, 0);
+        ptrs[0]->index = 1;
+        int height = 0;
+
+        while (!levels.empty())
+        {
+            auto entry = levels.back();
+            levels.pop_back();
+
+            auto const& node = nodes[entry.first];
+            auto ptr = ptrs[entry.first];
+            ptr->bounds = node.bounds;
+
+            if (node.child[0] < 0)
+            {
+                height = std::max(height, entry.second);
+                continue;
+            }
+
+            ptr->lc = ptrs[node.child[0]];
+            ptr->rc = ptrs[node.child[1]];
+            ptr->lc->index = ptr->index << 1;
+            ptr->rc->index = (ptr->index << 1) + 1;
+
+            levels.emplace_back(node.child[0], entry.second + 1);
+            levels.emplace_back(node.child[1], entry.second + 1);
+        }
+
+        bvh.m_height = height;
+    }
+
+    void BvhOptimizer::Process(Bvh2& bvh)
+    {
+        // Conversion of the tree counts towards the budget too
+        auto deadline = clock::now() + std::chrono::microseconds(static_cast<long long>(m_time_budget_ms * 1000.f));
+
+        if (bvh.m_nodecount < 3)
+        {
+            return;
+        }
+
+        // Encoded nodes are already indexed, internal ones keep bounds of their children
+        auto const num_nodes = static_cast<int>(bvh.m_nodecount);
+        std::vector<Node> nodes(num_nodes);
+
+        for (int i = 0; i < num_nodes; ++i)
+        {
+            auto const& node = bvh.m_nodes[i];
+            Bvh2::GetNodeBounds(node, &nodes[i].bounds.pmin.x, &nodes[i].bounds.pmax.x);
+            nodes[i].child[0] = Bvh2::IsInternal(node) ? static_cast<int>(node.addr_left) : -1;
+            nodes[i].child[1] = Bvh2::IsInternal(node) ? static_cast<int>(node.addr_right) : -1;
+        }
+
+        Optimize(nodes, deadline);
+
+        // Lay nodes out depth-first again, so children follow their parent
+        // in memory as refit and the traversal kernels expect
+        std::vector<Bvh2::Node> old_nodes(bvh.m_nodes, bvh.m_nodes + num_nodes);
+        Bvh2::RefArray old_refs(num_nodes, Bvh2::kInvalidId);
+        std::swap(old_refs, bvh.m_leaf_refs);
+
+        std::vector<std::pair<int, std::uint32_t*> > stack;
+        stack.emplace_back(0, nullptr);
+        std::uint32_t count = 0;
+
+        while (!stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            auto const idx = count++;
+            if (entry.second)
+            {
+                *entry.second = idx;
+            }
+
+            auto& dst = bvh.m_nodes[idx];
+            auto const& node = nodes[entry.first];
+            dst = old_nodes[entry.first];
+            bvh.m_leaf_refs[idx] = old_refs[entry.first];
+
+            if (node.child[0] < 0)
+            {
+                continue;
+            }
+
+            auto const& left = nodes[node.child[0]].bounds;
+            auto const& right = nodes[node.child[1]].bounds;
+            for (int i = 0; i < 3; ++i)
+            {
+                dst.aabb_left_min_or_v0[i] = left.pmin[i];
+                dst.aabb_left_max_or_v1[i] = left.pmax[i];
+                dst.aabb_right_min_or_v2[i] = right.pmin[i];
+                dst.aabb_right_max[i] = right.pmax[i];
+            }
+
+            stack.emplace_back(node.child[1], &dst.addr_right);
+            stack.emplace_back(node.child[0], &dst.addr_left);
+        }
+
+        assert(count == bvh.m_nodecount);
+    }
+
+    float BvhOptimizer::CalcCost(std::vector<Node> const& nodes)
+    {
+        // Leaves are never changed, so only internal nodes contribute
+        double cost = 0.0;
+        for (auto const& node : nodes)
+        {
+            if (node.child[0] >= 0)
+            {
+                cost += node.bounds.surface_area();
+            }
+        }
+
+        auto area = nodes[0].bounds.surface_area();
+        return area > 0.f ? static_cast<float>(cost / area) : 0.f;
+    }
+
+    void BvhOptimizer::Optimize(std::vector<Node>& nodes, clock::time_point deadline)
+    {
+        m_initial_cost = m_final_cost = CalcCost(nodes);
+
+        for (int pass = 0; pass < kMaxPasses && clock::now() < deadline; ++pass)
+        {
+            OptimizeNode(nodes, 0, 0, deadline);
+
+            auto cost = CalcCost(nodes);
+            bool converged = cost > m_final_cost * (1.f - kMinPassImprovement);
+            m_final_cost = cost;
+
+            if (converged)
+            {
+                break;
+            }
+        }
+    }
+
+    void BvhOptimizer::OptimizeNode(std::vector<Node>& nodes, int idx, int level, clock::time_point deadline) const
+    {
+        while (nodes[idx].child[0] >= 0)
+        {
+            if (clock::now() >= deadline)
+            {
+                return;
+            }
+
+            // Treelet nodes stay inside the subtree, so children can be processed
+            // independently once the treelet of their parent is fixed
+            RestructureTreelet(nodes, idx);
+
+            auto const left = nodes[idx].child[0];
+            auto const right = nodes[idx].child[1];
+
+            // 2^level subtrees are already processed concurrently at this level
+            if (level < 31 && (1 << level) < GetNumThreads())
+            {
+                auto& scheduler = task_scheduler::instance();
+                task_group group;
+
+                scheduler.run(group, [this, &nodes, left, level, deadline]() { OptimizeNode(nodes, left, level + 1, deadline); });
+                OptimizeNode(nodes, right, level + 1, deadline);
+                scheduler.wait(group);
+                return;
+            }
+
+            OptimizeNode(nodes, left, level + 1, deadline);
+
+            // Loop instead of recursion for the right child to bound the stack depth
+            idx = right;
+            ++level;
+        }
+    }
+
+    bool BvhOptimizer::RestructureTreelet(std::vector<Node>& nodes, int idx) const
+    {
+        // Form the treelet expanding the subtree of the largest area
+        int leaves[kTreeletSize];
+        int internal[kTreeletSize - 1];
+        int num_leaves = 2;
+        int num_internal = 1;
+
+        leaves[0] = nodes[idx].child[0];
+        leaves[1] = nodes[idx].child[1];
+        internal[0] = idx;
+
+        float cost = nodes[idx].bounds.surface_area();
+
+        while (num_leaves < kTreeletSize)
+        {
+            int best = -1;
+            float best_area = -1.f;
+
+            for (int i = 0; i < num_leaves; ++i)
+            {
+                auto const& node = nodes[leaves[i]];
+                auto area = node.bounds.surface_area();
+
+                if (node.child[0] >= 0 && area > best_area)
+                {
+                    best = i;
+                    best_area = area;
+                }
+            }
+
+            if (best < 0)
+            {
+                break;
+            }
+
+            auto const expanded = leaves[best];
+            internal[num_internal++] = expanded;
+            leaves[best] = nodes[expanded].child[0];
+            leaves[num_leaves++] = nodes[expanded].child[1];
+            cost += best_area;
+        }
+
+        // Two subtrees can only be combined one way
+        if (num_leaves < 3)
+        {
+            return false;
+        }
+
+        // Optimal cost of a subset is the area of its union plus
+        // the best cost of splitting it in two parts
+        int const num_subsets = 1 << num_leaves;
+        bbox bounds[kNumSubsets];
+        float costs[kNumSubsets];
+        int partitions[kNumSubsets];
+
+        for (int s = 1; s < num_subsets; ++s)
+        {
+            int const lowest = s & -s;
+
+            if (s == lowest)
+            {
+                int i = 0;
+                while ((1 << i) != s) ++i;
+                bounds[s] = nodes[leaves[i]].bounds;
+                // Subtree cost does not depend on the treelet
+                costs[s] = 0.f;
+                partitions[s] = 0;
+                continue;
+            }
+
+            bounds[s] = bboxunion(bounds[s ^ lowest], bounds[lowest]);
+
+            // The lowest bit stays in the left part, so each split is visited once
+            float best_cost = std::numeric_limits<float>::max();
+            int best_partition = lowest;
+            int const rest = s ^ lowest;
+
+            for (int p = (rest - 1) & rest; ; p = (p - 1) & rest)
+            {
+                int const left = p | lowest;
+                float const c = costs[left] + costs[s ^ left];
+
+                if (c < best_cost)
+                {
+                    best_cost = c;
+                    best_partition = left;
+                }
+
+                if (p == 0)
+                {
+                    break;
+                }
+            }
+
+            costs[s] = bounds[s].surface_area() + best_cost;
+            partitions[s] = best_partition;
+        }
+
+        int const all = num_subsets - 1;
+        if (costs[all] >= cost * (1.f - kMinTreeletImprovement))
+        {
+            return false;
+        }
+
+        // Emit the new topology reusing treelet internal nodes,
+        // the root keeps its slot so its parent is not affected
+        struct Emit
+        {
+            int subset;
+            int node;
+        };
+
+        Emit stack[kTreeletSize];
+        int stack_size = 0;
+        int next_internal = 1;
+        stack[stack_size++] = Emit{ all, internal[0] };
+
+        while (stack_size > 0)
+        {
+            auto const entry = stack[--stack_size];
+            auto& node = nodes[entry.node];
+            node.bounds = bounds[entry.subset];
+
+            int const parts[2] = { partitions[entry.subset], entry.subset ^ partitions[entry.subset] };
+
+            for (int c = 0; c < 2; ++c)
+            {
+                auto const part = parts[c];
+
+                if ((part & (part - 1)) == 0)
+                {
+                    int i = 0;
+                    while ((1 << i) != part) ++i;
+                    node.child[c] = leaves[i];
+                }
+                else
+                {
+                    auto const child = internal[next_internal++];
+                    node.child[c] = child;
+                    stack[stack_size++] = Emit{ part, child };
+                }
+            }
+        }
+
+        assert(next_internal == num_internal);
+        return true;
+    }
+}
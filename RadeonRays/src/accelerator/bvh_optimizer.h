@@ -0,0 +1,92 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "math/bbox.h"
+
+#include <chrono>
+#include <vector>
+
+namespace RadeonRays
+{
+    class Bvh;
+    class Bvh2;
+    class World;
+
+    ///< Post-build pass lowering SAH cost of a hierarchy by treelet restructuring
+    ///< (Karras, Aila "Fast Parallel Construction of High-Quality Bounding Volume
+    ///< Hierarchies", HPG 2013). A treelet of up to 7 subtrees is formed under
+    ///< each node and rewired into the topology of minimal cost found by dynamic
+    ///< programming over the subsets of its subtrees. Leaves keep their primitives,
+    ///< so the output of any builder can be processed. Top levels are processed
+    ///< first and independent subtrees go to separate tasks, the pass stops
+    ///< when the time budget is exceeded leaving a valid tree.
+    ///<
+    class BvhOptimizer
+    {
+    public:
+        // Time budget for the whole pass in milliseconds
+        explicit BvhOptimizer(float time_budget_ms)
+            : m_time_budget_ms(time_budget_ms)
+            , m_initial_cost(0.f)
+            , m_final_cost(0.f)
+        {
+        }
+
+        // Restructure the hierarchy in place
+        void Process(Bvh& bvh);
+        void Process(Bvh2& bvh);
+
+        // Restructure the hierarchy if the world sets "bvh.optimize.ms",
+        // its value is the time budget, builders call it after Build
+        static void Process(World const& world, Bvh& bvh);
+        static void Process(World const& world, Bvh2& bvh);
+
+        // SAH cost of internal nodes relative to the root area
+        // before and after the last Process call
+        float GetInitialCost() const { return m_initial_cost; }
+        float GetFinalCost() const { return m_final_cost; }
+
+    private:
+        // Flat tree node, leaves have no children
+        struct Node
+        {
+            bbox bounds;
+            int child[2];
+        };
+
+        using clock = std::chrono::steady_clock;
+
+        // Run restructuring passes over the tree rooted at nodes[0]
+        void Optimize(std::vector<Node>& nodes, clock::time_point deadline);
+        // Restructure treelets of the subtree top-down
+        void OptimizeNode(std::vector<Node>& nodes, int idx, int level, clock::time_point deadline) const;
+        // Replace the treelet rooted at idx with the optimal one, returns false if it is already optimal
+        bool RestructureTreelet(std::vector<Node>& nodes, int idx) const;
+        // Sum of internal node areas relative to the root area
+        static float CalcCost(std::vector<Node> const& nodes);
+
+        float m_time_budget_ms;
+        float m_initial_cost;
+        float m_final_cost;
+    };
+}
@@ -27,11 +27,10 @@ THE SOFTWARE.
 #include "calc.h"
 #include "event.h"
 
+#include <algorithm>
 #include <vector>
 #include <numeric>
-#include <chrono>
 #include <cstring>
-#include <iostream>
 #include <assert.h>
 
 #ifdef RR_EMBED_KERNELS
@@ -43,28 +42,26 @@ THE SOFTWARE.
 #endif
 #endif // RR_EMBED_KERNELS
 
-#define INITIAL_TRIANGLE_CAPACITY 100000
-
 namespace RadeonRays
 {
     
     static int kWorkGroupSize = 64;
+    // Max number of groups in the first pass of the bounds reduction
+    static int kMaxReductionGroups = 64;
     
     Hlbvh::Hlbvh(Calc::Device* device)
     : m_device(device)
     , m_gpudata(new GpuData(device))
+    , m_bound_valid(false)
+    , m_num_prims(0)
     {
         InitGpuData();
     }
     
     void Hlbvh::AllocateBuffers(size_t num_prims)
     {
-        // * 3 since only triangles are supported just yet
-        m_gpudata->positions = m_device->CreateBuffer(num_prims * sizeof(float3), Calc::BufferType::kWrite);
-        // * 3 since 3 vertex indices + 1 material idx
-        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
-        
-        
+        m_gpudata->ReleaseBuffers();
+
         std::vector<int> iota(num_prims);
         std::iota(iota.begin(), iota.end(), 0);
         
@@ -73,13 +70,15 @@ namespace RadeonRays
         m_gpudata->sorted_morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
         m_gpudata->sorted_prim_indices = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
         
+        // First N-1 - internal nodes, last N - leafs
         m_gpudata->nodes = m_device->CreateBuffer(2 * num_prims * sizeof(Node), Calc::BufferType::kWrite);
-        // Bounds
+        // Bounds, sorted bounds are indexed the same way nodes are
         m_gpudata->bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
-        m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kRead);
-        m_gpudata->sorted_bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
+        m_gpudata->sorted_bounds = m_device->CreateBuffer(2 * num_prims * sizeof(bbox), Calc::BufferType::kWrite);
         // Propagation flags
         m_gpudata->flags = m_device->CreateBuffer(2 * num_prims * sizeof(int), Calc::BufferType::kWrite);
+
+        m_gpudata->capacity = num_prims;
     }
     
     void Hlbvh::InitGpuData()
@@ -88,7 +87,10 @@ namespace RadeonRays
 #ifndef RR_EMBED_KERNELS
         if ( m_device->GetPlatform() == Calc::Platform::kOpenCL )
         {
-            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", nullptr, 0, nullptr );
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", headers, numheaders, nullptr );
         }
 
         else
@@ -117,8 +119,17 @@ namespace RadeonRays
         m_gpudata->build_func = m_gpudata->executable->CreateFunction("emit_hierarchy_main");
         m_gpudata->refit_func = m_gpudata->executable->CreateFunction("refit_bounds_main");
 
-        // Allocate GPU buffers
-        AllocateBuffers(INITIAL_TRIANGLE_CAPACITY);
+        // Device side bounds reduction, flags clear and leaf update are OpenCL only
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->reduce_bounds_func = m_gpudata->executable->CreateFunction("reduce_bounds_main");
+            m_gpudata->clear_flags_func = m_gpudata->executable->CreateFunction("clear_flags_main");
+            m_gpudata->update_leaves_func = m_gpudata->executable->CreateFunction("update_leaf_bounds_main");
+        }
+
+        // Primitive buffers are allocated on the first build
+        m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kWrite);
+        m_gpudata->bound_partials = m_device->CreateBuffer(kMaxReductionGroups * sizeof(bbox), Calc::BufferType::kWrite);
         
         // Initialize parallel primitives
         if (!m_device->HasBuiltinPrimitives())
@@ -132,69 +143,152 @@ namespace RadeonRays
     // Build function
     void Hlbvh::Build(bbox const* bounds, int numbounds)
     {
-//#ifdef _DEBUG
-        auto s = std::chrono::high_resolution_clock::now();
-//#endif
         BuildImpl(bounds, numbounds);
-//#ifdef _DEBUG
-        m_device->Finish(0);
-        // Note, that this is total time spent for setup and construction 
-        // including the time spent waiting in the queue.
-        auto d = std::chrono::high_resolution_clock::now() - s;
-        std::cout << "HLBVH setup + construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
-//#endif
     }
-    
+
+    // Refit function
+    void Hlbvh::Refit(bbox const* bounds, int numbounds)
+    {
+        // Leaf update needs a kernel, rebuild otherwise
+        if (!m_gpudata->update_leaves_func || numbounds != m_num_prims)
+        {
+            BuildImpl(bounds, numbounds);
+            return;
+        }
+
+        auto upload_event = UploadBounds(bounds, numbounds);
+
+        // Put new primitive bounds into the leafs of the existing hierarchy,
+        // the queue is in order so the kernel follows the scene bound reduction
+        int arg = 0;
+        m_gpudata->update_leaves_func->SetArg(arg++, m_gpudata->bounds);
+        m_gpudata->update_leaves_func->SetArg(arg++, m_gpudata->sorted_prim_indices);
+        m_gpudata->update_leaves_func->SetArg(arg++, sizeof(numbounds), &numbounds);
+        m_gpudata->update_leaves_func->SetArg(arg++, m_gpudata->sorted_bounds);
+
+        int globalsize = ((numbounds + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_device->Execute(m_gpudata->update_leaves_func, 0, globalsize, kWorkGroupSize, nullptr);
+
+        RefitNodes(numbounds);
+
+        // The caller owns bounds memory
+        upload_event->Wait();
+        m_device->DeleteEvent(upload_event);
+    }
     
     // World space bounding box
     bbox const& Hlbvh::Bounds() const
     {
-        // TODO: implement me
-        static bbox s_tmp;
-        return s_tmp;
+        if (!m_bound_valid)
+        {
+            Calc::Event* e = nullptr;
+            m_device->ReadBuffer(m_gpudata->scene_bound, 0, 0, sizeof(bbox), &m_bound, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+            m_bound_valid = true;
+        }
+
+        return m_bound;
     }
-    
-    // Build function
-    void Hlbvh::BuildImpl(bbox const* bounds, int numbounds)
+
+    Calc::Event* Hlbvh::UploadBounds(bbox const* bounds, int numbounds)
     {
         int size = numbounds;
-        
+
         // Make sure to allocate enough mem on GPU
         // We are trying to reuse space as reallocation takes time
         // but this call might be really frequent
-        if (static_cast<size_t>(size) > m_gpudata->positions->GetSize())
+        if (static_cast<size_t>(size) > m_gpudata->capacity)
         {
             AllocateBuffers(size);
         }
 
-        // Evaluate scene bouds
-        bbox scene_bound = bbox();
-        for (auto i = 0; i < numbounds; ++i)
-            scene_bound.grow(bounds[i]);
+        // Primitive bounds are the only data coming from the host,
+        // all the following stages run on the device back to back
+        Calc::Event* upload_event = nullptr;
+        m_device->WriteBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, const_cast<bbox*>(bounds), &upload_event);
 
-        m_device->WriteBuffer(m_gpudata->scene_bound, 0, 0, sizeof(bbox), &scene_bound, nullptr);
+        if (m_gpudata->reduce_bounds_func)
+        {
+            // Scene bound: a bbox per work group first, then a single group reduces them
+            int num_groups = std::min((size + kWorkGroupSize - 1) / kWorkGroupSize, kMaxReductionGroups);
+
+            int arg = 0;
+            m_gpudata->reduce_bounds_func->SetArg(arg++, m_gpudata->bounds);
+            m_gpudata->reduce_bounds_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->reduce_bounds_func->SetArg(arg++, m_gpudata->bound_partials);
+
+            Calc::Event* partials_event = nullptr;
+            m_device->Execute(m_gpudata->reduce_bounds_func, 0, num_groups * kWorkGroupSize, kWorkGroupSize, upload_event, &partials_event);
+
+            arg = 0;
+            m_gpudata->reduce_bounds_func->SetArg(arg++, m_gpudata->bound_partials);
+            m_gpudata->reduce_bounds_func->SetArg(arg++, sizeof(num_groups), &num_groups);
+            m_gpudata->reduce_bounds_func->SetArg(arg++, m_gpudata->scene_bound);
+
+            m_device->Execute(m_gpudata->reduce_bounds_func, 0, kWorkGroupSize, kWorkGroupSize, partials_event, nullptr);
+            m_device->DeleteEvent(partials_event);
 
-        // Write bounds buffer
+            m_bound_valid = false;
+        }
+        else
         {
-            bbox* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
-            std::memcpy(tmp, bounds, sizeof(bbox) * numbounds);
-            m_device->UnmapBuffer(m_gpudata->bounds, 0, tmp, nullptr);
+            // No reduction kernels for this platform
+            m_bound = bbox();
+            for (auto i = 0; i < numbounds; ++i)
+                m_bound.grow(bounds[i]);
+
+            m_device->WriteBuffer(m_gpudata->scene_bound, 0, 0, sizeof(bbox), &m_bound, nullptr);
             m_device->Finish(0);
+
+            m_bound_valid = true;
         }
-        
-        // Initialize flags with zero 
+
+        return upload_event;
+    }
+
+    void Hlbvh::RefitNodes(int numbounds)
+    {
+        int size = numbounds;
+
+        // Initialize flags with zero
+        int num_flags = 2 * size;
+        if (m_gpudata->clear_flags_func)
         {
-            int* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->flags, 0, 0, sizeof(int) * 2 * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
-            std::memset(tmp, 0, sizeof(int) * numbounds * 2);
-            m_device->UnmapBuffer(m_gpudata->flags, 0, tmp, nullptr);
+            int arg = 0;
+            m_gpudata->clear_flags_func->SetArg(arg++, m_gpudata->flags);
+            m_gpudata->clear_flags_func->SetArg(arg++, sizeof(num_flags), &num_flags);
+
+            int globalsize = ((num_flags + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            m_device->Execute(m_gpudata->clear_flags_func, 0, globalsize, kWorkGroupSize, nullptr);
+        }
+        else
+        {
+            std::vector<int> zeros(num_flags, 0);
+            m_device->WriteBuffer(m_gpudata->flags, 0, 0, sizeof(int) * num_flags, &zeros[0], nullptr);
             m_device->Finish(0);
         }
 
-        // Calculate Morton codes array
+        // Propagate bounds from the leafs up to the root
+        int arg = 0;
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->refit_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->flags);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_device->Execute(m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr);
+    }
+    
+    // Build function
+    void Hlbvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        int size = numbounds;
+
+        auto upload_event = UploadBounds(bounds, numbounds);
+
+        // Calculate Morton codes array,
+        // the queue is in order so the kernel follows the scene bound reduction
         int arg = 0;
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->bounds);
         m_gpudata->morton_code_func->SetArg(arg++, sizeof(size), &size);
@@ -205,16 +299,11 @@ namespace RadeonRays
         int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch Morton codes kernel
-        m_device->Execute(m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, nullptr);
-        m_device->Finish(0);
+        m_device->Execute(m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, upload_event, nullptr);
         
         // Sort primitives according to their Morton codes
         m_gpudata->pp->SortRadixInt32(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
 
-        std::vector<int> codes(size);
-        m_device->ReadBuffer(m_gpudata->sorted_prim_indices, 0, 0, sizeof(int) * size, &codes[0], nullptr);
-        m_device->Finish(0);
-       
         // Prepare tree construction kernel
         arg = 0;
         m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
@@ -224,22 +313,15 @@ namespace RadeonRays
         m_gpudata->build_func->SetArg(arg++, m_gpudata->nodes);
         m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_bounds);
         
-        // Calculate global size
-        globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-        
         // Launch hierarchy emission kernel
         m_device->Execute(m_gpudata->build_func, 0, globalsize, kWorkGroupSize, nullptr);
         
-        // Refit bounds
-        arg = 0;
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
-        m_gpudata->refit_func->SetArg(arg++, sizeof(size), &size);
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->nodes);
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->flags);
-        
-        globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-        
-        // Launch refit kernel
-        m_device->Execute(m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr);
+        RefitNodes(numbounds);
+
+        m_num_prims = numbounds;
+
+        // The caller owns bounds memory
+        upload_event->Wait();
+        m_device->DeleteEvent(upload_event);
     }
 }
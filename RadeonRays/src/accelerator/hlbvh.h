@@ -29,6 +29,7 @@ THE SOFTWARE.
 #include "../accelerator/bvh.h"
 
 #include <memory>
+#include <vector>
 
 namespace RadeonRays
 {
@@ -47,6 +48,9 @@ namespace RadeonRays
         
         // Build function
         void Build(bbox const* bounds, int numbounds);
+        // Update node bounds keeping the hierarchy of the last build,
+        // primitives have to be the same, only their bounds change
+        void Refit(bbox const* bounds, int numbounds);
         
         // This class has its own  GPU data,
         // and it provides it as an interface in GPU memory
@@ -64,6 +68,10 @@ namespace RadeonRays
     private:
         void InitGpuData();
         void AllocateBuffers(size_t numprims);
+        // Upload primitive bounds and calculate scene bound, the event tracks the upload
+        Calc::Event* UploadBounds(bbox const* bounds, int numbounds);
+        // Clear refit flags and propagate leaf bounds up to the root
+        void RefitNodes(int numbounds);
         
         Hlbvh(Hlbvh const&) = delete;
         Hlbvh& operator = (Hlbvh const&) = delete;
@@ -81,6 +89,12 @@ namespace RadeonRays
         
         // Primitive indices
         std::vector<int> m_prim_indices;
+
+        // Scene bound read back from the device on request
+        mutable bbox m_bound;
+        mutable bool m_bound_valid;
+        // Number of primitives in the last build
+        int m_num_prims;
     };
     
     // BVH node
@@ -98,61 +112,81 @@ namespace RadeonRays
         Calc::Device* device;
 
         // Parallel primitives
-        Calc::Primitives* pp;
+        Calc::Primitives* pp = nullptr;
 
         // GPU program
-        Calc::Executable* executable;
-        Calc::Function* morton_code_func;
-        Calc::Function* build_func;
-        Calc::Function* refit_func;
-        
-        // Parallel primitives instance
-        //CLWParallelPrimitives pp_;
-        
-        // Bbox centers
-        Calc::Buffer* positions;
-        
+        Calc::Executable* executable = nullptr;
+        Calc::Function* morton_code_func = nullptr;
+        Calc::Function* build_func = nullptr;
+        Calc::Function* refit_func = nullptr;
+        // Scene bound reduction, flags initialization and leaf update,
+        // nullptr if the platform has no kernels for them
+        Calc::Function* reduce_bounds_func = nullptr;
+        Calc::Function* clear_flags_func = nullptr;
+        Calc::Function* update_leaves_func = nullptr;
+
+        // Number of primitives buffers below have space for
+        std::size_t capacity = 0;
+
         // Morton codes of the primitive centroids
-        Calc::Buffer* morton_codes;
+        Calc::Buffer* morton_codes = nullptr;
         // Reorder indices
-        Calc::Buffer* prim_indices;
+        Calc::Buffer* prim_indices = nullptr;
         
-        Calc::Buffer* sorted_morton_codes;
-        Calc::Buffer* sorted_prim_indices;
+        Calc::Buffer* sorted_morton_codes = nullptr;
+        Calc::Buffer* sorted_prim_indices = nullptr;
         
         // Nodes: first N-1 - internal nodes, last N - leafs
-        Calc::Buffer* nodes;
+        Calc::Buffer* nodes = nullptr;
         
-        // Bounds
-        Calc::Buffer* bounds;
-        Calc::Buffer* sorted_bounds;
-        Calc::Buffer* scene_bound;
+        // Primitive bounds and node bounds
+        Calc::Buffer* bounds = nullptr;
+        Calc::Buffer* sorted_bounds = nullptr;
+        Calc::Buffer* scene_bound = nullptr;
+        // Bounds of the reduction work groups
+        Calc::Buffer* bound_partials = nullptr;
         
         // Atomic flags
-        Calc::Buffer*  flags;
+        Calc::Buffer*  flags = nullptr;
 
         GpuData(Calc::Device* dev)
             : device(dev)
         {
         }
 
+        // Delete buffers sized by the number of primitives
+        void ReleaseBuffers()
+        {
+            for (auto buffer : { &morton_codes, &prim_indices, &sorted_morton_codes, &sorted_prim_indices,
+                &nodes, &bounds, &sorted_bounds, &flags })
+            {
+                if (*buffer)
+                {
+                    device->DeleteBuffer(*buffer);
+                    *buffer = nullptr;
+                }
+            }
+
+            capacity = 0;
+        }
+
         ~GpuData()
         {
-            executable->DeleteFunction(morton_code_func);
-            executable->DeleteFunction(build_func);
-            executable->DeleteFunction(refit_func);
+            ReleaseBuffers();
+
+            for (auto func : { morton_code_func, build_func, refit_func,
+                reduce_bounds_func, clear_flags_func, update_leaves_func })
+            {
+                if (func)
+                {
+                    executable->DeleteFunction(func);
+                }
+            }
+
             device->DeleteExecutable(executable);
             device->DeletePrimitives(pp);
-            device->DeleteBuffer(positions);
-            device->DeleteBuffer(morton_codes);
-            device->DeleteBuffer(prim_indices);
-            device->DeleteBuffer(sorted_morton_codes);
-            device->DeleteBuffer(sorted_prim_indices);
-            device->DeleteBuffer(nodes);
-            device->DeleteBuffer(bounds);
-            device->DeleteBuffer(sorted_bounds);
             device->DeleteBuffer(scene_bound);
-            device->DeleteBuffer(flags);
+            device->DeleteBuffer(bound_partials);
         }
     };
 }
@@ -0,0 +1,377 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "morton_bvh.h"
+#include "../async/task_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace RadeonRays
+{
+    // Ranges smaller than this are processed on a single thread
+    static int constexpr kMinParallelPrimitives = 4096;
+    // Radix sort digit size
+    static int constexpr kRadixBits = 8;
+    static int constexpr kRadixSize = 1 << kRadixBits;
+
+    static int GetNumTasks(int count)
+    {
+        int num_tasks = task_scheduler::instance().num_threads();
+        return std::max(1, std::min(num_tasks, count / kMinParallelPrimitives));
+    }
+
+#ifdef __GNUC__
+    static inline int clz64(std::uint64_t x)
+    {
+        return __builtin_clzll(x);
+    }
+#else
+    static inline int clz64(std::uint64_t x)
+    {
+        int n = 0;
+        for (std::uint64_t mask = 1ull << 63; mask && !(x & mask); mask >>= 1)
+        {
+            ++n;
+        }
+        return n;
+    }
+#endif
+
+    // Insert two zero bits after each of the 10 low bits of x
+    static inline std::uint64_t ExpandBits10(std::uint64_t x)
+    {
+        x &= 0x3ff;
+        x = (x | x << 16) & 0x30000ff;
+        x = (x | x << 8) & 0x300f00f;
+        x = (x | x << 4) & 0x30c30c3;
+        x = (x | x << 2) & 0x9249249;
+        return x;
+    }
+
+    // Insert two zero bits after each of the 21 low bits of x
+    static inline std::uint64_t ExpandBits21(std::uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    // Length of the common prefix of the keys i and j,
+    // equal keys are distinguished by their indices
+    static inline int Delta(std::uint64_t const* codes, int n, int i, int j)
+    {
+        if (j < 0 || j >= n)
+        {
+            return -1;
+        }
+
+        auto diff = codes[i] ^ codes[j];
+        return diff ? clz64(diff) : 64 + clz64(static_cast<std::uint64_t>(i ^ j));
+    }
+
+    void MortonBvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        m_nodes.resize(2 * numbounds - 1);
+        m_indices.resize(numbounds);
+        m_height = 0;
+
+        std::vector<std::uint64_t> codes;
+        CalcMortonCodes(bounds, numbounds, codes);
+        SortMortonCodes(codes);
+
+        std::vector<int> parents;
+        EmitHierarchy(codes, parents);
+        CalcNodeBounds(bounds, parents);
+
+        m_packed_indices = m_indices;
+        m_nodecnt = 2 * numbounds - 1;
+        m_root = &m_nodes[0];
+    }
+
+    void MortonBvh::CalcMortonCodes(bbox const* bounds, int numbounds, std::vector<std::uint64_t>& codes)
+    {
+        int const num_tasks = GetNumTasks(numbounds);
+
+        // Codes are calculated relative to centroid bounds
+        std::vector<bbox> partial(num_tasks);
+        parallel_for(0, numbounds, num_tasks, [&partial, bounds](int task, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                partial[task].grow(bounds[i].center());
+            }
+        });
+
+        bbox centroid_bounds;
+        for (auto const& b : partial)
+        {
+            centroid_bounds.grow(b);
+        }
+
+        auto const extents = centroid_bounds.extents();
+        float3 const scale(extents.x > 0.f ? 1.f / extents.x : 0.f,
+                           extents.y > 0.f ? 1.f / extents.y : 0.f,
+                           extents.z > 0.f ? 1.f / extents.z : 0.f);
+
+        int const bits_per_axis = m_morton_bits / 3;
+        float const grid_size = static_cast<float>(1u << bits_per_axis);
+        float const max_cell = grid_size - 1.f;
+        bool const use_63bit = m_morton_bits == 63;
+
+        codes.resize(numbounds);
+        parallel_for(0, numbounds, num_tasks, [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                auto const p = (bounds[i].center() - centroid_bounds.pmin) * scale;
+
+                auto const x = static_cast<std::uint64_t>(std::min(std::max(p.x * grid_size, 0.f), max_cell));
+                auto const y = static_cast<std::uint64_t>(std::min(std::max(p.y * grid_size, 0.f), max_cell));
+                auto const z = static_cast<std::uint64_t>(std::min(std::max(p.z * grid_size, 0.f), max_cell));
+
+                codes[i] = use_63bit ?
+                    (ExpandBits21(x) << 2) | (ExpandBits21(y) << 1) | ExpandBits21(z) :
+                    (ExpandBits10(x) << 2) | (ExpandBits10(y) << 1) | ExpandBits10(z);
+
+                m_indices[i] = i;
+            }
+        });
+    }
+
+    void MortonBvh::SortMortonCodes(std::vector<std::uint64_t>& codes)
+    {
+        // LSD radix sort: each pass builds per-task digit histograms,
+        // then every task scatters its chunk to the offsets of its buckets.
+        // Chunks are scattered in order, so the sort is stable and deterministic.
+        int const n = static_cast<int>(codes.size());
+        int const num_tasks = GetNumTasks(n);
+        int const num_passes = (m_morton_bits + kRadixBits - 1) / kRadixBits;
+
+        std::vector<std::uint64_t> temp_codes(n);
+        std::vector<int> temp_indices(n);
+        std::vector<int> histograms(num_tasks * kRadixSize);
+
+        for (int pass = 0; pass < num_passes; ++pass)
+        {
+            int const shift = pass * kRadixBits;
+
+            std::fill(histograms.begin(), histograms.end(), 0);
+            parallel_for(0, n, num_tasks, [&](int task, int first, int last)
+            {
+                auto hist = &histograms[task * kRadixSize];
+                for (int i = first; i < last; ++i)
+                {
+                    ++hist[(codes[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // Convert counts to offsets, bucket-major
+            int offset = 0;
+            bool sorted = false;
+            for (int digit = 0; digit < kRadixSize; ++digit)
+            {
+                int count = 0;
+                for (int task = 0; task < num_tasks; ++task)
+                {
+                    auto& h = histograms[task * kRadixSize + digit];
+                    int const c = h;
+                    h = offset;
+                    offset += c;
+                    count += c;
+                }
+                // All keys share the digit: pass would not change the order
+                sorted = sorted || count == n;
+            }
+
+            if (sorted)
+            {
+                continue;
+            }
+
+            parallel_for(0, n, num_tasks, [&](int task, int first, int last)
+            {
+                auto hist = &histograms[task * kRadixSize];
+                for (int i = first; i < last; ++i)
+                {
+                    auto const idx = hist[(codes[i] >> shift) & (kRadixSize - 1)]++;
+                    temp_codes[idx] = codes[i];
+                    temp_indices[idx] = m_indices[i];
+                }
+            });
+
+            codes.swap(temp_codes);
+            m_indices.swap(temp_indices);
+        }
+    }
+
+    void MortonBvh::EmitHierarchy(std::vector<std::uint64_t> const& codes, std::vector<int>& parents)
+    {
+        // Internal nodes occupy [0, n - 1) slots, leaves follow them
+        int const n = static_cast<int>(codes.size());
+        int const num_internal = n - 1;
+        auto const keys = codes.data();
+
+        parents.resize(2 * n - 1);
+        parents[0] = -1;
+
+        parallel_for(0, n, GetNumTasks(n), [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                auto& leaf = m_nodes[num_internal + i];
+                leaf.type = kLeaf;
+                leaf.startidx = i;
+                leaf.numprims = 1;
+            }
+        });
+
+        // Each internal node finds its key range and split position
+        // independently of the others (Karras 2012)
+        parallel_for(0, num_internal, GetNumTasks(num_internal), [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                // Direction of the range
+                int const d = Delta(keys, n, i, i + 1) > Delta(keys, n, i, i - 1) ? 1 : -1;
+                int const delta_min = Delta(keys, n, i, i - d);
+
+                // Upper bound for the range length
+                int lmax = 2;
+                while (Delta(keys, n, i, i + lmax * d) > delta_min)
+                {
+                    lmax <<= 1;
+                }
+
+                // Exact range end using binary search
+                int l = 0;
+                for (int t = lmax >> 1; t >= 1; t >>= 1)
+                {
+                    if (Delta(keys, n, i, i + (l + t) * d) > delta_min)
+                    {
+                        l += t;
+                    }
+                }
+
+                int const j = i + l * d;
+                int const delta_node = Delta(keys, n, i, j);
+
+                // Split position using binary search
+                int s = 0;
+                for (int div = 2; ; div <<= 1)
+                {
+                    int const t = (l + div - 1) / div;
+
+                    if (Delta(keys, n, i, i + (s + t) * d) > delta_node)
+                    {
+                        s += t;
+                    }
+
+                    if (t == 1) break;
+                }
+
+                int const split = i + s * d + std::min(d, 0);
+                int const lc = std::min(i, j) == split ? num_internal + split : split;
+                int const rc = std::max(i, j) == split + 1 ? num_internal + split + 1 : split + 1;
+
+                auto& node = m_nodes[i];
+                node.type = kInternal;
+                node.lc = &m_nodes[lc];
+                node.rc = &m_nodes[rc];
+
+                parents[lc] = i;
+                parents[rc] = i;
+            }
+        });
+
+        // Complete tree indices depend on the path from the root,
+        // so they are assigned top-down once all the nodes are linked
+        m_nodes[0].index = 1;
+
+        std::vector<Node*> stack;
+        stack.push_back(&m_nodes[0]);
+
+        while (!stack.empty())
+        {
+            auto node = stack.back();
+            stack.pop_back();
+
+            if (node->type == kInternal)
+            {
+                node->lc->index = node->index << 1;
+                node->rc->index = (node->index << 1) + 1;
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+        }
+    }
+
+    void MortonBvh::CalcNodeBounds(bbox const* bounds, std::vector<int> const& parents)
+    {
+        // Each leaf walks up the tree, the second thread arriving
+        // at a node calculates its bounds, so all children are ready.
+        int const n = static_cast<int>(m_indices.size());
+        int const num_internal = n - 1;
+
+        std::vector<int> heights(2 * n - 1, 0);
+        std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[std::max(num_internal, 1)]);
+        for (int i = 0; i < num_internal; ++i)
+        {
+            visits[i] = 0;
+        }
+
+        parallel_for(0, n, GetNumTasks(n), [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                m_nodes[num_internal + i].bounds = bounds[m_indices[i]];
+
+                int idx = parents[num_internal + i];
+                while (idx >= 0 && visits[idx].fetch_add(1, std::memory_order_acq_rel) == 1)
+                {
+                    auto& node = m_nodes[idx];
+                    auto const lc = static_cast<int>(node.lc - &m_nodes[0]);
+                    auto const rc = static_cast<int>(node.rc - &m_nodes[0]);
+
+                    node.bounds = bboxunion(node.lc->bounds, node.rc->bounds);
+                    heights[idx] = 1 + std::max(heights[lc], heights[rc]);
+
+                    idx = parents[idx];
+                }
+            }
+        });
+
+        m_height = heights[0];
+    }
+
+    void MortonBvh::PrintStatistics(std::ostream& os) const
+    {
+        os << "Class name: " << "MortonBvh\n";
+        os << "Morton code bits: " << m_morton_bits << "\n";
+        os << "Number of triangles: " << m_indices.size() << "\n";
+        os << "Number of nodes: " << m_nodecnt << "\n";
+        os << "Tree height: " << GetHeight() << "\n";
+    }
+}
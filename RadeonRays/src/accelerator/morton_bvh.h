@@ -0,0 +1,75 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "bvh.h"
+
+#include <cstdint>
+
+namespace RadeonRays
+{
+    ///< Linear BVH builder (LBVH).
+    ///< Primitives are sorted along a Morton curve using parallel
+    ///< radix sort, then the hierarchy is emitted for all internal
+    ///< nodes independently (Karras 2012) and refitted bottom-up.
+    ///< Build is much faster than binned SAH while tree quality is lower,
+    ///< so it is a good fit for dynamic geometry.
+    ///<
+    class MortonBvh : public Bvh
+    {
+    public:
+        // morton_bits is either 30 (10 bits per axis) or 63 (21 bits per axis)
+        MortonBvh(float traversal_cost, int morton_bits = 63)
+            : Bvh(traversal_cost, 0, false)
+            , m_morton_bits(morton_bits == 30 ? 30 : 63)
+        {
+        }
+
+        ~MortonBvh() = default;
+
+        // Print BVH statistics
+        void PrintStatistics(std::ostream& os) const override;
+
+    protected:
+        // Build function
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+        // Calculate Morton codes of primitive centroids and reset m_indices
+        void CalcMortonCodes(bbox const* bounds, int numbounds, std::vector<std::uint64_t>& codes);
+        // Sort codes along with m_indices
+        void SortMortonCodes(std::vector<std::uint64_t>& codes);
+        // Emit internal nodes, returns parent index for each node
+        void EmitHierarchy(std::vector<std::uint64_t> const& codes, std::vector<int>& parents);
+        // Calculate bounds of internal nodes and tree height
+        void CalcNodeBounds(bbox const* bounds, std::vector<int> const& parents);
+
+    private:
+        // Number of bits in Morton code
+        int m_morton_bits;
+
+        MortonBvh(MortonBvh const&) = delete;
+        MortonBvh& operator = (MortonBvh const&) = delete;
+
+        friend class PlainBvhTranslator;
+        friend class FatNodeBvhTranslator;
+    };
+}
@@ -46,8 +46,21 @@ namespace RadeonRays
         Node* node = AllocateNode();
         node->bounds = req.bounds;
 
+        SahSplit os;
+        bool make_leaf = req.numprims < 2;
+
+        // Leaf cost is the number of primitives to intersect, split cost
+        // includes traversal. Nodes above the leaf size limit are split even
+        // without a SAH split, at the centroid bounds center or in half.
+        if (!make_leaf)
+        {
+            os = FindObjectSahSplit(req, primrefs);
+            make_leaf = req.numprims <= m_max_leaf_size &&
+                (is_nan(os.split) || req.numprims < os.sah);
+        }
+
         // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        if (make_leaf)
         {
             node->type = kLeaf;
             node->startidx = (int)m_packed_indices.size();
@@ -66,7 +79,6 @@ namespace RadeonRays
             int axis = req.centroid_bounds.maxdim();
             float border = req.centroid_bounds.center()[axis];
 
-            SahSplit os = FindObjectSahSplit(req, primrefs);
             SahSplit ss;
             auto split_type = SplitType::kObject;
 
@@ -33,8 +33,9 @@ namespace RadeonRays
                  int num_bins,
                  int max_split_depth, 
                  float min_overlap,
-                 float extra_refs_budget)
-        : Bvh(traversal_cost, num_bins, true)
+                 float extra_refs_budget,
+                 int max_leaf_size = 1)
+        : Bvh(traversal_cost, num_bins, true, max_leaf_size)
         , m_max_split_depth(max_split_depth)
         , m_min_overlap(min_overlap)
         , m_extra_refs_budget(extra_refs_budget)
@@ -26,7 +26,11 @@ THE SOFTWARE.
 #include "device.h"
 
 #include "../device/calc_intersection_device.h"
+#include "../device/cpu_intersection_device.h"
+#include "../device/multi_intersection_device.h"
+#include "../except/except.h"
 #include <cassert>
+#include <vector>
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -185,7 +189,7 @@ namespace RadeonRays
         {
             result += GetCalc()->GetDeviceCount();
         }
-        // embree is always the last device
+        // embree goes after calc devices
 #ifdef USE_EMBREE
         if (s_calc_platform & DeviceInfo::Platform::kEmbree)
         {
@@ -193,25 +197,45 @@ namespace RadeonRays
         }
 #endif //USE_EMBREE
 
+        // native cpu device is always the last device
+        if (s_calc_platform & DeviceInfo::Platform::kNative)
+        {
+            ++result;
+        }
+
         return result;
     }
-    static bool IsDeviceIndexEmbree(uint32_t devidx)
+
+    static std::uint32_t GetCalcDeviceCount()
     {
+        auto* calc = GetCalc();
+        return calc != nullptr ? calc->GetDeviceCount() : 0;
+    }
 
+    static bool IsDeviceIndexEmbree(uint32_t devidx)
+    {
 #ifdef USE_EMBREE
-        auto* calc = GetCalc();
-        if (calc != nullptr)
+        if (s_calc_platform & DeviceInfo::Platform::kEmbree)
         {
-            if (devidx == GetCalc()->GetDeviceCount())
-            {
-                return true;
-            }
+            return devidx == GetCalcDeviceCount();
         }
-        else if(devidx == 0)
+#endif //USE_EMBREE
+        return false;
+    }
+
+    static bool IsDeviceIndexNative(uint32_t devidx)
+    {
+        if (s_calc_platform & DeviceInfo::Platform::kNative)
         {
-            return true;
-        }
+            auto native_idx = GetCalcDeviceCount();
+#ifdef USE_EMBREE
+            if (s_calc_platform & DeviceInfo::Platform::kEmbree)
+            {
+                ++native_idx;
+            }
 #endif //USE_EMBREE
+            return devidx == native_idx;
+        }
         return false;
     }
 
@@ -232,6 +256,15 @@ namespace RadeonRays
 #endif //USE_EMBREE
             return;
         }
+
+        if (IsDeviceIndexNative(devidx))
+        {
+            devinfo.name = "native cpu";
+            devinfo.vendor = "amd";
+            devinfo.type = DeviceInfo::kCpu;
+            devinfo.platform = DeviceInfo::kNative;
+            return;
+        }
         assert(calc);
 
         Calc::DeviceSpec spec;
@@ -243,32 +276,74 @@ namespace RadeonRays
         devinfo.type = spec.type == Calc::DeviceType::kGpu ? DeviceInfo::kGpu : DeviceInfo::kCpu;
     }
 
-    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    static IntersectionDevice* CreateDevice(std::uint32_t devidx)
     {
         if (IsDeviceIndexEmbree(devidx))
         {
 #ifdef USE_EMBREE
-            return new IntersectionApiImpl(new EmbreeIntersectionDevice());
+            return new EmbreeIntersectionDevice();
 #endif //USE_EMBREE
         }
+        else if (IsDeviceIndexNative(devidx))
+        {
+            return new CpuIntersectionDevice();
+        }
         else
         {
             auto* calc = GetCalc();
             if (calc != nullptr)
             {
-                return new IntersectionApiImpl(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx)));
+                return new CalcIntersectionDevice(calc, calc->CreateDevice(devidx));
             }
         }
 
         return nullptr;
     }
 
+    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    {
+        auto device = CreateDevice(devidx);
+        return device ? new IntersectionApiImpl(device) : nullptr;
+    }
+
+    IntersectionApi* IntersectionApi::Create(std::uint32_t const* devidx, std::uint32_t numdevices)
+    {
+        if (numdevices == 1)
+        {
+            return Create(devidx[0]);
+        }
+
+        std::vector<IntersectionDevice*> devices;
+        for (auto i = 0U; i < numdevices; ++i)
+        {
+            auto device = CreateDevice(devidx[i]);
+
+            if (!device)
+            {
+                for (auto d : devices)
+                {
+                    delete d;
+                }
+                return nullptr;
+            }
+
+            devices.push_back(device);
+        }
+
+        return devices.empty() ? nullptr : new IntersectionApiImpl(new MultiIntersectionDevice(devices));
+    }
+
     // Deallocation (to simplify DLL scenario)
     void IntersectionApi::Delete(IntersectionApi* api)
     {
         delete api;
     }
 
+    void Shape::UpdateVertices(float const*, int, int)
+    {
+        Throw("The shape does not support vertex updates");
+    }
+
 #ifdef USE_VULKAN
     RRAPI IntersectionApi* CreateFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool)
     {
@@ -75,6 +75,21 @@ namespace RadeonRays
         return mesh;
     }
 
+    Shape* IntersectionApiImpl::CreateMeshShared(
+        // Position data
+        float const * vertices, int vnum, int vstride,
+        // Index data for vertices
+        int const * indices, int istride,
+        // Number of faces
+        int  numface
+        ) const
+    {
+        Mesh* mesh = new Mesh(vertices, vnum, vstride, indices, istride, numface);
+
+        mesh->SetId(nextid_++);
+
+        return mesh;
+    }
 
     Shape* IntersectionApiImpl::CreateInstance(Shape const* shape) const
     {
@@ -89,6 +104,8 @@ namespace RadeonRays
 
     void IntersectionApiImpl::DeleteShape(Shape const* shape)
     {
+        // Make sure the world does not keep dangling pointers
+        world_.DetachShape(shape);
         delete shape;
     }
 
@@ -110,7 +127,7 @@ namespace RadeonRays
 
     void IntersectionApiImpl::Commit()
     {
-        ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+        ThrowIf(world_.GetShapes().empty(), "Scene is empty.");
         m_device->Preprocess(world_);
 
         world_.OnCommit();
@@ -123,22 +140,51 @@ namespace RadeonRays
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
-        m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event);
+        m_device->QueryIntersection(0, rays, numrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
-        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
+        m_device->QueryOcclusion(0, rays, numrays, hitresults, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
-        m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event);
+        m_device->QueryIntersection(0, rays, numrays, maxrays, hitinfos, waitevent, event);
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
-        m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
+        m_device->QueryOcclusion(0, rays, numrays, maxrays, hitresults, waitevent, event);
+    }
+
+    std::uint32_t IntersectionApiImpl::GetQueueCount() const
+    {
+        return m_device->GetQueueCount();
+    }
+
+    void IntersectionApiImpl::QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(queue >= m_device->GetQueueCount(), "Invalid queue index");
+        m_device->QueryIntersection(queue, rays, numrays, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(queue >= m_device->GetQueueCount(), "Invalid queue index");
+        m_device->QueryOcclusion(queue, rays, numrays, hitresults, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(queue >= m_device->GetQueueCount(), "Invalid queue index");
+        m_device->QueryIntersection(queue, rays, numrays, maxrays, hitinfos, waitevent, event);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        ThrowIf(queue >= m_device->GetQueueCount(), "Invalid queue index");
+        m_device->QueryOcclusion(queue, rays, numrays, maxrays, hitresults, waitevent, event);
     }
 
     void IntersectionApiImpl::DeleteEvent(Event* event) const
@@ -168,7 +214,7 @@ namespace RadeonRays
 
     bool IntersectionApiImpl::IsWorldEmpty()
     {
-        return world_.shapes_.empty();
+        return world_.GetShapes().empty();
     }
 
 #ifdef USE_OPENCL
@@ -62,6 +62,17 @@ namespace RadeonRays
             int  numfaces
             ) const override;
 
+        // Create a triangle mesh referencing application owned data,
+        // it has to stay valid until the shape is deleted.
+        Shape* CreateMeshShared(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const override;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         Shape* CreateInstance(Shape const* shape) const override;
@@ -121,6 +132,13 @@ namespace RadeonRays
         // The call is asynchronous. Event pointer mights be nullptrs.
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        // Queue selection
+        std::uint32_t GetQueueCount() const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
         /******************************************
         Utility
         ******************************************/
@@ -0,0 +1,412 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Group of tasks which can be waited on as a whole.
+    ///< Keeps track of pending tasks and collects per-thread
+    ///< busy time to estimate how well the work has been distributed.
+    ///<
+    class task_group
+    {
+    public:
+        struct statistics
+        {
+            // Number of tasks executed
+            std::size_t num_tasks;
+            // Number of threads which executed at least one task
+            int num_threads;
+            // Time between group creation and the end of wait
+            double wall_time_ms;
+            // Sum of task execution times across all threads
+            double busy_time_ms;
+
+            // Average fraction of the wall time threads were busy
+            float utilization() const
+            {
+                return (num_threads > 0 && wall_time_ms > 0.0) ?
+                    static_cast<float>(busy_time_ms / (wall_time_ms * num_threads)) : 0.f;
+            }
+        };
+
+        task_group();
+        // Waits for pending tasks if the owner leaves its frame
+        // with an exception before task_scheduler::wait
+        ~task_group();
+
+        task_group(task_group const&) = delete;
+        task_group& operator = (task_group const&) = delete;
+
+        // Statistics are only valid after task_scheduler::wait
+        statistics const& get_statistics() const { return stats_; }
+
+    private:
+        friend class task_scheduler;
+
+        using clock = std::chrono::high_resolution_clock;
+
+        // Number of tasks submitted but not yet finished
+        std::atomic<int> pending_;
+        // Number of tasks executed
+        std::atomic<std::size_t> num_tasks_;
+        // Busy time per scheduler slot in nanoseconds
+        std::unique_ptr<std::atomic<long long>[]> busy_ns_;
+        // First exception thrown by a task
+        std::exception_ptr exception_;
+        std::mutex exception_mutex_;
+        clock::time_point start_;
+        statistics stats_;
+    };
+
+    ///< Persistent work-stealing task scheduler.
+    ///< Each worker owns a deque: it pushes and pops its own tasks
+    ///< from the back while idle workers steal from the front of
+    ///< other deques. Threads waiting for a group help executing
+    ///< tasks, so tasks are allowed to spawn and wait for subtasks.
+    ///< Idle threads sleep on a condition variable, there is no polling.
+    ///<
+    class task_scheduler
+    {
+    public:
+        // Scheduler shared by all the builders
+        static task_scheduler& instance()
+        {
+            static task_scheduler scheduler;
+            return scheduler;
+        }
+
+        // Total number of threads which can execute tasks:
+        // workers plus the thread waiting for a group,
+        // capped by set_max_threads
+        int num_threads() const
+        {
+            int const num_threads = static_cast<int>(workers_.size()) + 1;
+            int const max_threads = max_threads_;
+            return max_threads > 0 ? std::min(num_threads, max_threads) : num_threads;
+        }
+
+        // Limit the number of threads users split their work for,
+        // 0 removes the limit. 1 makes builders run serially
+        void set_max_threads(int max_threads)
+        {
+            max_threads_ = max_threads;
+        }
+
+        // Submit a task into the group
+        void run(task_group& group, std::function<void()>&& f)
+        {
+            ++group.pending_;
+
+            auto& queue = queues_[current_slot()];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.push_back(task{ std::move(f), &group });
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++num_queued_;
+            }
+            cv_.notify_one();
+        }
+
+        // Wait until all the tasks of the group are finished,
+        // calling thread executes tasks in the meantime
+        void wait(task_group& group)
+        {
+            auto const slot = current_slot();
+
+            while (group.pending_ > 0)
+            {
+                task t;
+                if (try_get(slot, t))
+                {
+                    execute(slot, t);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this, &group]() { return group.pending_ == 0 || num_queued_ > 0; });
+            }
+
+            // Gather statistics
+            auto& stats = group.stats_;
+            stats.num_tasks = group.num_tasks_;
+            stats.num_threads = 0;
+            stats.busy_time_ms = 0.0;
+            stats.wall_time_ms = std::chrono::duration<double, std::milli>(task_group::clock::now() - group.start_).count();
+
+            for (auto i = 0u; i < queues_.size(); ++i)
+            {
+                auto busy = group.busy_ns_[i].load();
+                if (busy > 0)
+                {
+                    stats.busy_time_ms += busy * 1e-6;
+                    ++stats.num_threads;
+                }
+            }
+
+            if (group.exception_)
+            {
+                auto e = group.exception_;
+                group.exception_ = nullptr;
+                std::rethrow_exception(e);
+            }
+        }
+
+        // Number of deques: one per worker plus one shared by external threads
+        std::size_t num_slots() const
+        {
+            return queues_.size();
+        }
+
+    private:
+        struct task
+        {
+            std::function<void()> f;
+            task_group* group;
+        };
+
+        struct work_queue
+        {
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        task_scheduler()
+            : done_(false)
+            , num_queued_(0)
+            , max_threads_(0)
+        {
+            int num_workers = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+            num_workers = num_workers < 1 ? 1 : num_workers;
+
+            queues_ = std::vector<work_queue>(num_workers + 1);
+
+            for (int i = 0; i < num_workers; ++i)
+            {
+                workers_.push_back(std::thread(&task_scheduler::run_loop, this, i));
+            }
+        }
+
+        ~task_scheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_ = true;
+            }
+            cv_.notify_all();
+
+            for (auto& w : workers_)
+            {
+                w.join();
+            }
+        }
+
+        task_scheduler(task_scheduler const&) = delete;
+        task_scheduler& operator = (task_scheduler const&) = delete;
+
+        // Slot of the calling thread, external threads share the last one
+        std::size_t current_slot() const
+        {
+            auto slot = worker_slot();
+            return slot < 0 ? queues_.size() - 1 : static_cast<std::size_t>(slot);
+        }
+
+        static int& worker_slot()
+        {
+            static thread_local int slot = -1;
+            return slot;
+        }
+
+        // Pop own task or steal one from other queues
+        bool try_get(std::size_t slot, task& t)
+        {
+            {
+                auto& queue = queues_[slot];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty())
+                {
+                    t = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                    --num_queued_;
+                    return true;
+                }
+            }
+
+            for (auto i = 1u; i < queues_.size(); ++i)
+            {
+                auto& queue = queues_[(slot + i) % queues_.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty())
+                {
+                    t = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                    --num_queued_;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void execute(std::size_t slot, task& t)
+        {
+            auto group = t.group;
+            auto start = task_group::clock::now();
+
+            try
+            {
+                t.f();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(group->exception_mutex_);
+                if (!group->exception_)
+                {
+                    group->exception_ = std::current_exception();
+                }
+            }
+
+            // Release captured state before signaling completion
+            t.f = nullptr;
+
+            group->busy_ns_[slot] += std::chrono::duration_cast<std::chrono::nanoseconds>(task_group::clock::now() - start).count();
+            ++group->num_tasks_;
+
+            if (--group->pending_ == 0)
+            {
+                // Wake up threads waiting for the group
+                std::lock_guard<std::mutex> lock(mutex_);
+                cv_.notify_all();
+            }
+        }
+
+        void run_loop(int slot)
+        {
+            worker_slot() = slot;
+
+            for (;;)
+            {
+                task t;
+                if (try_get(slot, t))
+                {
+                    execute(slot, t);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return done_ || num_queued_ > 0; });
+
+                if (done_) return;
+            }
+        }
+
+        std::vector<work_queue> queues_;
+        std::vector<std::thread> workers_;
+        // Guards sleeping
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool done_;
+        // Number of tasks sitting in queues
+        std::atomic<int> num_queued_;
+        // Limit reported by num_threads, 0 for none
+        std::atomic<int> max_threads_;
+    };
+
+    ///< Split [begin, end) range into num_tasks chunks and call
+    ///< func(task, chunk_begin, chunk_end) for each of them in parallel.
+    ///< First chunk is processed on the calling thread. All the chunks
+    ///< are finished on return, the first exception thrown is rethrown.
+    ///<
+    template <typename Func>
+    void parallel_for(int begin, int end, int num_tasks, Func const& func)
+    {
+        int const chunk = (end - begin + num_tasks - 1) / num_tasks;
+
+        if (num_tasks <= 1 || chunk <= 0)
+        {
+            func(0, begin, end);
+            return;
+        }
+
+        auto& scheduler = task_scheduler::instance();
+        task_group group;
+
+        for (int task = 1; task < num_tasks; ++task)
+        {
+            int const first = std::min(end, begin + task * chunk);
+            int const last = std::min(end, first + chunk);
+            scheduler.run(group, [&func, task, first, last]() { func(task, first, last); });
+        }
+
+        // If this throws, the group destructor still waits for the
+        // queued tasks before func goes out of scope
+        func(0, begin, std::min(end, begin + chunk));
+
+        scheduler.wait(group);
+    }
+
+    inline task_group::task_group()
+        : pending_(0)
+        , num_tasks_(0)
+        , busy_ns_(new std::atomic<long long>[task_scheduler::instance().num_slots()])
+        , start_(clock::now())
+    {
+        for (auto i = 0u; i < task_scheduler::instance().num_slots(); ++i)
+        {
+            busy_ns_[i] = 0;
+        }
+    }
+
+    inline task_group::~task_group()
+    {
+        if (pending_ > 0)
+        {
+            // Tasks reference the frame of the owner, the exception
+            // being propagated wins over the ones thrown by tasks
+            try
+            {
+                task_scheduler::instance().wait(*this);
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+}
+
+#endif // TASK_SCHEDULER_H
@@ -62,13 +62,26 @@ namespace RadeonRays
             cv_.notify_one();
         }
 
-        // Wait until there are element to process.
-        void wait_and_pop(T& t)
+        // Wait until there are element to process. Returns false
+        // if the queue has been closed and there is nothing left
+        bool wait_and_pop(T& t)
         {
             std::unique_lock<std::mutex> lock(mutex_);
-            cv_.wait(lock, [this](){return !queue_.empty();});
+            cv_.wait(lock, [this](){return !queue_.empty() || closed_;});
+            if (queue_.empty())
+                return false;
             t = std::move(queue_.front());
             queue_.pop();
+            return true;
+        }
+
+        // Wake up all the waiting threads, elements pushed
+        // before are still handed out
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            cv_.notify_all();
         }
 
         // Try to pop element. Returns true if element has been popped, 
@@ -93,6 +106,7 @@ namespace RadeonRays
         mutable std::mutex mutex_;
         std::condition_variable cv_;
         std::queue<T> queue_;
+        bool closed_ = false;
     };
 
 
@@ -102,10 +116,8 @@ namespace RadeonRays
     template <typename RetType> class thread_pool
     {
     public:
-        explicit thread_pool(int sleep_time = 50)
-            : sleep_time_(sleep_time)
+        thread_pool()
         {
-            done_ = false;
             int num_threads = std::thread::hardware_concurrency();
             num_threads = num_threads == 0 ? 2 : num_threads;
 
@@ -121,8 +133,8 @@ namespace RadeonRays
 
         ~thread_pool()
         {
-            done_ = true;
-            std::for_each(threads_.begin(), threads_.end(), std::mem_fun_ref(&std::thread::join));
+            work_queue_.close();
+            std::for_each(threads_.begin(), threads_.end(), [](std::thread& t) { t.join(); });
         }
 
         // Submit a new task into the pool. Future is returned in
@@ -140,33 +152,20 @@ namespace RadeonRays
             return work_queue_.size();
         }
 
-        void setSleepTime(int sleep_time)
-        {
-            sleep_time_ = sleep_time;
-        }
-
     private:
         void run_loop()
         {
+            // Workers sleep on the queue until a task arrives or the pool is destroyed
             std::packaged_task<RetType()> f;
-            while(!done_)
+            while (work_queue_.wait_and_pop(f))
             {
-                if (work_queue_.try_pop(f))
-                {
-                    f();
-                }
-                else
-                {
-                    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_time_));
-                }
+                f();
             }
         }
 
 
         thread_safe_queue<std::packaged_task<RetType()> > work_queue_;
-        std::atomic_bool done_;
         std::vector<std::thread> threads_;
-        int sleep_time_;
     };
 }
 
@@ -37,6 +37,8 @@ THE SOFTWARE.
 #include "../intersector/intersector_hlbvh.h"
 #include "../intersector/intersector_bittrail.h"
 #include "../world/world.h"
+#include "../except/except.h"
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
@@ -45,9 +47,12 @@ namespace RadeonRays
     // TODO: handle different BVH strategies, for now hardcoded
     CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device)
         : m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
-        , m_intersector(new IntersectorSkipLinks(device))
-        , m_intersector_string("bvh")
+        , m_num_queues(1)
     {
+        Calc::DeviceSpec spec;
+        device->GetSpec(spec);
+        m_num_queues = std::max(1u, spec.max_num_queues);
+
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
@@ -67,6 +72,21 @@ namespace RadeonRays
 
     void CalcIntersectionDevice::Preprocess(World const& world)
     {
+        // Intersectors are created below on first use, so their programs
+        // are compiled or loaded with the cache path already set
+        auto cache_path = world.options_.GetOption("kernel.cache.path");
+        if (cache_path)
+        {
+            m_device->SetExecutableCachePath(cache_path->AsString().c_str());
+        }
+
+        // Buffers released by the previous commit are reused for the new structures
+        auto pool_limit = world.options_.GetOption("device.buffer_pool.max_retained");
+        if (pool_limit)
+        {
+            m_device->SetBufferPoolLimit(static_cast<std::size_t>(pool_limit->AsFloat() * 1024 * 1024));
+        }
+
         bool use2level = false;
 
         // First check if 2 level BVH has been forced
@@ -86,7 +106,7 @@ namespace RadeonRays
             else
             {
                 // Otherwise check if there are instances in the world
-                for (auto shape : world.shapes_)
+                for (auto shape : world.GetShapes())
                 {
                     // Get implementation
                     auto shapeimpl = static_cast<ShapeImpl const*>(shape);
@@ -150,6 +170,13 @@ namespace RadeonRays
             }
         }
 
+        // Unknown acceleration types fall back to the default one
+        if (!m_intersector)
+        {
+            m_intersector.reset(new IntersectorSkipLinks(m_device.get()));
+            m_intersector_string = "bvh";
+        }
+
         try
         {
             // Let intersector to do its preprocessing job
@@ -239,7 +266,12 @@ namespace RadeonRays
     }
 
 
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    std::uint32_t CalcIntersectionDevice::GetQueueCount() const
+    {
+        return m_num_queues;
+    }
+
+    void CalcIntersectionDevice::QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
@@ -247,11 +279,13 @@ namespace RadeonRays
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
+        ThrowIf(!m_intersector, "Commit() should be called before queries.");
+
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
 
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -259,11 +293,11 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
@@ -271,11 +305,13 @@ namespace RadeonRays
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
+        ThrowIf(!m_intersector, "Commit() should be called before queries.");
+
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
 
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -283,11 +319,11 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
@@ -296,11 +332,13 @@ namespace RadeonRays
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
+        ThrowIf(!m_intersector, "Commit() should be called before queries.");
+
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
 
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -308,11 +346,11 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
@@ -321,11 +359,13 @@ namespace RadeonRays
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
+        ThrowIf(!m_intersector, "Commit() should be called before queries.");
+
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
 
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -333,7 +373,7 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
         }
 
     }
@@ -58,13 +58,15 @@ namespace RadeonRays
 
         void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
 
-        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        std::uint32_t GetQueueCount() const override;
 
-        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
 
-        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
-        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
         Calc::Platform GetPlatform() const { return m_device->GetPlatform(); }
     protected:
@@ -74,6 +76,8 @@ namespace RadeonRays
         std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
         std::unique_ptr<Intersector> m_intersector;
         std::string m_intersector_string;
+        // Number of device queues
+        std::uint32_t m_num_queues;
 
         // Initial number of events in the pool
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
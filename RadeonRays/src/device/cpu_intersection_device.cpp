@@ -0,0 +1,1134 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "cpu_intersection_device.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <numeric>
+#include <vector>
+
+#include "../async/task_scheduler.h"
+#include "../accelerator/bvh2.h"
+#include "../accelerator/bvh_optimizer.h"
+#include "../translator/wide_bvh_translator.h"
+#include "../world/world.h"
+#include "../except/except.h"
+
+#include <xmmintrin.h>
+#include <smmintrin.h>
+
+// Count of rays for one thread pool task
+#define TASK_SIZE 256
+// Smaller batches are traversed as submitted, reordering them doesn't pay off
+#define REORDER_MIN_RAYS 4096
+// Digit size of the ray key radix sort
+#define SORT_RADIX_BITS 8
+
+namespace RadeonRays
+{
+    // Host memory RadeonRays::Buffer implementation
+    class CpuBuffer : public Buffer
+    {
+    public:
+        CpuBuffer(size_t size, void* init)
+            : m_data(new char[size])
+        {
+            if (init)
+                memcpy(m_data, init, size);
+        }
+
+        virtual ~CpuBuffer()
+        {
+            delete[] m_data;
+        }
+
+        void* GetData()
+        {
+            return m_data;
+        }
+
+        const void* GetData() const
+        {
+            return m_data;
+        }
+
+    private:
+        char* m_data;
+    };
+
+    // RadeonRays::Event implementation tracking a set of pool tasks
+    class CpuEvent : public Event
+    {
+    public:
+        using Jobs = std::vector<std::shared_future<void> >;
+
+        CpuEvent() = default;
+
+        explicit CpuEvent(Jobs&& jobs)
+            : m_jobs(std::move(jobs))
+        {
+        }
+
+        virtual ~CpuEvent()
+        {
+            Wait();
+        }
+
+        virtual bool Complete() const
+        {
+            return std::all_of(m_jobs.cbegin(), m_jobs.cend(), [](std::shared_future<void> const& j)
+            {
+                return j.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+        }
+
+        virtual void Wait()
+        {
+            for (auto& j : m_jobs)
+                j.wait();
+        }
+
+        // Shared state of the jobs, stays valid after the event is deleted
+        Jobs const& GetJobs() const { return m_jobs; }
+
+    private:
+        Jobs m_jobs;
+    };
+
+    namespace
+    {
+        // Horizontal min/max of 4 lanes
+        inline float HorizontalMin(__m128 v)
+        {
+            v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+            v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+            return _mm_cvtss_f32(v);
+        }
+
+        inline float HorizontalMax(__m128 v)
+        {
+            v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+            v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+            return _mm_cvtss_f32(v);
+        }
+
+        // Per-ray data used by slab test, w components are zeroed
+        struct RayData
+        {
+            __m128 invdir;
+            __m128 oxinvdir;
+            __m128 zero;
+        };
+
+        inline RayData PrepareRay(ray const& r)
+        {
+            float const ooeps = 1e-8f;
+            auto safe = [ooeps](float d) { return 1.f / (std::fabs(d) > ooeps ? d : std::copysign(ooeps, d)); };
+
+            RayData data;
+            data.invdir = _mm_set_ps(0.f, safe(r.d.z), safe(r.d.y), safe(r.d.x));
+            data.oxinvdir = _mm_mul_ps(_mm_set_ps(0.f, -r.o.z, -r.o.y, -r.o.x), data.invdir);
+            data.zero = _mm_setzero_ps();
+            return data;
+        }
+
+        // Intersect the ray with bbox, returns span in t0/t1,
+        // intersection criteria is t0 <= t1. W lanes hold node
+        // addresses, so they are replaced with [0, t_max] span.
+        inline void IntersectBox(RayData const& r, __m128 pmin, __m128 pmax, float t_max, float& t0, float& t1)
+        {
+            auto const f = _mm_add_ps(_mm_mul_ps(pmax, r.invdir), r.oxinvdir);
+            auto const n = _mm_add_ps(_mm_mul_ps(pmin, r.invdir), r.oxinvdir);
+            auto const tmax = _mm_blend_ps(_mm_max_ps(f, n), _mm_set1_ps(t_max), 0x8);
+            auto const tmin = _mm_blend_ps(_mm_min_ps(f, n), r.zero, 0x8);
+            t1 = HorizontalMin(tmax);
+            t0 = HorizontalMax(tmin);
+        }
+
+        // Same as fast_intersect_triangle in common.cl, returns t_max on miss
+        inline float IntersectTriangle(ray const& r, float3 const& v1, float3 const& v2, float3 const& v3, float t_max)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+
+#ifdef RR_BACKFACE_CULL
+            if (r.GetDoBackfaceCulling() && dot(cross(e1, e2), r.d) > 0.f)
+            {
+                return t_max;
+            }
+#endif // RR_BACKFACE_CULL
+
+            float3 const s1 = cross(r.d, e2);
+            float const denom = dot(s1, e1);
+
+            if (denom == 0.f)
+            {
+                return t_max;
+            }
+
+            float const invd = 1.f / denom;
+            float3 const d = r.o - v1;
+            float const b1 = dot(d, s1) * invd;
+            float3 const s2 = cross(d, e1);
+            float const b2 = dot(r.d, s2) * invd;
+            float const temp = dot(e2, s2) * invd;
+
+            if (b1 < 0.f || b1 > 1.f || b2 < 0.f || b1 + b2 > 1.f || temp < 0.f || temp > t_max)
+            {
+                return t_max;
+            }
+
+            return temp;
+        }
+
+        inline float2 TriangleBarycentrics(float3 const& p, float3 const& v1, float3 const& v2, float3 const& v3)
+        {
+            float3 const e1 = v2 - v1;
+            float3 const e2 = v3 - v1;
+            float3 const e = p - v1;
+            float const d00 = dot(e1, e1);
+            float const d01 = dot(e1, e2);
+            float const d11 = dot(e2, e2);
+            float const d20 = dot(e, e1);
+            float const d21 = dot(e, e2);
+            float const denom = (d00 * d11 - d01 * d01);
+
+            if (denom == 0.f)
+            {
+                return float2(0.f, 0.f);
+            }
+
+            float const invdenom = 1.f / denom;
+            return float2((d11 * d20 - d01 * d21) * invdenom, (d00 * d21 - d01 * d20) * invdenom);
+        }
+    }
+
+    namespace
+    {
+        // Per-ray data used by wide node tests, each axis is broadcast to all lanes
+        struct WideRayData
+        {
+            __m128 invdir[3];
+            __m128 oxinvdir[3];
+        };
+
+        inline WideRayData PrepareWideRay(RayData const& data)
+        {
+            WideRayData wide;
+            wide.invdir[0] = _mm_shuffle_ps(data.invdir, data.invdir, _MM_SHUFFLE(0, 0, 0, 0));
+            wide.invdir[1] = _mm_shuffle_ps(data.invdir, data.invdir, _MM_SHUFFLE(1, 1, 1, 1));
+            wide.invdir[2] = _mm_shuffle_ps(data.invdir, data.invdir, _MM_SHUFFLE(2, 2, 2, 2));
+            wide.oxinvdir[0] = _mm_shuffle_ps(data.oxinvdir, data.oxinvdir, _MM_SHUFFLE(0, 0, 0, 0));
+            wide.oxinvdir[1] = _mm_shuffle_ps(data.oxinvdir, data.oxinvdir, _MM_SHUFFLE(1, 1, 1, 1));
+            wide.oxinvdir[2] = _mm_shuffle_ps(data.oxinvdir, data.oxinvdir, _MM_SHUFFLE(2, 2, 2, 2));
+            return wide;
+        }
+
+        // Decode 4 quantized planes starting at q
+        inline __m128 DequantizePlanes(std::uint8_t const* q, __m128 origin, __m128 scale)
+        {
+            std::int32_t packed;
+            memcpy(&packed, q, sizeof(packed));
+            auto const values = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+            return _mm_add_ps(origin, _mm_mul_ps(values, scale));
+        }
+
+        // Slab test of all the children, 4 at a time. Returns mask of children
+        // intersected within [0, t_max], their entry distances go to tnear.
+        template <typename Node, std::uint32_t Width>
+        inline std::uint32_t IntersectChildren(WideRayData const& r, Node const& node, float t_max, float (&tnear)[Width])
+        {
+            __m128 origin[3], scale[3];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                origin[axis] = _mm_set1_ps(node.origin[axis]);
+                scale[axis] = _mm_castsi128_ps(_mm_set1_epi32(static_cast<std::int32_t>(node.exponent[axis]) << 23));
+            }
+
+            std::uint32_t mask = 0;
+
+            for (std::uint32_t i = 0; i < Width; i += 4)
+            {
+                auto const nx = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmin_x + i, origin[0], scale[0]), r.invdir[0]), r.oxinvdir[0]);
+                auto const ny = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmin_y + i, origin[1], scale[1]), r.invdir[1]), r.oxinvdir[1]);
+                auto const nz = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmin_z + i, origin[2], scale[2]), r.invdir[2]), r.oxinvdir[2]);
+                auto const fx = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmax_x + i, origin[0], scale[0]), r.invdir[0]), r.oxinvdir[0]);
+                auto const fy = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmax_y + i, origin[1], scale[1]), r.invdir[1]), r.oxinvdir[1]);
+                auto const fz = _mm_add_ps(_mm_mul_ps(DequantizePlanes(node.qmax_z + i, origin[2], scale[2]), r.invdir[2]), r.oxinvdir[2]);
+
+                auto const t0 = _mm_max_ps(
+                    _mm_max_ps(_mm_min_ps(nx, fx), _mm_min_ps(ny, fy)),
+                    _mm_max_ps(_mm_min_ps(nz, fz), _mm_setzero_ps()));
+                auto const t1 = _mm_min_ps(
+                    _mm_min_ps(_mm_max_ps(nx, fx), _mm_max_ps(ny, fy)),
+                    _mm_min_ps(_mm_max_ps(nz, fz), _mm_set1_ps(t_max)));
+
+                mask |= static_cast<std::uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << i;
+                _mm_storeu_ps(tnear + i, t0);
+            }
+
+            // Empty slots are not tested
+            return mask & ((1u << node.num_children) - 1u);
+        }
+
+        template <typename Triangle>
+        inline void GetVertices(Triangle const& triangle, float3& v0, float3& v1, float3& v2)
+        {
+            v0 = float3(triangle.v0[0], triangle.v0[1], triangle.v0[2]);
+            v1 = float3(triangle.v1[0], triangle.v1[1], triangle.v1[2]);
+            v2 = float3(triangle.v2[0], triangle.v2[1], triangle.v2[2]);
+        }
+
+        // Closest hit (or any hit if AnyHit is set) traversal of a wide tree,
+        // returns triangle index or kInvalidId and updates closest_t
+        template <bool AnyHit, std::uint32_t Width>
+        inline std::uint32_t TraverseWide(WideBvhTranslator<Width> const& bvh, ray const& r, float& closest_t, std::uint32_t* stack)
+        {
+            using Translator = WideBvhTranslator<Width>;
+
+            auto const data = PrepareWideRay(PrepareRay(r));
+            auto const nodes = bvh.nodes_.data();
+            auto const triangles = bvh.triangles_.data();
+
+            std::uint32_t closest_idx = Translator::kInvalidId;
+            std::uint32_t addr = 0;
+            int sptr = 0;
+
+            stack[sptr++] = Translator::kInvalidId;
+
+            while (addr != Translator::kInvalidId)
+            {
+                auto const& node = nodes[addr];
+
+                float tnear[Width];
+                auto mask = IntersectChildren(data, node, closest_t, tnear);
+
+                // Triangles go right away, so closer hits cull internal children below
+                for (std::uint32_t i = node.num_internal; i < node.num_children; ++i)
+                {
+                    if (!(mask & (1u << i)))
+                    {
+                        continue;
+                    }
+
+                    auto const idx = node.triangle_base + i - node.num_internal;
+                    auto const& triangle = triangles[idx];
+
+#ifdef RR_RAY_MASK
+                    if (r.GetMask() == static_cast<int>(triangle.mesh_id))
+                    {
+                        continue;
+                    }
+#endif // RR_RAY_MASK
+
+                    float3 v0, v1, v2;
+                    GetVertices(triangle, v0, v1, v2);
+
+                    float const t = IntersectTriangle(r, v0, v1, v2, closest_t);
+
+                    if (t < closest_t)
+                    {
+                        closest_t = t;
+                        closest_idx = idx;
+
+                        if (AnyHit)
+                        {
+                            return closest_idx;
+                        }
+                    }
+                }
+
+                // Internal children are visited front to back, the closest one goes next
+                std::uint32_t children[Width];
+                std::uint32_t num_children = 0;
+
+                for (std::uint32_t i = 0; i < node.num_internal; ++i)
+                {
+                    if ((mask & (1u << i)) && tnear[i] <= closest_t)
+                    {
+                        // Insertion sort by descending distance
+                        auto j = num_children++;
+                        for (; j > 0 && tnear[children[j - 1]] < tnear[i]; --j)
+                        {
+                            children[j] = children[j - 1];
+                        }
+
+                        children[j] = i;
+                    }
+                }
+
+                if (num_children > 0)
+                {
+                    for (std::uint32_t i = 0; i + 1 < num_children; ++i)
+                    {
+                        stack[sptr++] = node.child_base + children[i];
+                    }
+
+                    addr = node.child_base + children[num_children - 1];
+                    continue;
+                }
+
+                addr = stack[--sptr];
+            }
+
+            return closest_idx;
+        }
+
+        // Stack size for the tree, each level defers up to Width - 1 children
+        template <std::uint32_t Width>
+        inline std::size_t GetStackSize(WideBvhTranslator<Width> const& bvh)
+        {
+            return (Width - 1) * static_cast<std::size_t>(bvh.GetHeight()) + 1;
+        }
+
+        // Inactive rays go after all the others
+        std::uint32_t constexpr kInactiveRayKey = 0xffffffffu;
+
+        // Number of tasks to reorder a batch with
+        inline int GetNumReorderTasks(int numrays)
+        {
+            return std::max(1, std::min(task_scheduler::instance().num_threads(), numrays / REORDER_MIN_RAYS));
+        }
+
+        // Insert two zero bits after each of the 10 low bits of x
+        inline std::uint32_t ExpandBits(std::uint32_t x)
+        {
+            x = (x | (x << 16)) & 0x030000ff;
+            x = (x | (x << 8)) & 0x0300f00f;
+            x = (x | (x << 4)) & 0x030c30c3;
+            x = (x | (x << 2)) & 0x09249249;
+            return x;
+        }
+
+        inline std::uint32_t Morton3(std::uint32_t x, std::uint32_t y, std::uint32_t z)
+        {
+            return (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+        }
+
+        // Map [0, 1] to [0, 2^bits - 1], NaNs and values out of range are clamped
+        inline std::uint32_t Quantize(float v, int bits)
+        {
+            float const max = static_cast<float>((1 << bits) - 1);
+            float const q = v * max;
+            return q > 0.f ? static_cast<std::uint32_t>(std::min(q, max)) : 0u;
+        }
+
+        // Coherence key of a ray: 9 bit direction Morton code over 21 bit origin one,
+        // so rays going the same way from nearby points become neighbours
+        inline std::uint32_t CalcRayKey(ray const& r, float3 const& origin, float3 const& scale)
+        {
+            if (!r.IsActive())
+            {
+                return kInactiveRayKey;
+            }
+
+            float const len = std::sqrt(r.d.x * r.d.x + r.d.y * r.d.y + r.d.z * r.d.z);
+            float const inv_len = len > 0.f ? 0.5f / len : 0.f;
+
+            auto const dir = Morton3(
+                Quantize(r.d.x * inv_len + 0.5f, 3),
+                Quantize(r.d.y * inv_len + 0.5f, 3),
+                Quantize(r.d.z * inv_len + 0.5f, 3));
+
+            auto const org = Morton3(
+                Quantize((r.o.x - origin.x) * scale.x, 7),
+                Quantize((r.o.y - origin.y) * scale.y, 7),
+                Quantize((r.o.z - origin.z) * scale.z, 7));
+
+            return (dir << 21) | org;
+        }
+    }
+
+    CpuIntersectionDevice::CpuIntersectionDevice()
+        : m_stack_size(0)
+        , m_sort_rays(false)
+        , m_compact_rays(false)
+    {
+    }
+
+    CpuIntersectionDevice::~CpuIntersectionDevice() = default;
+
+    void CpuIntersectionDevice::Preprocess(World const& world)
+    {
+        int statechange = world.GetStateChange();
+
+        auto sort_rays = world.options_.GetOption("query.sort_rays");
+        m_sort_rays = sort_rays && sort_rays->AsFloat() > 0.f;
+        auto compact_rays = world.options_.GetOption("query.compact_rays");
+        m_compact_rays = compact_rays && compact_rays->AsFloat() > 0.f;
+
+        // If something has been changed we need to rebuild BVH
+        if (m_bvh && !world.has_changed() && statechange == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        // Vertex and transform changes keep the topology valid, so the BVH can be refitted
+        auto refit = world.options_.GetOption("bvh.refit");
+        if (m_bvh && !world.has_changed() && refit && refit->AsFloat() > 0.f &&
+            (statechange & ~ShapeImpl::kStateChangeRefitMask) == 0)
+        {
+            std::vector<Bvh2::NodeRange> changed_nodes;
+            m_bvh->Refit(world.GetShapes().begin(), world.GetShapes().end(), changed_nodes);
+        }
+        else
+        {
+            Build(world);
+        }
+
+        // Every level defers at most one child, refits keep the height
+        m_stack_size = static_cast<std::size_t>(m_bvh->GetHeight()) + 1;
+
+        // Wide trees are collapsed from the binary one, quantized boxes
+        // can't be refitted in place so they are translated again
+        auto width = world.options_.GetOption("bvh.width");
+        int num_children = width ? static_cast<int>(width->AsFloat()) : 2;
+
+        if (num_children == 4)
+        {
+            if (!m_bvh4)
+            {
+                m_bvh4.reset(new WideBvhTranslator<4>());
+            }
+
+            m_bvh4->Process(*m_bvh);
+        }
+        else
+        {
+            m_bvh4.reset();
+        }
+
+        if (num_children == 8)
+        {
+            if (!m_bvh8)
+            {
+                m_bvh8.reset(new WideBvhTranslator<8>());
+            }
+
+            m_bvh8->Process(*m_bvh);
+        }
+        else
+        {
+            m_bvh8.reset();
+        }
+
+        // Root bounds enclose the whole scene, ray origins are quantized within them
+        float pmin[3], pmax[3];
+        Bvh2::GetNodeBounds(m_bvh->m_nodes[0], pmin, pmax);
+        m_bounds = bbox(float3(pmin[0], pmin[1], pmin[2]), float3(pmax[0], pmax[1], pmax[2]));
+    }
+
+    void CpuIntersectionDevice::Build(World const& world)
+    {
+        // Look up build options for world
+        auto builder = world.options_.GetOption("bvh.builder");
+        auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+        auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+
+        bool use_sah = (builder && builder->AsString() == "sah");
+        int num_bins = (nbins ? static_cast<int>(nbins->AsFloat()) : 64);
+        float traversal_cost = (tcost ? tcost->AsFloat() : 10.0f);
+
+        m_bvh.reset(new Bvh2(traversal_cost, num_bins, use_sah));
+
+        // Try to restore the hierarchy from the cache first
+        BvhCache cache(world);
+        std::uint64_t key = 0;
+
+        if (cache.IsEnabled())
+        {
+            key = BvhCache::CalcKey(world, "bvh2", { "bvh.builder", "bvh.sah.num_bins", "bvh.sah.traversal_cost", "bvh.optimize.ms" });
+
+            auto entry = cache.Load(key);
+            if (entry && m_bvh->Load(*entry))
+            {
+                return;
+            }
+        }
+
+        m_bvh->Build(world.GetShapes().begin(), world.GetShapes().end());
+
+        // Restructure the tree within the time budget
+        BvhOptimizer::Process(world, *m_bvh);
+
+        if (cache.IsEnabled())
+        {
+            m_bvh->Store(cache, key);
+        }
+    }
+
+    Buffer* CpuIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new CpuBuffer(size, initdata);
+    }
+
+    void CpuIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void CpuIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void CpuIntersectionDevice::MapBuffer(Buffer* buffer, MapType /*type*/, size_t offset, size_t /*size*/, void** data, Event** event) const
+    {
+        auto buf = dynamic_cast<CpuBuffer*>(buffer);
+        ThrowIf(!buf, "Invalid cpu buffer.");
+
+        if (data)
+        {
+            *data = static_cast<char*>(buf->GetData()) + offset;
+        }
+
+        // Host memory is always accessible, so event is signaled immediately
+        if (event)
+        {
+            *event = new CpuEvent();
+        }
+    }
+
+    void CpuIntersectionDevice::UnmapBuffer(Buffer* /*buffer*/, void* /*ptr*/, Event** event) const
+    {
+        if (event)
+        {
+            *event = new CpuEvent();
+        }
+    }
+
+    template <typename Func>
+    void CpuIntersectionDevice::Dispatch(ray const* rays, int numrays, Event const* waitevent, Event** event, Func&& func) const
+    {
+        CpuEvent::Jobs jobs;
+
+        // Dependencies are copied, so the caller can delete waitevent right away,
+        // events of other devices are waited for here
+        CpuEvent::Jobs deps;
+        if (auto cpu_event = dynamic_cast<CpuEvent const*>(waitevent))
+        {
+            deps = cpu_event->GetJobs();
+        }
+        else if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        if ((m_sort_rays || m_compact_rays) && numrays >= REORDER_MIN_RAYS)
+        {
+            // Order depends on ray data, so the first task waits for dependencies,
+            // reorders the batch and traverses it, the host is not blocked meanwhile
+            jobs.push_back(m_pool.submit([this, rays, numrays, deps, func]()
+            {
+                for (auto& dep : deps)
+                {
+                    dep.wait();
+                }
+
+                auto const order = ReorderRays(rays, numrays);
+                int const count = static_cast<int>(order.size());
+
+                parallel_for(0, count, (count + TASK_SIZE - 1) / TASK_SIZE, [&](int, int first, int last)
+                {
+                    func(order.data(), first, last - first);
+                });
+            }).share());
+        }
+        else
+        {
+            // Wait for dependencies before scheduling the work
+            for (auto& dep : deps)
+            {
+                dep.wait();
+            }
+
+            jobs.reserve((numrays + TASK_SIZE - 1) / TASK_SIZE);
+
+            for (int i = 0; i < numrays; i += TASK_SIZE)
+            {
+                int count = std::min(TASK_SIZE, numrays - i);
+                jobs.push_back(m_pool.submit([func, i, count]() { func(nullptr, i, count); }).share());
+            }
+        }
+
+        auto ev = new CpuEvent(std::move(jobs));
+
+        if (event)
+        {
+            *event = ev;
+        }
+        else
+        {
+            ev->Wait();
+            DeleteEvent(ev);
+        }
+    }
+
+    std::vector<int> CpuIntersectionDevice::ReorderRays(ray const* rays, int numrays) const
+    {
+        std::vector<int> order;
+
+        if (m_sort_rays)
+        {
+            // Inactive rays are sorted last, so they are cut off the tail
+            auto num_active = SortRays(rays, numrays, order);
+            if (m_compact_rays)
+            {
+                order.resize(num_active);
+            }
+        }
+        else
+        {
+            CompactRays(rays, numrays, order);
+        }
+
+        return order;
+    }
+
+    void CpuIntersectionDevice::CompactRays(ray const* rays, int numrays, std::vector<int>& order) const
+    {
+        int const num_tasks = GetNumReorderTasks(numrays);
+        std::vector<int> offsets(num_tasks + 1, 0);
+
+        parallel_for(0, numrays, num_tasks, [&](int task, int first, int last)
+        {
+            int count = 0;
+            for (int i = first; i < last; ++i)
+            {
+                count += rays[i].IsActive() ? 1 : 0;
+            }
+            offsets[task + 1] = count;
+        });
+
+        // Chunks are written in order, so active rays keep the submission order
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        order.resize(offsets.back());
+
+        parallel_for(0, numrays, num_tasks, [&](int task, int first, int last)
+        {
+            int idx = offsets[task];
+            for (int i = first; i < last; ++i)
+            {
+                if (rays[i].IsActive())
+                {
+                    order[idx++] = i;
+                }
+            }
+        });
+    }
+
+    int CpuIntersectionDevice::SortRays(ray const* rays, int numrays, std::vector<int>& order) const
+    {
+        int constexpr kRadixSize = 1 << SORT_RADIX_BITS;
+        int const num_tasks = GetNumReorderTasks(numrays);
+
+        auto const extents = m_bounds.extents();
+        float3 const scale(
+            extents.x > 0.f ? 1.f / extents.x : 0.f,
+            extents.y > 0.f ? 1.f / extents.y : 0.f,
+            extents.z > 0.f ? 1.f / extents.z : 0.f);
+
+        std::vector<std::uint32_t> keys(numrays);
+        std::vector<std::uint32_t> temp_keys(numrays);
+        std::vector<int> temp_order(numrays);
+        std::vector<int> histograms(num_tasks * kRadixSize);
+        order.resize(numrays);
+
+        parallel_for(0, numrays, num_tasks, [&](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                keys[i] = CalcRayKey(rays[i], m_bounds.pmin, scale);
+                order[i] = i;
+            }
+        });
+
+        // LSD radix sort, same scheme as MortonBvh uses for primitive codes
+        for (int shift = 0; shift < 32; shift += SORT_RADIX_BITS)
+        {
+            std::fill(histograms.begin(), histograms.end(), 0);
+            parallel_for(0, numrays, num_tasks, [&](int task, int first, int last)
+            {
+                auto hist = &histograms[task * kRadixSize];
+                for (int i = first; i < last; ++i)
+                {
+                    ++hist[(keys[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // Convert counts to offsets, bucket-major
+            int offset = 0;
+            bool sorted = false;
+            for (int digit = 0; digit < kRadixSize; ++digit)
+            {
+                int count = 0;
+                for (int task = 0; task < num_tasks; ++task)
+                {
+                    auto& h = histograms[task * kRadixSize + digit];
+                    int const c = h;
+                    h = offset;
+                    offset += c;
+                    count += c;
+                }
+                // All keys share the digit: pass would not change the order
+                sorted = sorted || count == numrays;
+            }
+
+            if (sorted)
+            {
+                continue;
+            }
+
+            parallel_for(0, numrays, num_tasks, [&](int task, int first, int last)
+            {
+                auto hist = &histograms[task * kRadixSize];
+                for (int i = first; i < last; ++i)
+                {
+                    auto const idx = hist[(keys[i] >> shift) & (kRadixSize - 1)]++;
+                    temp_keys[idx] = keys[i];
+                    temp_order[idx] = order[i];
+                }
+            });
+
+            keys.swap(temp_keys);
+            order.swap(temp_order);
+        }
+
+        return static_cast<int>(std::lower_bound(keys.begin(), keys.end(), kInactiveRayKey) - keys.begin());
+    }
+
+    std::uint32_t CpuIntersectionDevice::GetQueueCount() const
+    {
+        // Tasks of all the queries share the scheduler, so there is a single queue
+        return 1;
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(std::uint32_t /*queue*/, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        auto ray_buffer = dynamic_cast<CpuBuffer const*>(rays); ThrowIf(!ray_buffer, "Invalid cpu buffer.");
+        auto hit_buffer = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!hit_buffer, "Invalid cpu buffer.");
+        ThrowIf(!m_bvh, "Commit() should be called before queries.");
+
+        auto src = static_cast<ray const*>(ray_buffer->GetData());
+        auto dst = static_cast<Intersection*>(hit_buffer->GetData());
+
+        Dispatch(src, numrays, waitevent, event, [this, src, dst](int const* indices, int start, int count)
+        {
+            if (m_bvh8)
+            {
+                IntersectRange(*m_bvh8, src, indices, start, count, dst);
+            }
+            else if (m_bvh4)
+            {
+                IntersectRange(*m_bvh4, src, indices, start, count, dst);
+            }
+            else
+            {
+                IntersectRange(src, indices, start, count, dst);
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(std::uint32_t /*queue*/, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        auto ray_buffer = dynamic_cast<CpuBuffer const*>(rays); ThrowIf(!ray_buffer, "Invalid cpu buffer.");
+        auto hit_buffer = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!hit_buffer, "Invalid cpu buffer.");
+        ThrowIf(!m_bvh, "Commit() should be called before queries.");
+
+        auto src = static_cast<ray const*>(ray_buffer->GetData());
+        auto dst = static_cast<int*>(hit_buffer->GetData());
+
+        Dispatch(src, numrays, waitevent, event, [this, src, dst](int const* indices, int start, int count)
+        {
+            if (m_bvh8)
+            {
+                OccludedRange(*m_bvh8, src, indices, start, count, dst);
+            }
+            else if (m_bvh4)
+            {
+                OccludedRange(*m_bvh4, src, indices, start, count, dst);
+            }
+            else
+            {
+                OccludedRange(src, indices, start, count, dst);
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        auto count_buffer = dynamic_cast<CpuBuffer const*>(numrays); ThrowIf(!count_buffer, "Invalid cpu buffer.");
+
+        // Count is only valid once dependencies are complete
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        int count = std::min(*static_cast<int const*>(count_buffer->GetData()), maxrays);
+        QueryIntersection(queue, rays, count, hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        auto count_buffer = dynamic_cast<CpuBuffer const*>(numrays); ThrowIf(!count_buffer, "Invalid cpu buffer.");
+
+        // Count is only valid once dependencies are complete
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        int count = std::min(*static_cast<int const*>(count_buffer->GetData()), maxrays);
+        QueryOcclusion(queue, rays, count, hits, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::IntersectRange(ray const* rays, int const* indices, int start, int count, Intersection* hits) const
+    {
+        auto const nodes = m_bvh->m_nodes;
+        std::vector<std::uint32_t> stack(m_stack_size);
+
+        for (int i = start; i < start + count; ++i)
+        {
+            auto const rayidx = indices ? indices[i] : i;
+            auto const& r = rays[rayidx];
+
+            if (!r.IsActive())
+            {
+                continue;
+            }
+
+            auto const data = PrepareRay(r);
+            float closest_t = r.GetMaxT();
+            std::uint32_t closest_addr = Bvh2::kInvalidId;
+            std::uint32_t addr = 0;
+            int sptr = 0;
+
+            stack[sptr++] = Bvh2::kInvalidId;
+
+            while (addr != Bvh2::kInvalidId)
+            {
+                auto const& node = nodes[addr];
+
+                if (Bvh2::IsInternal(node))
+                {
+                    float t00, t01, t10, t11;
+                    IntersectBox(data, _mm_loadu_ps(node.aabb_left_min_or_v0), _mm_loadu_ps(node.aabb_left_max_or_v1), closest_t, t00, t01);
+                    IntersectBox(data, _mm_loadu_ps(node.aabb_right_min_or_v2), _mm_loadu_ps(node.aabb_right_max), closest_t, t10, t11);
+
+                    bool traverse_c0 = (t00 <= t01);
+                    bool traverse_c1 = (t10 <= t11);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        bool c1first = traverse_c1 && (!traverse_c0 || t00 > t10);
+                        addr = c1first ? node.addr_right : node.addr_left;
+
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            stack[sptr++] = c1first ? node.addr_left : node.addr_right;
+                        }
+
+                        continue;
+                    }
+                }
+                else
+                {
+#ifdef RR_RAY_MASK
+                    if (r.GetMask() != static_cast<int>(node.mesh_id))
+#endif // RR_RAY_MASK
+                    {
+                        float3 v0(node.aabb_left_min_or_v0[0], node.aabb_left_min_or_v0[1], node.aabb_left_min_or_v0[2]);
+                        float3 v1(node.aabb_left_max_or_v1[0], node.aabb_left_max_or_v1[1], node.aabb_left_max_or_v1[2]);
+                        float3 v2(node.aabb_right_min_or_v2[0], node.aabb_right_min_or_v2[1], node.aabb_right_min_or_v2[2]);
+
+                        float t = IntersectTriangle(r, v0, v1, v2, closest_t);
+
+                        if (t < closest_t)
+                        {
+                            closest_t = t;
+                            closest_addr = addr;
+                        }
+                    }
+                }
+
+                addr = stack[--sptr];
+            }
+
+            auto& hit = hits[rayidx];
+
+            if (closest_addr != Bvh2::kInvalidId)
+            {
+                auto const& node = nodes[closest_addr];
+                float3 v0(node.aabb_left_min_or_v0[0], node.aabb_left_min_or_v0[1], node.aabb_left_min_or_v0[2]);
+                float3 v1(node.aabb_left_max_or_v1[0], node.aabb_left_max_or_v1[1], node.aabb_left_max_or_v1[2]);
+                float3 v2(node.aabb_right_min_or_v2[0], node.aabb_right_min_or_v2[1], node.aabb_right_min_or_v2[2]);
+
+                auto const uv = TriangleBarycentrics(r.o + closest_t * r.d, v0, v1, v2);
+
+                hit.shapeid = static_cast<Id>(node.mesh_id);
+                hit.primid = static_cast<Id>(node.prim_id);
+                hit.uvwt = float4(uv.x, uv.y, 0.f, closest_t);
+            }
+            else
+            {
+                hit.shapeid = kNullId;
+                hit.primid = kNullId;
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::OccludedRange(ray const* rays, int const* indices, int start, int count, int* hits) const
+    {
+        auto const nodes = m_bvh->m_nodes;
+        std::vector<std::uint32_t> stack(m_stack_size);
+
+        for (int i = start; i < start + count; ++i)
+        {
+            auto const rayidx = indices ? indices[i] : i;
+            auto const& r = rays[rayidx];
+
+            if (!r.IsActive())
+            {
+                continue;
+            }
+
+            auto const data = PrepareRay(r);
+            float const closest_t = r.GetMaxT();
+            std::uint32_t addr = 0;
+            int sptr = 0;
+            bool hit = false;
+
+            stack[sptr++] = Bvh2::kInvalidId;
+
+            while (addr != Bvh2::kInvalidId && !hit)
+            {
+                auto const& node = nodes[addr];
+
+                if (Bvh2::IsInternal(node))
+                {
+                    float t00, t01, t10, t11;
+                    IntersectBox(data, _mm_loadu_ps(node.aabb_left_min_or_v0), _mm_loadu_ps(node.aabb_left_max_or_v1), closest_t, t00, t01);
+                    IntersectBox(data, _mm_loadu_ps(node.aabb_right_min_or_v2), _mm_loadu_ps(node.aabb_right_max), closest_t, t10, t11);
+
+                    bool traverse_c0 = (t00 <= t01);
+                    bool traverse_c1 = (t10 <= t11);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        bool c1first = traverse_c1 && (!traverse_c0 || t00 > t10);
+                        addr = c1first ? node.addr_right : node.addr_left;
+
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            stack[sptr++] = c1first ? node.addr_left : node.addr_right;
+                        }
+
+                        continue;
+                    }
+                }
+                else
+                {
+#ifdef RR_RAY_MASK
+                    if (r.GetMask() != static_cast<int>(node.mesh_id))
+#endif // RR_RAY_MASK
+                    {
+                        float3 v0(node.aabb_left_min_or_v0[0], node.aabb_left_min_or_v0[1], node.aabb_left_min_or_v0[2]);
+                        float3 v1(node.aabb_left_max_or_v1[0], node.aabb_left_max_or_v1[1], node.aabb_left_max_or_v1[2]);
+                        float3 v2(node.aabb_right_min_or_v2[0], node.aabb_right_min_or_v2[1], node.aabb_right_min_or_v2[2]);
+
+                        hit = IntersectTriangle(r, v0, v1, v2, closest_t) < closest_t;
+                    }
+                }
+
+                addr = stack[--sptr];
+            }
+
+            // 1 for hit and -1 for miss, same as GPU kernels
+            hits[rayidx] = hit ? 1 : -1;
+        }
+    }
+
+    template <std::uint32_t Width>
+    void CpuIntersectionDevice::IntersectRange(WideBvhTranslator<Width> const& bvh, ray const* rays, int const* indices, int start, int count, Intersection* hits) const
+    {
+        std::vector<std::uint32_t> stack(GetStackSize(bvh));
+
+        for (int i = start; i < start + count; ++i)
+        {
+            auto const rayidx = indices ? indices[i] : i;
+            auto const& r = rays[rayidx];
+
+            if (!r.IsActive())
+            {
+                continue;
+            }
+
+            float closest_t = r.GetMaxT();
+            auto const idx = TraverseWide<false>(bvh, r, closest_t, stack.data());
+            auto& hit = hits[rayidx];
+
+            if (idx != WideBvhTranslator<Width>::kInvalidId)
+            {
+                auto const& triangle = bvh.triangles_[idx];
+                float3 v0, v1, v2;
+                GetVertices(triangle, v0, v1, v2);
+
+                auto const uv = TriangleBarycentrics(r.o + closest_t * r.d, v0, v1, v2);
+
+                hit.shapeid = static_cast<Id>(triangle.mesh_id);
+                hit.primid = static_cast<Id>(triangle.prim_id);
+                hit.uvwt = float4(uv.x, uv.y, 0.f, closest_t);
+            }
+            else
+            {
+                hit.shapeid = kNullId;
+                hit.primid = kNullId;
+            }
+        }
+    }
+
+    template <std::uint32_t Width>
+    void CpuIntersectionDevice::OccludedRange(WideBvhTranslator<Width> const& bvh, ray const* rays, int const* indices, int start, int count, int* hits) const
+    {
+        std::vector<std::uint32_t> stack(GetStackSize(bvh));
+
+        for (int i = start; i < start + count; ++i)
+        {
+            auto const rayidx = indices ? indices[i] : i;
+            auto const& r = rays[rayidx];
+
+            if (!r.IsActive())
+            {
+                continue;
+            }
+
+            float closest_t = r.GetMaxT();
+            auto const idx = TraverseWide<true>(bvh, r, closest_t, stack.data());
+
+            // 1 for hit and -1 for miss, same as GPU kernels
+            hits[rayidx] = idx != WideBvhTranslator<Width>::kInvalidId ? 1 : -1;
+        }
+    }
+}
@@ -0,0 +1,111 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include "../async/thread_pool.h"
+#include "math/bbox.h"
+
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    class Bvh2;
+    template <std::uint32_t Width> class WideBvhTranslator;
+
+    ///< The class represents native CPU intersection device.
+    ///< It builds Bvh2 on the host and traverses it using SSE
+    ///< box tests, distributing ray batches across all the cores.
+    ///< With bvh.width set to 4 or 8 the tree is collapsed into
+    ///< a wide one and four children are tested at once.
+    ///< With query.sort_rays set large batches are traversed in the
+    ///< order of ray origin and direction codes for better coherence,
+    ///< with query.compact_rays set inactive rays are not dispatched.
+    ///< Unlike EmbreeIntersectionDevice it has no external dependencies.
+    ///<
+    class CpuIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        //
+        CpuIntersectionDevice();
+        ~CpuIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        std::uint32_t GetQueueCount() const override;
+
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+    protected:
+        // Build the binary hierarchy or restore it from the cache
+        void Build(World const& world);
+
+        // Split the batch into tasks and submit them into the pool, func gets the
+        // order to traverse rays in (nullptr if they go as submitted) and a range of it.
+        // Batches to reorder are reordered by the first task once waitevent completes
+        template <typename Func>
+        void Dispatch(ray const* rays, int numrays, Event const* waitevent, Event** event, Func&& func) const;
+
+        // Order to traverse rays in according to query.sort_rays and query.compact_rays
+        std::vector<int> ReorderRays(ray const* rays, int numrays) const;
+        // Indices of active rays
+        void CompactRays(ray const* rays, int numrays, std::vector<int>& order) const;
+        // Indices of rays sorted by their coherence keys, inactive rays go last,
+        // returns the number of active ones
+        int SortRays(ray const* rays, int numrays, std::vector<int>& order) const;
+
+        // Traverse the hierarchy for rays [start, start + count) of the batch order,
+        // indices map the order to rays and hits, nullptr stands for identity
+        void IntersectRange(ray const* rays, int const* indices, int start, int count, Intersection* hits) const;
+        void OccludedRange(ray const* rays, int const* indices, int start, int count, int* hits) const;
+        template <std::uint32_t Width>
+        void IntersectRange(WideBvhTranslator<Width> const& bvh, ray const* rays, int const* indices, int start, int count, Intersection* hits) const;
+        template <std::uint32_t Width>
+        void OccludedRange(WideBvhTranslator<Width> const& bvh, ray const* rays, int const* indices, int start, int count, int* hits) const;
+
+        // Acceleration structure
+        std::unique_ptr<Bvh2> m_bvh;
+        // Wide trees collapsed from m_bvh, at most one of them is used
+        std::unique_ptr<WideBvhTranslator<4>> m_bvh4;
+        std::unique_ptr<WideBvhTranslator<8>> m_bvh8;
+        // Traversal stack entries m_bvh needs
+        std::size_t m_stack_size;
+        // Scene bounds used to quantize ray origins
+        bbox m_bounds;
+        // Reorder rays before traversal
+        bool m_sort_rays;
+        // Skip inactive rays before traversal
+        bool m_compact_rays;
+
+        // Thread pool for ray batches
+        mutable thread_pool<void> m_pool;
+    };
+}
@@ -109,7 +109,6 @@ namespace RadeonRays
     };
 
     EmbreeIntersectionDevice::EmbreeIntersectionDevice()
-        : m_pool(1)
     {
         m_device = rtcNewDevice(nullptr);
         RTCError result = rtcDeviceGetError(m_device);
@@ -138,7 +137,7 @@ namespace RadeonRays
             it.second.updated = false;
 
         //checking removed shapes
-        for (auto it = world.shapes_.begin(); it != world.shapes_.end(); ++it)
+        for (auto it = world.GetShapes().begin(); it != world.GetShapes().end(); ++it)
         {
             auto& i = *it;
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
@@ -173,7 +172,7 @@ namespace RadeonRays
         rtcDeleteScene(m_scene); CheckEmbreeError();
         m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 ); CheckEmbreeError();
 
-        for (auto i : world.shapes_)
+        for (auto i : world.GetShapes())
         {
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
             ThrowIf(!shape, "Invalid shape.");
@@ -272,14 +271,25 @@ namespace RadeonRays
     }
     
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    std::uint32_t EmbreeIntersectionDevice::GetQueueCount() const
+    {
+        // Jobs of all the queries share the thread pool, so there is a single queue
+        return 1;
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
+        // Previous work has to finish before the rays are read
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
         EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]() 
         {
-            m_pool.setSleepTime(0);
             //processing buffers workflow:
             //1. convert RadeonRays::ray to RTCRay
             //2. rtcIntersect
@@ -349,7 +359,6 @@ namespace RadeonRays
 #endif // INTERSECTN
 
             std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
         });
 
         if (event)
@@ -363,14 +372,19 @@ namespace RadeonRays
         }
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
+        // Previous work has to finish before the rays are read
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
         EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]()
         {
-            m_pool.setSleepTime(0);
             //processing buffers workflow:
             //1. convert RadeonRays::ray to RTCRay
             //2. rtcOccluded
@@ -472,7 +486,6 @@ namespace RadeonRays
 #endif // INTERSECTN
 
             std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
         });
 
         if (event)
@@ -486,12 +499,12 @@ namespace RadeonRays
         }
     }
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         Throw("Not implemented for embree device.");
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         Throw("Not implemented for embree device.");
     }
@@ -499,7 +512,31 @@ namespace RadeonRays
     RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const RadeonRays::Mesh* mesh)
     {
         if (m_meshes.count(mesh))
-            return m_meshes[mesh].scene;
+        {
+            RTCScene scene = m_meshes[mesh].scene;
+
+            // Cached mesh scene has to pick up updated vertices
+            if (mesh->GetStateChange() & ShapeImpl::kStateChangeVertices)
+            {
+                float* verts = static_cast<float*>(rtcMapBuffer(scene, 0, RTC_VERTEX_BUFFER));
+                CheckEmbreeError();
+                ThrowIf(!verts, "Failed to map embree buffer.");
+                for (int i = 0; i < mesh->num_vertices(); ++i)
+                {
+                    auto v = mesh->GetVertex(i);
+                    verts[4 * i] = v.x;
+                    verts[4 * i + 1] = v.y;
+                    verts[4 * i + 2] = v.z;
+                    verts[4 * i + 3] = v.w;
+                }
+                rtcUnmapBuffer(scene, 0, RTC_VERTEX_BUFFER);
+                rtcUpdate(scene, 0);
+                rtcCommit(scene);
+                CheckEmbreeError();
+            }
+
+            return scene;
+        }
         RTCScene result = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 );
         CheckEmbreeError();
         ThrowIf(!mesh->puretriangle(), "Only triangle meshes supported by now.");
@@ -507,28 +544,30 @@ namespace RadeonRays
         unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
         CheckEmbreeError();
         
-        const float3* kMeshVerts = mesh->GetVertexData();
+        // Embree reads vertices with SIMD loads past the last one, so even
+        // shared meshes are copied rather than referenced via rtcSetBuffer
         float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!verts, "Failed to map embree buffer.");
         for (int i = 0; i < mesh->num_vertices(); ++i)
         {
-            verts[4 * i] = kMeshVerts[i].x;
-            verts[4 * i + 1] = kMeshVerts[i].y;
-            verts[4 * i + 2] = kMeshVerts[i].z;
-            verts[4 * i + 3] = kMeshVerts[i].w;
+            auto v = mesh->GetVertex(i);
+            verts[4 * i] = v.x;
+            verts[4 * i + 1] = v.y;
+            verts[4 * i + 2] = v.z;
+            verts[4 * i + 3] = v.w;
         }
         rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
 
         int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
         for (int i = 0; i < mesh->num_faces(); ++i)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            auto face = mesh->GetFace(i);
+            indices[3 * i] = face.i0;
+            indices[3 * i + 1] = face.i1;
+            indices[3 * i + 2] = face.i2;
         }
         rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
@@ -59,19 +59,22 @@ namespace RadeonRays
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const = 0;
 
+        // Number of queues queries can be issued to, queries on different queues might overlap.
+        virtual std::uint32_t GetQueueCount() const = 0;
+
         // Find intersection for the rays in rays buffer and write them into hits buffer.
         // rays is assumed AOS with elements of type RadeonRays::ray.
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
 
         // Find if the rays in rays buffer intersect any of the primitives in the scene.
         // rays is assumed AOS with elements of type RadeonRays::ray.
         // hits is assumed AOS with elements of type int (-1 if no intersection, 1 otherwise).
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
 
         // Find intersection for the rays in rays buffer and write them into hits buffer. Take the number of rays from the buffer in remote memory.
         // rays is assumed AOS with elements of type RadeonRays::ray.
@@ -79,7 +82,7 @@ namespace RadeonRays
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
 
         // Find if the rays in rays buffer intersect any of the primitives in the scene. Take the number of rays from the buffer in remote memory.
         // rays is assumed AOS with elements of type RadeonRays::ray.
@@ -87,7 +90,7 @@ namespace RadeonRays
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
     
         IntersectionDevice(IntersectionDevice const&) = delete;
         IntersectionDevice& operator = (IntersectionDevice const&) = delete;
@@ -0,0 +1,411 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "multi_intersection_device.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+
+#include "../except/except.h"
+
+// Parts of a batch are multiples of this number of rays
+#define SPLIT_GRANULARITY 64
+// Devices getting less rays than that are skipped for the batch
+#define MIN_RAYS_PER_DEVICE 1024
+// Weight of the latest throughput measurement in the estimate
+#define THROUGHPUT_BLEND 0.5
+
+namespace RadeonRays
+{
+    // Host memory RadeonRays::Buffer implementation
+    class HostBuffer : public Buffer
+    {
+    public:
+        HostBuffer(size_t size, void* init)
+            : m_data(new char[size])
+        {
+            if (init)
+                memcpy(m_data, init, size);
+        }
+
+        virtual ~HostBuffer()
+        {
+            delete[] m_data;
+        }
+
+        char* GetData()
+        {
+            return m_data;
+        }
+
+        char const* GetData() const
+        {
+            return m_data;
+        }
+
+    private:
+        char* m_data;
+    };
+
+    // RadeonRays::Event implementation tracking the parts of a batch
+    class HostEvent : public Event
+    {
+    public:
+        HostEvent() = default;
+
+        explicit HostEvent(std::vector<std::future<void> >&& jobs)
+            : m_jobs(std::move(jobs))
+        {
+        }
+
+        virtual ~HostEvent()
+        {
+            Wait();
+        }
+
+        virtual bool Complete() const
+        {
+            return std::all_of(m_jobs.cbegin(), m_jobs.cend(), [](std::future<void> const& j)
+            {
+                return j.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+        }
+
+        virtual void Wait()
+        {
+            for (auto& j : m_jobs)
+                j.wait();
+        }
+
+    private:
+        std::vector<std::future<void> > m_jobs;
+    };
+
+    struct MultiIntersectionDevice::DeviceData
+    {
+        std::unique_ptr<IntersectionDevice> device;
+        // Staging buffers on the device and their capacity in rays
+        Buffer* rays = nullptr;
+        Buffer* hits = nullptr;
+        int capacity = 0;
+        // Estimated rays per second, 0 until measured
+        double throughput = 0.0;
+        // Serializes batches sharing staging buffers
+        std::mutex mutex;
+    };
+
+    MultiIntersectionDevice::MultiIntersectionDevice(std::vector<IntersectionDevice*> const& devices)
+    {
+        ThrowIf(devices.empty(), "No devices specified.");
+
+        for (auto device : devices)
+        {
+            m_devices.emplace_back(new DeviceData());
+            m_devices.back()->device.reset(device);
+        }
+    }
+
+    MultiIntersectionDevice::~MultiIntersectionDevice()
+    {
+        for (auto& data : m_devices)
+        {
+            if (data->rays)
+            {
+                data->device->DeleteBuffer(data->rays);
+                data->device->DeleteBuffer(data->hits);
+            }
+        }
+    }
+
+    void MultiIntersectionDevice::Preprocess(World const& world)
+    {
+        // Devices build their structures independently
+        std::vector<std::future<void> > jobs;
+        for (auto& data : m_devices)
+        {
+            auto device = data->device.get();
+            jobs.push_back(std::async(std::launch::async, [device, &world]() { device->Preprocess(world); }));
+        }
+
+        for (auto& j : jobs)
+        {
+            j.get();
+        }
+    }
+
+    Buffer* MultiIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new HostBuffer(size, initdata);
+    }
+
+    void MultiIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void MultiIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    void MultiIntersectionDevice::MapBuffer(Buffer* buffer, MapType /*type*/, size_t offset, size_t /*size*/, void** data, Event** event) const
+    {
+        auto buf = dynamic_cast<HostBuffer*>(buffer);
+        ThrowIf(!buf, "Invalid host buffer.");
+
+        if (data)
+        {
+            *data = buf->GetData() + offset;
+        }
+
+        if (event)
+        {
+            *event = new HostEvent();
+        }
+    }
+
+    void MultiIntersectionDevice::UnmapBuffer(Buffer* /*buffer*/, void* /*ptr*/, Event** event) const
+    {
+        if (event)
+        {
+            *event = new HostEvent();
+        }
+    }
+
+    std::uint32_t MultiIntersectionDevice::GetQueueCount() const
+    {
+        // Batches are spread over the devices anyway
+        return 1;
+    }
+
+    float MultiIntersectionDevice::GetDeviceShare(std::size_t idx) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Unmeasured devices are assumed as fast as the fastest one
+        double max_throughput = 0.0;
+        for (auto& data : m_devices)
+        {
+            max_throughput = std::max(max_throughput, data->throughput);
+        }
+
+        if (max_throughput == 0.0)
+        {
+            return 1.f / m_devices.size();
+        }
+
+        double sum = 0.0;
+        for (auto& data : m_devices)
+        {
+            sum += data->throughput > 0.0 ? data->throughput : max_throughput;
+        }
+
+        auto throughput = m_devices[idx]->throughput;
+        return static_cast<float>((throughput > 0.0 ? throughput : max_throughput) / sum);
+    }
+
+    void MultiIntersectionDevice::Run(DeviceData& data, char const* rays, int numrays, char* hits, std::size_t hitsize, bool occlusion) const
+    {
+        std::lock_guard<std::mutex> lock(data.mutex);
+
+        auto device = data.device.get();
+
+        if (data.capacity < numrays)
+        {
+            if (data.rays)
+            {
+                device->DeleteBuffer(data.rays);
+                device->DeleteBuffer(data.hits);
+            }
+
+            data.rays = device->CreateBuffer(numrays * sizeof(ray), nullptr);
+            data.hits = device->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+            data.capacity = numrays;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Device maps and queries might complete asynchronously
+        auto wait = [device](Event* e)
+        {
+            e->Wait();
+            device->DeleteEvent(e);
+        };
+
+        void* ptr = nullptr;
+        Event* e = nullptr;
+        device->MapBuffer(data.rays, kMapWrite, 0, numrays * sizeof(ray), &ptr, &e);
+        wait(e);
+        memcpy(ptr, rays, numrays * sizeof(ray));
+        device->UnmapBuffer(data.rays, ptr, &e);
+        wait(e);
+
+        if (occlusion)
+        {
+            device->QueryOcclusion(0, data.rays, numrays, data.hits, nullptr, &e);
+        }
+        else
+        {
+            device->QueryIntersection(0, data.rays, numrays, data.hits, nullptr, &e);
+        }
+        wait(e);
+
+        device->MapBuffer(data.hits, kMapRead, 0, numrays * hitsize, &ptr, &e);
+        wait(e);
+        memcpy(hits, ptr, numrays * hitsize);
+        device->UnmapBuffer(data.hits, ptr, &e);
+        wait(e);
+
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        auto throughput = numrays / std::max(elapsed.count(), 1e-6);
+
+        std::lock_guard<std::mutex> estimate_lock(m_mutex);
+        data.throughput = data.throughput > 0.0 ?
+            (1.0 - THROUGHPUT_BLEND) * data.throughput + THROUGHPUT_BLEND * throughput : throughput;
+    }
+
+    void MultiIntersectionDevice::Dispatch(Buffer const* rays, int numrays, Buffer* hits, std::size_t hitsize, bool occlusion, Event** event) const
+    {
+        auto raybuf = dynamic_cast<HostBuffer const*>(rays);
+        auto hitbuf = dynamic_cast<HostBuffer*>(hits);
+        ThrowIf(!raybuf || !hitbuf, "Invalid host buffer.");
+
+        if (numrays <= 0)
+        {
+            if (event)
+            {
+                *event = new HostEvent();
+            }
+            return;
+        }
+
+        // Split the batch proportionally to the device throughput
+        std::vector<int> counts(m_devices.size(), 0);
+        int assigned = 0;
+        std::size_t best = 0;
+        float best_share = 0.f;
+        for (std::size_t i = 0; i < m_devices.size(); ++i)
+        {
+            auto share = GetDeviceShare(i);
+            auto count = static_cast<int>(numrays * share) / SPLIT_GRANULARITY * SPLIT_GRANULARITY;
+
+            if (count >= MIN_RAYS_PER_DEVICE)
+            {
+                counts[i] = count;
+                assigned += count;
+            }
+
+            if (share > best_share)
+            {
+                best = i;
+                best_share = share;
+            }
+        }
+
+        // The rest goes to the fastest device
+        counts[best] += numrays - assigned;
+
+        std::vector<std::future<void> > jobs;
+        int offset = 0;
+        for (std::size_t i = 0; i < m_devices.size(); ++i)
+        {
+            if (counts[i] == 0)
+            {
+                continue;
+            }
+
+            auto data = m_devices[i].get();
+            auto src = raybuf->GetData() + offset * sizeof(ray);
+            auto dst = hitbuf->GetData() + offset * hitsize;
+            auto count = counts[i];
+
+            jobs.push_back(std::async(std::launch::async, [=]()
+            {
+                Run(*data, src, count, dst, hitsize, occlusion);
+            }));
+
+            offset += count;
+        }
+
+        if (event)
+        {
+            *event = new HostEvent(std::move(jobs));
+        }
+        else
+        {
+            for (auto& j : jobs)
+            {
+                j.get();
+            }
+        }
+    }
+
+    void MultiIntersectionDevice::QueryIntersection(std::uint32_t /*queue*/, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        // Ray data has to be in place before it is split
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        Dispatch(rays, numrays, hitinfos, sizeof(Intersection), false, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(std::uint32_t /*queue*/, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        Dispatch(rays, numrays, hitresults, sizeof(int), true, event);
+    }
+
+    void MultiIntersectionDevice::QueryIntersection(std::uint32_t /*queue*/, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto countbuf = dynamic_cast<HostBuffer const*>(numrays);
+        ThrowIf(!countbuf, "Invalid host buffer.");
+
+        auto count = std::min(*reinterpret_cast<int const*>(countbuf->GetData()), maxrays);
+        Dispatch(rays, count, hitinfos, sizeof(Intersection), false, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(std::uint32_t /*queue*/, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto countbuf = dynamic_cast<HostBuffer const*>(numrays);
+        ThrowIf(!countbuf, "Invalid host buffer.");
+
+        auto count = std::min(*reinterpret_cast<int const*>(countbuf->GetData()), maxrays);
+        Dispatch(rays, count, hitresults, sizeof(int), true, event);
+    }
+}
@@ -0,0 +1,75 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class represents a set of intersection devices used as one.
+    ///< Each device keeps its own copy of the scene, ray batches are split
+    ///< between the devices proportionally to their measured throughput
+    ///< and the results are gathered back. Buffers reside in host memory,
+    ///< every device stages its part of a batch through its own buffers.
+    ///<
+    class MultiIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // Takes ownership of the devices
+        explicit MultiIntersectionDevice(std::vector<IntersectionDevice*> const& devices);
+        ~MultiIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        std::uint32_t GetQueueCount() const override;
+
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(std::uint32_t queue, Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        // Number of devices and share of the next batch assigned to each of them
+        std::size_t GetDeviceCount() const { return m_devices.size(); }
+        float GetDeviceShare(std::size_t idx) const;
+
+    private:
+        struct DeviceData;
+
+        // Split the batch between the devices and run it, hitsize is the size of a single result
+        void Dispatch(Buffer const* rays, int numrays, Buffer* hits, std::size_t hitsize, bool occlusion, Event** event) const;
+        // Run a part of the batch on a device and copy the results into hits
+        void Run(DeviceData& data, char const* rays, int numrays, char* hits, std::size_t hitsize, bool occlusion) const;
+
+        std::vector<std::unique_ptr<DeviceData>> m_devices;
+        // Protects throughput estimates
+        mutable std::mutex m_mutex;
+    };
+}
@@ -1,17 +1,205 @@
 #include "intersector.h"
+#include "ray_compactor.h"
+#include "ray_sorter.h"
 #include "device.h"
+#include "../primitive/shapeimpl.h"
+#include "../world/world.h"
+
+#include <algorithm>
 
 namespace RadeonRays
 {
+    // Smaller batches are traversed as submitted, reordering them doesn't pay off
+    static std::uint32_t const kMinReorderRays = 4096;
+
     Intersector::Intersector(Calc::Device *device)
-        : m_device(device),
-        m_counter(device->CreateBuffer(sizeof(int), Calc::BufferType::kRead),
-                  [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); })
+        : m_device(device)
+        , m_max_stack_memory(0)
+    {
+    }
+
+    Intersector::~Intersector()
+    {
+        for (auto const& counters : m_counters)
+        {
+            if (!counters)
+            {
+                continue;
+            }
+
+            for (std::size_t i = 0; i < kNumCounters; ++i)
+            {
+                if (counters[i].event)
+                {
+                    counters[i].event->Wait();
+                    m_device->DeleteEvent(counters[i].event);
+                }
+
+                m_device->DeleteBuffer(counters[i].buffer);
+            }
+        }
+
+        for (auto stack : m_stacks)
+        {
+            if (stack)
+            {
+                m_device->DeleteBuffer(stack);
+            }
+        }
+    }
+
+    std::uint32_t Intersector::CalcStackSize(int height, std::uint32_t block_size)
+    {
+        // A path holds at most height deferred nodes plus the end marker,
+        // each spill moves block_size - 1 of them into a block
+        auto num_blocks = (static_cast<std::uint32_t>(std::max(height, 0)) + block_size - 1) / (block_size - 1);
+        return std::max(num_blocks, 1u) * block_size;
+    }
+
+    std::uint32_t Intersector::GetNumStackThreads(std::uint32_t max_rays, std::uint32_t stack_size, std::uint32_t group_size) const
+    {
+        std::uint32_t num_threads = (std::max(max_rays, 1u) + group_size - 1) / group_size * group_size;
+
+        if (m_max_stack_memory > 0)
+        {
+            auto thread_memory = stack_size * sizeof(std::uint32_t);
+            auto max_threads = static_cast<std::uint32_t>(m_max_stack_memory / thread_memory) / group_size * group_size;
+            num_threads = std::min(num_threads, std::max(max_threads, group_size));
+        }
+
+        return num_threads;
+    }
+
+    Calc::Buffer* Intersector::GetStack(std::uint32_t queue_idx, std::uint32_t num_threads, std::uint32_t stack_size) const
+    {
+        std::lock_guard<std::mutex> lock(m_stacks_mutex);
+
+        if (queue_idx >= m_stacks.size())
+        {
+            m_stacks.resize(queue_idx + 1, nullptr);
+        }
+
+        auto& stack = m_stacks[queue_idx];
+        std::size_t size = std::size_t(num_threads) * stack_size * sizeof(std::uint32_t);
+
+        if (!stack || stack->GetSize() < size)
+        {
+            // Grow with some headroom to avoid reallocations on slowly growing batches
+            if (stack)
+            {
+                size = std::max(size, stack->GetSize() + stack->GetSize() / 2);
+                m_device->DeleteBuffer(stack);
+            }
+
+            if (m_max_stack_memory > 0)
+            {
+                size = std::max(std::min(size, m_max_stack_memory),
+                    std::size_t(num_threads) * stack_size * sizeof(std::uint32_t));
+            }
+
+            stack = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
+        }
+
+        return stack;
+    }
+
+    Calc::Buffer* Intersector::WriteCounter(std::uint32_t queue_idx, std::uint32_t num_rays) const
     {
+        std::lock_guard<std::mutex> lock(m_counters_mutex);
+
+        if (queue_idx >= m_counters.size())
+        {
+            m_counters.resize(queue_idx + 1);
+            m_next_counter.resize(queue_idx + 1, 0);
+        }
+
+        auto& counters = m_counters[queue_idx];
+
+        if (!counters)
+        {
+            counters.reset(new Counter[kNumCounters]);
+
+            for (std::size_t i = 0; i < kNumCounters; ++i)
+            {
+                counters[i].buffer = m_device->CreateBuffer(sizeof(std::uint32_t), Calc::BufferType::kRead);
+                counters[i].event = nullptr;
+                counters[i].value = 0;
+            }
+        }
+
+        auto& counter = counters[m_next_counter[queue_idx]];
+        m_next_counter[queue_idx] = (m_next_counter[queue_idx] + 1) % kNumCounters;
+
+        // Only blocks if the host is kNumCounters queries ahead of the device
+        if (counter.event)
+        {
+            counter.event->Wait();
+            m_device->DeleteEvent(counter.event);
+            counter.event = nullptr;
+        }
+
+        counter.value = num_rays;
+        m_device->WriteBuffer(counter.buffer, queue_idx, 0, sizeof(counter.value), &counter.value, &counter.event);
+
+        return counter.buffer;
     }
     
     void Intersector::SetWorld(World const &world)
     {
+        auto max_stack_memory = world.options_.GetOption("query.max_stack_memory");
+        m_max_stack_memory = max_stack_memory ?
+            static_cast<std::size_t>(max_stack_memory->AsFloat() * 1024 * 1024) : 0;
+
+        // Release stacks exceeding the limit, they are reallocated on demand
+        {
+            std::lock_guard<std::mutex> lock(m_stacks_mutex);
+            for (auto& stack : m_stacks)
+            {
+                if (stack && m_max_stack_memory > 0 && stack->GetSize() > m_max_stack_memory)
+                {
+                    m_device->DeleteBuffer(stack);
+                    stack = nullptr;
+                }
+            }
+        }
+
+        // Sorting and compaction rely on device parallel primitives
+        auto sort_rays = world.options_.GetOption("query.sort_rays");
+        if (sort_rays && sort_rays->AsFloat() > 0.f &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives())
+        {
+            bool update_bounds = !m_sorter || world.has_changed() ||
+                world.GetStateChange() != ShapeImpl::kStateChangeNone;
+
+            if (!m_sorter)
+            {
+                m_sorter.reset(new RaySorter(m_device));
+            }
+
+            if (update_bounds)
+            {
+                m_sorter->SetBounds(world.GetBounds());
+            }
+        }
+        else
+        {
+            m_sorter.reset();
+        }
+
+        auto compact_rays = world.options_.GetOption("query.compact_rays");
+        if (compact_rays && compact_rays->AsFloat() > 0.f &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives())
+        {
+            if (!m_compactor)
+            {
+                m_compactor.reset(new RayCompactor(m_device));
+            }
+        }
+        else
+        {
+            m_compactor.reset();
+        }
+
         Process(world);
     }
 
@@ -28,28 +216,169 @@ namespace RadeonRays
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
         Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Intersect(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        auto counter = WriteCounter(queue_idx, num_rays);
+        QueryIntersection(queue_idx, rays, counter, num_rays, hits, wait_event, event);
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
         Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Occluded(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        auto counter = WriteCounter(queue_idx, num_rays);
+        QueryOcclusion(queue_idx, rays, counter, num_rays, hits, wait_event, event);
     }
 
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        Query(queue_idx, rays, num_rays, max_rays, hits, wait_event, event, false);
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Occluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        Query(queue_idx, rays, num_rays, max_rays, hits, wait_event, event, true);
+    }
+
+    void Intersector::Query(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event, bool occlusion) const
+    {
+        bool compact = m_compactor && max_rays >= kMinReorderRays;
+        bool sort = m_sorter && max_rays >= kMinReorderRays;
+
+        // Every stage is enqueued into the same queue, so they run in order without events
+        Calc::Buffer const* query_rays = rays;
+        Calc::Buffer const* query_num_rays = num_rays;
+        Calc::Buffer* query_hits = hits;
+        Calc::Event const* query_wait_event = wait_event;
+
+        // Active rays go first, so the sort only reorders them
+        Calc::Buffer* live_hits = nullptr;
+        if (compact)
+        {
+            Calc::Buffer* live_rays = nullptr;
+            Calc::Buffer* num_live_rays = nullptr;
+            m_compactor->Compact(queue_idx, query_rays, query_num_rays, max_rays, query_wait_event, &live_rays, &num_live_rays, &live_hits);
+
+            query_rays = live_rays;
+            query_num_rays = num_live_rays;
+            query_hits = live_hits;
+            query_wait_event = nullptr;
+        }
+
+        Calc::Buffer const* sort_num_rays = query_num_rays;
+        Calc::Buffer* unsorted_hits = query_hits;
+        if (sort)
+        {
+            Calc::Buffer* sorted_rays = nullptr;
+            Calc::Buffer* sorted_hits = nullptr;
+            m_sorter->Sort(queue_idx, query_rays, query_num_rays, max_rays, query_wait_event, &sorted_rays, &sorted_hits);
+
+            query_rays = sorted_rays;
+            query_hits = sorted_hits;
+            query_wait_event = nullptr;
+        }
+
+        // The last stage signals the completion event
+        bool reordered = compact || sort;
+        if (occlusion)
+        {
+            Occluded(queue_idx, query_rays, query_num_rays, max_rays, query_hits, query_wait_event, reordered ? nullptr : event);
+        }
+        else
+        {
+            Intersect(queue_idx, query_rays, query_num_rays, max_rays, query_hits, query_wait_event, reordered ? nullptr : event);
+        }
+
+        if (sort)
+        {
+            if (occlusion)
+            {
+                m_sorter->ScatterOcclusion(queue_idx, sort_num_rays, max_rays, unsorted_hits, compact ? nullptr : event);
+            }
+            else
+            {
+                m_sorter->ScatterHits(queue_idx, sort_num_rays, max_rays, unsorted_hits, compact ? nullptr : event);
+            }
+        }
+
+        if (compact)
+        {
+            if (occlusion)
+            {
+                m_compactor->ScatterOcclusion(queue_idx, max_rays, hits, event);
+            }
+            else
+            {
+                m_compactor->ScatterHits(queue_idx, max_rays, hits, event);
+            }
+        }
+    }
+
+    bool Intersector::LoadBuffers(BvhCache::Entry const& entry,
+        std::vector<std::pair<std::uint32_t, Calc::Buffer**>> const& buffers) const
+    {
+        std::vector<std::pair<void const*, std::size_t>> sections;
+
+        for (auto const& buffer : buffers)
+        {
+            std::size_t size = 0;
+            auto data = entry.GetSection(buffer.first, size);
+            if (!data || size == 0)
+            {
+                return false;
+            }
+
+            sections.push_back(std::make_pair(data, size));
+        }
+
+        // Data is copied on creation, so the entry can be unmapped right after
+        for (auto i = 0u; i < buffers.size(); ++i)
+        {
+            *buffers[i].second = m_device->CreateBuffer(sections[i].second, Calc::BufferType::kRead,
+                const_cast<void*>(sections[i].first));
+        }
+
+        return true;
+    }
+
+    bool Intersector::StoreBuffers(BvhCache const& cache, std::uint64_t key,
+        std::vector<CachedBuffer> const& buffers) const
+    {
+        std::vector<BvhCache::Section> sections;
+        std::vector<Calc::Event*> events;
+
+        for (auto const& buffer : buffers)
+        {
+            void* data = nullptr;
+            Calc::Event* e = nullptr;
+            m_device->MapBuffer(buffer.buffer, 0, 0, buffer.size, Calc::MapType::kMapRead, &data, &e);
+
+            sections.push_back(BvhCache::Section{ buffer.type, data, buffer.size });
+            events.push_back(e);
+        }
+
+        for (auto e : events)
+        {
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+        events.clear();
+
+        auto result = cache.Store(key, sections);
+
+        for (auto i = 0u; i < buffers.size(); ++i)
+        {
+            Calc::Event* e = nullptr;
+            m_device->UnmapBuffer(buffers[i].buffer, 0, const_cast<void*>(sections[i].data), &e);
+            events.push_back(e);
+        }
+
+        for (auto e : events)
+        {
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+
+        return result;
     }
 }
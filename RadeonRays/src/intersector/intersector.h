@@ -31,13 +31,19 @@ THE SOFTWARE.
 #include "calc.h"
 #include "buffer.h"
 #include "event.h"
+#include "../accelerator/bvh_cache.h"
 
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 namespace RadeonRays
 {
     class World;
+    class RaySorter;
+    class RayCompactor;
 
     /** 
     \brief Intersector interface
@@ -55,7 +61,7 @@ namespace RadeonRays
         // which is going to be used by an intersector.
         Intersector(Calc::Device* device);
         // Destructor.
-        virtual ~Intersector() = default;
+        virtual ~Intersector();
 
         /** 
         \brief Check if the intersector is compatible with a given world.
@@ -154,10 +160,72 @@ namespace RadeonRays
             Calc::Event const *wait_event, Calc::Event **event) const = 0;
 
     protected: 
+        // Device buffer to store into the cache
+        struct CachedBuffer
+        {
+            std::uint32_t type;
+            Calc::Buffer* buffer;
+            std::size_t size;
+        };
+
+        // Create read only device buffers out of cache entry sections,
+        // nothing is created if some of the sections are missing
+        bool LoadBuffers(BvhCache::Entry const& entry,
+            std::vector<std::pair<std::uint32_t, Calc::Buffer**>> const& buffers) const;
+        // Read device buffers back and store them as cache entry sections
+        bool StoreBuffers(BvhCache const& cache, std::uint64_t key,
+            std::vector<CachedBuffer> const& buffers) const;
+
+        // Number of global stack entries a thread needs to traverse a tree of the given
+        // height, kernels keep block_size top entries in local memory and spill them as a block
+        static std::uint32_t CalcStackSize(int height, std::uint32_t block_size);
+        // Number of threads to run a query of max_rays rays with, so that their stacks of
+        // stack_size entries fit into the memory limit, threads loop over the rays if there
+        // are less of them. The result is a multiple of group_size.
+        std::uint32_t GetNumStackThreads(std::uint32_t max_rays, std::uint32_t stack_size, std::uint32_t group_size) const;
+        // Traversal stack of the queue for num_threads threads, the memory is kept
+        // between the queries and shared by intersection and occlusion ones
+        Calc::Buffer* GetStack(std::uint32_t queue_idx, std::uint32_t num_threads, std::uint32_t stack_size) const;
+
         // Device to use
         Calc::Device* m_device;
-        // Buffer holding ray count
-        std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>> m_counter;
+
+    private:
+        // Number of ray count buffers in flight per queue
+        static std::size_t const kNumCounters = 16;
+
+        // Ray count buffer written by a query
+        struct Counter
+        {
+            Calc::Buffer* buffer;
+            // Write of the count, host value has to live until it is complete
+            Calc::Event* event;
+            std::uint32_t value;
+        };
+
+        // Queries passing ray count from the host write it into the next counter
+        // of the queue ring. Queues execute in order, so the write can't overtake
+        // the query reusing the counter before and there is no need to drain
+        // the queue, we only wait for the write issued kNumCounters queries ago.
+        Calc::Buffer* WriteCounter(std::uint32_t queue_idx, std::uint32_t num_rays) const;
+
+        // Run the query compacting and sorting rays first if enabled
+        void Query(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event, bool occlusion) const;
+
+        mutable std::vector<std::unique_ptr<Counter[]>> m_counters;
+        mutable std::vector<std::size_t> m_next_counter;
+        mutable std::mutex m_counters_mutex;
+
+        // Traversal stacks per queue
+        mutable std::vector<Calc::Buffer*> m_stacks;
+        mutable std::mutex m_stacks_mutex;
+        // Stack memory limit in bytes, 0 if unlimited
+        std::size_t m_max_stack_memory;
+        // Reorders large batches before traversal if query.sort_rays is set
+        std::unique_ptr<RaySorter> m_sorter;
+        // Removes inactive rays from large batches if query.compact_rays is set
+        std::unique_ptr<RayCompactor> m_compactor;
     };
 }
 
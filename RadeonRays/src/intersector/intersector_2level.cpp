@@ -21,6 +21,8 @@ THE SOFTWARE.
 ********************************************************************/
 #include "intersector_2level.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/morton_bvh.h"
+#include "../accelerator/bvh_optimizer.h"
 #include "../translator/plain_bvh_translator.h"
 #include "../world/world.h"
 #include "../primitive/mesh.h"
@@ -30,8 +32,10 @@ THE SOFTWARE.
 #include "device.h"
 #include "executable.h"
 
+#include <algorithm>
 #include <memory>
-#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 static int const kWorkGroupSize = 64;
 
@@ -114,6 +118,18 @@ namespace RadeonRays
 
     struct IntersectorTwoLevel::CpuData
     {
+        // Meshes followed by instances, the order of bottom level BVHs
+        std::vector<Shape const*> shapes;
+        // Position of a shape in shapes, for meshes it is their BVH index as well
+        std::unordered_map<Shape const*, int> shape_index;
+        // Bottom level BVH index for each shape
+        std::vector<int> shape_bvhidx;
+        // Position of each shape's entry in shapedata (top level order)
+        std::vector<int> shapedata_idx;
+        // World space bounds of shapes the top level is built from
+        std::vector<bbox> object_bounds;
+        int nummeshes = 0;
+
         std::vector<int> mesh_vertices_start_idx;
         std::vector<int> mesh_faces_start_idx;
         std::vector<Bvh const*> bvhptrs;
@@ -178,487 +194,441 @@ namespace RadeonRays
 
     void IntersectorTwoLevel::Process(World const& world)
     {
-        // If something has been changed we need to rebuild BVH
-        int statechange = world.GetStateChange();
+        World::ChangeList changes;
+        world.GetChanges(changes);
 
-        // Full rebuild in case number of objects changes
-        if (m_bvhs.empty() || world.has_changed())
+        // Full rebuild in case number of objects or geometry changes
+        if (m_bvhs.empty() || world.has_changed() || (changes.statechange & ShapeImpl::kStateChangeVertices))
         {
-            if (!m_bvhs.empty())
-            {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
-                m_device->DeleteBuffer(m_gpudata->shapes);
-            }
+            Rebuild(world);
+        }
+        // Only transforms or ids have been changed: bottom level BVHs stay resident
+        else if (!changes.changed.empty())
+        {
+            UpdateTopLevel(world, changes.changed);
+        }
+    }
 
+    std::unique_ptr<Bvh> IntersectorTwoLevel::CreateBvh(World const& world, bool top_level) const
+    {
+        auto builder = world.options_.GetOption("bvh.builder");
+        auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+        auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+        auto mbits = world.options_.GetOption("bvh.lbvh.morton_bits");
+        auto leaf_size = world.options_.GetOption("bvh.max_leaf_size");
+
+        bool use_sah = false;
+        bool use_lbvh = false;
+        int morton_bits = mbits ? (int)mbits->AsFloat() : 63;
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        int max_leaf_size = leaf_size && !top_level ?
+            std::min((int)leaf_size->AsFloat(), PlainBvhTranslator::kMaxLeafPrimitives) : 1;
+
+
+        if (builder && builder->AsString() == "sah")
+        {
+            use_sah = true;
+        }
+        else if (builder && builder->AsString() == "lbvh")
+        {
+            use_lbvh = true;
+        }
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+        return use_lbvh ?
+            std::unique_ptr<Bvh>(new MortonBvh(traversal_cost, morton_bits)) :
+            std::make_unique<Bvh>(traversal_cost, num_bins, use_sah, max_leaf_size);
+    }
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+    void IntersectorTwoLevel::Rebuild(World const& world)
+    {
+        if (!m_bvhs.empty())
+        {
+            m_device->DeleteBuffer(m_gpudata->bvh);
+            m_device->DeleteBuffer(m_gpudata->vertices);
+            m_device->DeleteBuffer(m_gpudata->faces);
+            m_device->DeleteBuffer(m_gpudata->shapes);
+        }
 
+        // Copy the shapes here to be able to partition them and handle more efficiently
+        // #22: we need to be able to handle instances whos base shapes are not present 
+        // in the scene, so we have to add them manually here (once per base shape).
+        auto& shapes = m_cpudata->shapes;
+        std::unordered_set<Shape const*> shapes_disabled;
 
-            if (builder && builder->AsString() == "sah")
-            {
-                use_sah = true;
-            }
+        shapes.clear();
+        shapes.reserve(world.GetShapes().size());
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+        for (auto s : world.GetShapes())
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(s);
 
-            for (auto s : world.shapes_)
+            if (shapeimpl->is_instance())
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                // Here we know this is an instance, need to check if its base shape has been added as well
+                auto instance = static_cast<Instance const*>(shapeimpl);
+                auto base_shape = instance->GetBaseShape();
 
-                if (shapeimpl->is_instance())
+                if (!world.IsAttached(base_shape) && shapes_disabled.insert(base_shape).second)
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
-
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-                    {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
-                    }
+                    // Need to add the shape to the list, it is marked disabled
+                    shapes.push_back(base_shape);
                 }
-
-                shapes.push_back(s);
             }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
-
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
-
-            int numvertices = 0;
-            int numfaces = 0;
-
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
-            m_cpudata->mesh_faces_start_idx.resize(nummeshes);
-            m_cpudata->bvhptrs.resize(nummeshes + 1);
-            m_cpudata->shapedata.resize(nummeshes + numinstances);
-
-            // [0...numshapes-1] contain bottom level BVHs
-            // [numshapes] is the top level one
-            m_bvhs.resize(nummeshes + 1);
-            // Create actual BVH objects
-            for (int i = 0; i < nummeshes + 1; ++i)
-            {
-                m_bvhs[i] = std::make_unique<Bvh>(traversal_cost, num_bins, use_sah);
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
-            }
+            shapes.push_back(s);
+        }
 
-            // Prepare necessary offsets in the arrays
-            // in order to be able to parallelize
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+        // Now partition the range into meshes and instances
+        auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+        {
+            return !static_cast<ShapeImpl const*>(shape)->is_instance();
+        });
+
+        // Count the number of meshes
+        int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+        // Count the number of instances
+        int numinstances = (int)std::distance(firstinst, shapes.end());
+        int numshapes = nummeshes + numinstances;
+
+        int numvertices = 0;
+        int numfaces = 0;
+
+        // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+        m_cpudata->nummeshes = nummeshes;
+        m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
+        m_cpudata->mesh_faces_start_idx.resize(nummeshes);
+        m_cpudata->bvhptrs.resize(nummeshes + 1);
+        m_cpudata->shapedata.resize(numshapes);
+        m_cpudata->shapedata_idx.resize(numshapes);
+        m_cpudata->shape_bvhidx.resize(numshapes);
+        m_cpudata->object_bounds.resize(numshapes);
+
+        // Map shapes to their position, for meshes it is also the index of their BVH
+        m_cpudata->shape_index.clear();
+        m_cpudata->shape_index.reserve(numshapes);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            m_cpudata->shape_index[shapes[i]] = i;
+        }
 
-                m_cpudata->mesh_faces_start_idx[i] = numfaces;
-                m_cpudata->mesh_vertices_start_idx[i] = numvertices;
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            m_cpudata->shape_bvhidx[i] = i;
+        }
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
-            }
+        for (int i = nummeshes; i < numshapes; ++i)
+        {
+            auto instance = static_cast<Instance const*>(shapes[i]);
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            m_cpudata->bounds.resize(numfaces);
+            // It should be there
+            auto iter = m_cpudata->shape_index.find(instance->GetBaseShape());
 
-            // We are storing individual object bounds here to build top level BVH
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+            // TODO: should be assert
+            ThrowIf(iter == m_cpudata->shape_index.cend() || iter->second >= nummeshes, "Internal error");
 
-            matrix m, minv;
+            m_cpudata->shape_bvhidx[i] = iter->second;
+        }
 
-            // Handle simple shapes
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
+        // [0...numshapes-1] contain bottom level BVHs
+        // [numshapes] is the top level one
+        m_bvhs.resize(nummeshes + 1);
+        // Create actual BVH objects
+        for (int i = 0; i < nummeshes + 1; ++i)
+        {
+            m_bvhs[i] = CreateBvh(world, i == nummeshes);
+            m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+        }
 
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
+        // Prepare necessary offsets in the arrays
+        // in order to be able to parallelize
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    // Request bounds in object space since we build BVHs for objects locally
-                    mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
-                }
+            m_cpudata->mesh_faces_start_idx[i] = numfaces;
+            m_cpudata->mesh_vertices_start_idx[i] = numvertices;
 
-                // Build BVH for current mesh
-                m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
+            numfaces += mesh->num_faces();
+            numvertices += mesh->num_vertices();
+        }
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+        // We can't avoild allocating it here, since bounds aren't stored anywhere
+        m_cpudata->bounds.resize(numfaces);
 
-                // Collect BVH pointers for toip level build
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
-            }
+        // We are storing individual object bounds here to build top level BVH
+        auto& object_bounds = m_cpudata->object_bounds;
 
-            // Handle instances
+        // Handle simple shapes
 #pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+            for (int j = 0; j < mesh->num_faces(); ++j)
             {
+                // Request bounds in object space since we build BVHs for objects locally
+                mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
+            }
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
+            // Build BVH for current mesh
+            m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
+            BvhOptimizer::Process(world, *m_bvhs[i]);
+        }
 
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+        // Extract and store bounds. Note they are in object space and we need to translate them to world space
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            matrix m, minv;
+            shapes[i]->GetTransform(m, minv);
+            object_bounds[i] = transform_bbox(m_bvhs[m_cpudata->shape_bvhidx[i]]->Bounds(), m);
+        }
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+        // Calculate top level BVH
+        m_bvhs[nummeshes]->Build(&object_bounds[0], numshapes);
+        BvhOptimizer::Process(world, *m_bvhs[nummeshes]);
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+        m_cpudata->translator.Flush();
+        m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+        // Update GPU data
+        // Copy translated nodes first
+        m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
+        m_gpudata->bvhrootidx = m_cpudata->translator.root_;
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
-            }
+        // Create vertex buffer
+        {
+            // Vertices
+            m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
 
-            // Calculate top level BVH
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            // Get the pointer to mapped data
+            float3* vertexdata = nullptr;
+            Calc::Event* e = nullptr;
 
-            m_cpudata->translator.Flush();
-            // TODO: parallelize this
-            m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
+            m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
-            // Update GPU data
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
-            m_gpudata->bvhrootidx = m_cpudata->translator.root_;
+            e->Wait();
+            m_device->DeleteEvent(e);
 
-            // Create vertex buffer
+            // Vertices are kept in object space, transforms are applied during traversal
+#pragma omp parallel for
+            for (int i = 0; i < nummeshes; ++i)
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
-
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
-
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+                // Get the mesh
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                // Iterate thru vertices and append them to GPU buffer
+                for (int j = 0; j < mesh->num_vertices(); ++j)
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = myvertexdata[j];
-                    }
+                    vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = mesh->GetVertex(j);
                 }
-
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
             }
 
-            // Create face buffer
-            {
-                // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::kRead);
-
-                // Get the pointer to mapped data
-                Face* facedata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
-
-                // Here the point is to add mesh starting index to actual index contained within the mesh,
-                // getting absolute index in the buffer.
-                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
-                // is contained within bvh.primids_
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
-                {
-                    // Reordering indices for a given mesh
-                    int const* reordering = m_bvhs[i]->GetIndices();
-
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+            m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
-                    Mesh::Face const* myfaces = mesh->GetFaceData();
-
-                    int startidx = m_cpudata->mesh_vertices_start_idx[i];
-
-                    for (int j = 0; j < mesh->num_faces(); ++j)
-                    {
-                        // Copy face data to GPU buffer
-                        int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
-                        int faceidx = reordering[j];
-
-                        facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
-                        facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
-                        facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
 
-                        facedata[myidx].shape_id = mesh->GetId();
-                        facedata[myidx].prim_id = faceidx;
-                    }
-                }
+        // Create face buffer
+        {
+            // Create face buffer
+            m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::kRead);
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+            // Get the pointer to mapped data
+            Face* facedata = nullptr;
+            Calc::Event* e = nullptr;
 
-                e->Wait();
-                m_device->DeleteEvent(e);
-            }
+            m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
 
+            e->Wait();
+            m_device->DeleteEvent(e);
 
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            // Here the point is to add mesh starting index to actual index contained within the mesh,
+            // getting absolute index in the buffer.
+            // Besides that we need to permute the faces accorningly to BVH reordering, whihc
+            // is contained within bvh.primids_
 
 #pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
+            for (int i = 0; i < nummeshes; ++i)
             {
+                // Reordering indices for a given mesh
+                int const* reordering = m_bvhs[i]->GetIndices();
+
                 // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
+                int startidx = m_cpudata->mesh_vertices_start_idx[i];
 
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
-                {
-                    m_cpudata->shapedata[i].shapeDisabled = 0;
-                }
-                else
+                for (int j = 0; j < mesh->num_faces(); ++j)
                 {
-                    m_cpudata->shapedata[i].shapeDisabled = 1;
-                }
+                    // Copy face data to GPU buffer
+                    int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
+                    int faceidx = reordering[j];
+                    Mesh::Face face = mesh->GetFace(faceidx);
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+                    facedata[myidx].idx[0] = face.idx[0] + startidx;
+                    facedata[myidx].idx[1] = face.idx[1] + startidx;
+                    facedata[myidx].idx[2] = face.idx[2] + startidx;
 
-                if (!shapeimpl->is_instance())
-                {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
+                    facedata[myidx].shape_id = mesh->GetId();
+                    facedata[myidx].prim_id = faceidx;
                 }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
-
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            }
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+            m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
-            }
+        // Now we need to collect shapdata
+        int const* topindices = m_bvhs[nummeshes]->GetIndices();
 
-            // Create face ID buffer
-            m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
-        }
-        // Refit
-        else if (statechange != ShapeImpl::kStateChangeNone)
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
         {
-            //std::cout << "Refit\n";
+            // Get the mesh
+            ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+            auto& data = m_cpudata->shapedata[i];
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+            data.id = shapeimpl->GetId();
 
-            for (auto s : world.shapes_)
-            {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+            // For disabled shapes force mask to zero since these shapes 
+            // present only virtually (they have not been added to the scene)
+            // and we need to skip them while doing traversal.
+            data.shapeDisabled = shapes_disabled.find(shapeimpl) == shapes_disabled.cend() ? 0 : 1;
 
-                if (shapeimpl->is_instance())
-                {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
-
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-                    {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
-                    }
-                }
+            matrix m;
+            shapeimpl->GetTransform(m, data.minv);
 
-                shapes.push_back(s);
-            }
+            data.bvhidx = m_cpudata->translator.roots_[m_cpudata->shape_bvhidx[topindices[i]]];
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
+            // Remember where the shape went to update it in place later
+            m_cpudata->shapedata_idx[topindices[i]] = i;
+        }
 
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+        // Create face ID buffer
+        m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+    }
 
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+    void IntersectorTwoLevel::UpdateTopLevel(World const& world, std::vector<Shape const*> const& changed)
+    {
+        auto& cpudata = *m_cpudata;
+        int nummeshes = cpudata.nummeshes;
+        int numshapes = (int)cpudata.shapes.size();
+        int numchanged = (int)changed.size();
 
-            matrix m, minv;
+        // Positions of the changed entries in shapedata
+        std::vector<int> changed_idx(numchanged, -1);
 
-            // Go over meshes and rebuild BVH bounds
 #pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
-            }
+        for (int i = 0; i < numchanged; ++i)
+        {
+            auto iter = cpudata.shape_index.find(changed[i]);
 
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            // Attached shapes are all there, this is just a safety net
+            if (iter == cpudata.shape_index.cend())
             {
+                continue;
+            }
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
-
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            int shapeidx = iter->second;
+            int dataidx = cpudata.shapedata_idx[shapeidx];
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+            matrix m;
+            auto& data = cpudata.shapedata[dataidx];
+            changed[i]->GetTransform(m, data.minv);
+            data.id = changed[i]->GetId();
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            // Bottom level BVHs are resident, only world space bounds of the shape change
+            cpudata.object_bounds[shapeidx] = transform_bbox(m_bvhs[cpudata.shape_bvhidx[shapeidx]]->Bounds(), m);
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            changed_idx[i] = dataidx;
+        }
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
-            }
+        std::vector<Calc::Event*> events;
 
-            // Calculate top level BVH
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+        auto refit = world.options_.GetOption("bvh.refit");
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        if (refit && refit->AsFloat() > 0.f)
+        {
+            // Topology of the top level BVH is kept, so are the positions of
+            // the shapes in shapedata and only changed entries need to be uploaded
+            auto& top = *m_bvhs[nummeshes];
+            top.Refit(&cpudata.object_bounds[0], numshapes);
 
+            std::vector<std::pair<int, int>> ranges;
+            cpudata.translator.UpdateBounds(top, cpudata.translator.root_, ranges);
 
-            if (builder && builder->AsString() == "sah")
+            for (auto const& range : ranges)
             {
-                use_sah = true;
+                Calc::Event* e = nullptr;
+                m_device->WriteBuffer(m_gpudata->bvh, 0, range.first * sizeof(PlainBvhTranslator::Node), (range.second - range.first) * sizeof(PlainBvhTranslator::Node), (char*)&cpudata.translator.nodes_[range.first], &e);
+                events.push_back(e);
             }
 
-            m_bvhs[nummeshes] = std::make_unique<Bvh>(traversal_cost, num_bins, use_sah);
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            // Merge changed entries into ranges, small gaps are uploaded
+            // along to avoid issuing a write per shape
+            int const kMaxGap = 32;
 
+            changed_idx.erase(std::remove(changed_idx.begin(), changed_idx.end(), -1), changed_idx.end());
+            std::sort(changed_idx.begin(), changed_idx.end());
 
-            // TODO: parallelize this
-            m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
-
-            // Update GPU data
-            // Copy only top BVH data
-            Calc::Event* e = nullptr;
-            m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * (nummeshes + numinstances) - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
-
-            e->Wait();
-            m_device->DeleteEvent(e);
-
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
-
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
+            for (auto i = 0u; i < changed_idx.size();)
             {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+                int first = changed_idx[i];
+                int last = first + 1;
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+                for (++i; i < changed_idx.size() && changed_idx[i] - last <= kMaxGap; ++i)
                 {
-                    m_cpudata->shapedata[i].shapeDisabled = 0;
+                    last = changed_idx[i] + 1;
                 }
-                else
-                {
-                    m_cpudata->shapedata[i].shapeDisabled = 1;
-                }
-
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
 
-                if (!shapeimpl->is_instance())
-                {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
-                }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
-
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                Calc::Event* e = nullptr;
+                m_device->WriteBuffer(m_gpudata->shapes, 0, first * sizeof(ShapeData), (last - first) * sizeof(ShapeData), (char*)&cpudata.shapedata[first], &e);
+                events.push_back(e);
+            }
+        }
+        else
+        {
+            // Rebuild top level BVH only
+            m_bvhs[nummeshes] = CreateBvh(world, true);
+            m_bvhs[nummeshes]->Build(&cpudata.object_bounds[0], numshapes);
+            BvhOptimizer::Process(world, *m_bvhs[nummeshes]);
+            cpudata.bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+            // The number of top level nodes is the same, so it fits in place
+            cpudata.translator.UpdateTopLevel(*m_bvhs[nummeshes]);
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            Calc::Event* e = nullptr;
+            int root = cpudata.translator.root_;
+            m_device->WriteBuffer(m_gpudata->bvh, 0, root * sizeof(PlainBvhTranslator::Node), (cpudata.translator.nodes_.size() - root) * sizeof(PlainBvhTranslator::Node), (char*)&cpudata.translator.nodes_[root], &e);
+            events.push_back(e);
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            // Shapes are ordered by top level leaves, so permute them to the new order
+            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            std::vector<ShapeData> shapedata(numshapes);
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
+#pragma omp parallel for
+            for (int i = 0; i < numshapes; ++i)
+            {
+                shapedata[i] = cpudata.shapedata[cpudata.shapedata_idx[topindices[i]]];
+                cpudata.shapedata_idx[topindices[i]] = i;
             }
 
-            // Create face ID buffer
-            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, (nummeshes + numinstances) * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+            cpudata.shapedata.swap(shapedata);
+
+            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numshapes * sizeof(ShapeData), (char*)&cpudata.shapedata[0], &e);
+            events.push_back(e);
+        }
 
+        for (auto e : events)
+        {
             e->Wait();
             m_device->DeleteEvent(e);
-
-            m_device->Finish(0);
         }
     }
 
@@ -681,7 +651,7 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 
     void IntersectorTwoLevel::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -703,6 +673,6 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 }
@@ -59,6 +59,7 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     class Bvh;
+    class Shape;
 
     /** 
     \brief Intersector implementation using 2-level skip links BVH
@@ -81,6 +82,15 @@ namespace RadeonRays
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
 
+        // Create BVH according to builder options,
+        // top level leaves always reference a single shape
+        std::unique_ptr<Bvh> CreateBvh(World const& world, bool top_level) const;
+        // Rebuild all the BVHs and upload the whole scene
+        void Rebuild(World const& world);
+        // Rebuild or refit top level BVH after transforms of the shapes have been changed,
+        // bottom level BVHs are kept resident
+        void UpdateTopLevel(World const& world, std::vector<Shape const*> const& changed);
+
     private:
         // Gpu data
         struct GpuData;
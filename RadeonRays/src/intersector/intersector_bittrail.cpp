@@ -24,7 +24,9 @@
 #include "calc.h"
 #include "executable.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/bvh_optimizer.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/morton_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
@@ -147,7 +149,7 @@ namespace RadeonRays
                 m_device->DeleteBuffer(m_gpudata->vertices);
             }
 
-            int numshapes = (int)world.shapes_.size();
+            int numshapes = (int)world.GetShapes().size();
             int numvertices = 0;
             int numfaces = 0;
 
@@ -162,10 +164,13 @@ namespace RadeonRays
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
             auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
             auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            auto mbits = world.options_.GetOption("bvh.lbvh.morton_bits");
 
 
             bool use_sah = false;
             bool use_splits = false;
+            bool use_lbvh = false;
+            int morton_bits = mbits ? (int)mbits->AsFloat() : 63;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             int num_bins = nbins ? (int)nbins->AsFloat() : 64;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
@@ -176,19 +181,31 @@ namespace RadeonRays
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
                 use_splits = true;
             }
 
-            m_bvh.reset(use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
-            );
+            if (use_splits)
+            {
+                m_bvh.reset(new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget));
+            }
+            else if (use_lbvh)
+            {
+                m_bvh.reset(new MortonBvh(traversal_cost, morton_bits));
+            }
+            else
+            {
+                m_bvh.reset(new Bvh(traversal_cost, num_bins, use_sah));
+            }
 
             // Partition the array into meshes and instances
-            std::vector<Shape const*> shapes(world.shapes_);
+            std::vector<Shape const*> shapes(world.GetShapes());
 
             auto firstinst = std::partition(shapes.begin(), shapes.end(),
                 [&](Shape const* shape)
@@ -264,6 +281,9 @@ namespace RadeonRays
 
             m_bvh->Build(&bounds[0], numfaces);
 
+            // Restructure the tree within the time budget
+            BvhOptimizer::Process(world, *m_bvh);
+
             FatNodeBvhTranslator translator;
             translator.Process(*m_bvh);
 
@@ -290,8 +310,6 @@ namespace RadeonRays
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     mesh->GetTransform(m, minv);
 
@@ -299,7 +317,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -309,8 +327,6 @@ namespace RadeonRays
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     instance->GetTransform(m, minv);
 
@@ -318,7 +334,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -361,17 +377,16 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    Mesh::Face face = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].id = faceidx;
@@ -420,7 +435,7 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 
     void IntersectorBitTrail::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -442,6 +457,6 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 }
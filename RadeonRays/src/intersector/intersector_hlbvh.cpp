@@ -24,20 +24,33 @@ THE SOFTWARE.
 #include "../accelerator/hlbvh.h"
 #include "../primitive/mesh.h"
 #include "../world/world.h"
-#include "../translator/plain_bvh_translator.h"
-
 
 #include "device.h"
 #include "executable.h"
 #include "../except/except.h"
 
 #include <algorithm>
+#include <cstring>
 #include <memory>
 
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "kernels_cl.h"
+#endif
+#if USE_VULKAN
+#    include "kernels_vk.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
-static int const kMaxStackSize = 48;
-static int const kMaxBatchSize = 2048 * 2048;
+// Stack entries kept in local memory by OpenCL kernels
+static std::uint32_t const kShortStackSize = 16;
+// LBVH depth is bounded by the Morton code length plus
+// the bits of primitive index used to split equal codes
+static int const kMaxTreeHeight = 64;
+// Global stack entries per ray of Vulkan kernels, they are compile time constants there
+static std::uint32_t const kVulkanStackSize = 48;
 
 namespace RadeonRays
 {
@@ -49,8 +62,9 @@ namespace RadeonRays
         Calc::Buffer* vertices;
         // Indices
         Calc::Buffer* faces;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Number of vertices and faces the buffers have space for
+        int vertices_capacity;
+        int faces_capacity;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
@@ -60,6 +74,11 @@ namespace RadeonRays
             : device(d)
             , vertices(nullptr)
             , faces(nullptr)
+            , vertices_capacity(0)
+            , faces_capacity(0)
+            , executable(nullptr)
+            , isect_func(nullptr)
+            , occlude_func(nullptr)
         {
         }
 
@@ -67,7 +86,6 @@ namespace RadeonRays
         {
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
-            device->DeleteBuffer(stack);
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
             device->DeleteExecutable(executable);
@@ -117,7 +135,7 @@ namespace RadeonRays
 #if USE_VULKAN
         if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_build_vulkan, std::strlen(g_hlbvh_vulkan), buildopts.c_str());
+            m_gpudata->executable = m_device->CompileExecutable(g_hlbvh_vulkan, std::strlen(g_hlbvh_vulkan), buildopts.c_str());
         }
 #endif
 
@@ -129,287 +147,200 @@ namespace RadeonRays
 
     void IntersectorHlbvh::Process(World const& world)
     {
-        // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed())
+        int statechange = world.GetStateChange();
+
+        // Nothing to do if the scene is the same
+        if (m_bvh && !world.has_changed() && statechange == ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
-            {
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
-                m_device->DeleteBuffer(m_gpudata->stack);
-            }
-            
-            int numshapes = (int)world.shapes_.size();
-            int numvertices = 0;
-            int numfaces = 0;
+            return;
+        }
+
+        // Topology is the same for vertex and transform changes, so the hierarchy can be refitted,
+        // the build is fast enough to be repeated every frame otherwise
+        auto refit_option = world.options_.GetOption("bvh.refit");
+        bool refit = m_bvh && !world.has_changed() &&
+            refit_option && refit_option->AsFloat() > 0.f &&
+            (statechange & ~ShapeImpl::kStateChangeRefitMask) == 0;
+
+        // Faces reference shape ids, so they only change with the shape set or ids
+        bool update_faces = !m_bvh || world.has_changed() || (statechange & ShapeImpl::kStateChangeId) != 0;
+
+        auto const& shapes = world.GetShapes();
+        int numshapes = (int)shapes.size();
+        int numvertices = 0;
+        int numfaces = 0;
 
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            std::vector<int> mesh_vertices_start_idx(numshapes);
-            std::vector<int> mesh_faces_start_idx(numshapes);
+        // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+        std::vector<int> mesh_faces_start_idx(numshapes);
 
-            //
+        // The structure lives across frames, reusing its device memory
+        if (!m_bvh)
+        {
             m_bvh = std::make_unique<Hlbvh>(m_device);
+        }
 
-            // Here we now that only Meshes are present, otherwise 2level strategy would have been used
-            for (int i = 0; i < numshapes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+        // Here we now that only Meshes are present, otherwise 2level strategy would have been used
+        for (int i = 0; i < numshapes; ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                mesh_faces_start_idx[i] = numfaces;
-                mesh_vertices_start_idx[i] = numvertices;
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_vertices_start_idx[i] = numvertices;
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
-            }
+            numfaces += mesh->num_faces();
+            numvertices += mesh->num_vertices();
+        }
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+        // We can't avoid allocating it here, since bounds aren't stored anywhere
+        std::vector<bbox> bounds(numfaces);
 
 #pragma omp parallel for
-            for (int i = 0; i < numshapes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+        for (int i = 0; i < numshapes; ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                // Here we directly get world space bounds
+                mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
             }
+        }
 
+        if (refit)
+        {
+            m_bvh->Refit(&bounds[0], numfaces);
+        }
+        else
+        {
             m_bvh->Build(&bounds[0], numfaces);
+        }
 
-            // Create vertex buffer
+        // Update vertex buffer
+        {
+            // Vertices, the buffer is reused while it is large enough
+            if (numvertices > m_gpudata->vertices_capacity)
             {
-                // Vertices
+                m_device->DeleteBuffer(m_gpudata->vertices);
                 m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_gpudata->vertices_capacity = numvertices;
+            }
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+            // Get the pointer to mapped data
+            float3* vertexdata = nullptr;
+            Calc::Event* e = nullptr;
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+            m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+            e->Wait();
+            m_device->DeleteEvent(e);
 
+            // Here we need to put data in world space rather than object space
+            // So we need to get the transform from the mesh and multiply each vertex
 #pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
-                {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
-                }
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e); 
-
-                e->Wait();
-                m_device->DeleteEvent(e);
-            }
-
-
-                // Create face buffer
+            for (int i = 0; i < numshapes; ++i)
             {
-                struct Face
-                {
-                    // Up to 3 indices
-                    int idx[3];
-                    // Shape ID
-                    int shape_id;
-                    // Primitive ID
-                    int prim_id;
-                };
-
-                // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
-
-                // Get the pointer to mapped data
-                Face* facedata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
+                // Get the mesh
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                // Get mesh transform
+                matrix m, minv;
+                mesh->GetTransform(m, minv);
 
-                // Here the point is to add mesh starting index to actual index contained within the mesh,
-                // getting absolute index in the buffer.
-                // Besides that we need to permute the faces accorningly to BVH reordering, whihc
-                // is contained within bvh.primids_
-                for (int i = 0; i < numfaces; ++i)
+                // Iterate thru vertices multiply and append them to GPU buffer
+                for (int j = 0; j < mesh->num_vertices(); ++j)
                 {
-                    int indextolook4 = i;
-
-                    // We need to find a shape corresponding to current face
-                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
-
-                    // Find the index of the shape
-                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
-
-                    // Get the mesh directly or out of instance
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[shapeidx]);
-
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
-                    // Find face idx
-                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
-                    // Find mesh start idx
-                    int mystartidx = mesh_vertices_start_idx[shapeidx];
-
-                    // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
-
-                    // Optimization: we are putting faceid here
-                    facedata[i].shape_id = mesh->GetId();
-                    facedata[i].prim_id = faceidx;
+                    vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                 }
-
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
-                e->Wait();
-                m_device->DeleteEvent(e);
             }
 
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
-            // Make sure everything is commited
-            m_device->Finish(0);
-        }
-        else if (world.GetStateChange() != ShapeImpl::kStateChangeNone)
-        {
-            int numshapes = (int)world.shapes_.size();
-            int numvertices = 0;
-            int numfaces = 0;
-
-            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
-            std::vector<int> mesh_vertices_start_idx(numshapes);
-            std::vector<int> mesh_faces_start_idx(numshapes);
+            m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
-            //
-            //bvh_.reset(new Hlbvh(context_));
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
 
-            // Here we now that only Meshes are present, otherwise 2level strategy would have been used
-            for (int i = 0; i < numshapes; ++i)
+        // Update face buffer, faces are not reordered by the build
+        if (update_faces)
+        {
+            struct Face
+            {
+                // Up to 3 indices
+                int idx[3];
+                // Shape ID
+                int shape_id;
+                // Primitive ID
+                int prim_id;
+            };
+
+            if (numfaces > m_gpudata->faces_capacity)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+                m_device->DeleteBuffer(m_gpudata->faces);
+                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
+                m_gpudata->faces_capacity = numfaces;
+            }
 
-                mesh_faces_start_idx[i] = numfaces;
-                mesh_vertices_start_idx[i] = numvertices;
+            // Get the pointer to mapped data
+            Face* facedata = nullptr;
+            Calc::Event* e = nullptr;
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
-            }
+            m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            e->Wait();
+            m_device->DeleteEvent(e);
 
+            // Here the point is to add mesh starting index to actual index contained within the mesh,
+            // getting absolute index in the buffer.
 #pragma omp parallel for
             for (int i = 0; i < numshapes; ++i)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                // Find mesh start idx
+                int mystartidx = mesh_vertices_start_idx[i];
 
                 for (int j = 0; j < mesh->num_faces(); ++j)
                 {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
-            }
-
-            m_bvh->Build(&bounds[0], numfaces);
-
-            // Create vertex buffer
-            {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                    Mesh::Face face = mesh->GetFace(j);
+                    auto& dst = facedata[mesh_faces_start_idx[i] + j];
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
-
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+                    // Copy face data to GPU buffer
+                    dst.idx[0] = face.idx[0] + mystartidx;
+                    dst.idx[1] = face.idx[1] + mystartidx;
+                    dst.idx[2] = face.idx[2] + mystartidx;
 
-#pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
-                {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    // Optimization: we are putting faceid here
+                    dst.shape_id = mesh->GetId();
+                    dst.prim_id = j;
                 }
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-
-                e->Wait();
-                m_device->DeleteEvent(e);
             }
+
+            m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
         }
-    }
 
+        // Make sure everything is commited
+        m_device->Finish(0);
+    }
 
     void IntersectorHlbvh::Intersect(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
     {
-        // Check if we can allocate enough stack memory
-        if (max_rays >= kMaxBatchSize)
-        {
-            throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
-        }
-
-        auto& func = m_gpudata->isect_func;
-
-        // Set args
-        int arg = 0;
-
-        func->SetArg(arg++, m_bvh->GetGpuData().nodes);
-        func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, m_gpudata->faces);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
-
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+        Traverse(m_gpudata->isect_func, queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
     }
 
-    void IntersectorHlbvh::Occluded(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    void IntersectorHlbvh::Occluded(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
     {
-        // Check if we can allocate enough stack memory
-        if (max_rays >= kMaxBatchSize)
-        {
-            throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
-        }
+        Traverse(m_gpudata->occlude_func, queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
 
-        auto& func = m_gpudata->occlude_func;
+    void IntersectorHlbvh::Traverse(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        // OpenCL kernels loop over the rays, so the batch can be tiled to fit stack memory limit
+        bool can_tile = m_device->GetPlatform() == Calc::Platform::kOpenCL;
+        auto stack_size = can_tile ? CalcStackSize(kMaxTreeHeight, kShortStackSize) : kVulkanStackSize;
+        auto num_threads = can_tile ? GetNumStackThreads(max_rays, stack_size, kWorkGroupSize) :
+            ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        auto stack = GetStack(queue_idx, num_threads, stack_size);
 
         // Set args
         int arg = 0;
@@ -420,13 +351,16 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+        if (can_tile)
+        {
+            func->SetArg(arg++, sizeof(stack_size), &stack_size);
+        }
         func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        size_t globalsize = num_threads;
 
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+        m_device->Execute(func, queue_idx, globalsize, localsize, wait_event, event);
     }
-
 }
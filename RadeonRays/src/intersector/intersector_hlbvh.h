@@ -38,7 +38,8 @@ THE SOFTWARE.
 
 
     Intersector is using simple stack-based traversal method. Acceleration structure is built 
-    on GPU.
+    on GPU and kept between commits, it is rebuilt on every change or refitted
+    for vertex and transform changes if "bvh.refit" option is set.
 
     Pros:
         -Very fast to build and update.
@@ -72,6 +73,10 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Run traversal kernel sizing its stack memory
+        void Traverse(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const;
 
     private:
         struct GpuData;
@@ -24,16 +24,24 @@ THE SOFTWARE.
 #include "calc.h"
 #include "executable.h"
 #include "../accelerator/bvh2.h"
+#include "../accelerator/bvh_optimizer.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../translator/q_bvh_translator.h"
+#include "../translator/wide_bvh_translator.h"
 #include "../world/world.h"
 
 namespace RadeonRays
 {
     // Preferred work group size for Radeon devices
-    static int const kMaxStackSize  = 48;
     static int const kWorkGroupSize = 64;
+    // Stack entries kept in local memory by OpenCL kernels
+    static std::uint32_t const kLdsStackSize = 16;
+    // Stack entries per ray of Vulkan kernels, they are compile time constants there
+    static std::uint32_t const kVulkanStackSize = 32;
+    // Quantized child boxes may cover this much more surface area than fp32 ones
+    // in total, otherwise extra node visits outweigh halved node size
+    static float const kMaxQBvhAreaRatio = 1.1f;
 
     struct IntersectorLDS::GpuData
     {
@@ -68,30 +76,59 @@ namespace RadeonRays
         Calc::Device *device;
         // BVH nodes
         Calc::Buffer *bvh;
-        // Traversal stack
-        Calc::Buffer *stack;
+        // Leaf triangles of wide BVH
+        Calc::Buffer *triangles;
+        // Traversal stack entries per thread
+        std::uint32_t stack_size;
 
         Program *prog;
         Program bvh_prog;
         Program qbvh_prog;
+        // Wide BVH program is compiled on demand for the requested width
+        std::unique_ptr<Program> wide_prog;
+        std::uint32_t wide_width;
+        // Kernel build options
+        std::string buildopts;
 
         GpuData(Calc::Device *device)
             : device(device)
             , bvh(nullptr)
-            , stack(nullptr)
+            , triangles(nullptr)
+            , stack_size(kVulkanStackSize)
             , prog(nullptr)
             , bvh_prog(device)
             , qbvh_prog(device)
+            , wide_width(0)
         {
         }
 
         ~GpuData()
         {
             device->DeleteBuffer(bvh);
-            device->DeleteBuffer(stack);
+
+            if (triangles)
+            {
+                device->DeleteBuffer(triangles);
+            }
         }
     };
 
+    // Collapse the tree and upload wide nodes and triangles, returns tree height
+    template <std::uint32_t Width>
+    static int UploadWideBvh(Calc::Device *device, const Bvh2 &bvh, Calc::Buffer *&nodes, Calc::Buffer *&triangles)
+    {
+        WideBvhTranslator<Width> translator;
+        translator.Process(bvh);
+
+        using Translator = WideBvhTranslator<Width>;
+        nodes = device->CreateBuffer(translator.nodes_.size() * sizeof(typename Translator::Node),
+            Calc::BufferType::kRead, translator.nodes_.data());
+        triangles = device->CreateBuffer(translator.triangles_.size() * sizeof(typename Translator::Triangle),
+            Calc::BufferType::kRead, translator.triangles_.data());
+
+        return translator.GetHeight();
+    }
+
     IntersectorLDS::IntersectorLDS(Calc::Device *device)
         : Intersector(device)
         , m_gpudata(new GpuData(device))
@@ -109,6 +146,8 @@ namespace RadeonRays
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+        m_gpudata->buildopts = buildopts;
+
         Calc::DeviceSpec spec;
         m_device->GetSpec(spec);
 
@@ -127,8 +166,6 @@ namespace RadeonRays
         {
             assert(device->GetPlatform() == Calc::Platform::kVulkan);
             m_gpudata->bvh_prog.executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/bvh2.comp", nullptr, 0, buildopts.c_str());
-            if (spec.has_fp16)
-                m_gpudata->qbvh_prog.executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/bvh2_fp16.comp", nullptr, 0, buildopts.c_str());
         }
 #else
 #if USE_OPENCL
@@ -144,8 +181,6 @@ namespace RadeonRays
         {
             if (m_gpudata->bvh_prog.executable == nullptr)
                 m_gpudata->bvh_prog.executable = m_device->CompileExecutable(g_bvh2_vulkan, std::strlen(g_bvh2_vulkan), buildopts.c_str());
-            if (m_gpudata->qbvh_prog.executable == nullptr && spec.has_fp16)
-                m_gpudata->qbvh_prog.executable = m_device->CompileExecutable(g_bvh2_fp16_vulkan, std::strlen(g_bvh2_fp16_vulkan), buildopts.c_str());
         }
 #endif
 #endif
@@ -160,33 +195,114 @@ namespace RadeonRays
         }
     }
 
+    void IntersectorLDS::CompileWideProgram(std::uint32_t width)
+    {
+        if (m_gpudata->wide_prog && m_gpudata->wide_width == width)
+        {
+            return;
+        }
+
+        std::unique_ptr<GpuData::Program> prog(new GpuData::Program(m_device));
+        std::string buildopts = m_gpudata->buildopts + "-D BVH_WIDTH=" + std::to_string(width) + " ";
+
+#ifndef RR_EMBED_KERNELS
+        const char *headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(const char *);
+
+        prog->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_wide_bvh.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        prog->executable = m_device->CompileExecutable(g_intersect_wide_bvh_opencl, std::strlen(g_intersect_wide_bvh_opencl), buildopts.c_str());
+#endif
+#endif
+
+        prog->isect_func = prog->executable->CreateFunction("intersect_main");
+        prog->occlude_func = prog->executable->CreateFunction("occluded_main");
+
+        m_gpudata->wide_prog = std::move(prog);
+        m_gpudata->wide_width = width;
+    }
+
     void IntersectorLDS::Process(const World &world)
     {
+        int statechange = world.GetStateChange();
+
         // If something has been changed we need to rebuild BVH
-        if (!m_gpudata->bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || statechange != ShapeImpl::kStateChangeNone)
         {
+            // Vertex and transform changes keep the topology valid, so the BVH can be refitted
+            auto refit_option = world.options_.GetOption("bvh.refit");
+            bool refit = m_bvh && m_gpudata->bvh && !world.has_changed() &&
+                m_gpudata->prog == &m_gpudata->bvh_prog &&
+                refit_option && refit_option->AsFloat() > 0.f &&
+                (statechange & ~ShapeImpl::kStateChangeRefitMask) == 0;
+
+            if (refit)
+            {
+                std::vector<Bvh2::NodeRange> changed_nodes;
+                m_bvh->Refit(world.GetShapes().begin(), world.GetShapes().end(), changed_nodes);
+
+                // Upload changed nodes only
+                std::vector<Calc::Event*> events;
+                for (auto const& range : changed_nodes)
+                {
+                    Calc::Event *e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->bvh, 0,
+                        range.first * sizeof(Bvh2::Node),
+                        (range.second - range.first) * sizeof(Bvh2::Node),
+                        &m_bvh->m_nodes[range.first], &e);
+                    events.push_back(e);
+                }
+
+                for (auto e : events)
+                {
+                    e->Wait();
+                    m_device->DeleteEvent(e);
+                }
+
+                return;
+            }
+
             // Free previous data
             if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
             }
 
+            if (m_gpudata->triangles)
+            {
+                m_device->DeleteBuffer(m_gpudata->triangles);
+                m_gpudata->triangles = nullptr;
+            }
+
             // Look up build options for world
             auto type = world.options_.GetOption("bvh.type");
             auto builder = world.options_.GetOption("bvh.builder");
             auto nbins = world.options_.GetOption("bvh.sah.num_bins");
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+            auto width = world.options_.GetOption("bvh.width");
 
             bool use_qbvh = false, use_sah = false;
             int num_bins = (nbins ? static_cast<int>(nbins->AsFloat()) : 64);
             float traversal_cost = (tcost ? tcost->AsFloat() : 10.0f);
 
-#if 0
+            // Quantized nodes are only used by OpenCL devices with fp16 support,
+            // others fall back to fp32 nodes
             if (type && type->AsString() == "qbvh")
             {
                 use_qbvh = (m_gpudata->qbvh_prog.executable != nullptr);
             }
-#endif
+
+            // Wide nodes are only traversed by OpenCL kernels and take precedence over quantized binary ones
+            std::uint32_t num_children = width ? static_cast<std::uint32_t>(width->AsFloat()) : 2u;
+            bool use_wide = (num_children == 4 || num_children == 8) &&
+                m_device->GetPlatform() == Calc::Platform::kOpenCL;
+
+            if (use_wide)
+            {
+                use_qbvh = false;
+            }
 
             if (builder && builder->AsString() == "sah")
             {
@@ -194,8 +310,68 @@ namespace RadeonRays
             }
 
             // Create the bvh
-            Bvh2 bvh(traversal_cost, num_bins, use_sah);
-            bvh.Build(world.shapes_.begin(), world.shapes_.end());
+            m_bvh.reset(new Bvh2(traversal_cost, num_bins, use_sah));
+            auto& bvh = *m_bvh;
+
+            // Flat nodes are shared with the native device, so they are cached under the same tag
+            BvhCache cache(world);
+            std::uint64_t key = 0;
+            bool cached = false;
+
+            if (cache.IsEnabled())
+            {
+                key = BvhCache::CalcKey(world, "bvh2", { "bvh.builder", "bvh.sah.num_bins", "bvh.sah.traversal_cost", "bvh.optimize.ms" });
+
+                auto entry = cache.Load(key);
+                cached = entry && bvh.Load(*entry);
+            }
+
+            if (!cached)
+            {
+                bvh.Build(world.GetShapes().begin(), world.GetShapes().end());
+
+                // Restructure the tree within the time budget
+                BvhOptimizer::Process(world, bvh);
+
+                if (cache.IsEnabled())
+                {
+                    bvh.Store(cache, key);
+                }
+            }
+
+            if (use_wide)
+            {
+                CompileWideProgram(num_children);
+
+                int height = num_children == 4 ?
+                    UploadWideBvh<4>(m_device, bvh, m_gpudata->bvh, m_gpudata->triangles) :
+                    UploadWideBvh<8>(m_device, bvh, m_gpudata->bvh, m_gpudata->triangles);
+
+                // Each level defers up to num_children - 1 children
+                m_gpudata->stack_size = CalcStackSize((num_children - 1) * height, kLdsStackSize);
+                m_gpudata->prog = m_gpudata->wide_prog.get();
+
+                // Make sure everything is committed
+                m_device->Finish(0);
+                return;
+            }
+
+            // Quantization is rejected if it does not preserve the tree
+            // or makes boxes too loose, e.g. far away from the origin
+            QBvhTranslator translator;
+            if (use_qbvh)
+            {
+                translator.Process(bvh);
+                use_qbvh = translator.Validate(bvh, kMaxQBvhAreaRatio);
+            }
+
+            // Size stacks for the tree, Vulkan kernels have them fixed.
+            // Wide nodes defer up to 3 children per level.
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                auto height = bvh.GetHeight();
+                m_gpudata->stack_size = CalcStackSize(use_qbvh ? 3 * height : height, kLdsStackSize);
+            }
 
             // Upload BVH data to GPU memory
             if (!use_qbvh)
@@ -227,9 +403,6 @@ namespace RadeonRays
             }
             else
             {
-                QBvhTranslator translator;
-                translator.Process(bvh);
-
                 // Update GPU data
                 auto bvh_size_in_bytes = translator.GetSizeInBytes();
                 m_gpudata->bvh = m_device->CreateBuffer(bvh_size_in_bytes, Calc::BufferType::kRead);
@@ -267,61 +440,49 @@ namespace RadeonRays
         std::uint32_t max_rays, Calc::Buffer *hits,
         const Calc::Event *wait_event, Calc::Event **event) const
     {
-        std::size_t stack_size = 4 * max_rays * kMaxStackSize;
-
-        // Check if we need to reallocate memory
-        if (!m_gpudata->stack || stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
-
         assert(m_gpudata->prog);
-        auto &func = m_gpudata->prog->isect_func;
-
-        // Set args
-        int arg = 0;
-
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
-
-        std::size_t localsize = kWorkGroupSize;
-        std::size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+        Traverse(m_gpudata->prog->isect_func, queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
     }
 
     void IntersectorLDS::Occluded(std::uint32_t queue_idx, const Calc::Buffer *rays, const Calc::Buffer *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits,
         const Calc::Event *wait_event, Calc::Event **event) const
     {
-        std::size_t stack_size = 4 * max_rays * kMaxStackSize;
-
-        // Check if we need to reallocate memory
-        if (!m_gpudata->stack || stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
-
         assert(m_gpudata->prog);
-        auto &func = m_gpudata->prog->occlude_func;
+        Traverse(m_gpudata->prog->occlude_func, queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
+
+    void IntersectorLDS::Traverse(Calc::Function *func, std::uint32_t queue_idx, const Calc::Buffer *rays, const Calc::Buffer *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits,
+        const Calc::Event *wait_event, Calc::Event **event) const
+    {
+        // OpenCL kernels loop over the rays, so the batch can be tiled to fit stack memory limit
+        bool can_tile = m_device->GetPlatform() == Calc::Platform::kOpenCL;
+        auto stack_size = m_gpudata->stack_size;
+        auto num_threads = can_tile ? GetNumStackThreads(max_rays, stack_size, kWorkGroupSize) :
+            ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        auto stack = GetStack(queue_idx, num_threads, stack_size);
 
         // Set args
         int arg = 0;
 
         func->SetArg(arg++, m_gpudata->bvh);
+        if (m_gpudata->prog == m_gpudata->wide_prog.get())
+        {
+            func->SetArg(arg++, m_gpudata->triangles);
+        }
         func->SetArg(arg++, rays);
         func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+        if (can_tile)
+        {
+            func->SetArg(arg++, sizeof(stack_size), &stack_size);
+        }
         func->SetArg(arg++, hits);
 
         std::size_t localsize = kWorkGroupSize;
-        std::size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        std::size_t globalsize = num_threads;
 
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+        m_device->Execute(func, queue_idx, globalsize, localsize, wait_event, event);
     }
 }
@@ -25,8 +25,12 @@ THE SOFTWARE.
 #include "device.h"
 #include "intersector.h"
 
+#include <memory>
+
 namespace RadeonRays
 {
+    class Bvh2;
+
     class IntersectorLDS : public Intersector
     {
     public:
@@ -44,11 +48,20 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, const Calc::Buffer *rays, const Calc::Buffer *num_rays,
             std::uint32_t max_rays, Calc::Buffer *hits,
             const Calc::Event *wait_event, Calc::Event **event) const override;
+        // Run traversal kernel sizing its stack memory
+        void Traverse(Calc::Function *func, std::uint32_t queue_idx, const Calc::Buffer *rays, const Calc::Buffer *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            const Calc::Event *wait_event, Calc::Event **event) const;
+
+        // Compile wide BVH traversal for the given number of children
+        void CompileWideProgram(std::uint32_t width);
 
     private:
         struct GpuData;
 
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
+        // Bvh data structure, kept to be refitted
+        std::unique_ptr<Bvh2> m_bvh;
     };
 }
@@ -24,7 +24,9 @@
 #include "calc.h"
 #include "executable.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/bvh_optimizer.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/morton_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
@@ -36,11 +38,40 @@
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
-static int const kMaxStackSize = 48;
-static int const kMaxBatchSize = 1024 * 1024;
+// Stack entries kept in local memory by OpenCL kernels
+static std::uint32_t const kShortStackSize = 16;
+// Global stack entries per ray of Vulkan kernels, they are compile time constants there
+static std::uint32_t const kVulkanStackSize = 32;
 
 namespace RadeonRays
 {
+    // Height of a translated tree, leaves have child0 == -1
+    static int GetHeight(FatNodeBvhTranslator::Node const* nodes)
+    {
+        std::vector<std::pair<int, int>> stack;
+        stack.emplace_back(0, 0);
+
+        int height = 0;
+        while (!stack.empty())
+        {
+            auto entry = stack.back();
+            stack.pop_back();
+
+            auto const& node = nodes[entry.first];
+            if (node.s1.child0 == -1)
+            {
+                height = std::max(height, entry.second);
+            }
+            else
+            {
+                stack.emplace_back(node.s1.child0, entry.second + 1);
+                stack.emplace_back(node.s1.child1, entry.second + 1);
+            }
+        }
+
+        return height;
+    }
+
     struct IntersectorShortStack::GpuData
     {
         // Device
@@ -49,8 +80,8 @@ namespace RadeonRays
         Calc::Buffer* bvh;
         // Vertex positions
         Calc::Buffer* vertices;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Traversal stack entries per thread
+        std::uint32_t stack_size;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
@@ -60,7 +91,7 @@ namespace RadeonRays
             : device(d)
             , bvh(nullptr)
             , vertices(nullptr)
-            , stack(nullptr)
+            , stack_size(kVulkanStackSize)
             , executable(nullptr)
             , isect_func(nullptr)
             , occlude_func(nullptr)
@@ -71,7 +102,6 @@ namespace RadeonRays
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
-            device->DeleteBuffer(stack);
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
             device->DeleteExecutable(executable);
@@ -135,23 +165,44 @@ namespace RadeonRays
     {
 
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            if (m_gpudata->bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
+                m_gpudata->bvh = nullptr;
             }
 
-            // Check if we can allocate enough stack memory
-            Calc::DeviceSpec spec;
-            m_device->GetSpec(spec);
-            if (spec.max_alloc_size <= kMaxBatchSize * kMaxStackSize * sizeof(int))
+            bool use_vulkan = m_device->GetPlatform() == Calc::Platform::kVulkan;
+
+            BvhCache cache(world);
+            std::uint64_t key = 0;
+
+            if (cache.IsEnabled())
             {
-                throw ExceptionImpl("fatbvh accelerator can't allocate enough stack memory, try using bvh instead");
+                key = BvhCache::CalcKey(world, "fatbvh", { "bvh.builder", "bvh.sah.use_splits",
+                    "bvh.sah.max_split_depth", "bvh.sah.min_overlap", "bvh.sah.traversal_cost",
+                    "bvh.sah.extra_node_budget", "bvh.sah.num_bins", "bvh.lbvh.morton_bits", "bvh.optimize.ms" });
+
+                // Face indices are injected into the nodes, so nodes and vertices are enough
+                auto entry = cache.Load(key);
+                std::size_t size = 0;
+                auto nodes = entry ? entry->GetSection(BvhCache::kNodes, size) : nullptr;
+                if (nodes && LoadBuffers(*entry, {
+                    { BvhCache::kNodes, &m_gpudata->bvh },
+                    { BvhCache::kVertices, &m_gpudata->vertices } }))
+                {
+                    auto height = GetHeight(static_cast<FatNodeBvhTranslator::Node const*>(nodes));
+                    m_gpudata->stack_size = use_vulkan ? kVulkanStackSize : CalcStackSize(height, kShortStackSize);
+
+                    m_bvh.reset();
+                    m_device->Finish(0);
+                    return;
+                }
             }
 
-            int numshapes = (int)world.shapes_.size();
+            int numshapes = (int)world.GetShapes().size();
             int numvertices = 0;
             int numfaces = 0;
 
@@ -166,9 +217,12 @@ namespace RadeonRays
             auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
             auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
             auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            auto mbits = world.options_.GetOption("bvh.lbvh.morton_bits");
 
             bool use_sah = false;
             bool use_splits = false;
+            bool use_lbvh = false;
+            int morton_bits = mbits ? (int)mbits->AsFloat() : 63;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             int num_bins = nbins ? (int)nbins->AsFloat() : 64;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
@@ -179,19 +233,31 @@ namespace RadeonRays
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
                 use_splits = true;
             }
 
-            m_bvh.reset(use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
-            );
+            if (use_splits)
+            {
+                m_bvh.reset(new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget));
+            }
+            else if (use_lbvh)
+            {
+                m_bvh.reset(new MortonBvh(traversal_cost, morton_bits));
+            }
+            else
+            {
+                m_bvh.reset(new Bvh(traversal_cost, num_bins, use_sah));
+            }
 
             // Partition the array into meshes and instances
-            std::vector<Shape const*> shapes(world.shapes_);
+            std::vector<Shape const*> shapes(world.GetShapes());
 
             auto firstinst = std::partition(shapes.begin(), shapes.end(),
                 [&](Shape const* shape)
@@ -265,17 +331,22 @@ namespace RadeonRays
 
             m_bvh->Build(&bounds[0], numfaces);
 
+            // Restructure the tree within the time budget
+            BvhOptimizer::Process(world, *m_bvh);
+
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
 #endif
 
-            // Check if the tree height is reasonable
-            if (m_bvh->GetHeight() >= kMaxStackSize)
+            // Vulkan kernels have fixed stacks, so check if the tree height is reasonable
+            if (use_vulkan && m_bvh->GetHeight() >= static_cast<int>(kVulkanStackSize + kShortStackSize))
             {
                 m_bvh.reset(nullptr);
                 throw ExceptionImpl("fatbvh accelerator can cause stack overflow for this scene, try using bvh instead");
             }
 
+            m_gpudata->stack_size = use_vulkan ? kVulkanStackSize : CalcStackSize(m_bvh->GetHeight(), kShortStackSize);
+
             FatNodeBvhTranslator translator;
             translator.Process(*m_bvh);
 
@@ -304,8 +375,6 @@ namespace RadeonRays
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     mesh->GetTransform(m, minv);
 
@@ -313,7 +382,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -323,8 +392,6 @@ namespace RadeonRays
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     instance->GetTransform(m, minv);
 
@@ -332,7 +399,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -374,17 +441,16 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    Mesh::Face face = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].id = faceidx;
@@ -396,74 +462,54 @@ namespace RadeonRays
             // Copy translated nodes first
             m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
 
-            // Stack
-            if (m_gpudata->stack)
-            {
-                m_device->DeleteBuffer(m_gpudata->stack);
-                m_gpudata->stack = nullptr;
-            }
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
-
             // Make sure everything is commited
             m_device->Finish(0);
+
+            if (cache.IsEnabled())
+            {
+                StoreBuffers(cache, key, {
+                    { BvhCache::kNodes, m_gpudata->bvh, translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node) },
+                    { BvhCache::kVertices, m_gpudata->vertices, numvertices * sizeof(float3) } });
+            }
         }
     }
 
     void IntersectorShortStack::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
-
-        auto& func = m_gpudata->isect_func;
-
-        // Set args
-        int arg = 0;
-
-        func->SetArg(arg++, m_gpudata->bvh);
-        func->SetArg(arg++, m_gpudata->vertices);
-        func->SetArg(arg++, rays);
-        func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
-        func->SetArg(arg++, hits);
-
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        Traverse(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, waitevent, event);
     }
 
     void IntersectorShortStack::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+        Traverse(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, waitevent, event);
+    }
 
-        auto& func = m_gpudata->occlude_func;
+    void IntersectorShortStack::Traverse(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        // OpenCL kernels loop over the rays, so the batch can be tiled to fit stack memory limit
+        bool can_tile = m_device->GetPlatform() == Calc::Platform::kOpenCL;
+        auto stack_size = m_gpudata->stack_size;
+        auto num_threads = can_tile ? GetNumStackThreads(maxrays, stack_size, kWorkGroupSize) :
+            ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        auto stack = GetStack(queueidx, num_threads, stack_size);
 
-       // Set args
+        // Set args
         int arg = 0;
 
         func->SetArg(arg++, m_gpudata->bvh);
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+        if (can_tile)
+        {
+            func->SetArg(arg++, sizeof(stack_size), &stack_size);
+        }
         func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        size_t globalsize = num_threads;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 }
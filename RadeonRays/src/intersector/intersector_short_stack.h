@@ -75,7 +75,7 @@ THE SOFTWARE.
         -Very fast traversal.
         -Benefits from BVH quality optimization.
     Cons:
-        -Depth is limited.
+        -Depth is limited with Vulkan kernels, OpenCL ones size global stack by the tree height.
         -Generates LDS traffic.
  */
 #pragma once
@@ -110,6 +110,10 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Run traversal kernel sizing its stack memory
+        void Traverse(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const;
 
     private:
         struct GpuData;
@@ -22,7 +22,9 @@ THE SOFTWARE.
 #include "intersector_skip_links.h"
 
 #include "../accelerator/bvh.h"
+#include "../accelerator/bvh_optimizer.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/morton_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
@@ -76,9 +78,16 @@ namespace RadeonRays
         }
     };
 
+    struct IntersectorSkipLinks::CpuData
+    {
+        // Translated nodes of the last build, kept to refit them
+        PlainBvhTranslator translator;
+    };
+
     IntersectorSkipLinks::IntersectorSkipLinks(Calc::Device* device)
         : Intersector(device)
         , m_gpudata(new GpuData(device))
+        , m_cpudata(new CpuData)
         , m_bvh(nullptr)
     {
         std::string buildopts;
@@ -132,17 +141,48 @@ namespace RadeonRays
 
     void IntersectorSkipLinks::Process(World const& world)
     {
+        int statechange = world.GetStateChange();
+
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_gpudata->bvh || world.has_changed() || statechange != ShapeImpl::kStateChangeNone)
         {
-            if (m_bvh)
+            // Vertex and transform changes keep the topology valid, so the BVH can be refitted
+            auto refit_option = world.options_.GetOption("bvh.refit");
+            bool refit = m_bvh && !world.has_changed() &&
+                refit_option && refit_option->AsFloat() > 0.f &&
+                (statechange & ~ShapeImpl::kStateChangeRefitMask) == 0;
+
+            if (m_gpudata->bvh && !refit)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
+                m_gpudata->bvh = nullptr;
             }
 
-            int numshapes = (int)world.shapes_.size();
+            BvhCache cache(world);
+            std::uint64_t key = 0;
+
+            if (!refit && cache.IsEnabled())
+            {
+                key = BvhCache::CalcKey(world, "skiplinks", { "bvh.builder", "bvh.sah.use_splits",
+                    "bvh.sah.max_split_depth", "bvh.sah.min_overlap", "bvh.sah.traversal_cost",
+                    "bvh.sah.extra_node_budget", "bvh.sah.num_bins", "bvh.lbvh.morton_bits", "bvh.optimize.ms", "bvh.max_leaf_size" });
+
+                auto entry = cache.Load(key);
+                if (entry && LoadBuffers(*entry, {
+                    { BvhCache::kNodes, &m_gpudata->bvh },
+                    { BvhCache::kVertices, &m_gpudata->vertices },
+                    { BvhCache::kFaces, &m_gpudata->faces } }))
+                {
+                    // Host side hierarchy is not restored, so the next change triggers a full build
+                    m_bvh.reset();
+                    m_device->Finish(0);
+                    return;
+                }
+            }
+
+            int numshapes = (int)world.GetShapes().size();
             int numvertices = 0;
             int numfaces = 0;
 
@@ -150,40 +190,61 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            // Check options
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-            bool use_sah = false;
-            bool use_splits = false;
-            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
-
-            if (builder && builder->AsString() == "sah")
+            if (!refit)
             {
-                use_sah = true;
-            }
+                // Check options
+                auto builder = world.options_.GetOption("bvh.builder");
+                auto splits = world.options_.GetOption("bvh.sah.use_splits");
+                auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
+                auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
+                auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+                auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+                auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+                auto mbits = world.options_.GetOption("bvh.lbvh.morton_bits");
+                auto leaf_size = world.options_.GetOption("bvh.max_leaf_size");
+
+                bool use_sah = false;
+                bool use_splits = false;
+                bool use_lbvh = false;
+                int morton_bits = mbits ? (int)mbits->AsFloat() : 63;
+                int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
+                int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+                float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
+                float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+                float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+                int max_leaf_size = leaf_size ?
+                    std::min((int)leaf_size->AsFloat(), PlainBvhTranslator::kMaxLeafPrimitives) : 1;
+
+                if (builder && builder->AsString() == "sah")
+                {
+                    use_sah = true;
+                }
+                else if (builder && builder->AsString() == "lbvh")
+                {
+                    use_lbvh = true;
+                }
 
-            if (splits && splits->AsFloat() > 0.f)
-            {
-                use_splits = true;
-            }
+                if (splits && splits->AsFloat() > 0.f)
+                {
+                    use_splits = true;
+                }
 
-            m_bvh.reset( use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
-            );
+                if (use_splits)
+                {
+                    m_bvh.reset(new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget, max_leaf_size));
+                }
+                else if (use_lbvh)
+                {
+                    m_bvh.reset(new MortonBvh(traversal_cost, morton_bits));
+                }
+                else
+                {
+                    m_bvh.reset(new Bvh(traversal_cost, num_bins, use_sah, max_leaf_size));
+                }
+            }
 
             // Partition the array into meshes and instances
-            std::vector<Shape const*> shapes(world.shapes_);
+            std::vector<Shape const*> shapes(world.GetShapes());
 
             auto firstinst = std::partition(shapes.begin(), shapes.end(),
                 [&](Shape const* shape)
@@ -255,12 +316,77 @@ namespace RadeonRays
                 }
             }
 
+            if (refit)
+            {
+                m_bvh->Refit(&bounds[0], numfaces);
+
+                std::vector<Calc::Event*> events;
+
+                // Upload nodes with changed bounds only
+                auto& translator = m_cpudata->translator;
+                std::vector<std::pair<int, int>> changed_nodes;
+                translator.UpdateBounds(*m_bvh, changed_nodes);
+
+                for (auto const& range : changed_nodes)
+                {
+                    Calc::Event* e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->bvh, 0,
+                        range.first * sizeof(PlainBvhTranslator::Node),
+                        (range.second - range.first) * sizeof(PlainBvhTranslator::Node),
+                        &translator.nodes_[range.first], &e);
+                    events.push_back(e);
+                }
+
+                // Upload world space vertices of changed shapes only
+                std::vector<float3> vertexdata(numvertices);
+
+                for (int i = 0; i < nummeshes + numinstances; ++i)
+                {
+                    auto shape = static_cast<ShapeImpl const*>(shapes[i]);
+                    Mesh const* mesh = static_cast<Mesh const*>(i < nummeshes ? shape : static_cast<Instance const*>(shape)->GetBaseShape());
+
+                    if (shape->GetStateChange() == ShapeImpl::kStateChangeNone &&
+                        mesh->GetStateChange() == ShapeImpl::kStateChangeNone)
+                    {
+                        continue;
+                    }
+
+                    matrix m, minv;
+                    shape->GetTransform(m, minv);
+
+                    float3* dst = &vertexdata[mesh_vertices_start_idx[i]];
+
+                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    {
+                        dst[j] = transform_point(mesh->GetVertex(j), m);
+                    }
+
+                    Calc::Event* e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->vertices, 0,
+                        mesh_vertices_start_idx[i] * sizeof(float3),
+                        mesh->num_vertices() * sizeof(float3),
+                        dst, &e);
+                    events.push_back(e);
+                }
+
+                for (auto e : events)
+                {
+                    e->Wait();
+                    m_device->DeleteEvent(e);
+                }
+
+                return;
+            }
+
             m_bvh->Build(&bounds[0], numfaces);
 
+            // Restructure the tree within the time budget
+            BvhOptimizer::Process(world, *m_bvh);
+
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
 #endif
-            PlainBvhTranslator translator;
+            auto& translator = m_cpudata->translator;
             translator.Process(*m_bvh);
 
             // Update GPU data
@@ -289,8 +415,6 @@ namespace RadeonRays
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     mesh->GetTransform(m, minv);
 
@@ -298,7 +422,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -308,8 +432,6 @@ namespace RadeonRays
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
                     instance->GetTransform(m, minv);
 
@@ -317,7 +439,7 @@ namespace RadeonRays
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
 
@@ -327,6 +449,8 @@ namespace RadeonRays
                 m_device->DeleteEvent(e);
             }
 
+            std::size_t faces_size = 0;
+
             // Create face buffer
             {
                 struct Face
@@ -342,7 +466,8 @@ namespace RadeonRays
                 // This number is different from the number of faces for some BVHs
                 auto numindices = m_bvh->GetNumIndices();
                 // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+                faces_size = numindices * sizeof(Face);
+                m_gpudata->faces = m_device->CreateBuffer(faces_size, Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 Face* facedata = nullptr;
@@ -379,17 +504,16 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    Mesh::Face face = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = face.idx[0] + mystartidx;
+                    facedata[i].idx[1] = face.idx[1] + mystartidx;
+                    facedata[i].idx[2] = face.idx[2] + mystartidx;
 
                     // Optimization: we are putting faceid here
                     facedata[i].shape_id = shapes[shapeidx]->GetId();
@@ -404,6 +528,14 @@ namespace RadeonRays
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            if (cache.IsEnabled())
+            {
+                StoreBuffers(cache, key, {
+                    { BvhCache::kNodes, m_gpudata->bvh, translator.nodes_.size() * sizeof(PlainBvhTranslator::Node) },
+                    { BvhCache::kVertices, m_gpudata->vertices, numvertices * sizeof(float3) },
+                    { BvhCache::kFaces, m_gpudata->faces, faces_size } });
+            }
         }
     }
 
@@ -424,7 +556,7 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 
     void IntersectorSkipLinks::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -444,7 +576,7 @@ namespace RadeonRays
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, waitevent, event);
     }
 
 }
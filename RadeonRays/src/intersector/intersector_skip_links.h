@@ -91,9 +91,11 @@ namespace RadeonRays
 
     private:
         struct GpuData;
+        struct CpuData;
 
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
+        std::unique_ptr<CpuData> m_cpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
     };
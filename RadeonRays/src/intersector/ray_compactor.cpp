@@ -0,0 +1,237 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_compactor.h"
+
+#include "radeon_rays.h"
+#include "primitives.h"
+#include "../except/except.h"
+
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RayCompactor::QueueData
+    {
+        Calc::Device* device;
+        // Parallel primitives, CLW keeps temporary buffers and kernel
+        // arguments per instance, so queues must not share them
+        Calc::Primitives* pp;
+        // Activity flags and ray indices
+        Calc::Buffer* predicates;
+        Calc::Buffer* indices;
+        // Indices of active rays and their number
+        Calc::Buffer* live_indices;
+        Calc::Buffer* num_live_rays;
+        // Active rays and their results
+        Calc::Buffer* rays;
+        Calc::Buffer* hits;
+        // Number of rays the buffers have room for
+        std::uint32_t capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , pp(d->CreatePrimitives())
+            , predicates(nullptr)
+            , indices(nullptr)
+            , live_indices(nullptr)
+            , num_live_rays(d->CreateBuffer(sizeof(int), Calc::BufferType::kWrite))
+            , rays(nullptr)
+            , hits(nullptr)
+            , capacity(0)
+        {
+        }
+
+        ~QueueData()
+        {
+            ReleaseBuffers();
+            device->DeleteBuffer(num_live_rays);
+            device->DeletePrimitives(pp);
+        }
+
+        void ReleaseBuffers()
+        {
+            for (auto buffer : { predicates, indices, live_indices, rays, hits })
+            {
+                if (buffer)
+                {
+                    device->DeleteBuffer(buffer);
+                }
+            }
+
+            predicates = indices = live_indices = rays = hits = nullptr;
+            capacity = 0;
+        }
+    };
+
+    RayCompactor::RayCompactor(Calc::Device* device)
+        : m_device(device)
+        , m_executable(nullptr)
+    {
+        ThrowIf(!device->HasBuiltinPrimitives(), "This device does not support ray compaction.");
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+            m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/compact_rays.cl", headers, numheaders, nullptr);
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_executable = m_device->CompileExecutable(g_compact_rays_opencl, std::strlen(g_compact_rays_opencl), nullptr);
+        }
+#endif
+#endif
+
+        ThrowIf(!m_executable, "Ray compaction is supported on OpenCL devices only.");
+
+        m_predicates_func = m_executable->CreateFunction("calculate_ray_predicates_main");
+        m_gather_func = m_executable->CreateFunction("gather_rays_main");
+        m_scatter_hits_func = m_executable->CreateFunction("scatter_hits_main");
+        m_scatter_occlusion_func = m_executable->CreateFunction("scatter_occlusion_main");
+    }
+
+    RayCompactor::~RayCompactor()
+    {
+        m_queues.clear();
+
+        m_executable->DeleteFunction(m_predicates_func);
+        m_executable->DeleteFunction(m_gather_func);
+        m_executable->DeleteFunction(m_scatter_hits_func);
+        m_executable->DeleteFunction(m_scatter_occlusion_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    RayCompactor::QueueData& RayCompactor::GetQueueData(std::uint32_t queue_idx)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (queue_idx >= m_queues.size())
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        return *data;
+    }
+
+    RayCompactor::QueueData& RayCompactor::GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        auto& data = GetQueueData(queue_idx);
+
+        // Queues execute in order, so buffers of the previous batch can be released right away
+        if (data.capacity < max_rays)
+        {
+            data.ReleaseBuffers();
+
+            data.predicates = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.live_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite);
+            // Occlusion results are smaller, so the same buffer serves both queries
+            data.hits = m_device->CreateBuffer(max_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+            data.capacity = max_rays;
+        }
+
+        return data;
+    }
+
+    void RayCompactor::Compact(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Event const* wait_event,
+        Calc::Buffer** live_rays, Calc::Buffer** num_live_rays, Calc::Buffer** live_hits)
+    {
+        auto& data = GetQueueData(queue_idx, max_rays);
+        int capacity = static_cast<int>(max_rays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Predicates are calculated for the whole capacity, since the scan size is known on the host only
+        int arg = 0;
+        m_predicates_func->SetArg(arg++, rays);
+        m_predicates_func->SetArg(arg++, num_rays);
+        m_predicates_func->SetArg(arg++, sizeof(capacity), &capacity);
+        m_predicates_func->SetArg(arg++, data.predicates);
+        m_predicates_func->SetArg(arg++, data.indices);
+        m_device->Execute(m_predicates_func, queue_idx, globalsize, localsize, wait_event, nullptr);
+
+        data.pp->CompactInt32(queue_idx, data.predicates, data.indices, data.live_indices, max_rays, data.num_live_rays);
+
+        arg = 0;
+        m_gather_func->SetArg(arg++, rays);
+        m_gather_func->SetArg(arg++, data.num_live_rays);
+        m_gather_func->SetArg(arg++, data.live_indices);
+        m_gather_func->SetArg(arg++, data.rays);
+        m_device->Execute(m_gather_func, queue_idx, globalsize, localsize, nullptr);
+
+        *live_rays = data.rays;
+        *num_live_rays = data.num_live_rays;
+        *live_hits = data.hits;
+    }
+
+    void RayCompactor::Scatter(Calc::Function* func, std::uint32_t queue_idx, std::uint32_t max_rays,
+        Calc::Buffer* hits, Calc::Event** event)
+    {
+        auto& data = GetQueueData(queue_idx);
+        assert(data.capacity >= max_rays);
+
+        int arg = 0;
+        func->SetArg(arg++, data.num_live_rays);
+        func->SetArg(arg++, data.live_indices);
+        func->SetArg(arg++, data.hits);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+    }
+
+    void RayCompactor::ScatterHits(std::uint32_t queue_idx, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_hits_func, queue_idx, max_rays, hits, event);
+    }
+
+    void RayCompactor::ScatterOcclusion(std::uint32_t queue_idx, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_occlusion_func, queue_idx, max_rays, hits, event);
+    }
+}
@@ -0,0 +1,80 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "executable.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class removes inactive rays from batches before traversal,
+    ///< so kernels are not launched for the rays which would exit right
+    ///< away. Active rays are compacted with Calc parallel primitives,
+    ///< their number stays on the device and is passed to intersectors
+    ///< as the ray count buffer. Results are scattered back into the
+    ///< original order, results of inactive rays are left untouched.
+    ///< Each queue has its own buffers and parallel primitives.
+    ///<
+    class RayCompactor
+    {
+    public:
+        RayCompactor(Calc::Device* device);
+        ~RayCompactor();
+
+        // Compact the batch, active rays, the buffer holding their number and the buffer
+        // for their results are returned, they are valid until the next compaction on the queue
+        void Compact(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Event const* wait_event,
+            Calc::Buffer** live_rays, Calc::Buffer** num_live_rays, Calc::Buffer** live_hits);
+
+        // Move results of the last compacted batch of the queue into the original order
+        void ScatterHits(std::uint32_t queue_idx, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+        void ScatterOcclusion(std::uint32_t queue_idx, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+
+        RayCompactor(RayCompactor const&) = delete;
+        RayCompactor& operator = (RayCompactor const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Buffers of the queue having room for max_rays rays
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays);
+        QueueData& GetQueueData(std::uint32_t queue_idx);
+        void Scatter(Calc::Function* func, std::uint32_t queue_idx, std::uint32_t max_rays,
+            Calc::Buffer* hits, Calc::Event** event);
+
+        Calc::Device* m_device;
+        Calc::Executable* m_executable;
+        Calc::Function* m_predicates_func;
+        Calc::Function* m_gather_func;
+        Calc::Function* m_scatter_hits_func;
+        Calc::Function* m_scatter_occlusion_func;
+
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+        std::mutex m_mutex;
+    };
+}
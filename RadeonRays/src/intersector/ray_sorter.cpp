@@ -0,0 +1,257 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_sorter.h"
+
+#include "radeon_rays.h"
+#include "primitives.h"
+#include "../except/except.h"
+
+#include <cassert>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct RaySorter::QueueData
+    {
+        Calc::Device* device;
+        // Parallel primitives, CLW keeps temporary buffers and kernel
+        // arguments per instance, so queues must not share them
+        Calc::Primitives* pp;
+        // Keys and ray indices before and after the sort
+        Calc::Buffer* keys;
+        Calc::Buffer* indices;
+        Calc::Buffer* sorted_keys;
+        Calc::Buffer* sorted_indices;
+        // Sorted rays and their results
+        Calc::Buffer* rays;
+        Calc::Buffer* hits;
+        // Number of rays the buffers have room for
+        std::uint32_t capacity;
+
+        QueueData(Calc::Device* d)
+            : device(d)
+            , pp(d->CreatePrimitives())
+            , keys(nullptr)
+            , indices(nullptr)
+            , sorted_keys(nullptr)
+            , sorted_indices(nullptr)
+            , rays(nullptr)
+            , hits(nullptr)
+            , capacity(0)
+        {
+        }
+
+        ~QueueData()
+        {
+            ReleaseBuffers();
+            device->DeletePrimitives(pp);
+        }
+
+        void ReleaseBuffers()
+        {
+            for (auto buffer : { keys, indices, sorted_keys, sorted_indices, rays, hits })
+            {
+                if (buffer)
+                {
+                    device->DeleteBuffer(buffer);
+                }
+            }
+
+            keys = indices = sorted_keys = sorted_indices = rays = hits = nullptr;
+            capacity = 0;
+        }
+    };
+
+    RaySorter::RaySorter(Calc::Device* device)
+        : m_device(device)
+        , m_executable(nullptr)
+    {
+        ThrowIf(!device->HasBuiltinPrimitives(), "This device does not support ray sorting.");
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+            m_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/sort_rays.cl", headers, numheaders, nullptr);
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_executable = m_device->CompileExecutable(g_sort_rays_opencl, std::strlen(g_sort_rays_opencl), nullptr);
+        }
+#endif
+#endif
+
+        ThrowIf(!m_executable, "Ray sorting is supported on OpenCL devices only.");
+
+        m_keys_func = m_executable->CreateFunction("calculate_ray_keys_main");
+        m_gather_func = m_executable->CreateFunction("gather_rays_main");
+        m_scatter_hits_func = m_executable->CreateFunction("scatter_hits_main");
+        m_scatter_occlusion_func = m_executable->CreateFunction("scatter_occlusion_main");
+
+        SetBounds(bbox());
+    }
+
+    RaySorter::~RaySorter()
+    {
+        m_queues.clear();
+
+        m_executable->DeleteFunction(m_keys_func);
+        m_executable->DeleteFunction(m_gather_func);
+        m_executable->DeleteFunction(m_scatter_hits_func);
+        m_executable->DeleteFunction(m_scatter_occlusion_func);
+        m_device->DeleteExecutable(m_executable);
+    }
+
+    void RaySorter::SetBounds(bbox const& bounds)
+    {
+        auto const extents = bounds.extents();
+
+        for (int i = 0; i < 3; ++i)
+        {
+            // Empty and flat bounds map the axis to 0
+            m_scene_min[i] = extents[i] > 0.f ? bounds.pmin[i] : 0.f;
+            m_scene_scale[i] = extents[i] > 0.f ? 1.f / extents[i] : 0.f;
+        }
+
+        m_scene_min[3] = 0.f;
+        m_scene_scale[3] = 0.f;
+    }
+
+    RaySorter::QueueData& RaySorter::GetQueueData(std::uint32_t queue_idx)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (queue_idx >= m_queues.size())
+        {
+            m_queues.resize(queue_idx + 1);
+        }
+
+        auto& data = m_queues[queue_idx];
+
+        if (!data)
+        {
+            data.reset(new QueueData(m_device));
+        }
+
+        return *data;
+    }
+
+    RaySorter::QueueData& RaySorter::GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays)
+    {
+        auto& data = GetQueueData(queue_idx);
+
+        // Queues execute in order, so buffers of the previous batch can be released right away
+        if (data.capacity < max_rays)
+        {
+            data.ReleaseBuffers();
+
+            data.keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.sorted_keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.sorted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+            data.rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite);
+            // Occlusion results are smaller, so the same buffer serves both queries
+            data.hits = m_device->CreateBuffer(max_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+            data.capacity = max_rays;
+        }
+
+        return data;
+    }
+
+    void RaySorter::Sort(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Event const* wait_event,
+        Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits)
+    {
+        auto& data = GetQueueData(queue_idx, max_rays);
+        int capacity = static_cast<int>(max_rays);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Keys are calculated for the whole capacity, since the sort size is known on the host only
+        int arg = 0;
+        m_keys_func->SetArg(arg++, rays);
+        m_keys_func->SetArg(arg++, num_rays);
+        m_keys_func->SetArg(arg++, sizeof(capacity), &capacity);
+        m_keys_func->SetArg(arg++, sizeof(m_scene_min), m_scene_min);
+        m_keys_func->SetArg(arg++, sizeof(m_scene_scale), m_scene_scale);
+        m_keys_func->SetArg(arg++, data.keys);
+        m_keys_func->SetArg(arg++, data.indices);
+        m_device->Execute(m_keys_func, queue_idx, globalsize, localsize, wait_event, nullptr);
+
+        data.pp->SortRadixInt32(queue_idx, data.keys, data.sorted_keys, data.indices, data.sorted_indices, max_rays);
+
+        arg = 0;
+        m_gather_func->SetArg(arg++, rays);
+        m_gather_func->SetArg(arg++, num_rays);
+        m_gather_func->SetArg(arg++, data.sorted_indices);
+        m_gather_func->SetArg(arg++, data.rays);
+        m_device->Execute(m_gather_func, queue_idx, globalsize, localsize, nullptr);
+
+        *sorted_rays = data.rays;
+        *sorted_hits = data.hits;
+    }
+
+    void RaySorter::Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        auto& data = GetQueueData(queue_idx);
+        assert(data.capacity >= max_rays);
+
+        int arg = 0;
+        func->SetArg(arg++, data.rays);
+        func->SetArg(arg++, num_rays);
+        func->SetArg(arg++, data.sorted_indices);
+        func->SetArg(arg++, data.hits);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+    }
+
+    void RaySorter::ScatterHits(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_hits_func, queue_idx, num_rays, max_rays, hits, event);
+    }
+
+    void RaySorter::ScatterOcclusion(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event)
+    {
+        Scatter(m_scatter_occlusion_func, queue_idx, num_rays, max_rays, hits, event);
+    }
+}
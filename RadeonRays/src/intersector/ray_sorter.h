@@ -0,0 +1,89 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "executable.h"
+#include "math/bbox.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class reorders ray batches by coherence keys made of ray
+    ///< direction and origin Morton codes. Intersectors traverse the
+    ///< sorted copy of a batch and the results are scattered back into
+    ///< the order rays have been submitted in. All the work is enqueued
+    ///< into the queue of the query, so no host synchronization is needed.
+    ///< Each queue has its own sort buffers and parallel primitives.
+    ///<
+    class RaySorter
+    {
+    public:
+        RaySorter(Calc::Device* device);
+        ~RaySorter();
+
+        // Scene bounds, ray origins are quantized within them
+        void SetBounds(bbox const& bounds);
+
+        // Sort the batch, sorted copy of rays and the buffer for its
+        // results are returned, they are valid until the next sort on the queue
+        void Sort(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Event const* wait_event,
+            Calc::Buffer** sorted_rays, Calc::Buffer** sorted_hits);
+
+        // Move results of the last sorted batch of the queue into the original order
+        void ScatterHits(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+        void ScatterOcclusion(std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+
+        RaySorter(RaySorter const&) = delete;
+        RaySorter& operator = (RaySorter const&) = delete;
+
+    private:
+        struct QueueData;
+
+        // Buffers of the queue having room for max_rays rays
+        QueueData& GetQueueData(std::uint32_t queue_idx, std::uint32_t max_rays);
+        QueueData& GetQueueData(std::uint32_t queue_idx);
+        void Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event);
+
+        Calc::Device* m_device;
+        Calc::Executable* m_executable;
+        Calc::Function* m_keys_func;
+        Calc::Function* m_gather_func;
+        Calc::Function* m_scatter_hits_func;
+        Calc::Function* m_scatter_occlusion_func;
+
+        // Quantization grid of ray origins
+        float m_scene_min[4];
+        float m_scene_scale[4];
+
+        std::vector<std::unique_ptr<QueueData>> m_queues;
+        std::mutex m_mutex;
+    };
+}
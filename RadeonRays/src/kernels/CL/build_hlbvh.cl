@@ -47,6 +47,8 @@ DEFINES
 #define NODEIDX(i) (i)
 // Shortcut for delta evaluation
 #define DELTA(i,j) delta(morton_codes,num_prims,i,j)
+// Work group size of the bounds reduction
+#define REDUCTION_GROUP_SIZE 64
 
 /*************************************************************************
 TYPE DEFINITIONS
@@ -97,6 +99,69 @@ INLINE bbox bbox_union(bbox b1, bbox b2)
     return res;
 }
 
+// Reduce bounds to one bbox per work group, the second
+// pass with a single group reduces the partial results
+KERNEL void reduce_bounds_main(
+    // Bounds to reduce
+    GLOBAL bbox const* restrict bounds,
+    // Number of bounds
+    int num_bounds,
+    // Bbox per work group
+    GLOBAL bbox* restrict result
+    )
+{
+    __local float4 lds_pmin[REDUCTION_GROUP_SIZE];
+    __local float4 lds_pmax[REDUCTION_GROUP_SIZE];
+
+    int local_id = get_local_id(0);
+
+    bbox b;
+    b.pmin = (float4)(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    b.pmax = (float4)(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+
+    for (int i = get_global_id(0); i < num_bounds; i += get_global_size(0))
+    {
+        b = bbox_union(b, bounds[i]);
+    }
+
+    lds_pmin[local_id] = b.pmin;
+    lds_pmax[local_id] = b.pmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = REDUCTION_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+    {
+        if (local_id < stride)
+        {
+            lds_pmin[local_id] = min(lds_pmin[local_id], lds_pmin[local_id + stride]);
+            lds_pmax[local_id] = max(lds_pmax[local_id], lds_pmax[local_id + stride]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        result[get_group_id(0)].pmin = lds_pmin[0];
+        result[get_group_id(0)].pmax = lds_pmax[0];
+    }
+}
+
+// Zero refit flags
+KERNEL void clear_flags_main(
+    // Atomic flags
+    GLOBAL int* flags,
+    // Number of flags
+    int num_flags
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_flags)
+    {
+        flags[global_id] = 0;
+    }
+}
+
 // Assign Morton codes to each of positions
 KERNEL void calculate_morton_code_main(
     // Centers of primitive bounding boxes
@@ -280,7 +345,8 @@ KERNEL void refit_bounds_main(
         // Get my leaf index
         int idx = LEAFIDX(global_id);
 
-        do
+        // Single leaf is the root itself
+        while (idx != 0)
         {
             // Move to parent node
             idx = nodes[idx].parent;
@@ -298,8 +364,9 @@ KERNEL void refit_bounds_main(
                 // Calculate bounds
                 bbox b = bbox_union(bounds[lc], bounds[rc]);
 
-                // Write bounds
+                // Write bounds, the thread finishing the parent reads them
                 bounds[idx] = b;
+                mem_fence(CLK_GLOBAL_MEM_FENCE);
             }
             else
             {
@@ -309,6 +376,25 @@ KERNEL void refit_bounds_main(
                 break;
             }
         }
-        while (idx != 0);
     }
-}
\ No newline at end of file
+}
+
+// Put updated primitive bounds into the leaves keeping the hierarchy
+KERNEL void update_leaf_bounds_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices sorted along the hierarchy
+    GLOBAL int const* restrict indices,
+    // Number of primitives
+    int num_prims,
+    // Node bounds
+    GLOBAL bbox* bounds_sorted
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        bounds_sorted[LEAFIDX(global_id)] = bounds[indices[global_id]];
+    }
+}
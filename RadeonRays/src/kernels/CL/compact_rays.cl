@@ -0,0 +1,130 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file compact_rays.cl
+    \brief Inactive ray removal used by RayCompactor.
+
+    Each ray of the batch gets a predicate telling if it is active, indices
+    of active rays are compacted with parallel primitives and the rays are
+    gathered into a dense batch. Intersectors traverse the dense batch with
+    the number of active rays as the ray count, then results are scattered
+    back to the original indices.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Calculate activity predicates and ray indices for the whole batch capacity
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void calculate_ray_predicates_main(
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Capacity of rays buffer
+    int max_rays,
+    // 1 for active rays, 0 otherwise
+    GLOBAL int *predicates,
+    // Ray indices
+    GLOBAL int *indices)
+{
+    const int index = get_global_id(0);
+
+    if (index < max_rays)
+    {
+        int active = 0;
+
+        if (index < *num_rays)
+        {
+            const ray my_ray = rays[index];
+            active = ray_is_active(&my_ray) ? 1 : 0;
+        }
+
+        predicates[index] = active;
+        indices[index] = index;
+    }
+}
+
+// Copy active rays into the dense batch
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void gather_rays_main(
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of active rays
+    GLOBAL const int *restrict num_live_rays,
+    // Original index of each active ray
+    GLOBAL const int *restrict indices,
+    // Active rays
+    GLOBAL ray *live_rays)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_live_rays)
+    {
+        live_rays[index] = rays[indices[index]];
+    }
+}
+
+// Move intersections back to the original ray indices
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_hits_main(
+    // Number of active rays
+    GLOBAL const int *restrict num_live_rays,
+    // Original index of each active ray
+    GLOBAL const int *restrict indices,
+    // Hits of active rays
+    GLOBAL const Intersection *restrict live_hits,
+    // Hit data
+    GLOBAL Intersection *hits)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_live_rays)
+    {
+        hits[indices[index]] = live_hits[index];
+    }
+}
+
+// Move occlusion results back to the original ray indices
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_occlusion_main(
+    // Number of active rays
+    GLOBAL const int *restrict num_live_rays,
+    // Original index of each active ray
+    GLOBAL const int *restrict indices,
+    // Results of active rays
+    GLOBAL const int *restrict live_hits,
+    // Hit results
+    GLOBAL int *hits)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_live_rays)
+    {
+        hits[indices[index]] = live_hits[index];
+    }
+}
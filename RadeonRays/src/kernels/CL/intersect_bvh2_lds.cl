@@ -33,7 +33,6 @@ TYPE DEFINITIONS
 #define INTERNAL_NODE(node) (GetAddrLeft(node) != INVALID_ADDR)
 
 #define GROUP_SIZE 64
-#define STACK_SIZE 32
 #define LDS_STACK_SIZE 16
 
 // BVH node
@@ -72,16 +71,20 @@ KERNEL void intersect_main(
     GLOBAL const int *restrict num_rays,
     // Stack memory
     GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
     // Hit data
     GLOBAL Intersection *hits)
 {
     __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
 
-    uint index = get_global_id(0);
     uint local_index = get_local_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
 
     // Handle only working subset
-    if (index < *num_rays)
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
         const ray my_ray = rays[index];
 
@@ -98,7 +101,6 @@ KERNEL void intersect_main(
             // Current closest address
             uint closest_addr = INVALID_ADDR;
 
-            uint stack_bottom = STACK_SIZE * index;
             uint sptr = stack_bottom;
             uint lds_stack_bottom = local_index * LDS_STACK_SIZE;
             uint lds_sptr = lds_stack_bottom;
@@ -235,16 +237,20 @@ KERNEL void occluded_main(
     GLOBAL const int *restrict num_rays,
     // Stack memory
     GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int *hits)
 {
     __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
 
-    uint index = get_global_id(0);
     uint local_index = get_local_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
 
     // Handle only working subset
-    if (index < *num_rays)
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
         const ray my_ray = rays[index];
 
@@ -258,7 +264,6 @@ KERNEL void occluded_main(
             // Intersection parametric distance
             const float closest_t = my_ray.o.w;
 
-            uint stack_bottom = STACK_SIZE * index;
             uint sptr = stack_bottom;
             uint lds_stack_bottom = local_index * LDS_STACK_SIZE;
             uint lds_sptr = lds_stack_bottom;
@@ -334,7 +339,7 @@ KERNEL void occluded_main(
                         if (t < closest_t)
                         {
                             hits[index] = HIT_MARKER;
-                            return;
+                            break;
                         }
 #ifdef RR_RAY_MASK
                     }
@@ -357,7 +362,10 @@ KERNEL void occluded_main(
             }
 
             // Finished traversal, but no intersection found
-            hits[index] = MISS_MARKER;
+            if (addr == INVALID_ADDR)
+            {
+                hits[index] = MISS_MARKER;
+            }
         }
     }
 }
@@ -20,8 +20,6 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 
-#pragma OPENCL EXTENSION cl_khr_fp16 : enable
-
 /*************************************************************************
 INCLUDES
 **************************************************************************/
@@ -33,9 +31,9 @@ TYPE DEFINITIONS
 
 #define INVALID_ADDR 0xffffffffu
 #define INTERNAL_NODE(node) ((node).aabb01_min_or_v0_and_addr0.w != INVALID_ADDR)
+#define GetMeshId(node) ((node).aabb01_max_or_v1_and_addr1_or_mesh_id.w)
 
 #define GROUP_SIZE 64
-#define STACK_SIZE 32
 #define LDS_STACK_SIZE 16
 
 // BVH node
@@ -51,44 +49,44 @@ typedef struct
 #define mymin3(a, b, c) min(min((a), (b)), (c))
 #define mymax3(a, b, c) max(max((a), (b)), (c))
 
-INLINE half2 unpackFloat2x16(uint v)
+// Decode a pair of half precision values, the slab test itself is done
+// in fp32 so that conservatively rounded boxes never miss a ray
+INLINE float2 unpack_half2(uint v)
 {
-    return (half2)
-        (as_half(convert_ushort(v & 0xffffu)),
-         as_half(convert_ushort(v >> 16)));
+    return vload_half2(0, (half const*)&v);
 }
 
-INLINE half4 fast_intersect_bbox2(uint3 pmin, uint3 pmax, half3 invdir, half3 oxinvdir, float t_max)
+INLINE float4 fast_intersect_bbox2(uint3 pmin, uint3 pmax, float3 invdir, float3 oxinvdir, float t_max)
 {
-    half2 pmin_x = unpackFloat2x16(pmin.x);
-    half2 pmin_y = unpackFloat2x16(pmin.y);
-    half2 pmin_z = unpackFloat2x16(pmin.z);
-    half2 pmax_x = unpackFloat2x16(pmax.x);
-    half2 pmax_y = unpackFloat2x16(pmax.y);
-    half2 pmax_z = unpackFloat2x16(pmax.z);
-
-    half2 f_x = fma(pmax_x, invdir.xx, oxinvdir.xx);
-    half2 f_y = fma(pmax_y, invdir.yy, oxinvdir.yy);
-    half2 f_z = fma(pmax_z, invdir.zz, oxinvdir.zz);
-
-    half2 n_x = fma(pmin_x, invdir.xx, oxinvdir.xx);
-    half2 n_y = fma(pmin_y, invdir.yy, oxinvdir.yy);
-    half2 n_z = fma(pmin_z, invdir.zz, oxinvdir.zz);
-
-    half2 t_max_x = max(f_x, n_x);
-    half2 t_max_y = max(f_y, n_y);
-    half2 t_max_z = max(f_z, n_z);
-
-    half2 t_min_x = min(f_x, n_x);
-    half2 t_min_y = min(f_y, n_y);
-    half2 t_min_z = min(f_z, n_z);
-
-    half2 t_zero = (half2)(0.0f, 0.0f);
-    half2 t_max2 = (half2)(t_max, t_max);
-    half2 t1 = min(mymin3(t_max_x, t_max_y, t_max_z), t_max2);
-    half2 t0 = max(mymax3(t_min_x, t_min_y, t_min_z), t_zero);
-
-    return (half4)(t0, t1);
+    float2 pmin_x = unpack_half2(pmin.x);
+    float2 pmin_y = unpack_half2(pmin.y);
+    float2 pmin_z = unpack_half2(pmin.z);
+    float2 pmax_x = unpack_half2(pmax.x);
+    float2 pmax_y = unpack_half2(pmax.y);
+    float2 pmax_z = unpack_half2(pmax.z);
+
+    float2 f_x = fma(pmax_x, invdir.xx, oxinvdir.xx);
+    float2 f_y = fma(pmax_y, invdir.yy, oxinvdir.yy);
+    float2 f_z = fma(pmax_z, invdir.zz, oxinvdir.zz);
+
+    float2 n_x = fma(pmin_x, invdir.xx, oxinvdir.xx);
+    float2 n_y = fma(pmin_y, invdir.yy, oxinvdir.yy);
+    float2 n_z = fma(pmin_z, invdir.zz, oxinvdir.zz);
+
+    float2 t_max_x = max(f_x, n_x);
+    float2 t_max_y = max(f_y, n_y);
+    float2 t_max_z = max(f_z, n_z);
+
+    float2 t_min_x = min(f_x, n_x);
+    float2 t_min_y = min(f_y, n_y);
+    float2 t_min_z = min(f_z, n_z);
+
+    float2 t_zero = (float2)(0.0f, 0.0f);
+    float2 t_max2 = (float2)(t_max, t_max);
+    float2 t1 = min(mymin3(t_max_x, t_max_y, t_max_z), t_max2);
+    float2 t0 = max(mymax3(t_min_x, t_min_y, t_min_z), t_zero);
+
+    return (float4)(t0, t1);
 }
 
 INLINE float3 safe_invdir2(ray r)
@@ -137,25 +135,28 @@ KERNEL void intersect_main(
     GLOBAL const int *restrict num_rays,
     // Stack memory
     GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
     // Hit data
     GLOBAL Intersection *hits)
 {
     __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
 
-    uint index = get_global_id(0);
     uint local_index = get_local_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
 
     // Handle only working subset
-    if (index < *num_rays)
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
         const ray my_ray = rays[index];
 
         if (ray_is_active(&my_ray))
         {
             // Precompute inverse direction and origin / dir for bbox testing
-            const float3 invDir32 = safe_invdir2(my_ray);
-            const half3 invDir = convert_half3(invDir32);
-            const half3 oxInvDir = convert_half3(-my_ray.o.xyz * invDir32);
+            const float3 invDir = safe_invdir2(my_ray);
+            const float3 oxInvDir = -my_ray.o.xyz * invDir;
 
             // Intersection parametric distance
             float closest_t = my_ray.o.w;
@@ -165,7 +166,6 @@ KERNEL void intersect_main(
             // Current closest address
             uint closest_addr = INVALID_ADDR;
 
-            uint stack_bottom = STACK_SIZE * index;
             uint sptr = stack_bottom;
             uint lds_stack_bottom = local_index * LDS_STACK_SIZE;
             uint lds_sptr = lds_stack_bottom;
@@ -178,11 +178,11 @@ KERNEL void intersect_main(
 
                 if (INTERNAL_NODE(node))
                 {
-                    half4 s01 = fast_intersect_bbox2(
+                    float4 s01 = fast_intersect_bbox2(
                         node.aabb01_min_or_v0_and_addr0.xyz,
                         node.aabb01_max_or_v1_and_addr1_or_mesh_id.xyz,
                         invDir, oxInvDir, closest_t);
-                    half4 s23 = fast_intersect_bbox2(
+                    float4 s23 = fast_intersect_bbox2(
                         node.aabb23_min_or_v2_and_addr2_or_prim_id.xyz,
                         node.aabb23_max_and_addr3.xyz,
                         invDir, oxInvDir, closest_t);
@@ -195,7 +195,7 @@ KERNEL void intersect_main(
                     if (traverse_c0 || traverse_c1 || traverse_c2 || traverse_c3)
                     {
                         uint a = INVALID_ADDR;
-                        half d = 100000000.0f;
+                        float d = FLT_MAX;
 
                         if (traverse_c0)
                         {
@@ -323,25 +323,28 @@ KERNEL void occluded_main(
     GLOBAL const int *restrict num_rays,
     // Stack memory
     GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int *hits)
 {
     __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
 
-    uint index = get_global_id(0);
     uint local_index = get_local_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
 
     // Handle only working subset
-    if (index < *num_rays)
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
         const ray my_ray = rays[index];
 
         if (ray_is_active(&my_ray))
         {
             // Precompute inverse direction and origin / dir for bbox testing
-            const float3 invDir32 = safe_invdir2(my_ray);
-            const half3 invDir = convert_half3(invDir32);
-            const half3 oxInvDir = convert_half3(-my_ray.o.xyz * invDir32);
+            const float3 invDir = safe_invdir2(my_ray);
+            const float3 oxInvDir = -my_ray.o.xyz * invDir;
 
             // Intersection parametric distance
             float closest_t = my_ray.o.w;
@@ -351,7 +354,6 @@ KERNEL void occluded_main(
             // Current closest address
             uint closest_addr = INVALID_ADDR;
 
-            uint stack_bottom = STACK_SIZE * index;
             uint sptr = stack_bottom;
             uint lds_stack_bottom = local_index * LDS_STACK_SIZE;
             uint lds_sptr = lds_stack_bottom;
@@ -364,11 +366,11 @@ KERNEL void occluded_main(
 
                 if (INTERNAL_NODE(node))
                 {
-                    half4 s01 = fast_intersect_bbox2(
+                    float4 s01 = fast_intersect_bbox2(
                         node.aabb01_min_or_v0_and_addr0.xyz,
                         node.aabb01_max_or_v1_and_addr1_or_mesh_id.xyz,
                         invDir, oxInvDir, closest_t);
-                    half4 s23 = fast_intersect_bbox2(
+                    float4 s23 = fast_intersect_bbox2(
                         node.aabb23_min_or_v2_and_addr2_or_prim_id.xyz,
                         node.aabb23_max_and_addr3.xyz,
                         invDir, oxInvDir, closest_t);
@@ -381,7 +383,7 @@ KERNEL void occluded_main(
                     if (traverse_c0 || traverse_c1 || traverse_c2 || traverse_c3)
                     {
                         uint a = INVALID_ADDR;
-                        half d = 100000000.0f;
+                        float d = FLT_MAX;
 
                         if (traverse_c0)
                         {
@@ -448,7 +450,7 @@ KERNEL void occluded_main(
                         if (t < closest_t)
                         {
                             hits[index] = HIT_MARKER;
-                            return;
+                            break;
                         }
 #ifdef RR_RAY_MASK
                 }
@@ -471,7 +473,10 @@ KERNEL void occluded_main(
             }
 
             // Finished traversal, but no intersection found
-            hits[index] = MISS_MARKER;
+            if (addr == INVALID_ADDR)
+            {
+                hits[index] = MISS_MARKER;
+            }
         }
     }
 }
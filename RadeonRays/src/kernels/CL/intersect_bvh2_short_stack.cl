@@ -90,7 +90,6 @@ TYPE DEFINITIONS
 **************************************************************************/
 
 #define LEAFNODE(x) (((x).child0) == -1)
-#define GLOBAL_STACK_SIZE 32
 #define SHORT_STACK_SIZE 16
 #define WAVEFRONT_SIZE 64
 
@@ -136,6 +135,8 @@ occluded_main(
     GLOBAL int const * restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
+    // Number of stack entries per thread
+    int stack_size,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
@@ -143,19 +144,18 @@ occluded_main(
     // Allocate stack in LDS
     __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
-    int group_id = get_group_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    __global int* gm_stack_base = stack + get_global_id(0) * stack_size;
 
     // Handle only working set
-    if (global_id < *num_rays)
+    for (int global_id = get_global_id(0); global_id < *num_rays; global_id += get_global_size(0))
     {
         ray const r = rays[global_id];
 
         if (ray_is_active(&r))
         {
-            // Allocate stack in global memory 
-            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
             __global int* gm_stack = gm_stack_base;
 
             __local int* lm_stack_base = lds + local_id;
@@ -200,7 +200,7 @@ occluded_main(
                         if (f < t_max)
                         {
                             hits[global_id] = HIT_MARKER;
-                            return;
+                            break;
                         }
 #ifdef RR_RAY_MASK
                     }
@@ -280,7 +280,10 @@ occluded_main(
             }
 
             // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            if (addr == INVALID_IDX)
+            {
+                hits[global_id] = MISS_MARKER;
+            }
         }
     }
 }
@@ -297,25 +300,26 @@ KERNEL void intersect_main(
     GLOBAL int const* restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
+    // Number of stack entries per thread
+    int stack_size,
     // Hit data
     GLOBAL Intersection* hits)
 {
     // Allocate stack in LDS
     __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
-    int group_id = get_group_id(0);
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    __global int* gm_stack_base = stack + get_global_id(0) * stack_size;
 
     // Handle only working subset
-    if (global_id < *num_rays)
+    for (int global_id = get_global_id(0); global_id < *num_rays; global_id += get_global_size(0))
     {
         ray const r = rays[global_id];
 
         if (ray_is_active(&r))
         {
-            // Allocate stack in global memory 
-            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
             __global int* gm_stack = gm_stack_base;
             __local int* lm_stack_base = lds + local_id;
             __local int* lm_stack = lm_stack_base;
@@ -141,11 +141,18 @@ void intersect_main(
                     // Check if the node is a leaf
                     if (LEAFNODE(node))
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-#ifdef RR_RAY_MASK
-                        if (ray_get_mask(&r) != face.shape_id)
+                        // Leaf faces are stored contiguously
+                        int const start_idx = STARTIDX(node);
+                        int const end_idx = start_idx + NUMPRIMS(node);
+
+                        for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                         {
+                            Face const face = faces[face_idx];
+#ifdef RR_RAY_MASK
+                            if (ray_get_mask(&r) == face.shape_id)
+                            {
+                                continue;
+                            }
 #endif // RR_RAY_MASK
                             float3 const v1 = vertices[face.idx[0]];
                             float3 const v2 = vertices[face.idx[1]];
@@ -159,9 +166,7 @@ void intersect_main(
                                 t_max = f;
                                 isect_idx = face_idx;
                             }
-#ifdef RR_RAY_MASK
                         }
-#endif // RR_RAY_MASK
                     }
                     else
                     {
@@ -250,11 +255,18 @@ void occluded_main(
                     // Check if the node is a leaf
                     if (LEAFNODE(node))
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-#ifdef RR_RAY_MASK
-                        if (ray_get_mask(&r) != face.shape_id)
+                        // Leaf faces are stored contiguously
+                        int const start_idx = STARTIDX(node);
+                        int const end_idx = start_idx + NUMPRIMS(node);
+
+                        for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                         {
+                            Face const face = faces[face_idx];
+#ifdef RR_RAY_MASK
+                            if (ray_get_mask(&r) == face.shape_id)
+                            {
+                                continue;
+                            }
 #endif // RR_RAY_MASK
                             float3 const v1 = vertices[face.idx[0]];
                             float3 const v2 = vertices[face.idx[1]];
@@ -268,9 +280,7 @@ void occluded_main(
                                 hits[global_id] = HIT_MARKER;
                                 return;
                             }
-#ifdef RR_RAY_MASK
                         }
-#endif // RR_RAY_MASK
                     }
                     else
                     {
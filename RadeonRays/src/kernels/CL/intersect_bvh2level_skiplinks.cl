@@ -62,6 +62,7 @@ DEFINES
 **************************************************************************/
 #define PI 3.14159265358979323846f
 #define STARTIDX(x)     (((int)(x.pmin.w)) >> 4)
+#define NUMPRIMS(x)     (((int)(x.pmin.w)) & 0xF)
 #define SHAPEIDX(x)     (((int)(x.pmin.w)) >> 4)
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
 #define NEXT(x)     ((int)((x).pmax.w))
@@ -195,26 +196,31 @@ KERNEL void intersect_main(
                         // or containing another BVH (top level hierarhcy)
                         if (top_addr != INVALID_IDX)
                         {
-                            // Intersect leaf here
+                            // Intersect leaf here, its faces are stored contiguously
                             //
-                            int const face_idx = STARTIDX(node);
-                            Face const face = faces[face_idx];
-                            float3 const v1 = vertices[face.idx[0]];
-                            float3 const v2 = vertices[face.idx[1]];
-                            float3 const v3 = vertices[face.idx[2]];
-
-                            // Intersect triangle
-                            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                            // If hit update closest hit distance and index
-                            if (f < t_max)
-                            {
-                                t_max = f;
-                                closest_prim_id = face.prim_id;
-                                closest_shape_id = shape_id;
+                            int const start_idx = STARTIDX(node);
+                            int const end_idx = start_idx + NUMPRIMS(node);
 
-                                float3 const p = r.o.xyz + r.d.xyz * t_max;
-                                // Calculte barycentric coordinates
-                                closest_barycentrics = triangle_calculate_barycentrics(p, v1, v2, v3);
+                            for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
+                            {
+                                Face const face = faces[face_idx];
+                                float3 const v1 = vertices[face.idx[0]];
+                                float3 const v2 = vertices[face.idx[1]];
+                                float3 const v3 = vertices[face.idx[2]];
+
+                                // Intersect triangle
+                                float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                                // If hit update closest hit distance and index
+                                if (f < t_max)
+                                {
+                                    t_max = f;
+                                    closest_prim_id = face.prim_id;
+                                    closest_shape_id = shape_id;
+
+                                    float3 const p = r.o.xyz + r.d.xyz * t_max;
+                                    // Calculte barycentric coordinates
+                                    closest_barycentrics = triangle_calculate_barycentrics(p, v1, v2, v3);
+                                }
                             }
 
                             // And goto next node
@@ -364,21 +370,26 @@ KERNEL void occluded_main(
                         // or containing another BVH (top level hierarhcy)
                         if (top_addr != INVALID_IDX)
                         {
-                            // Intersect leaf here
+                            // Intersect leaf here, its faces are stored contiguously
                             //
-                            int const face_idx = STARTIDX(node);
-                            Face const face = faces[face_idx];
-                            float3 const v1 = vertices[face.idx[0]];
-                            float3 const v2 = vertices[face.idx[1]];
-                            float3 const v3 = vertices[face.idx[2]];
-
-                            // Intersect triangle
-                            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                            // If hit update closest hit distance and index
-                            if (f < t_max)
+                            int const start_idx = STARTIDX(node);
+                            int const end_idx = start_idx + NUMPRIMS(node);
+
+                            for (int face_idx = start_idx; face_idx < end_idx; ++face_idx)
                             {
-                                hits[global_id] = HIT_MARKER;
-                                return;
+                                Face const face = faces[face_idx];
+                                float3 const v1 = vertices[face.idx[0]];
+                                float3 const v2 = vertices[face.idx[1]];
+                                float3 const v3 = vertices[face.idx[2]];
+
+                                // Intersect triangle
+                                float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                                // If hit store the result and bail out
+                                if (f < t_max)
+                                {
+                                    hits[global_id] = HIT_MARKER;
+                                    return;
+                                }
                             }
 
                             // And goto next node
@@ -52,7 +52,6 @@ TYPE DEFINITIONS
 **************************************************************************/
 #define STARTIDX(x)     (((int)((x).child0)))
 #define LEAFNODE(x)     (((x).child0) == ((x).child1))
-#define GLOBAL_STACK_SIZE 32
 #define SHORT_STACK_SIZE 16
 #define WAVEFRONT_SIZE 64
 
@@ -91,26 +90,29 @@ occluded_main(
     GLOBAL int const * restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
+    // Number of stack entries per thread
+    int stack_size,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
 {
-    int global_id = get_global_id(0);
+    // Short stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
     int local_id = get_local_id(0);
-    int group_id = get_group_id(0);
 
-    // Handle only working set
-    if (global_id < *num_rays)
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    for (int index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
-        ray const r = rays[global_id];
+        ray const r = rays[index];
 
         if (ray_is_active(&r))
         {
             // Allocate stack in global memory 
-            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack_base = stack + get_global_id(0) * stack_size;
             __global int* gm_stack = gm_stack_base;
-            // Allocate stack in LDS
-            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            // Stack in LDS
             __local int* lm_stack_base = lds + local_id;
             __local int* lm_stack = lm_stack_base;
 
@@ -122,8 +124,8 @@ occluded_main(
 
             // Current node address
             int addr = 0;
-            // Current closest intersection leaf index
-            int isect_idx = INVALID_IDX;
+            // Hit result
+            int hit = MISS_MARKER;
 
             //  Initalize local stack
             *lm_stack = INVALID_IDX;
@@ -150,11 +152,11 @@ occluded_main(
                         float3 const v3 = vertices[face.idx[2]];
                         // Intersect triangle
                         float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                        // If hit update closest hit distance and index
+                        // Any hit terminates the traversal
                         if (f < t_max)
                         {
-                            hits[global_id] = HIT_MARKER;
-                            return;
+                            hit = HIT_MARKER;
+                            break;
                         }
 #ifdef RR_RAY_MASK
                     }
@@ -233,8 +235,7 @@ occluded_main(
                 }
             }
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            hits[index] = hit;
         }
     }
 }
@@ -255,25 +256,28 @@ KERNEL void intersect_main(
     GLOBAL int const* restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
+    // Number of stack entries per thread
+    int stack_size,
     // Hit data
     GLOBAL Intersection* hits)
 {
-    int global_id = get_global_id(0);
+    // Short stack in LDS
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
     int local_id = get_local_id(0);
-    int group_id = get_group_id(0);
 
-    // Handle only working subset
-    if (global_id < *num_rays)
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    for (int index = get_global_id(0); index < *num_rays; index += get_global_size(0))
     {
-        ray const r = rays[global_id];
+        ray const r = rays[index];
 
         if (ray_is_active(&r))
         {
             // Allocate stack in global memory 
-            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack_base = stack + get_global_id(0) * stack_size;
             __global int* gm_stack = gm_stack_base;
-            // Allocate stack in LDS
-            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            // Stack in LDS
             __local int* lm_stack_base = lds + local_id;
             __local int* lm_stack = lm_stack_base;
 
@@ -409,15 +413,15 @@ KERNEL void intersect_main(
                 // Calculte barycentric coordinates
                 float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
                 // Update hit information
-                hits[global_id].shape_id = face.shape_id;
-                hits[global_id].prim_id = face.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+                hits[index].shape_id = face.shape_id;
+                hits[index].prim_id = face.prim_id;
+                hits[index].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
             }
             else
             {
                 // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                hits[index].shape_id = MISS_MARKER;
+                hits[index].prim_id = MISS_MARKER;
             }
         }
     }
@@ -0,0 +1,376 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define INVALID_ADDR 0xffffffffu
+
+#define GROUP_SIZE 64
+#define LDS_STACK_SIZE 16
+
+// Number of children per node, set by the host
+#ifndef BVH_WIDTH
+#define BVH_WIDTH 8
+#endif
+
+// Wide BVH node, see WideBvhTranslator::Node.
+// Children are ordered as internal nodes, then triangles.
+typedef struct
+{
+    // Min point of the node box, origin of the quantization grid
+    float origin[3];
+    // Index of the first internal child
+    uint child_base;
+    // Index of the first triangle child
+    uint triangle_base;
+    // Biased exponents of the grid cell size
+    uchar exponent[3];
+    // Number of internal children
+    uchar num_internal;
+    // Quantized child boxes
+    uchar qmin_x[BVH_WIDTH];
+    uchar qmin_y[BVH_WIDTH];
+    uchar qmin_z[BVH_WIDTH];
+    uchar qmax_x[BVH_WIDTH];
+    uchar qmax_y[BVH_WIDTH];
+    uchar qmax_z[BVH_WIDTH];
+    // Number of internal and triangle children
+    uchar num_children;
+} __attribute__((aligned(16))) wide_node;
+
+// Leaf triangle, w components keep mesh and primitive IDs
+typedef struct
+{
+    float4 v0_and_mesh_id;
+    float4 v1_and_prim_id;
+    float4 v2;
+} wide_triangle;
+
+#define mymin3(a, b, c) min(min((a), (b)), (c))
+#define mymax3(a, b, c) max(max((a), (b)), (c))
+
+INLINE float3 safe_invdir2(ray r)
+{
+    float const dirx = r.d.x;
+    float const diry = r.d.y;
+    float const dirz = r.d.z;
+    float const ooeps = 1e-5;
+    float3 invdir;
+    invdir.x = 1.0f / (fabs(dirx) > ooeps ? dirx : copysign(ooeps, dirx));
+    invdir.y = 1.0f / (fabs(diry) > ooeps ? diry : copysign(ooeps, diry));
+    invdir.z = 1.0f / (fabs(dirz) > ooeps ? dirz : copysign(ooeps, dirz));
+    return invdir;
+}
+
+// Slab test of all the children, returns mask of the ones intersected
+// within [0, t_max] and stores their entry distances into tnear.
+// Quantized planes are q * 2^e + origin, the product is exact, so boxes
+// are exactly the ones the host has rounded outwards.
+INLINE uint intersect_children(wide_node const* node, float3 invdir, float3 oxinvdir, float t_max, float* tnear)
+{
+    float3 const origin = (float3)(node->origin[0], node->origin[1], node->origin[2]);
+    float3 const scale = as_float3(convert_uint3((uchar3)(node->exponent[0], node->exponent[1], node->exponent[2])) << 23);
+
+    uint mask = 0;
+
+    for (uint i = 0; i < node->num_children; ++i)
+    {
+        float3 const pmin = fma(convert_float3((uchar3)(node->qmin_x[i], node->qmin_y[i], node->qmin_z[i])), scale, origin);
+        float3 const pmax = fma(convert_float3((uchar3)(node->qmax_x[i], node->qmax_y[i], node->qmax_z[i])), scale, origin);
+
+        float3 const f = fma(pmax, invdir, oxinvdir);
+        float3 const n = fma(pmin, invdir, oxinvdir);
+
+        float3 const tmax = max(f, n);
+        float3 const tmin = min(f, n);
+
+        float const t1 = min(mymin3(tmax.x, tmax.y, tmax.z), t_max);
+        float const t0 = max(mymax3(tmin.x, tmin.y, tmin.z), 0.f);
+
+        tnear[i] = t0;
+        mask |= (t0 <= t1) ? (1u << i) : 0u;
+    }
+
+    return mask;
+}
+
+INLINE void stack_push(
+    __local uint *lds_stack,
+    __private uint *lds_sptr,
+    uint lds_stack_bottom,
+    __global uint *stack,
+    __private uint *sptr,
+    uint idx)
+{
+    if (*lds_sptr - lds_stack_bottom >= LDS_STACK_SIZE)
+    {
+        for (int i = 1; i < LDS_STACK_SIZE; ++i)
+        {
+            stack[*sptr + i] = lds_stack[lds_stack_bottom + i];
+        }
+
+        *sptr = *sptr + LDS_STACK_SIZE;
+        *lds_sptr = lds_stack_bottom + 1;
+    }
+
+    lds_stack[*lds_sptr] = idx;
+    *lds_sptr = *lds_sptr + 1;
+}
+
+INLINE uint stack_pop(
+    __local uint *lds_stack,
+    __private uint *lds_sptr,
+    uint lds_stack_bottom,
+    __global uint *stack,
+    __private uint *sptr,
+    uint stack_bottom)
+{
+    uint addr = lds_stack[--*lds_sptr];
+
+    if (addr == INVALID_ADDR && *sptr > stack_bottom)
+    {
+        *sptr = *sptr - LDS_STACK_SIZE;
+        for (int i = 1; i < LDS_STACK_SIZE; ++i)
+        {
+            lds_stack[lds_stack_bottom + i] = stack[*sptr + i];
+        }
+
+        *lds_sptr = lds_stack_bottom + LDS_STACK_SIZE - 1;
+        addr = lds_stack[*lds_sptr];
+    }
+
+    return addr;
+}
+
+// Closest hit or any hit traversal, returns triangle index or INVALID_ADDR
+INLINE uint traverse(
+    GLOBAL const wide_node *restrict nodes,
+    GLOBAL const wide_triangle *restrict triangles,
+    ray const* my_ray,
+    float* closest_t,
+    bool any_hit,
+    __local uint *lds_stack,
+    uint lds_stack_bottom,
+    __global uint *stack,
+    uint stack_bottom)
+{
+    // Precompute inverse direction and origin / dir for bbox testing
+    const float3 invDir = safe_invdir2(*my_ray);
+    const float3 oxInvDir = -my_ray->o.xyz * invDir;
+
+    uint closest_idx = INVALID_ADDR;
+    uint addr = 0;
+
+    uint sptr = stack_bottom;
+    uint lds_sptr = lds_stack_bottom;
+
+    lds_stack[lds_sptr++] = INVALID_ADDR;
+
+    while (addr != INVALID_ADDR)
+    {
+        const wide_node node = nodes[addr];
+
+        float tnear[BVH_WIDTH];
+        uint mask = intersect_children(&node, invDir, oxInvDir, *closest_t, tnear);
+
+        // Triangles go right away, so closer hits cull internal children below
+        for (uint i = node.num_internal; i < node.num_children; ++i)
+        {
+            if (mask & (1u << i))
+            {
+                uint const idx = node.triangle_base + i - node.num_internal;
+                const wide_triangle triangle = triangles[idx];
+
+#ifdef RR_RAY_MASK
+                if (ray_get_mask(my_ray) != as_int(triangle.v0_and_mesh_id.w))
+#endif // RR_RAY_MASK
+                {
+                    float t = fast_intersect_triangle(
+                        *my_ray,
+                        triangle.v0_and_mesh_id.xyz,
+                        triangle.v1_and_prim_id.xyz,
+                        triangle.v2.xyz,
+                        *closest_t);
+
+                    if (t < *closest_t)
+                    {
+                        *closest_t = t;
+                        closest_idx = idx;
+
+                        if (any_hit)
+                        {
+                            return closest_idx;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Internal children are visited front to back, the closest one goes next
+        uint children[BVH_WIDTH];
+        uint num_children = 0;
+
+        for (uint i = 0; i < node.num_internal; ++i)
+        {
+            if ((mask & (1u << i)) && tnear[i] <= *closest_t)
+            {
+                uint j = num_children++;
+                for (; j > 0 && tnear[children[j - 1]] < tnear[i]; --j)
+                {
+                    children[j] = children[j - 1];
+                }
+
+                children[j] = i;
+            }
+        }
+
+        if (num_children > 0)
+        {
+            for (uint i = 0; i + 1 < num_children; ++i)
+            {
+                stack_push(lds_stack, &lds_sptr, lds_stack_bottom, stack, &sptr, node.child_base + children[i]);
+            }
+
+            addr = node.child_base + children[num_children - 1];
+            continue;
+        }
+
+        addr = stack_pop(lds_stack, &lds_sptr, lds_stack_bottom, stack, &sptr, stack_bottom);
+    }
+
+    return closest_idx;
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL const wide_node *restrict nodes,
+    // Leaf triangles
+    GLOBAL const wide_triangle *restrict triangles,
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Stack memory
+    GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
+    // Hit data
+    GLOBAL Intersection *hits)
+{
+    __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
+
+    uint lds_stack_bottom = get_local_id(0) * LDS_STACK_SIZE;
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
+
+    // Handle only working subset
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
+    {
+        const ray my_ray = rays[index];
+
+        if (ray_is_active(&my_ray))
+        {
+            // Intersection parametric distance
+            float closest_t = my_ray.o.w;
+
+            uint idx = traverse(nodes, triangles, &my_ray, &closest_t, false,
+                lds_stack, lds_stack_bottom, stack, stack_bottom);
+
+            // Check if we have found an intersection
+            if (idx != INVALID_ADDR)
+            {
+                // Calculate hit position
+                const wide_triangle triangle = triangles[idx];
+                const float3 p = my_ray.o.xyz + closest_t * my_ray.d.xyz;
+
+                // Calculate barycentric coordinates
+                const float2 uv = triangle_calculate_barycentrics(
+                    p,
+                    triangle.v0_and_mesh_id.xyz,
+                    triangle.v1_and_prim_id.xyz,
+                    triangle.v2.xyz);
+
+                // Update hit information
+                hits[index].prim_id = as_int(triangle.v1_and_prim_id.w);
+                hits[index].shape_id = as_int(triangle.v0_and_mesh_id.w);
+                hits[index].uvwt = (float4)(uv.x, uv.y, 0.0f, closest_t);
+            }
+            else
+            {
+                // Miss here
+                hits[index].prim_id = MISS_MARKER;
+                hits[index].shape_id = MISS_MARKER;
+            }
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_main(
+    // Bvh nodes
+    GLOBAL const wide_node *restrict nodes,
+    // Leaf triangles
+    GLOBAL const wide_triangle *restrict triangles,
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Stack memory
+    GLOBAL uint *stack,
+    // Number of stack entries per thread
+    uint stack_size,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int *hits)
+{
+    __local uint lds_stack[GROUP_SIZE * LDS_STACK_SIZE];
+
+    uint lds_stack_bottom = get_local_id(0) * LDS_STACK_SIZE;
+    // Each thread owns a stack slice and loops over the rays,
+    // so the batch is processed in tiles if there are less threads
+    uint stack_bottom = stack_size * get_global_id(0);
+
+    // Handle only working subset
+    for (uint index = get_global_id(0); index < *num_rays; index += get_global_size(0))
+    {
+        const ray my_ray = rays[index];
+
+        if (ray_is_active(&my_ray))
+        {
+            // Intersection parametric distance
+            float closest_t = my_ray.o.w;
+
+            uint idx = traverse(nodes, triangles, &my_ray, &closest_t, true,
+                lds_stack, lds_stack_bottom, stack, stack_bottom);
+
+            hits[index] = idx != INVALID_ADDR ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
@@ -0,0 +1,199 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file sort_rays.cl
+    \brief Ray batch reordering used by RaySorter.
+
+    Each ray gets a 30 bit key: 9 bit Morton code of its direction over
+    21 bit Morton code of its origin quantized within the scene bounds.
+    Rays sorted by these keys go in similar directions from nearby points,
+    so neighbouring threads visit similar nodes during the traversal.
+    Inactive rays and the tail of the batch past the ray count get the
+    largest key, the sort is stable, so they end up after active rays.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+#define INACTIVE_RAY_KEY 0x7fffffff
+
+/*************************************************************************
+HELPER FUNCTIONS
+**************************************************************************/
+// Insert two zero bits after each of the 10 low bits of x
+INLINE
+uint expand_bits(uint x)
+{
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// Map [0, 1] to [0, 2^bits - 1], NaNs and values out of range are clamped
+INLINE
+uint3 quantize(float3 v, uint bits)
+{
+    const float max_value = (float)((1u << bits) - 1);
+    return convert_uint3(fmin(fmax(v * max_value, 0.f), max_value));
+}
+
+INLINE
+uint morton3(uint3 v)
+{
+    return (expand_bits(v.x) << 2) | (expand_bits(v.y) << 1) | expand_bits(v.z);
+}
+
+INLINE
+int calculate_ray_key(ray const* r, float3 scene_min, float3 scene_scale)
+{
+    const float len = length(r->d.xyz);
+    const float3 dir = len > 0.f ? r->d.xyz * (0.5f / len) + 0.5f : (float3)(0.5f, 0.5f, 0.5f);
+
+    const uint dir_code = morton3(quantize(dir, 3));
+    const uint org_code = morton3(quantize((r->o.xyz - scene_min) * scene_scale, 7));
+
+    return (int)((dir_code << 21) | org_code);
+}
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Calculate sort keys and initial ray indices for the whole batch capacity
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void calculate_ray_keys_main(
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Capacity of rays buffer
+    int max_rays,
+    // Min point of the scene bounds
+    float4 scene_min,
+    // Reciprocal extents of the scene bounds, 0 for flat axes
+    float4 scene_scale,
+    // Ray keys
+    GLOBAL int *keys,
+    // Ray indices
+    GLOBAL int *indices)
+{
+    const int index = get_global_id(0);
+
+    if (index < max_rays)
+    {
+        int key = INACTIVE_RAY_KEY;
+
+        if (index < *num_rays)
+        {
+            const ray my_ray = rays[index];
+
+            if (ray_is_active(&my_ray))
+            {
+                key = calculate_ray_key(&my_ray, scene_min.xyz, scene_scale.xyz);
+            }
+        }
+
+        keys[index] = key;
+        indices[index] = index;
+    }
+}
+
+// Copy rays into the sorted order
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void gather_rays_main(
+    // Rays
+    GLOBAL const ray *restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Original index of each sorted ray
+    GLOBAL const int *restrict indices,
+    // Sorted rays
+    GLOBAL ray *sorted_rays)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_rays)
+    {
+        sorted_rays[index] = rays[indices[index]];
+    }
+}
+
+// Move intersections back into the original ray order,
+// results of inactive rays are left untouched as kernels do
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_hits_main(
+    // Sorted rays
+    GLOBAL const ray *restrict sorted_rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Original index of each sorted ray
+    GLOBAL const int *restrict indices,
+    // Hits of sorted rays
+    GLOBAL const Intersection *restrict sorted_hits,
+    // Hit data
+    GLOBAL Intersection *hits)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_rays)
+    {
+        const ray my_ray = sorted_rays[index];
+
+        if (ray_is_active(&my_ray))
+        {
+            hits[indices[index]] = sorted_hits[index];
+        }
+    }
+}
+
+// Move occlusion results back into the original ray order
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_occlusion_main(
+    // Sorted rays
+    GLOBAL const ray *restrict sorted_rays,
+    // Number of rays in rays buffer
+    GLOBAL const int *restrict num_rays,
+    // Original index of each sorted ray
+    GLOBAL const int *restrict indices,
+    // Results of sorted rays
+    GLOBAL const int *restrict sorted_hits,
+    // Hit results
+    GLOBAL int *hits)
+{
+    const int index = get_global_id(0);
+
+    if (index < *num_rays)
+    {
+        const ray my_ray = sorted_rays[index];
+
+        if (ray_is_active(&my_ray))
+        {
+            hits[indices[index]] = sorted_hits[index];
+        }
+    }
+}
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include <memory>
 
 #include "shapeimpl.h"
+#include "../except/except.h"
 #include "math/float3.h"
 #include "math/float2.h"
 
@@ -47,6 +48,9 @@ namespace RadeonRays
 
         // Instance flag
         bool is_instance() const override;
+
+        // Instances share geometry with the base shape
+        void UpdateVertices(float const* vertices, int vnum, int vstride) override;
     private:
         /// Disallow to copy meshes, too heavy
         Instance(Instance const& o) = delete;
@@ -71,6 +75,11 @@ namespace RadeonRays
         return true;
     }
 
+    inline void Instance::UpdateVertices(float const*, int, int)
+    {
+        Throw("Instance vertices can only be updated through the base shape");
+    }
+
 }
 
 #endif // MESH_H
@@ -32,7 +32,13 @@ namespace RadeonRays
         int const* vidx, int vistride,
         int const* nfaceverts,
         int nfaces)
-        : puretriangle_(true)
+        : shared_vertices_(nullptr)
+        , shared_indices_(nullptr)
+        , vstride_(0)
+        , istride_(0)
+        , numvertices_(vnum)
+        , numfaces_(nfaces)
+        , puretriangle_(true)
     {
         // Handle vertices
         // Allocate space in advance
@@ -112,16 +118,62 @@ namespace RadeonRays
         }
     }
 
+    Mesh::Mesh(float const* vertices, int vnum, int vstride,
+        int const* vidx, int vistride,
+        int nfaces)
+        : shared_vertices_(vertices)
+        , shared_indices_(vidx)
+        , vstride_((vstride == 0) ? (3 * sizeof(float)) : vstride)
+        , istride_((vistride == 0) ? (3 * sizeof(int)) : vistride)
+        , numvertices_(vnum)
+        , numfaces_(nfaces)
+        , puretriangle_(true)
+    {
+        ThrowIf(!vertices || !vidx, "Shared mesh requires vertex and index data");
+    }
+
+    void Mesh::UpdateVertices(float const* vertices, int vnum, int vstride)
+    {
+        ThrowIf(vnum != num_vertices(), "Vertex count can't be changed by UpdateVertices");
+
+        // Calculate vertex stride, assume dense packing if non passed
+        vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+
+        // Shared meshes just reference the new data
+        if (shared())
+        {
+            ThrowIf(!vertices, "Shared mesh requires vertex data");
+
+            shared_vertices_ = vertices;
+            vstride_ = vstride;
+
+            SetStateChange(kStateChangeVertices);
+            return;
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < vnum; ++i)
+        {
+            float const* current = (float const*)((char*)vertices + i*vstride);
+
+            vertices_[i] = float3(current[0], current[1], current[2]);
+        }
+
+        SetStateChange(kStateChangeVertices);
+    }
+
     int Mesh::GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const
     {
+        auto face = GetFace(faceidx);
+
         // origin code special cased identity matrix. TODO check speed regressions
-        outverts[0] = transform_point(vertices_[faces_[faceidx].i0], transform);
-        outverts[1] = transform_point(vertices_[faces_[faceidx].i1], transform);
-        outverts[2] = transform_point(vertices_[faces_[faceidx].i2], transform);
+        outverts[0] = transform_point(GetVertex(face.i0), transform);
+        outverts[1] = transform_point(GetVertex(face.i1), transform);
+        outverts[2] = transform_point(GetVertex(face.i2), transform);
 
-        if (faces_[faceidx].type_ == FaceType::QUAD)
+        if (face.type_ == FaceType::QUAD)
         {
-            outverts[3] = transform_point(vertices_[faces_[faceidx].i3], transform);
+            outverts[3] = transform_point(GetVertex(face.i3), transform);
             return 4;
         } else
         {
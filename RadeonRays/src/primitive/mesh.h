@@ -63,11 +63,16 @@ namespace RadeonRays
             FaceType type_;
         };
 
-        //
+        // Copy vertices and faces into the mesh
         Mesh(float const* vertices, int vnum, int vstride,
             int const* vidx, int vistride,
             int const* nfaceverts,
             int nfaces);
+        // Reference application owned triangle data without copying,
+        // it must stay valid until the mesh is deleted
+        Mesh(float const* vertices, int vnum, int vstride,
+            int const* vidx, int vistride,
+            int nfaces);
         
         //
         ~Mesh() = default;
@@ -77,12 +82,16 @@ namespace RadeonRays
         int num_vertices() const;
         // 
         void GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const;
-        //
-        float3 const* GetVertexData() const { return &vertices_[0]; }
-        //
-        Face const* GetFaceData() const { return &faces_[0]; }
+        // Update vertex positions keeping the topology
+        void UpdateVertices(float const* vertices, int vnum, int vstride) override;
+        // Object space position of a vertex
+        float3 GetVertex(int idx) const;
+        // Vertex indices of a face
+        Face GetFace(int idx) const;
         // True if the mesh consists of triangles only
         bool puretriangle() const { return puretriangle_;  }
+        // True if the mesh references application memory
+        bool shared() const { return shared_vertices_ != nullptr; }
 
     private:
         /// Disallow to copy meshes, too heavy
@@ -96,6 +105,13 @@ namespace RadeonRays
         std::vector<float3> vertices_;
         /// Primitives
         std::vector<Face> faces_;
+        /// Application owned vertices and indices of shared meshes
+        float const* shared_vertices_;
+        int const* shared_indices_;
+        int vstride_;
+        int istride_;
+        int numvertices_;
+        int numfaces_;
         /// Pure triangle flag
         bool puretriangle_;
     };
@@ -103,13 +119,44 @@ namespace RadeonRays
     //
     inline int Mesh::num_faces() const
     {
-        return (int)faces_.size();
+        return numfaces_;
     }
 
     //
     inline int Mesh::num_vertices() const
     {
-        return (int)vertices_.size();
+        return numvertices_;
+    }
+
+    //
+    inline float3 Mesh::GetVertex(int idx) const
+    {
+        if (!shared_vertices_)
+        {
+            return vertices_[idx];
+        }
+
+        auto current = (float const*)((char const*)shared_vertices_ + (std::size_t)idx * vstride_);
+        return float3(current[0], current[1], current[2]);
+    }
+
+    //
+    inline Mesh::Face Mesh::GetFace(int idx) const
+    {
+        if (!shared_vertices_)
+        {
+            return faces_[idx];
+        }
+
+        auto current = (int const*)((char const*)shared_indices_ + (std::size_t)idx * istride_);
+
+        Face face;
+        face.i0 = current[0];
+        face.i1 = current[1];
+        face.i2 = current[2];
+        face.i3 = -1;
+        face.type_ = FaceType::TRIANGLE;
+        return face;
     }
 }
 
@@ -25,6 +25,10 @@ THE SOFTWARE.
 #include "radeon_rays.h"
 #include "math/float3.h"
 #include "math/matrix.h"
+#include "../world/world.h"
+
+#include <algorithm>
+#include <vector>
 
 namespace RadeonRays
 {
@@ -41,11 +45,17 @@ namespace RadeonRays
             kStateChangeTransform = 0x1,
             kStateChangeMotion = 0x2,
             kStateChangeId = 0x4,
-            kStateChangeMask = 0x5
+            kStateChangeMask = 0x5,
+            kStateChangeVertices = 0x8,
+            // Changes which keep BVH topology valid
+            kStateChangeRefitMask = kStateChangeTransform | kStateChangeVertices
         };
         
         // Constructor
-        ShapeImpl() = default;
+        ShapeImpl()
+            : statechange_(kStateChangeNone)
+        {
+        }
 
         // Destructor
         ~ShapeImpl() = default;
@@ -80,10 +90,14 @@ namespace RadeonRays
         // Get state changes since last OnCommit
         int GetStateChange() const;
 
-        // Clear state change
-        void OnCommit() const;
+        // Clear state change once none of the other worlds
+        // the shape is attached to has the change pending
+        void OnCommit(World const* world) const;
         
     protected:
+        // Add state change flags and report them to the worlds the shape is attached to
+        void SetStateChange(int flags) const;
+
         // World transform
         matrix worldmat_;
         matrix worldmatinv_;
@@ -93,13 +107,19 @@ namespace RadeonRays
         Id id_;
         // State change
         mutable int statechange_;
+
+    private:
+        friend class World;
+
+        // Worlds the shape is attached to
+        mutable std::vector<World const*> worlds_;
     };
     
     inline void ShapeImpl::SetTransform(matrix const& m, matrix const& minv)
     {
         worldmat_ = m;
         worldmatinv_ = minv;
-        statechange_ |= kStateChangeTransform;
+        SetStateChange(kStateChangeTransform);
     }
     
     inline void ShapeImpl::GetTransform(matrix& m, matrix& minv) const
@@ -111,7 +131,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetLinearVelocity(float3 const& v)
     {
         linearmotion_ = v;
-        statechange_ |= kStateChangeMotion;
+        SetStateChange(kStateChangeMotion);
     }
     
     inline float3 ShapeImpl::GetLinearVelocity() const
@@ -122,7 +142,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetAngularVelocity(quaternion const& q)
     {
         angulrmotion_ = q;
-        statechange_ |= kStateChangeMotion;
+        SetStateChange(kStateChangeMotion);
     }
     
     inline quaternion ShapeImpl::GetAngularVelocity() const
@@ -133,7 +153,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetId(Id id)
     {
         id_ = id;
-        statechange_ |= kStateChangeId;
+        SetStateChange(kStateChangeId);
     }
     
     inline Id ShapeImpl::GetId() const
@@ -146,9 +166,25 @@ namespace RadeonRays
         return statechange_;
     }
     
-    inline void ShapeImpl::OnCommit() const
+    inline void ShapeImpl::OnCommit(World const* world) const
+    {
+        auto pending = std::any_of(worlds_.cbegin(), worlds_.cend(),
+            [this, world](World const* other) { return other != world && other->HasStateChange(this); });
+
+        if (!pending)
+        {
+            statechange_ = kStateChangeNone;
+        }
+    }
+
+    inline void ShapeImpl::SetStateChange(int flags) const
     {
-        statechange_ = kStateChangeNone;
+        statechange_ |= flags;
+
+        for (auto world : worlds_)
+        {
+            world->OnShapeChanged(this, flags);
+        }
     }
 
     inline bool ShapeImpl::is_instance() const
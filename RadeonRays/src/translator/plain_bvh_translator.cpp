@@ -24,231 +24,240 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
+#include <algorithm>
 #include <cassert>
 #include <stack>
 #include <iostream>
 
 namespace RadeonRays
 {
+    // Trees with less nodes are translated on a single thread
+    static int constexpr kMinParallelNodes = 8192;
+
     void PlainBvhTranslator::Process(Bvh& bvh)
     {
-        // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
-        nodecnt_ = 0;
-        int newsize = bvh.m_nodecnt;
-        nodes_.resize(newsize);
-        extra_.resize(newsize);
-
         // Check if we have been initialized
         assert(bvh.m_root);
 
-        // Save current root position
-        int rootidx = 0;
+        // Capacity is kept between the calls, so nodes are only reallocated if the tree grows
+        nodecnt_ = bvh.m_nodecnt;
+        nodes_.resize(nodecnt_);
 
-        // Process root
-        ProcessNode(bvh.m_root);
+        ProcessTree(bvh, 0, 0);
+    }
 
-        // Set next ptr
-        nodes_[rootidx].bounds.pmax.w = -1;
+    void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
+    {
+        ProcessTree(bvh, root_, 0);
+        nodecnt_ = root_ + bvh.m_nodecnt;
+    }
 
-        //
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w != -1.f)
-            {
-                nodes_[i + 1].bounds.pmax.w = nodes_[i].bounds.pmin.w;
-                nodes_[(int)(nodes_[i].bounds.pmin.w)].bounds.pmax.w = nodes_[i].bounds.pmax.w;
-            }
-        }
+    void PlainBvhTranslator::UpdateBounds(Bvh const& bvh, std::vector<std::pair<int, int>>& changed)
+    {
+        assert((int)nodes_.size() == bvh.m_nodecnt);
 
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
-        {
-            if (nodes_[i].bounds.pmin.w == -1.f)
-            {
-                nodes_[i].bounds.pmin.w = (float)extra_[i];
-            }
-            else
-            {
-                nodes_[i].bounds.pmin.w = -1.f;
-            }
-        }
+        UpdateBounds(bvh, 0, changed);
     }
 
-    void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
+    void PlainBvhTranslator::UpdateBounds(Bvh const& bvh, int first, std::vector<std::pair<int, int>>& changed)
     {
-        nodecnt_ = root_;
+        assert(bvh.m_root);
+        assert(first + bvh.m_nodecnt <= (int)nodes_.size());
 
-        // Process root
-        ProcessNode(bvh.m_root);
+        changed.clear();
 
-        // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
+        // Nodes are visited in the same depth-first order Process has used,
+        // links stored in w components are kept intact
+        std::stack<Bvh::Node const*> s;
+        s.push(bvh.m_root);
 
-        for (int j = root_; j < root_ + bvh.m_nodecnt; ++j)
+        int idx = first;
+        while (!s.empty())
         {
-            if (nodes_[j].bounds.pmin.w != -1.f)
-            {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-            }
-        }
+            auto n = s.top();
+            s.pop();
 
-        for (int j = root_; j < root_ + bvh.m_nodecnt; ++j)
-        {
-            if (nodes_[j].bounds.pmin.w == -1.f)
+            auto& bounds = nodes_[idx].bounds;
+
+            if (bounds.pmin.x != n->bounds.pmin.x || bounds.pmin.y != n->bounds.pmin.y || bounds.pmin.z != n->bounds.pmin.z ||
+                bounds.pmax.x != n->bounds.pmax.x || bounds.pmax.y != n->bounds.pmax.y || bounds.pmax.z != n->bounds.pmax.z)
             {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
+                bounds.pmin = float3(n->bounds.pmin.x, n->bounds.pmin.y, n->bounds.pmin.z, bounds.pmin.w);
+                bounds.pmax = float3(n->bounds.pmax.x, n->bounds.pmax.y, n->bounds.pmax.z, bounds.pmax.w);
+
+                // Extend the last range or start a new one
+                if (!changed.empty() && changed.back().second == idx)
+                {
+                    ++changed.back().second;
+                }
+                else
+                {
+                    changed.push_back(std::make_pair(idx, idx + 1));
+                }
             }
-            else
+
+            if (n->type != Bvh::kLeaf)
             {
-                nodes_[j].bounds.pmin.w = -1.f;
+                s.push(n->rc);
+                s.push(n->lc);
             }
-        }
 
+            ++idx;
+        }
     }
 
     void PlainBvhTranslator::Process(Bvh const** bvhs, int const* offsets, int numbvhs)
     {
-        // First of all count the number of required nodes for all BVH's
-        int nodecnt = 0;
-        for (int i = 0; i < numbvhs + 1; ++i)
-        {
-            if (!bvhs[i])
-            {
-                continue;
-            }
-
-            nodecnt += bvhs[i]->m_nodecnt;
-        }
-
-        nodes_.resize(nodecnt);
-        extra_.resize(nodecnt);
+        // Trees are laid out one after another, the top level one goes last
         roots_.resize(numbvhs);
 
+        int nodecnt = 0;
         for (int i = 0; i < numbvhs; ++i)
         {
-            if (!bvhs[i])
+            roots_[i] = -1;
+
+            if (bvhs[i])
             {
-                continue;
+                roots_[i] = nodecnt;
+                nodecnt += bvhs[i]->m_nodecnt;
             }
+        }
 
-            int currentroot = nodecnt_;
-
-            roots_[i] = currentroot;
-            
-            // Process root
-            ProcessNode(bvhs[i]->m_root, offsets[i]);
+        root_ = nodecnt;
+        nodecnt_ = nodecnt + bvhs[numbvhs]->m_nodecnt;
+        nodes_.resize(nodecnt_);
 
-            // Set next ptr
-            nodes_[currentroot].bounds.pmax.w = -1;
+        // Positions are known upfront, so the trees are translated independently
+        int const num_tasks = std::max(1, std::min(numbvhs, 4 * task_scheduler::instance().num_threads()));
 
-            for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j)
+        parallel_for(0, numbvhs, num_tasks, [this, bvhs, offsets](int, int first, int last)
+        {
+            for (int i = first; i < last; ++i)
             {
-                if (nodes_[j].bounds.pmin.w != -1.f)
+                if (bvhs[i])
                 {
-                    nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                    nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
+                    ProcessTree(*bvhs[i], roots_[i], offsets[i]);
                 }
             }
+        });
 
-            for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j)
-            {
-                if (nodes_[j].bounds.pmin.w == -1.f)
-                {
-                    nodes_[j].bounds.pmin.w = (float)extra_[j];
-                }
-                else
-                {
-                    nodes_[j].bounds.pmin.w = -1.f;
-                }
-            }
-        }
-
-        // The final one
-        root_ = nodecnt_;
+        ProcessTree(*bvhs[numbvhs], root_, 0);
+    }
 
-        // Process root
-        ProcessNode(bvhs[numbvhs]->m_root);
+    void PlainBvhTranslator::ProcessTree(Bvh const& bvh, int first, int offset)
+    {
+        assert(bvh.m_root);
+        assert(first + bvh.m_nodecnt <= (int)nodes_.size());
 
-        // Set next ptr
-        nodes_[root_].bounds.pmax.w = -1;
+        int const end = first + bvh.m_nodecnt;
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j)
+        // Small trees are not worth the tasks, nor is a single thread
+        if (bvh.m_nodecnt < kMinParallelNodes || task_scheduler::instance().num_threads() < 2)
         {
-            if (nodes_[j].bounds.pmin.w != -1.f)
-            {
-                nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-                nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-            }
+            int const count = ProcessNode(bvh.m_root, first, end, offset);
+            assert(count == bvh.m_nodecnt);
+            (void)count;
+            return;
         }
 
-        for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j)
+        // Offsets of the top subtrees go first, then they are filled in parallel
+        SubtreeSizes sizes;
+        CountNodes(bvh.m_root, 0, 1, sizes);
+        ProcessNode(bvh.m_root, first, end, offset, 0, 1, sizes);
+    }
+
+    int PlainBvhTranslator::CountNodes(Bvh::Node const* n)
+    {
+        return n->type == Bvh::kLeaf ? 1 : 1 + CountNodes(n->lc) + CountNodes(n->rc);
+    }
+
+    int PlainBvhTranslator::CountNodes(Bvh::Node const* n, int level, int heapidx, SubtreeSizes& sizes)
+    {
+        int count = 1;
+
+        if (n->type != Bvh::kLeaf)
         {
-            if (nodes_[j].bounds.pmin.w == -1.f)
+            if (level < kParallelLevels)
             {
-                nodes_[j].bounds.pmin.w = (float)extra_[j];
+                auto& scheduler = task_scheduler::instance();
+                int left = 0;
+                task_group group;
+
+                scheduler.run(group, [&]() { left = CountNodes(n->lc, level + 1, heapidx << 1, sizes); });
+                count += CountNodes(n->rc, level + 1, (heapidx << 1) + 1, sizes);
+                scheduler.wait(group);
+                count += left;
             }
             else
             {
-                nodes_[j].bounds.pmin.w = -1.f;
+                count += CountNodes(n->lc) + CountNodes(n->rc);
             }
         }
 
+        sizes[heapidx] = count;
+        return count;
     }
 
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n)
+    void PlainBvhTranslator::ProcessNode(Bvh::Node const* n, int idx, int end, int offset, int level, int heapidx, SubtreeSizes const& sizes)
     {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
-        node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
-
-        if (n->type == Bvh::kLeaf)
+        if (level >= kParallelLevels || n->type == Bvh::kLeaf)
         {
-            int startidx = n->startidx;
-            extra = (startidx << 4) | (n->numprims & 0xF);
-            node.bounds.pmin.w = -1.f;
-        }
-        else
-        {
-            ProcessNode(n->lc);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc);
+            ProcessNode(n, idx, end, offset);
+            return;
         }
 
-        return idx;
+        int const next = idx + sizes[heapidx];
+
+        Node& node = nodes_[idx];
+        node.bounds = n->bounds;
+        node.bounds.pmin.w = -1.f;
+        node.bounds.pmax.w = next < end ? (float)next : -1.f;
+
+        // Left child follows its parent, right one goes after the left subtree
+        int const rightidx = idx + 1 + sizes[heapidx << 1];
+
+        auto& scheduler = task_scheduler::instance();
+        task_group group;
+
+        scheduler.run(group, [&]() { ProcessNode(n->lc, idx + 1, end, offset, level + 1, heapidx << 1, sizes); });
+        ProcessNode(n->rc, rightidx, end, offset, level + 1, (heapidx << 1) + 1, sizes);
+        scheduler.wait(group);
     }
 
-    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n, int offset)
+    int PlainBvhTranslator::ProcessNode(Bvh::Node const* n, int idx, int end, int offset)
     {
-        int idx = nodecnt_;
-        //std::cout << "Index " << idx << "\n";
-        Node& node = nodes_[nodecnt_];
+        Node& node = nodes_[idx];
         node.bounds = n->bounds;
-        int& extra = extra_[nodecnt_++];
+
+        int count = 1;
 
         if (n->type == Bvh::kLeaf)
         {
             int startidx = n->startidx + offset;
-            extra = (startidx << 4) | (n->numprims & 0xF);
-            node.bounds.pmin.w = -1.f;
+            assert(n->numprims <= kMaxLeafPrimitives);
+            node.bounds.pmin.w = (float)((startidx << 4) | (n->numprims & 0xF));
         }
         else
         {
-            ProcessNode(n->lc, offset);
-            node.bounds.pmin.w = (float)ProcessNode(n->rc, offset);
+            node.bounds.pmin.w = -1.f;
+            // Left child follows its parent, right one goes after the left subtree
+            count += ProcessNode(n->lc, idx + 1, end, offset);
+            count += ProcessNode(n->rc, idx + count, end, offset);
         }
 
-        return idx;
+        // Skip link is the node following the subtree, -1 past the end of the tree
+        int const next = idx + count;
+        node.bounds.pmax.w = next < end ? (float)next : -1.f;
+        return count;
     }
 
-
     void PlainBvhTranslator::Flush()
     {
         nodecnt_ = 0;
         root_ = 0;
         roots_.resize(0);
         nodes_.resize(0);
-        extra_.resize(0);
     }
 }
@@ -22,7 +22,10 @@ THE SOFTWARE.
 #ifndef PLAIN_BVH_TRANSLATOR_H
 #define PLAIN_BVH_TRANSLATOR_H
 
+#include <array>
 #include <map>
+#include <utility>
+#include <vector>
 
 #include "radeon_rays.h"
 #include "../accelerator/bvh.h"
@@ -42,6 +45,9 @@ namespace RadeonRays
         // Constructor
         PlainBvhTranslator() = default;
 
+        // Leaf primitive count is packed into 4 bits next to the start index
+        static int constexpr kMaxLeafPrimitives = 15;
+
         // Plain BVH node
         struct Node
         {
@@ -53,16 +59,31 @@ namespace RadeonRays
         void Process(Bvh& bvh);
         void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         void UpdateTopLevel(Bvh const& bvh);
+        // Update node bounds after Process(bvh) once bvh has been refitted,
+        // [first, last) ranges of nodes which have been changed are returned
+        void UpdateBounds(Bvh const& bvh, std::vector<std::pair<int, int>>& changed);
+        // Same for the tree translated starting at node first (e.g. top level one at root_)
+        void UpdateBounds(Bvh const& bvh, int first, std::vector<std::pair<int, int>>& changed);
 
         std::vector<Node> nodes_;
-        std::vector<int>  extra_;
         std::vector<int>  roots_;
         int nodecnt_ = 0;
         int root_ = 0;
 
     private:
-        int ProcessNode(Bvh::Node const* node);
-        int ProcessNode(Bvh::Node const* n, int offset);
+        // Subtrees at the levels above this one are translated in parallel
+        static int constexpr kParallelLevels = 6;
+        // Subtree node counts of the top levels by their index in a complete tree
+        using SubtreeSizes = std::array<int, 2 << kParallelLevels>;
+
+        // Translate the tree into nodes_ starting at first, offset is added to leaf primitive indices
+        void ProcessTree(Bvh const& bvh, int first, int offset);
+        static int CountNodes(Bvh::Node const* n);
+        static int CountNodes(Bvh::Node const* n, int level, int heapidx, SubtreeSizes& sizes);
+        // Translate the subtree into nodes_[idx] and following nodes in depth-first order,
+        // end is the position past the tree. Returns the number of nodes.
+        int ProcessNode(Bvh::Node const* n, int idx, int end, int offset);
+        void ProcessNode(Bvh::Node const* n, int idx, int end, int offset, int level, int heapidx, SubtreeSizes const& sizes);
 
         PlainBvhTranslator(PlainBvhTranslator const&) = delete;
         PlainBvhTranslator& operator =(PlainBvhTranslator const&) = delete;
@@ -21,6 +21,9 @@ THE SOFTWARE.
 ********************************************************************/
 #include "q_bvh_translator.h"
 
+#include <algorithm>
+#include <stack>
+
 namespace RadeonRays
 {
 
@@ -47,42 +50,60 @@ namespace RadeonRays
         };
     };
 
-    inline
     std::uint16_t float_to_half(float value, bool min)
     {
         FP32 f; f.f = { value };
-        FP16 o = { 0 };
-        if (f.Exponent == 0) {
-            o.Exponent = 0;
+        std::uint16_t const sign = f.Sign ? 0x8000u : 0u;
+
+        if (f.Exponent == 255)
+        {
+            return static_cast<std::uint16_t>(sign | (f.Mantissa ? 0x7e00u : 0x7c00u));
         }
-        else if (f.Exponent == 255) {
-            o.Exponent = 31;
-            o.Mantissa = f.Mantissa ? 0x200 : 0;
+
+        // Magnitude has to be rounded up if the value is rounded away from zero
+        bool const away = (f.Sign != 0) == min;
+        bool inexact = false;
+        std::uint32_t h = 0;
+
+        int newexp = f.Exponent - 127 + 15;
+        if (f.Exponent == 0)
+        {
+            // Zero or fp32 denormal, the latter is below the smallest half
+            inexact = f.Mantissa != 0;
         }
-        else {
-            int newexp = f.Exponent - 127 + 15;
-            if (newexp >= 31) {
-                o.Exponent = 31;
-            }
-            else if (newexp <= 0) {
-                if ((14 - newexp) <= 24) {
-                    std::uint32_t mant = f.Mantissa | 0x800000;
-                    o.Mantissa = mant >> (14 - newexp);
-                    if (((mant >> (13 - newexp))) & 1 && (!f.Sign && !min || f.Sign && min)) {
-                        o.u++;
-                    }
-                }
+        else if (newexp >= 31)
+        {
+            // Out of half range: infinity or the largest finite value
+            return static_cast<std::uint16_t>(sign | (away ? 0x7c00u : 0x7bffu));
+        }
+        else if (newexp <= 0)
+        {
+            // Half denormal
+            std::uint32_t mant = f.Mantissa | 0x800000u;
+            std::uint32_t shift = 14 - newexp;
+            if (shift > 24)
+            {
+                inexact = true;
             }
-            else {
-                o.Exponent = newexp;
-                o.Mantissa = f.Mantissa >> 13;
-                if (!f.Sign && !min || f.Sign && min)
-                    o.u++;
+            else
+            {
+                h = mant >> shift;
+                inexact = (mant & ((1u << shift) - 1)) != 0;
             }
         }
+        else
+        {
+            h = (newexp << 10) | (f.Mantissa >> 13);
+            inexact = (f.Mantissa & 0x1fffu) != 0;
+        }
+
+        // Carry into exponent gives the next representable value
+        if (inexact && away)
+        {
+            ++h;
+        }
 
-        o.Sign = f.Sign;
-        return o.u;
+        return static_cast<std::uint16_t>(sign | h);
     }
 
     inline
@@ -97,7 +118,6 @@ namespace RadeonRays
         return float_to_half(value, false);
     }
 
-    inline
     float half_to_float(std::uint16_t value)
     {
         FP16 h = { value };
@@ -304,4 +324,138 @@ namespace RadeonRays
         }
     }
 
+    static float SurfaceArea(float const* pmin, float const* pmax)
+    {
+        float const dx = pmax[0] - pmin[0];
+        float const dy = pmax[1] - pmin[1];
+        float const dz = pmax[2] - pmin[2];
+        return 2.f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    bool QBvhTranslator::Validate(const Bvh2 &bvh, float max_area_ratio) const
+    {
+        if (nodes_.empty())
+        {
+            return false;
+        }
+
+        // Node pairs are walked the same way Process has visited them
+        struct Elem
+        {
+            std::uint32_t bvh_node_index;
+            std::uint32_t qbvh_node_index;
+        };
+
+        // Total surface area of child boxes before and after quantization
+        double area = 0.0;
+        double qarea = 0.0;
+
+        // Check if quantized box contains the original one and account for its area
+        auto check_box = [&](float const* pmin, float const* pmax, float const* qmin, float const* qmax)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                if (!(qmin[i] <= pmin[i] && qmax[i] >= pmax[i]))
+                {
+                    return false;
+                }
+            }
+
+            area += SurfaceArea(pmin, pmax);
+            qarea += SurfaceArea(qmin, qmax);
+            return true;
+        };
+
+        auto const num_nodes = static_cast<std::uint32_t>(nodes_.size());
+
+        std::stack<Elem> stack;
+        stack.push({ 0u, 0u });
+
+        while (!stack.empty())
+        {
+            auto elem = stack.top();
+            stack.pop();
+
+            if (elem.qbvh_node_index >= num_nodes)
+            {
+                return false;
+            }
+
+            auto const& node = bvh.m_nodes[elem.bvh_node_index];
+            auto const& qnode = nodes_[elem.qbvh_node_index];
+
+            if (!Bvh2::IsInternal(node))
+            {
+                // Leaves keep full precision triangles
+                float v[3][3];
+                copy3(reinterpret_cast<float const*>(qnode.aabb01_min_or_v0), v[0]);
+                copy3(reinterpret_cast<float const*>(qnode.aabb01_max_or_v1), v[1]);
+                copy3(reinterpret_cast<float const*>(qnode.aabb23_min_or_v2), v[2]);
+
+                if (qnode.addr0 != kInvalidId ||
+                    qnode.addr1_or_mesh_id != node.mesh_id ||
+                    qnode.addr2_or_prim_id != node.prim_id ||
+                    !std::equal(v[0], v[0] + 3, node.aabb_left_min_or_v0) ||
+                    !std::equal(v[1], v[1] + 3, node.aabb_left_max_or_v1) ||
+                    !std::equal(v[2], v[2] + 3, node.aabb_right_min_or_v2))
+                {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (qnode.addr0 == kInvalidId)
+            {
+                return false;
+            }
+
+            for (std::uint8_t side = 0; side < 2; ++side)
+            {
+                auto const& child = bvh.m_nodes[Bvh2::GetChildIndex(node, side)];
+
+                // Each child takes a pair of boxes in the quantized node
+                std::uint32_t const* qmin = side == 0 ? qnode.aabb01_min_or_v0 : qnode.aabb23_min_or_v2;
+                std::uint32_t const* qmax = side == 0 ? qnode.aabb01_max_or_v1 : qnode.aabb23_max;
+                std::uint32_t const addr_lo = side == 0 ? qnode.addr0 : qnode.addr2_or_prim_id;
+                std::uint32_t const addr_hi = side == 0 ? qnode.addr1_or_mesh_id : qnode.addr3;
+
+                float lo_min[3], lo_max[3];
+                copy3unpack_lo(qmin, lo_min);
+                copy3unpack_lo(qmax, lo_max);
+
+                if (Bvh2::IsInternal(child))
+                {
+                    // Grandchildren boxes go to low and high halves
+                    float hi_min[3], hi_max[3];
+                    copy3unpack_hi(qmin, hi_min);
+                    copy3unpack_hi(qmax, hi_max);
+
+                    if (addr_hi == kInvalidId ||
+                        !check_box(child.aabb_left_min_or_v0, child.aabb_left_max_or_v1, lo_min, lo_max) ||
+                        !check_box(child.aabb_right_min_or_v2, child.aabb_right_max, hi_min, hi_max))
+                    {
+                        return false;
+                    }
+
+                    stack.push({ Bvh2::GetChildIndex(child, 0), addr_lo });
+                    stack.push({ Bvh2::GetChildIndex(child, 1), addr_hi });
+                }
+                else
+                {
+                    float const* pmin = side == 0 ? node.aabb_left_min_or_v0 : node.aabb_right_min_or_v2;
+                    float const* pmax = side == 0 ? node.aabb_left_max_or_v1 : node.aabb_right_max;
+
+                    if (addr_hi != kInvalidId || !check_box(pmin, pmax, lo_min, lo_max))
+                    {
+                        return false;
+                    }
+
+                    stack.push({ Bvh2::GetChildIndex(node, side), addr_lo });
+                }
+            }
+        }
+
+        return qarea <= max_area_ratio * area;
+    }
 }
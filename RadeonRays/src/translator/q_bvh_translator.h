@@ -25,6 +25,11 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    // Round to half precision towards -inf for min or towards +inf for max,
+    // so quantized boxes always contain the original ones
+    std::uint16_t float_to_half(float value, bool min);
+    // Widen half precision value to float, it is exact
+    float half_to_float(std::uint16_t value);
 
     class QBvhTranslator
     {
@@ -64,6 +69,11 @@ namespace RadeonRays
 
         void Process(const Bvh2 &bvh);
 
+        // Check the translated tree against bvh it has been produced from:
+        // quantized boxes have to contain the original ones and their total
+        // surface area must not exceed the original one by more than max_area_ratio
+        bool Validate(const Bvh2 &bvh, float max_area_ratio) const;
+
         inline std::size_t GetSizeInBytes() const
         {
             return nodes_.size() * sizeof(Node);
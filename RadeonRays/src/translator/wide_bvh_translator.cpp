@@ -0,0 +1,256 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "wide_bvh_translator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace RadeonRays
+{
+
+    // Grid cell size for the biased exponent, always a normal power of two
+    inline float ExponentToScale(std::uint32_t exponent)
+    {
+        std::uint32_t const bits = exponent << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return scale;
+    }
+
+    // Same as traversal does, q * scale is exact so it does not depend on fma contraction
+    inline float Dequantize(float origin, std::uint32_t q, float scale)
+    {
+        return origin + static_cast<float>(q) * scale;
+    }
+
+    // Smallest cell size such that 255 cells starting at lo cover hi
+    inline std::uint8_t CalcExponent(float lo, float hi)
+    {
+        std::uint32_t exponent = 1;
+        float const extent = hi - lo;
+
+        if (extent > 0.f)
+        {
+            int e = 0;
+            float const m = std::frexp(extent / 255.f, &e);
+            exponent = static_cast<std::uint32_t>(std::max(1, std::min(254, e + 127 - (m == 0.5f ? 1 : 0))));
+        }
+
+        // Rounding of the division or the origin offset may leave hi uncovered
+        while (exponent < 254 && Dequantize(lo, 255, ExponentToScale(exponent)) < hi)
+        {
+            ++exponent;
+        }
+
+        return static_cast<std::uint8_t>(exponent);
+    }
+
+    inline std::uint8_t QuantizeMin(float origin, float scale, float value)
+    {
+        float const q = std::floor((value - origin) / scale);
+        auto qi = static_cast<std::uint32_t>(std::min(std::max(q, 0.f), 255.f));
+
+        while (qi > 0 && Dequantize(origin, qi, scale) > value)
+        {
+            --qi;
+        }
+
+        return static_cast<std::uint8_t>(qi);
+    }
+
+    inline std::uint8_t QuantizeMax(float origin, float scale, float value)
+    {
+        float const q = std::ceil((value - origin) / scale);
+        auto qi = static_cast<std::uint32_t>(std::min(std::max(q, 0.f), 255.f));
+
+        while (qi < 255 && Dequantize(origin, qi, scale) < value)
+        {
+            ++qi;
+        }
+
+        return static_cast<std::uint8_t>(qi);
+    }
+
+    template <std::uint32_t Width>
+    void WideBvhTranslator<Width>::Process(const Bvh2 &bvh)
+    {
+        nodes_.clear();
+        triangles_.clear();
+        height_ = 0;
+
+        if (bvh.m_nodecount == 0)
+        {
+            return;
+        }
+
+        struct Elem
+        {
+            std::uint32_t bvh_node_index;
+            std::uint32_t node_index;
+            int level;
+        };
+
+        auto surface_area = [&bvh](std::uint32_t index)
+        {
+            float pmin[3], pmax[3];
+            Bvh2::GetNodeBounds(bvh.m_nodes[index], pmin, pmax);
+            float const dx = pmax[0] - pmin[0];
+            float const dy = pmax[1] - pmin[1];
+            float const dz = pmax[2] - pmin[2];
+            return dx * dy + dy * dz + dz * dx;
+        };
+
+        auto is_internal = [&bvh](std::uint32_t index)
+        {
+            return Bvh2::IsInternal(bvh.m_nodes[index]);
+        };
+
+        std::vector<Elem> stack;
+        stack.push_back({ 0u, 0u, 1 });
+        nodes_.emplace_back();
+
+        while (!stack.empty())
+        {
+            auto const elem = stack.back();
+            stack.pop_back();
+            height_ = std::max(height_, elem.level);
+
+            // Open internal children in the order of their surface area until
+            // the node is full, so the subtrees most likely to be visited by
+            // a ray are the ones pulled up and tested together
+            std::uint32_t children[Width];
+            std::uint32_t num_children = 1;
+            children[0] = elem.bvh_node_index;
+
+            while (num_children < Width)
+            {
+                std::uint32_t best = Width;
+                float best_area = -1.f;
+
+                for (std::uint32_t i = 0; i < num_children; ++i)
+                {
+                    if (is_internal(children[i]))
+                    {
+                        float const area = surface_area(children[i]);
+
+                        if (area > best_area)
+                        {
+                            best = i;
+                            best_area = area;
+                        }
+                    }
+                }
+
+                if (best == Width)
+                {
+                    break;
+                }
+
+                auto const& node = bvh.m_nodes[children[best]];
+                children[best] = Bvh2::GetChildIndex(node, 0);
+                children[num_children++] = Bvh2::GetChildIndex(node, 1);
+            }
+
+            auto const num_internal = static_cast<std::uint32_t>(
+                std::stable_partition(children, children + num_children, is_internal) - children);
+
+            // Allocate children before taking the node reference
+            auto const child_base = static_cast<std::uint32_t>(nodes_.size());
+            auto const triangle_base = static_cast<std::uint32_t>(triangles_.size());
+            nodes_.resize(nodes_.size() + num_internal);
+
+            auto& node = nodes_[elem.node_index];
+            node.child_base = num_internal > 0 ? child_base : kInvalidId;
+            node.triangle_base = num_internal < num_children ? triangle_base : kInvalidId;
+            node.num_internal = static_cast<std::uint8_t>(num_internal);
+            node.num_children = static_cast<std::uint8_t>(num_children);
+
+            float child_min[Width][3];
+            float child_max[Width][3];
+            float node_min[3] = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+            float node_max[3] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+
+            for (std::uint32_t i = 0; i < num_children; ++i)
+            {
+                Bvh2::GetNodeBounds(bvh.m_nodes[children[i]], child_min[i], child_max[i]);
+
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    node_min[axis] = std::min(node_min[axis], child_min[i][axis]);
+                    node_max[axis] = std::max(node_max[axis], child_max[i][axis]);
+                }
+            }
+
+            float scale[3];
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                node.origin[axis] = node_min[axis];
+                node.exponent[axis] = CalcExponent(node_min[axis], node_max[axis]);
+                scale[axis] = ExponentToScale(node.exponent[axis]);
+            }
+
+            // Empty slots get inverted boxes, traversal skips them by the child count anyway
+            std::fill(node.qmin_x, node.qmin_x + Width, std::uint8_t(255));
+            std::fill(node.qmin_y, node.qmin_y + Width, std::uint8_t(255));
+            std::fill(node.qmin_z, node.qmin_z + Width, std::uint8_t(255));
+            std::fill(node.qmax_x, node.qmax_x + Width, std::uint8_t(0));
+            std::fill(node.qmax_y, node.qmax_y + Width, std::uint8_t(0));
+            std::fill(node.qmax_z, node.qmax_z + Width, std::uint8_t(0));
+
+            for (std::uint32_t i = 0; i < num_children; ++i)
+            {
+                node.qmin_x[i] = QuantizeMin(node.origin[0], scale[0], child_min[i][0]);
+                node.qmin_y[i] = QuantizeMin(node.origin[1], scale[1], child_min[i][1]);
+                node.qmin_z[i] = QuantizeMin(node.origin[2], scale[2], child_min[i][2]);
+                node.qmax_x[i] = QuantizeMax(node.origin[0], scale[0], child_max[i][0]);
+                node.qmax_y[i] = QuantizeMax(node.origin[1], scale[1], child_max[i][1]);
+                node.qmax_z[i] = QuantizeMax(node.origin[2], scale[2], child_max[i][2]);
+            }
+
+            for (std::uint32_t i = 0; i < num_internal; ++i)
+            {
+                stack.push_back({ children[i], child_base + i, elem.level + 1 });
+            }
+
+            for (std::uint32_t i = num_internal; i < num_children; ++i)
+            {
+                auto const& leaf = bvh.m_nodes[children[i]];
+
+                Triangle triangle;
+                std::copy(leaf.aabb_left_min_or_v0, leaf.aabb_left_min_or_v0 + 3, triangle.v0);
+                std::copy(leaf.aabb_left_max_or_v1, leaf.aabb_left_max_or_v1 + 3, triangle.v1);
+                std::copy(leaf.aabb_right_min_or_v2, leaf.aabb_right_min_or_v2 + 3, triangle.v2);
+                triangle.mesh_id = leaf.mesh_id;
+                triangle.prim_id = leaf.prim_id;
+                triangle.padding = kInvalidId;
+                triangles_.push_back(triangle);
+            }
+        }
+    }
+
+    template class WideBvhTranslator<4>;
+    template class WideBvhTranslator<8>;
+
+}
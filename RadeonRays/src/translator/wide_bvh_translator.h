@@ -0,0 +1,107 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "../accelerator/bvh2.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace RadeonRays
+{
+
+    // Collapses binary Bvh2 into a tree with up to Width children per node.
+    // Child boxes are quantized to 8 bits per plane relative to the parent box,
+    // triangles of the leaves are stored separately.
+    template <std::uint32_t Width>
+    class WideBvhTranslator
+    {
+        static_assert(Width == 4 || Width == 8, "Only 4 and 8 wide trees are supported");
+
+    public:
+        static constexpr std::uint32_t kWidth = Width;
+        static constexpr std::uint32_t kInvalidId = 0xffffffffu;
+
+        // Encoded node format, 64 bytes for BVH4 and 80 bytes for BVH8.
+        // Children are ordered as internal nodes, then triangles, then empty slots.
+        // Child box plane i is origin[i] + q * 2^(exponent[i] - 127).
+        struct alignas(16) Node
+        {
+            // Min point of the node box, origin of the quantization grid
+            float origin[3];
+            // Index of the first internal child, the rest follow it
+            std::uint32_t child_base = kInvalidId;
+            // Index of the first triangle child, the rest follow it
+            std::uint32_t triangle_base = kInvalidId;
+            // Biased exponents of the grid cell size per axis
+            std::uint8_t exponent[3];
+            // Number of internal children
+            std::uint8_t num_internal = 0;
+            // Quantized child boxes, conservatively rounded outwards
+            std::uint8_t qmin_x[Width];
+            std::uint8_t qmin_y[Width];
+            std::uint8_t qmin_z[Width];
+            std::uint8_t qmax_x[Width];
+            std::uint8_t qmax_y[Width];
+            std::uint8_t qmax_z[Width];
+            // Number of internal and triangle children
+            std::uint8_t num_children = 0;
+        };
+
+        // Leaf triangle
+        struct alignas(16) Triangle
+        {
+            float v0[3];
+            std::uint32_t mesh_id;
+            float v1[3];
+            std::uint32_t prim_id;
+            float v2[3];
+            std::uint32_t padding;
+        };
+
+        // Constructor
+        WideBvhTranslator() = default;
+
+        void Process(const Bvh2 &bvh);
+
+        // Number of nodes on the longest root to leaf path, triangles excluded
+        inline int GetHeight() const
+        {
+            return height_;
+        }
+
+        inline std::size_t GetSizeInBytes() const
+        {
+            return nodes_.size() * sizeof(Node) + triangles_.size() * sizeof(Triangle);
+        }
+
+        std::vector<Node> nodes_;
+        std::vector<Triangle> triangles_;
+
+    private:
+        int height_ = 0;
+    };
+
+    using Bvh4Translator = WideBvhTranslator<4>;
+    using Bvh8Translator = WideBvhTranslator<8>;
+
+}
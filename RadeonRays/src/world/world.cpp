@@ -21,58 +21,284 @@ THE SOFTWARE.
 ********************************************************************/
 #include "world.h"
 
-#include "../primitive/shapeimpl.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "math/mathutils.h"
+
+#include <algorithm>
+#include <iterator>
 
 namespace RadeonRays
 {
+    World::~World()
+    {
+        // Attached shapes outlive the world, so they must not report to it anymore
+        for (auto const& slot : slot_index_)
+        {
+            auto& worlds = static_cast<ShapeImpl const*>(slot.first)->worlds_;
+            worlds.erase(std::remove(worlds.begin(), worlds.end(), this), worlds.end());
+        }
+    }
+
     void World::AttachShape(Shape const* shape)
     {
-        if (std::find(shapes_.cbegin(), shapes_.cend(), shape) == shapes_.cend())
+        if (slot_index_.find(shape) != slot_index_.end())
+        {
+            return;
+        }
+
+        std::size_t index;
+        if (free_slots_.empty())
+        {
+            index = slots_.size();
+            slots_.push_back(shape);
+        }
+        else
         {
-            shapes_.push_back(shape);
-            has_changed_ = true;
+            index = free_slots_.back();
+            free_slots_.pop_back();
+            slots_[index] = shape;
         }
+
+        slot_index_.emplace(shape, index);
+        shapes_valid_ = false;
+
+        auto iter = membership_changes_.find(shape);
+        if (iter == membership_changes_.end())
+        {
+            membership_changes_.emplace(shape, 1);
+            membership_log_.push_back(shape);
+        }
+        else
+        {
+            ++iter->second;
+        }
+
+        static_cast<ShapeImpl const*>(shape)->worlds_.push_back(this);
+        has_changed_ = true;
     }
 
     void World::DetachShape(Shape const* shape)
     {
-        auto iter = std::find(shapes_.begin(), shapes_.end(), shape);
-        if (iter != shapes_.end())
+        auto slot = slot_index_.find(shape);
+        if (slot == slot_index_.end())
         {
-            shapes_.erase(iter);
-            has_changed_ = true;
+            return;
         }
+
+        slots_[slot->second] = nullptr;
+        free_slots_.push_back(slot->second);
+        slot_index_.erase(slot);
+        shapes_valid_ = false;
+
+        auto iter = membership_changes_.find(shape);
+        if (iter == membership_changes_.end())
+        {
+            membership_changes_.emplace(shape, -1);
+            membership_log_.push_back(shape);
+        }
+        else
+        {
+            --iter->second;
+        }
+
+        auto& worlds = static_cast<ShapeImpl const*>(shape)->worlds_;
+        worlds.erase(std::find(worlds.begin(), worlds.end(), this));
+        has_changed_ = true;
     }
     
     void World::DetachAll()
     {
-        shapes_.clear();
+        for (auto shape : slots_)
+        {
+            if (shape)
+            {
+                DetachShape(shape);
+            }
+        }
+
+        // Nothing is attached, so start filling slots from the beginning
+        slots_.clear();
+        free_slots_.clear();
         has_changed_ = true;
     }
 
+    bool World::IsAttached(Shape const* shape) const
+    {
+        return slot_index_.find(shape) != slot_index_.end();
+    }
+
+    std::vector<Shape const*> const& World::GetShapes() const
+    {
+        // Devices might preprocess the world concurrently
+        std::lock_guard<std::mutex> lock(shapes_mutex_);
+
+        if (!shapes_valid_)
+        {
+            shapes_.clear();
+            std::copy_if(slots_.cbegin(), slots_.cend(), std::back_inserter(shapes_),
+                [](Shape const* shape) { return shape != nullptr; });
+            shapes_valid_ = true;
+        }
+
+        return shapes_;
+    }
+
+    void World::OnShapeChanged(Shape const* shape, int flags) const
+    {
+        auto iter = state_changes_.find(shape);
+        if (iter == state_changes_.end())
+        {
+            state_changes_.emplace(shape, flags);
+            changed_.push_back(shape);
+        }
+        else
+        {
+            iter->second |= flags;
+        }
+    }
+
+    bool World::HasStateChange(Shape const* shape) const
+    {
+        return IsAttached(shape) && state_changes_.find(shape) != state_changes_.end();
+    }
+
+    int World::GetStateChange(Shape const* shape) const
+    {
+        int statechange = ShapeImpl::kStateChangeNone;
+
+        auto iter = state_changes_.find(shape);
+        if (iter != state_changes_.end())
+        {
+            statechange |= iter->second;
+        }
+
+        if (membership_changes_.find(shape) != membership_changes_.end())
+        {
+            statechange |= static_cast<ShapeImpl const*>(shape)->GetStateChange();
+        }
+
+        return statechange;
+    }
+
+    bbox World::GetBounds() const
+    {
+        bbox bounds;
+
+        for (auto shape : GetShapes())
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            auto isinstance = shapeimpl->is_instance();
+            auto mesh = static_cast<Mesh const*>(isinstance ? static_cast<Instance const*>(shape)->GetBaseShape() : shape);
+
+            // Instances share base shape geometry, so its object
+            // space bounds are transformed by the instance transform
+            bbox shape_bounds;
+            for (int i = 0; i < mesh->num_faces(); ++i)
+            {
+                bbox face_bounds;
+                mesh->GetFaceBounds(i, isinstance, face_bounds);
+                shape_bounds.grow(face_bounds);
+            }
+
+            if (isinstance)
+            {
+                matrix m, minv;
+                shapeimpl->GetTransform(m, minv);
+                shape_bounds = transform_bbox(shape_bounds, m);
+            }
+
+            bounds.grow(shape_bounds);
+        }
+
+        return bounds;
+    }
+
     int World::GetStateChange() const
     {
-        int statechange_ = ShapeImpl::kStateChangeNone;
+        int statechange = ShapeImpl::kStateChangeNone;
 
-        for (auto shape : shapes_)
+        // Attached shapes can only have their flags set if they
+        // have been changed while attached or attached after the change
+        for (auto shape : changed_)
         {
-            ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shape);
+            if (IsAttached(shape))
+            {
+                statechange |= GetStateChange(shape);
+            }
+        }
 
-            statechange_ |= shapeimpl->GetStateChange();
+        for (auto shape : membership_log_)
+        {
+            if (IsAttached(shape))
+            {
+                statechange |= GetStateChange(shape);
+            }
         }
 
-        return statechange_;
+        return statechange;
+    }
+
+    void World::GetChanges(ChangeList& changes) const
+    {
+        changes.added.clear();
+        changes.removed.clear();
+        changes.changed.clear();
+        changes.statechange = ShapeImpl::kStateChangeNone;
+
+        for (auto shape : membership_log_)
+        {
+            auto change = membership_changes_.find(shape)->second;
+
+            if (change > 0)
+            {
+                changes.added.push_back(shape);
+            }
+            else if (change < 0)
+            {
+                changes.removed.push_back(shape);
+            }
+            else if (IsAttached(shape) && GetStateChange(shape) != ShapeImpl::kStateChangeNone)
+            {
+                // Detached and attached back, might have been changed in between
+                changes.changed.push_back(shape);
+                changes.statechange |= GetStateChange(shape);
+            }
+        }
+
+        for (auto shape : changed_)
+        {
+            // Shapes with membership changes have been handled above
+            if (IsAttached(shape) && membership_changes_.find(shape) == membership_changes_.end())
+            {
+                changes.changed.push_back(shape);
+                changes.statechange |= GetStateChange(shape);
+            }
+        }
     }
 
     void World::OnCommit()
     {
-        for (auto shape : shapes_)
+        for (auto shape : changed_)
         {
-            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            if (IsAttached(shape))
+            {
+                static_cast<ShapeImpl const*>(shape)->OnCommit(this);
+            }
+        }
 
-            shapeimpl->OnCommit();
+        for (auto shape : membership_log_)
+        {
+            if (IsAttached(shape))
+            {
+                static_cast<ShapeImpl const*>(shape)->OnCommit(this);
+            }
         }
 
+        changed_.clear();
+        state_changes_.clear();
+        membership_changes_.clear();
+        membership_log_.clear();
         has_changed_ = false;
     }
-}
\ No newline at end of file
+}
@@ -23,9 +23,12 @@ THE SOFTWARE.
 #define WORLD_H
 
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "radeon_rays.h"
+#include "math/bbox.h"
 #include "../util/options.h"
 
 namespace RadeonRays
@@ -34,17 +37,41 @@ namespace RadeonRays
     ///< It hosts entities and is in charge of destroying them.
     ///< For convenience reasons it impelements Primitive interface
     ///< to be able to provide intersection capabilities.
+    ///< Attached shapes are kept in stable slots with a hashed slot
+    ///< index and a free list, so attach and detach are O(1) and never
+    ///< reorder the remaining shapes. Changes since the last commit are
+    ///< recorded by each world separately as they happen, so querying
+    ///< them is proportional to the number of changes rather than to the
+    ///< number of shapes, and a shape might be attached to several worlds.
     ///<
     class World
     {
     public:
+        ///< Shape changes since the last commit
+        struct ChangeList
+        {
+            // Shapes attached since the last commit
+            std::vector<Shape const*> added;
+            // Shapes detached since the last commit,
+            // these might have been deleted already, so never dereference them
+            std::vector<Shape const*> removed;
+            // Shapes attached before and still attached having
+            // their state changed (transform, id, motion, vertices)
+            std::vector<Shape const*> changed;
+            // Combined state change flags of changed shapes
+            int statechange;
+        };
+
         //
         World() = default;
         //
-        virtual ~World() = default;
-        // Attach the shape updating all the flags
+        virtual ~World();
+        //
+        World(World const&) = delete;
+        World& operator = (World const&) = delete;
+        // Attach the shape updating all the flags, the shape takes the first free slot
         void AttachShape(Shape const* shape);
-        // Detach the shape 
+        // Detach the shape, the slots of remaining shapes are not changed
         void DetachShape(Shape const* shape);
         // Detach all
         void DetachAll();
@@ -52,15 +79,23 @@ namespace RadeonRays
         void OnCommit();
         // 
         bool has_changed() const;
-        //
+        // Combined state change flags of attached shapes
         int GetStateChange() const;
+        // Collect changes since the last commit
+        void GetChanges(ChangeList& changes) const;
+        // Check if the shape is attached
+        bool IsAttached(Shape const* shape) const;
+        // World space bounds of attached shapes
+        bbox GetBounds() const;
+        // Attached shapes in the order of their slots
+        std::vector<Shape const*> const& GetShapes() const;
+        // Record state change flags of the attached shape, called by shapes themselves
+        void OnShapeChanged(Shape const* shape, int flags) const;
+        // Check if the attached shape has state changes not committed by this world
+        bool HasStateChange(Shape const* shape) const;
 
 
     public:
-        // Shapes in the scene
-        std::vector<Shape const*> shapes_;
-        // Flags to indicate shapes have been changed
-        std::vector<int> shapes_dirty_;
 
         // TODO: Do more preciese dirty flags tracking
         bool has_changed_ = true;
@@ -68,6 +103,30 @@ namespace RadeonRays
         int hint_;
         // Options
         Options options_;
+
+    private:
+        // Flags recorded by this world for the shape, shapes attached since
+        // the last commit also carry the flags set while detached
+        int GetStateChange(Shape const* shape) const;
+
+        // Shape slots, nullptr for free ones
+        std::vector<Shape const*> slots_;
+        // Free slots in slots_
+        std::vector<std::size_t> free_slots_;
+        // Index of each attached shape in slots_
+        std::unordered_map<Shape const*, std::size_t> slot_index_;
+        // Attached shapes packed from slots_ on demand
+        mutable std::vector<Shape const*> shapes_;
+        mutable bool shapes_valid_ = true;
+        mutable std::mutex shapes_mutex_;
+        // Net membership change since the last commit: 1 attached, -1 detached, 0 none
+        std::unordered_map<Shape const*, int> membership_changes_;
+        // Shapes of membership_changes_ in the order they were first touched
+        std::vector<Shape const*> membership_log_;
+        // State change flags of shapes changed while attached, since the last commit of this world
+        mutable std::unordered_map<Shape const*, int> state_changes_;
+        // Shapes of state_changes_ in the order they were first changed
+        mutable std::vector<Shape const*> changed_;
     };
 
     inline bool World::has_changed() const
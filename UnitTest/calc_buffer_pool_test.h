@@ -0,0 +1,199 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef CALC_BUFFER_POOL_TEST_H
+#define CALC_BUFFER_POOL_TEST_H
+
+/// This test suite is testing Calc buffer pool directly
+/// with host side buffers standing in for the device ones
+///
+
+#include <cstdint>
+#include <memory>
+#include <set>
+
+#include "gtest/gtest.h"
+
+#include "Calc/src/buffer_pool.h"
+#include "buffer.h"
+
+// Fixture counting buffers created and destroyed by the pool
+class BufferPoolTest : public ::testing::Test
+{
+public:
+    class HostBuffer : public Calc::Buffer
+    {
+    public:
+        HostBuffer(std::size_t size) : size_(size) {}
+        std::size_t GetSize() const override { return size_; }
+
+    private:
+        std::size_t size_;
+    };
+
+    void SetUp() override
+    {
+        pool_.reset(new Calc::BufferPool(
+            [this](std::size_t size, std::uint32_t)
+            {
+                auto buffer = new HostBuffer(size);
+                alive_.insert(buffer);
+                return buffer;
+            },
+            [this](Calc::Buffer* buffer)
+            {
+                ASSERT_EQ(alive_.erase(buffer), 1u);
+                delete buffer;
+            }));
+    }
+
+    void TearDown() override
+    {
+        pool_.reset();
+        // Everything handed out was released, so nothing may leak
+        ASSERT_TRUE(alive_.empty());
+    }
+
+    std::unique_ptr<Calc::BufferPool> pool_;
+    std::set<Calc::Buffer*> alive_;
+};
+
+TEST_F(BufferPoolTest, SizeClasses)
+{
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(1), 256u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(256), 256u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(257), 320u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(512), 512u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(600), 640u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(1000), 1024u);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize(1u << 20), 1u << 20);
+    ASSERT_EQ(Calc::BufferPool::GetClassSize((1u << 20) + 1), (1u << 20) + (1u << 18));
+
+    auto buffer = pool_->Acquire(600, 0);
+    ASSERT_EQ(buffer->GetSize(), 640u);
+    pool_->Release(buffer);
+}
+
+TEST_F(BufferPoolTest, Reuse)
+{
+    auto buffer = pool_->Acquire(1000, 0);
+    pool_->Release(buffer);
+
+    // Same class and flags get the retained buffer back
+    ASSERT_EQ(pool_->Acquire(900, 0), buffer);
+    // Other flags or classes do not
+    auto other_flags = pool_->Acquire(1000, 1);
+    auto other_class = pool_->Acquire(2000, 0);
+    ASSERT_NE(other_flags, buffer);
+    ASSERT_NE(other_class, buffer);
+
+    Calc::PoolStatistics stats;
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_hits, 1u);
+    ASSERT_EQ(stats.num_allocations, 3u);
+    ASSERT_EQ(stats.num_used, 3u);
+    ASSERT_EQ(stats.num_retained, 0u);
+
+    pool_->Release(buffer);
+    pool_->Release(other_flags);
+    pool_->Release(other_class);
+
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_used, 0u);
+    ASSERT_EQ(stats.num_retained, 3u);
+    ASSERT_EQ(stats.retained_size, 1024u + 1024u + 2048u);
+
+    pool_->Trim();
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_retained, 0u);
+    ASSERT_TRUE(alive_.empty());
+}
+
+TEST_F(BufferPoolTest, Eviction)
+{
+    pool_->SetRetainLimit(4096);
+
+    auto small = pool_->Acquire(1024, 0);
+    auto large = pool_->Acquire(2048, 0);
+    auto huge = pool_->Acquire(8192, 0);
+
+    // Larger than the limit, destroyed right away
+    pool_->Release(huge);
+    ASSERT_EQ(alive_.count(huge), 0u);
+
+    pool_->Release(large);
+    pool_->Release(small);
+
+    // Does not fit with both retained, the largest one goes first
+    auto medium = pool_->Acquire(1536, 0);
+    pool_->Release(medium);
+    ASSERT_EQ(alive_.count(large), 0u);
+    ASSERT_EQ(alive_.count(small), 1u);
+    ASSERT_EQ(alive_.count(medium), 1u);
+
+    Calc::PoolStatistics stats;
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.retained_size, 1024u + 1536u);
+
+    // Disabling retention frees everything
+    pool_->SetRetainLimit(0);
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_retained, 0u);
+    ASSERT_TRUE(alive_.empty());
+}
+
+TEST_F(BufferPoolTest, Fence)
+{
+    bool complete = false;
+
+    auto buffer = pool_->Acquire(1024, 0);
+    pool_->Release(buffer, [&complete]() { return complete; });
+
+    // Still in use by the device, a new one is created
+    auto other = pool_->Acquire(1024, 0);
+    ASSERT_NE(other, buffer);
+    pool_->Release(other);
+
+    // The one released without a fence is reused
+    ASSERT_EQ(pool_->Acquire(1024, 0), other);
+
+    complete = true;
+    ASSERT_EQ(pool_->Acquire(1024, 0), buffer);
+
+    Calc::PoolStatistics stats;
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_allocations, 2u);
+    ASSERT_EQ(stats.num_hits, 2u);
+
+    // Buffers in flight are counted and evicted like retained ones
+    pool_->Release(buffer, []() { return false; });
+    pool_->Release(other, []() { return false; });
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_retained, 2u);
+    ASSERT_EQ(stats.retained_size, 2048u);
+
+    pool_->SetRetainLimit(1024);
+    pool_->GetStatistics(stats);
+    ASSERT_EQ(stats.num_retained, 1u);
+    ASSERT_EQ(alive_.count(buffer), 0u);
+}
+
+#endif // CALC_BUFFER_POOL_TEST_H
@@ -40,6 +40,8 @@ THE SOFTWARE.
 #include "event.h"
 #include "executable.h"
 
+#include "RadeonRays/src/accelerator/hlbvh.h"
+
 // Api creation fixture, prepares api_ for further tests
 class CalcTestkOpenCL : public ::testing::Test
 {
@@ -563,4 +565,60 @@ TEST_F(CalcTestkOpenCL, ExecuteRawParams)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+// Scene bound reduced on the device has to match the host one exactly,
+// sizes cover a single group, a partial last group and the strided loop
+TEST_F(CalcTestkOpenCL, HlbvhBounds)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    std::srand(0);
+    auto rnd = []() { return (std::rand() / (float)RAND_MAX) * 200.f - 100.f; };
+
+    {
+        RadeonRays::Hlbvh hlbvh(device);
+
+        for (auto size : { 50, 4133, 100000 })
+        {
+            std::vector<RadeonRays::bbox> bounds(size);
+            RadeonRays::bbox expected;
+
+            for (auto& bound : bounds)
+            {
+                RadeonRays::float3 p(rnd(), rnd(), rnd());
+                bound = RadeonRays::bbox(p, p + RadeonRays::float3(1.f, 2.f, 3.f));
+                expected.grow(bound);
+            }
+
+            ASSERT_NO_THROW(hlbvh.Build(&bounds[0], size));
+
+            auto result = hlbvh.Bounds();
+            for (auto i = 0; i < 3; ++i)
+            {
+                ASSERT_EQ(result.pmin[i], expected.pmin[i]);
+                ASSERT_EQ(result.pmax[i], expected.pmax[i]);
+            }
+
+            // Refit reduces the new bounds as well
+            RadeonRays::float3 offset(10.f, -20.f, 30.f);
+            for (auto& bound : bounds)
+            {
+                bound = RadeonRays::bbox(bound.pmin + offset, bound.pmax + offset);
+            }
+
+            ASSERT_NO_THROW(hlbvh.Refit(&bounds[0], size));
+
+            result = hlbvh.Bounds();
+            for (auto i = 0; i < 3; ++i)
+            {
+                ASSERT_EQ(result.pmin[i], expected.pmin[i] + offset[i]);
+                ASSERT_EQ(result.pmax[i], expected.pmax[i] + offset[i]);
+            }
+        }
+    }
+
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 #endif //USE_OPENCL
\ No newline at end of file
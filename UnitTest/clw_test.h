@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <numeric>
 #include <cstdlib>
 #include <ctime>
+#include <thread>
 
 #include "gtest/gtest.h"
 
@@ -442,6 +443,114 @@ TEST_F(CLW, RadixSortLarge)
     }
 }
 
+// Checks scratch buffers are not reused while the scans using them are still queued
+TEST_F(CLW, ExclusiveScanBackToBack)
+{
+    // Init rand
+    std::srand((unsigned)std::time(nullptr));
+    // Large enough for the multi level scan with scratch buffers
+    int arraysize = 300000;
+    int numscans = 8;
+
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    std::vector<std::vector<int>> hostarrays(numscans, std::vector<int>(arraysize));
+    std::vector<CLWBuffer<cl_int>> devinputs;
+    std::vector<CLWBuffer<cl_int>> devoutputs;
+
+    for (auto& hostarray : hostarrays)
+    {
+        std::generate(hostarray.begin(), hostarray.end(), [] { return rand() % 1000; });
+
+        devinputs.push_back(context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE));
+        devoutputs.push_back(context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE));
+        context_.WriteBuffer(0, devinputs.back(), &hostarray[0], arraysize).Wait();
+    }
+
+    // Enqueue all the scans without waiting
+    for (int i = 0; i < numscans; ++i)
+    {
+        prims.ScanExclusiveAdd(0, devinputs[i], devoutputs[i], arraysize);
+    }
+
+    context_.Finish(0);
+
+    std::vector<int> result(arraysize);
+    for (int i = 0; i < numscans; ++i)
+    {
+        context_.ReadBuffer(0, devoutputs[i], &result[0], arraysize).Wait();
+
+        int sum = 0;
+        for (int j = 0; j < arraysize; ++j)
+        {
+            ASSERT_EQ(result[j], sum);
+            sum += hostarrays[i][j];
+        }
+    }
+}
+
+// Checks scans issued from several threads, pairs of threads share a queue
+// so scratch buffers get reused across threads
+TEST_F(CLW, ExclusiveScanThreads)
+{
+    // Init rand
+    std::srand((unsigned)std::time(nullptr));
+    int arraysize = 300000;
+    int numthreads = 4;
+    int numqueues = 2;
+    int numscans = 8;
+
+    while (context_.GetCommandQueueCount() < (unsigned)numqueues)
+    {
+        context_.AddCommandQueue(context_.GetDevice(0));
+    }
+
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    std::vector<std::vector<int>> hostarrays(numthreads, std::vector<int>(arraysize));
+    for (auto& hostarray : hostarrays)
+    {
+        std::generate(hostarray.begin(), hostarray.end(), [] { return rand() % 1000; });
+    }
+
+    std::vector<int> failures(numthreads, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numthreads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            auto queue = (unsigned)(t % numqueues);
+            auto devinput = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+            auto devoutput = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE);
+            context_.WriteBuffer(queue, devinput, &hostarrays[t][0], arraysize).Wait();
+
+            std::vector<int> result(arraysize);
+            for (int i = 0; i < numscans; ++i)
+            {
+                prims.ScanExclusiveAdd(queue, devinput, devoutput, arraysize);
+                context_.ReadBuffer(queue, devoutput, &result[0], arraysize).Wait();
+
+                int sum = 0;
+                for (int j = 0; j < arraysize; ++j)
+                {
+                    failures[t] += (result[j] != sum);
+                    sum += hostarrays[t][j];
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto failure : failures)
+    {
+        ASSERT_EQ(failure, 0);
+    }
+}
+
 #endif
 
 #endif //USE_OPENCL
@@ -0,0 +1,431 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RADEONRAYS_BVH_TEST_H
+#define RADEONRAYS_BVH_TEST_H
+
+/// This test suite is testing RadeonRays hierarchy builders,
+/// translators and the task scheduler they run on directly,
+/// without going through IntersectionApi
+///
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "RadeonRays/src/accelerator/bvh.h"
+#include "RadeonRays/src/accelerator/bvh2.h"
+#include "RadeonRays/src/accelerator/bvh_optimizer.h"
+#include "RadeonRays/src/accelerator/morton_bvh.h"
+#include "RadeonRays/src/async/task_scheduler.h"
+#include "RadeonRays/src/translator/fatnode_bvh_translator.h"
+#include "RadeonRays/src/translator/plain_bvh_translator.h"
+#include "RadeonRays/src/translator/q_bvh_translator.h"
+#include "RadeonRays/src/world/world.h"
+
+using namespace RadeonRays;
+
+// Fixture generating random primitive bounds, restores
+// scheduler thread limit tests are allowed to change
+class BvhTest : public ::testing::Test
+{
+public:
+    void SetUp() override
+    {
+        // Large enough for builders and translators to split the work
+        GenerateBoxes(20000, 0x1234);
+    }
+
+    void TearDown() override
+    {
+        task_scheduler::instance().set_max_threads(0);
+    }
+
+    void GenerateBoxes(int count, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> position(-10.f, 10.f);
+        std::uniform_real_distribution<float> size(0.f, 0.1f);
+
+        boxes_.resize(count);
+        for (auto& box : boxes_)
+        {
+            float3 pmin(position(rng), position(rng), position(rng));
+            box = bbox(pmin, pmin + float3(size(rng), size(rng), size(rng)));
+        }
+    }
+
+    void ExpectNodesEqual(PlainBvhTranslator const& expected, PlainBvhTranslator const& test) const
+    {
+        ASSERT_EQ(expected.nodes_.size(), test.nodes_.size());
+        EXPECT_EQ(0, std::memcmp(expected.nodes_.data(), test.nodes_.data(),
+            expected.nodes_.size() * sizeof(PlainBvhTranslator::Node)));
+    }
+
+    std::vector<bbox> boxes_;
+};
+
+// Exposes the node tree built by Bvh
+class BvhNodes : public Bvh
+{
+public:
+    using Bvh::Bvh;
+
+    struct Stats
+    {
+        int num_nodes = 0;
+        int num_leaves = 0;
+        int num_prims = 0;
+        int max_leaf_prims = 0;
+    };
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        std::vector<Node const*> stack(1, m_root);
+        while (!stack.empty())
+        {
+            auto node = stack.back();
+            stack.pop_back();
+            ++stats.num_nodes;
+
+            if (node->type == kLeaf)
+            {
+                ++stats.num_leaves;
+                stats.num_prims += node->numprims;
+                stats.max_leaf_prims = std::max(stats.max_leaf_prims, node->numprims);
+            }
+            else
+            {
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+        }
+
+        return stats;
+    }
+
+    int GetNodeCount() const { return m_nodecnt; }
+};
+
+TEST_F(BvhTest, ParallelBuildMatchesSerial)
+{
+    auto& scheduler = task_scheduler::instance();
+    if (scheduler.num_threads() < 2)
+    {
+        return;
+    }
+
+    for (auto usesah : { false, true })
+    {
+        scheduler.set_max_threads(1);
+        Bvh serial(10.f, 64, usesah);
+        serial.Build(boxes_.data(), static_cast<int>(boxes_.size()));
+
+        scheduler.set_max_threads(0);
+        Bvh parallel(10.f, 64, usesah);
+        parallel.Build(boxes_.data(), static_cast<int>(boxes_.size()));
+
+        EXPECT_EQ(serial.GetHeight(), parallel.GetHeight());
+        ASSERT_EQ(serial.GetNumIndices(), parallel.GetNumIndices());
+        EXPECT_TRUE(std::equal(serial.GetIndices(), serial.GetIndices() + serial.GetNumIndices(), parallel.GetIndices()));
+
+        // Translation covers node bounds and layout
+        scheduler.set_max_threads(1);
+        PlainBvhTranslator serial_nodes;
+        serial_nodes.Process(serial);
+        PlainBvhTranslator parallel_nodes;
+        parallel_nodes.Process(parallel);
+
+        ExpectNodesEqual(serial_nodes, parallel_nodes);
+    }
+}
+
+TEST_F(BvhTest, ParallelTranslationMatchesSerial)
+{
+    auto& scheduler = task_scheduler::instance();
+    if (scheduler.num_threads() < 2)
+    {
+        return;
+    }
+
+    for (auto max_leaf_size : { 1, 4 })
+    {
+        Bvh bvh(10.f, 64, true, max_leaf_size);
+        bvh.Build(boxes_.data(), static_cast<int>(boxes_.size()));
+
+        scheduler.set_max_threads(1);
+        PlainBvhTranslator serial;
+        serial.Process(bvh);
+
+        scheduler.set_max_threads(0);
+        PlainBvhTranslator parallel;
+        parallel.Process(bvh);
+
+        // Large enough for the parallel path
+        ASSERT_GT(serial.nodes_.size(), 8192u);
+        ExpectNodesEqual(serial, parallel);
+    }
+}
+
+TEST_F(BvhTest, MortonBvhCompleteTreeIndices)
+{
+    // Small enough for the indices of all the levels to fit into int
+    GenerateBoxes(1000, 0x5678);
+
+    MortonBvh bvh(10.f);
+    bvh.Build(boxes_.data(), static_cast<int>(boxes_.size()));
+    ASSERT_LT(bvh.GetHeight(), 31);
+
+    FatNodeBvhTranslator translator;
+    translator.Process(bvh);
+
+    // Root is 1, children of node i are 2i and 2i + 1
+    ASSERT_EQ(translator.nodecnt_, 2 * static_cast<int>(boxes_.size()) - 1);
+    EXPECT_EQ(translator.indices_[0], 1);
+
+    for (int i = 0; i < translator.nodecnt_; ++i)
+    {
+        auto const& node = translator.nodes_[i];
+        if (node.s1.child0 == -1)
+        {
+            continue;
+        }
+
+        EXPECT_EQ(translator.indices_[node.s1.child0], translator.indices_[i] << 1);
+        EXPECT_EQ(translator.indices_[node.s1.child1], (translator.indices_[i] << 1) + 1);
+    }
+}
+
+TEST_F(BvhTest, MaxLeafSize)
+{
+    auto const numprims = static_cast<int>(boxes_.size());
+
+    for (auto usesah : { false, true })
+    {
+        BvhNodes single(10.f, 64, usesah, 1);
+        single.Build(boxes_.data(), numprims);
+        auto single_stats = single.GetStats();
+        EXPECT_EQ(single_stats.num_leaves, numprims);
+        EXPECT_EQ(single_stats.max_leaf_prims, 1);
+
+        for (auto max_leaf_size : { 2, 4, 15 })
+        {
+            BvhNodes bvh(10.f, 64, usesah, max_leaf_size);
+            bvh.Build(boxes_.data(), numprims);
+            auto stats = bvh.GetStats();
+
+            // Every primitive lands in exactly one leaf of the allowed size
+            EXPECT_EQ(stats.num_prims, numprims);
+            EXPECT_LE(stats.max_leaf_prims, max_leaf_size);
+            EXPECT_GT(stats.max_leaf_prims, 1);
+            EXPECT_LT(stats.num_leaves, single_stats.num_leaves);
+            EXPECT_GE(stats.num_leaves, (numprims + max_leaf_size - 1) / max_leaf_size);
+
+            // Node counter matches the nodes actually created, translators rely on it
+            EXPECT_EQ(stats.num_nodes, 2 * stats.num_leaves - 1);
+            EXPECT_EQ(bvh.GetNodeCount(), stats.num_nodes);
+
+            PlainBvhTranslator translator;
+            translator.Process(bvh);
+            EXPECT_EQ(static_cast<int>(translator.nodes_.size()), stats.num_nodes);
+        }
+    }
+}
+
+TEST_F(BvhTest, OptimizerLowersCost)
+{
+    MortonBvh lbvh(10.f);
+    Bvh median(10.f, 64, false);
+
+    for (Bvh* bvh : { static_cast<Bvh*>(&lbvh), &median })
+    {
+        bvh->Build(boxes_.data(), static_cast<int>(boxes_.size()));
+
+        std::vector<int> indices(bvh->GetIndices(), bvh->GetIndices() + bvh->GetNumIndices());
+        std::sort(indices.begin(), indices.end());
+
+        // Generous budget, the pass stops once it converges
+        BvhOptimizer optimizer(10000.f);
+        optimizer.Process(*bvh);
+
+        EXPECT_GT(optimizer.GetInitialCost(), 0.f);
+        EXPECT_LT(optimizer.GetFinalCost(), optimizer.GetInitialCost());
+
+        // Leaves keep their primitives
+        std::vector<int> optimized(bvh->GetIndices(), bvh->GetIndices() + bvh->GetNumIndices());
+        std::sort(optimized.begin(), optimized.end());
+        EXPECT_EQ(indices, optimized);
+
+        PlainBvhTranslator translator;
+        translator.Process(*bvh);
+        EXPECT_EQ(translator.nodes_.size(), 2 * boxes_.size() - 1);
+    }
+}
+
+TEST_F(BvhTest, OptimizerWorldOption)
+{
+    World world;
+
+    // No option, the tree stays as built
+    Bvh bvh(10.f, 64, false);
+    bvh.Build(boxes_.data(), static_cast<int>(boxes_.size()));
+    PlainBvhTranslator built;
+    built.Process(bvh);
+
+    BvhOptimizer::Process(world, bvh);
+    PlainBvhTranslator unchanged;
+    unchanged.Process(bvh);
+    ExpectNodesEqual(built, unchanged);
+
+    world.options_.SetValue("bvh.optimize.ms", 10000.f);
+    BvhOptimizer::Process(world, bvh);
+    PlainBvhTranslator optimized;
+    optimized.Process(bvh);
+    ASSERT_EQ(built.nodes_.size(), optimized.nodes_.size());
+    EXPECT_NE(0, std::memcmp(built.nodes_.data(), optimized.nodes_.data(),
+        built.nodes_.size() * sizeof(PlainBvhTranslator::Node)));
+}
+
+TEST(HalfPrecision, FloatToHalfRoundsOutwards)
+{
+    std::mt19937 rng(0x9abc);
+    std::uniform_real_distribution<float> mantissa(-1.f, 1.f);
+    std::uniform_int_distribution<int> exponent(-30, 20);
+
+    std::vector<float> values = { 0.f, -0.f, 1.f, -1.f, 0.1f, -0.1f, 1.f / 3.f, 65504.f, -65504.f,
+        65519.f, 1e6f, -1e6f, 6.1035156e-5f, 5.9604645e-8f, 1e-9f, -1e-9f, std::numeric_limits<float>::denorm_min() };
+    for (int i = 0; i < 10000; ++i)
+    {
+        values.push_back(std::ldexp(mantissa(rng), exponent(rng)));
+    }
+
+    for (auto value : values)
+    {
+        auto lo = float_to_half(value, true);
+        auto hi = float_to_half(value, false);
+
+        // Quantized interval contains the value
+        EXPECT_LE(half_to_float(lo), value) << value;
+        EXPECT_GE(half_to_float(hi), value) << value;
+
+        if (half_to_float(lo) == value)
+        {
+            // Representable values are kept exactly
+            EXPECT_EQ(half_to_float(hi), value) << value;
+        }
+        else
+        {
+            // Otherwise they are neighbours of the same sign, the one
+            // further from zero has the magnitude one code larger
+            ASSERT_EQ(lo & 0x8000u, hi & 0x8000u) << value;
+            auto const lo_mag = lo & 0x7fffu;
+            auto const hi_mag = hi & 0x7fffu;
+            EXPECT_EQ((lo & 0x8000u) ? lo_mag - hi_mag : hi_mag - lo_mag, 1u) << value;
+        }
+    }
+
+    // Infinities stay infinities
+    auto const inf = std::numeric_limits<float>::infinity();
+    EXPECT_EQ(half_to_float(float_to_half(inf, true)), inf);
+    EXPECT_EQ(half_to_float(float_to_half(-inf, false)), -inf);
+}
+
+TEST_F(BvhTest, QBvhValidate)
+{
+    std::mt19937 rng(0xdef0);
+    std::uniform_real_distribution<float> position(-10.f, 10.f);
+    std::uniform_real_distribution<float> offset(-0.1f, 0.1f);
+
+    int const numfaces = 5000;
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    for (int i = 0; i < numfaces; ++i)
+    {
+        float3 p(position(rng), position(rng), position(rng));
+        for (int v = 0; v < 3; ++v)
+        {
+            vertices.push_back(p.x + offset(rng));
+            vertices.push_back(p.y + offset(rng));
+            vertices.push_back(p.z + offset(rng));
+            indices.push_back(3 * i + v);
+        }
+    }
+
+    std::unique_ptr<Mesh> mesh(new Mesh(vertices.data(), 3 * numfaces, 3 * sizeof(float), indices.data(), 0, nullptr, numfaces));
+    std::vector<Shape const*> shapes = { mesh.get() };
+
+    Bvh2 bvh(10.f, 64, true);
+    bvh.Build(shapes.begin(), shapes.end());
+
+    QBvhTranslator translator;
+    EXPECT_FALSE(translator.Validate(bvh, 2.f));
+
+    translator.Process(bvh);
+    EXPECT_TRUE(translator.Validate(bvh, 2.f));
+    // Rounding outwards only grows the boxes
+    EXPECT_FALSE(translator.Validate(bvh, 1.f));
+
+    // Shrink the first box of the root below the original one
+    auto broken = translator;
+    auto& root = broken.nodes_[0];
+    auto lo_min = half_to_float(root.aabb01_min_or_v0[0] & 0xffffu);
+    root.aabb01_min_or_v0[0] = (root.aabb01_min_or_v0[0] & 0xffff0000u) + float_to_half(lo_min + 1.f, false);
+    EXPECT_FALSE(broken.Validate(bvh, 2.f));
+}
+
+TEST(TaskScheduler, ParallelForFinishesTasksOnException)
+{
+    int const kNumTasks = 8;
+
+    for (auto throwing_task : { 0, kNumTasks - 1 })
+    {
+        std::atomic<int> finished(0);
+
+        // The calling thread runs task 0, workers run the rest
+        EXPECT_THROW(parallel_for(0, kNumTasks, kNumTasks, [&finished, throwing_task](int task, int, int)
+        {
+            if (task == throwing_task)
+            {
+                throw std::runtime_error("Task failed");
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ++finished;
+        }), std::runtime_error);
+
+        // No task is left running once parallel_for has returned
+        EXPECT_EQ(finished, kNumTasks - 1);
+    }
+}
+
+#endif // RADEONRAYS_BVH_TEST_H
@@ -258,7 +258,47 @@ TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Fat
 
 }
 
-TEST_F(ApiConformanceCL, DISABLED_CPU_CornellBox_1000Rays_Brutforce_HlBvh)
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Lbvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh_Lbvh30)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.lbvh.morton_bits", 30.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_Bruteforce_Lbvh)
+{
+    if (!apicpu_)
+        return;
+
+    auto api = apicpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "lbvh");
+    api->SetOption("bvh.force2level", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, CPU_CornellBox_1000Rays_Brutforce_HlBvh)
 {
     if (!apicpu_)
         return;
@@ -377,6 +417,96 @@ TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_B
 
 }
 
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_MaxLeafSize_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_MaxLeafSize_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 4.f);
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_MaxLeafSize_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.max_leaf_size", 8.f);
+    api->SetOption("bvh.force2level", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_Force2level_Transforms_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 1.f);
+
+    // Reference intersections apply shape transforms as well
+    auto translate = [](TestShape& test_shape, float3 const& offset)
+    {
+        test_shape.shape->SetTransform(translation(offset), translation(-offset));
+    };
+
+    // Instance shares the bottom level hierarchy of its base mesh
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api->CreateInstance(apishapes_gpu_[0]));
+    ASSERT_NO_THROW(api->AttachShape(instance));
+    test_shapes_.push_back(test_shapes_[0]);
+    test_shapes_.back().shape = instance;
+    translate(test_shapes_.back(), float3(0.3f, 0.f, 0.1f));
+
+    ExpectClosestRaysOk<10000>(api);
+
+    // Only transforms change, so the top level is rebuilt alone
+    // and shape data is permuted to the order of its new leaves
+    api->SetOption("bvh.refit", 0.f);
+    for (auto i = 0u; i < test_shapes_.size(); i += 2)
+    {
+        translate(test_shapes_[i], float3(0.2f, -0.1f * i, 0.f));
+    }
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Another permutation on top of the previous one
+    for (auto i = 1u; i < test_shapes_.size(); i += 3)
+    {
+        translate(test_shapes_[i], float3(-0.1f * i, 0.f, 0.2f));
+    }
+    ExpectClosestRaysOk<10000>(api);
+
+    // Refit keeps the order of shape data, changed entries are uploaded in place
+    api->SetOption("bvh.refit", 1.f);
+    for (auto i = 0u; i < test_shapes_.size(); i += 3)
+    {
+        translate(test_shapes_[i], float3(0.f, 0.1f, -0.05f * i));
+    }
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    translate(test_shapes_.back(), float3(-0.3f, 0.2f, 0.f));
+    ExpectClosestRaysOk<10000>(api);
+
+    ASSERT_NO_THROW(api->DetachShape(instance));
+    ASSERT_NO_THROW(api->DeleteShape(instance));
+    test_shapes_.pop_back();
+}
+
 TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_FatBvh)
 {
     auto api = apigpu_;
@@ -388,7 +518,83 @@ TEST_F(ApiConformanceCL, GPU_CornellBox_1000RandomRays_ClosestHit_Bruteforce_Fat
 
 }
 
-TEST_F(ApiConformanceCL, DISABLED_GPU_CornellBox_1000Rays_Brutforce_HlBvh)
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_ClosestHit_Bruteforce_FatBvh_QBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_AnyHit_Bruteforce_FatBvh_QBvh)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.type", "qbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_Bruteforce_FatBvh_Bvh4)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.width", 4.f);
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_Bruteforce_FatBvh_Bvh8)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.width", 8.f);
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_Bruteforce_SortRays)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+    api->SetOption("query.sort_rays", 1.f);
+
+    // Hits have to land at the original ray indices
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RandomRays_Bruteforce_CompactRays)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "fatbvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+    api->SetOption("query.compact_rays", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Live rays are sorted and scattered back twice
+    api->SetOption("query.sort_rays", 1.f);
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000Rays_Brutforce_HlBvh)
 {
     auto api = apigpu_;
     api->SetOption("acc.type", "hlbvh");
@@ -528,6 +734,175 @@ TEST_F(ApiConformanceCL, DISABLED_CornellBox_10000RaysRandom_ClosestHit_Events_B
     EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
 }
 
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_StackMemory_Bruteforce)
+{
+    auto api = apigpu_;
+
+    // Intersectors keeping traversal stacks in global memory
+    for (auto type : { "fatbvh", "hlbvh" })
+    {
+        api->SetOption("acc.type", type);
+        api->SetOption("bvh.builder", "sah");
+        api->SetOption("bvh.force2level", 0.f);
+        api->SetOption("query.max_stack_memory", 0.f);
+
+        // Stacks grow with the batch size
+        ExpectClosestRaysOk<100>(api);
+        ExpectClosestRaysOk<10000>(api);
+
+        // Stacks of the whole batch do not fit into 64KB, so threads loop over the rays
+        api->SetOption("query.max_stack_memory", 1.f / 16.f);
+        ExpectClosestRaysOk<10000>(api);
+        ExpectAnyRaysOk<10000>(api);
+
+        // Median split builds a deeper tree needing larger stacks per thread,
+        // reattaching the shapes forces the rebuild
+        api->SetOption("bvh.builder", "median");
+        ASSERT_NO_THROW(api->DetachAll());
+        for (auto shape : apishapes_gpu_)
+        {
+            ASSERT_NO_THROW(api->AttachShape(shape));
+        }
+        ExpectClosestRaysOk<10000>(api);
+
+        // The stack grows again once the limit is lifted
+        api->SetOption("query.max_stack_memory", 0.f);
+        ExpectClosestRaysOk<10000>(api);
+        ExpectAnyRaysOk<10000>(api);
+    }
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_10000RaysRandom_ClosestHit_MultiDevice_Bruteforce)
+{
+    // OpenCL maps complete asynchronously, so the batch parts must wait for them.
+    // Pair the GPU with the OpenCL CPU device if there is one, with itself otherwise
+    std::uint32_t devidx[2] = { 0, 0 };
+    bool has_gpu = false;
+    bool has_cpu = false;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.type == DeviceInfo::kGpu && !has_gpu)
+        {
+            devidx[0] = idx;
+            has_gpu = true;
+        }
+
+        if (devinfo.type == DeviceInfo::kCpu && !has_cpu)
+        {
+            devidx[1] = idx;
+            has_cpu = true;
+        }
+    }
+
+    if (!has_cpu)
+    {
+        devidx[1] = devidx[0];
+    }
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = IntersectionApi::Create(devidx, 2));
+    ASSERT_NE(api, nullptr);
+
+    for (auto shape : apishapes_gpu_)
+    {
+        ASSERT_NO_THROW(api->AttachShape(shape));
+    }
+
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+
+    // The second batch is split by measured throughput
+    ExpectClosestRaysOk<10000>(api);
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Shapes are owned by the fixture
+    api->DetachAll();
+    IntersectionApi::Delete(api);
+}
+
+TEST_F(ApiConformanceCL, GPU_CornellBox_1000RaysRandom_ClosestHit_CounterRing_Bruteforce)
+{
+    int const kNumRays = 1000;
+    // More queries per queue than there are ray counters in its ring
+    int const kNumQueries = 40;
+
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+
+    std::vector<Intersection> isect_brute(kNumRays);
+    std::vector<ray> r_brute(kNumRays);
+
+    for (auto& r : r_brute)
+    {
+        r.o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r.d = normalize(float3(rand_float(), rand_float(), rand_float()));
+        r.SetActive(true);
+        r.SetMask(-1);
+        r.SetDoBackfaceCulling(false);
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute.data(), kNumRays, isect_brute.data());
+
+    // Hits past the number of rays of a query must stay untouched
+    std::vector<Intersection> isect_init(kNumRays);
+    for (auto& isect : isect_init)
+    {
+        isect.shapeid = -2;
+    }
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), r_brute.data());
+
+    auto num_queues = api->GetQueueCount();
+    std::vector<Buffer*> isect_buffers;
+    std::vector<int> num_rays;
+
+    // Queries are issued back to back without waiting, each with its own ray count
+    for (auto queue = 0u; queue < num_queues; ++queue)
+    {
+        for (int i = 0; i < kNumQueries; ++i)
+        {
+            isect_buffers.push_back(api->CreateBuffer(kNumRays * sizeof(Intersection), isect_init.data()));
+            num_rays.push_back(kNumRays - (int)(queue * kNumQueries + i) % kNumRays);
+
+            EXPECT_NO_THROW(api->QueryIntersection(queue, ray_buffer, num_rays.back(), isect_buffers.back(), nullptr, nullptr));
+        }
+    }
+
+    for (auto i = 0u; i < isect_buffers.size(); ++i)
+    {
+        Intersection* isect = nullptr;
+        Event* e = nullptr;
+        EXPECT_NO_THROW(api->MapBuffer(isect_buffers[i], kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &e));
+        e->Wait(); api->DeleteEvent(e);
+
+        for (int j = 0; j < kNumRays; ++j)
+        {
+            if (j < num_rays[i])
+            {
+                ExpectClosestIntersectionOk(isect_brute[j], isect[j]);
+            }
+            else
+            {
+                ASSERT_EQ(isect[j].shapeid, -2);
+            }
+        }
+
+        EXPECT_NO_THROW(api->UnmapBuffer(isect_buffers[i], isect, &e));
+        e->Wait(); api->DeleteEvent(e);
+
+        EXPECT_NO_THROW(api->DeleteBuffer(isect_buffers[i]));
+    }
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+}
+
 
 inline void ApiConformanceCL::ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const
 {
@@ -0,0 +1,1117 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+#pragma once
+
+/// This test suite is testing RadeonRays native CPU device results to conform to brute force
+///
+
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+#include "tiny_obj_loader.h"
+#include "utils.h"
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+// Api creation fixture, prepares api_ for further tests
+class ApiConformanceNative : public ::testing::Test
+{
+public:
+    static const int kMaxRaysTests = 10000;
+
+    void SetUp() override;
+    void TearDown() override;
+
+    void Wait(IntersectionApi* api)
+    {
+        e_->Wait();
+        api->DeleteEvent(e_);
+    }
+
+    void ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const;
+
+    template< int kNumRays> void ExpectClosestRaysOk(RadeonRays::IntersectionApi* api) const;
+
+    template< int kNumRays> void ExpectAnyRaysOk(RadeonRays::IntersectionApi* api) const;
+
+    // Deform all the meshes updating both API shapes and reference data
+    void DeformShapes(float scale, float offset);
+
+    // GPU api
+    IntersectionApi* apigpu_;
+
+    std::vector<Shape*> apishapes_gpu_;
+    std::vector<TestShape> test_shapes_;
+
+    Event* e_;
+
+    // Tinyobj data
+    std::vector<shape_t> shapes_;
+    std::vector<material_t> materials_;
+
+};
+
+inline void ApiConformanceNative::SetUp()
+{
+    apigpu_ = nullptr;
+
+    IntersectionApi::SetPlatform(DeviceInfo::kNative);
+
+    //Search for native CPU
+    int cpuidx = -1;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.type == DeviceInfo::kCpu && cpuidx == -1)
+        {
+            cpuidx = idx;
+        }
+    }
+
+    EXPECT_NE(cpuidx, -1);
+
+    apigpu_ = IntersectionApi::Create(cpuidx);
+    EXPECT_NE(apigpu_, nullptr);
+
+    // Load obj file 
+    std::string res = LoadObj(shapes_, materials_, "../Resources/CornellBox/orig.objm");
+
+    // Create meshes within IntersectionApi
+    for (int i = 0; i<(int)shapes_.size(); ++i)
+    {
+        Shape* shape = nullptr;
+
+        EXPECT_NO_THROW(shape = apigpu_->CreateMesh(&shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3, 3 * sizeof(float),
+            &shapes_[i].mesh.indices[0], 0, nullptr, (int)shapes_[i].mesh.indices.size() / 3));
+
+        EXPECT_NO_THROW(apigpu_->AttachShape(shape));
+        
+        test_shapes_.push_back({ &shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3,
+            &shapes_[i].mesh.indices[0], (int)shapes_[i].mesh.indices.size(), nullptr, (int)shapes_[i].mesh.indices.size() / 3 });
+        test_shapes_.back().shape = shape;
+
+        apishapes_gpu_.push_back(shape);
+    }
+
+    apigpu_->SetOption("acc.type", "bvh");
+    apigpu_->SetOption("bvh.builder", "sah");
+
+    srand(0xABCDEF12);
+
+}
+
+inline void ApiConformanceNative::TearDown()
+{
+    // TearDown needs to be safe for no OpenCL cpu or GPU hence
+    // all the if( apiXpu_)
+
+    // Commit update
+    if (apigpu_) { EXPECT_NO_THROW(apigpu_->Commit()); }
+
+    // Delete meshes
+    for (int i = 0; i<(int)apishapes_gpu_.size(); ++i)
+    {
+        if (apigpu_) { EXPECT_NO_THROW(apigpu_->DeleteShape(apishapes_gpu_[i])); }
+    }
+
+    if (apigpu_) { IntersectionApi::Delete(apigpu_); }
+}
+
+/*
+BEGIN GPU TESTS
+*/
+TEST_F(ApiConformanceNative, CornellBox_1RandomRay_ClosestHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_100RayRandom_ClosestHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<100>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_ClosestHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_ClosestHit_Force2level_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_Median_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "median");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_Median_Optimize_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "median");
+    api->SetOption("bvh.optimize.ms", 100.f);
+    api->SetOption("bvh.refit", 1.f);
+
+    ExpectClosestRaysOk<1000>(api);
+    ExpectAnyRaysOk<1000>(api);
+
+    // Restructured tree has to stay refittable
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_Bvh4_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.width", 4.f);
+    api->SetOption("bvh.refit", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Wide tree follows the refitted one
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_Bvh8_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.width", 8.f);
+    api->SetOption("bvh.refit", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_SortRays_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.refit", 1.f);
+    api->SetOption("query.sort_rays", 1.f);
+
+    // Hits have to land at the original ray indices
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Origins are quantized within the refitted bounds
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_CompactRays_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("query.compact_rays", 1.f);
+
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Compaction on top of sorting drops the inactive tail
+    api->SetOption("query.sort_rays", 1.f);
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_SortRays_Events)
+{
+    int const kNumRays = 10000;
+
+    ray r_brute[kNumRays];
+    Intersection isect_brute[kNumRays];
+    bool any_brute[kNumRays];
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    apigpu_->SetOption("acc.type", "bvh");
+    apigpu_->SetOption("bvh.builder", "sah");
+    apigpu_->SetOption("query.sort_rays", 1.f);
+    apigpu_->SetOption("query.compact_rays", 1.f);
+
+    EXPECT_NO_THROW(apigpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, any_brute);
+
+    auto ray_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto any_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ray* r_gpu = nullptr;
+    Event* egpu;
+    EXPECT_NO_THROW(apigpu_->MapBuffer(ray_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_gpu[i].o = r_brute[i].o;
+        r_gpu[i].d = r_brute[i].d;
+        r_gpu[i].SetActive(true);
+        r_gpu[i].SetMask(0xFFFFFFFF);
+    }
+
+    Event* eunmap = nullptr;
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(ray_buffer_gpu, r_gpu, &eunmap));
+
+    // Reordering happens in the query tasks once the events they depend on complete,
+    // wait events can be deleted as soon as the dependent query is issued
+    Event* eany = nullptr;
+    Event* eclosest = nullptr;
+    EXPECT_NO_THROW(apigpu_->QueryOcclusion(ray_buffer_gpu, kNumRays, any_buffer_gpu, eunmap, &eany));
+    apigpu_->DeleteEvent(eunmap);
+    EXPECT_NO_THROW(apigpu_->QueryIntersection(ray_buffer_gpu, kNumRays, isect_buffer_gpu, eany, &eclosest));
+    apigpu_->DeleteEvent(eany);
+
+    eclosest->Wait();
+    apigpu_->DeleteEvent(eclosest);
+
+    Intersection* isect_gpu = nullptr;
+    EXPECT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    int* any_gpu = nullptr;
+    EXPECT_NO_THROW(apigpu_->MapBuffer(any_buffer_gpu, kMapRead, 0, kNumRays * sizeof(int), (void**)&any_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect_gpu[i]);
+        ASSERT_EQ(any_brute[i], any_gpu[i] > 0);
+    }
+
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(any_buffer_gpu, any_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer_gpu));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(any_buffer_gpu));
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_CompactRays_Inactive)
+{
+    int const kNumRays = 10000;
+    int const kUntouchedId = 12345;
+
+    ray r_brute[kNumRays];
+    Intersection isect_brute[kNumRays];
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    apigpu_->SetOption("acc.type", "bvh");
+    apigpu_->SetOption("bvh.builder", "sah");
+    apigpu_->SetOption("query.compact_rays", 1.f);
+
+    EXPECT_NO_THROW(apigpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    for (auto sort_rays : { 0.f, 1.f })
+    {
+        apigpu_->SetOption("query.sort_rays", sort_rays);
+        EXPECT_NO_THROW(apigpu_->Commit());
+
+        ray* r_gpu = nullptr;
+        Intersection* isect_gpu = nullptr;
+
+        Event* egpu;
+        EXPECT_NO_THROW(apigpu_->MapBuffer(ray_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        // Every third ray is inactive
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            r_gpu[i].o = r_brute[i].o;
+            r_gpu[i].d = r_brute[i].d;
+            r_gpu[i].SetActive(i % 3 != 0);
+            r_gpu[i].SetMask(0xFFFFFFFF);
+        }
+
+        EXPECT_NO_THROW(apigpu_->UnmapBuffer(ray_buffer_gpu, r_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        EXPECT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            isect_gpu[i].shapeid = kUntouchedId;
+            isect_gpu[i].primid = kUntouchedId;
+        }
+
+        EXPECT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        EXPECT_NO_THROW(apigpu_->QueryIntersection(ray_buffer_gpu, kNumRays, isect_buffer_gpu, nullptr, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        EXPECT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            if (i % 3 != 0)
+            {
+                ExpectClosestIntersectionOk(isect_brute[i], isect_gpu[i]);
+            }
+            else
+            {
+                EXPECT_EQ(isect_gpu[i].shapeid, kUntouchedId);
+                EXPECT_EQ(isect_gpu[i].primid, kUntouchedId);
+            }
+        }
+
+        EXPECT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+        egpu->Wait(); apigpu_->DeleteEvent(egpu);
+    }
+
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer_gpu));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
+}
+
+TEST_F(ApiConformanceNative, DeepTree_ClosestHit_AnyHit)
+{
+    // Each triangle is twice as close to the origin as the previous one,
+    // so median splits peel a single triangle off and the tree gets deeper
+    // than 64 levels, rays along x hit all the boxes they pass
+    int const kNumTriangles = 120;
+
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    for (int i = 0; i < kNumTriangles; ++i)
+    {
+        float x = std::ldexp(1.f, -i);
+        float const v[] = { x, -1.f, -1.f, x, 1.f, -1.f, x, 0.f, 1.f };
+        vertices.insert(vertices.end(), v, v + 9);
+        for (int j = 0; j < 3; ++j)
+        {
+            indices.push_back(3 * i + j);
+        }
+    }
+
+    apigpu_->DetachAll();
+    apigpu_->SetOption("acc.type", "bvh");
+    apigpu_->SetOption("bvh.builder", "median");
+
+    Shape* shape = nullptr;
+    ASSERT_NO_THROW(shape = apigpu_->CreateMesh(vertices.data(), 3 * kNumTriangles, 3 * sizeof(float), indices.data(), 0, nullptr, kNumTriangles));
+    ASSERT_NO_THROW(apigpu_->AttachShape(shape));
+    ASSERT_NO_THROW(apigpu_->Commit());
+
+    // One ray in front of each triangle, the last ones go down the deepest path
+    std::vector<ray> rays(kNumTriangles);
+    for (int i = 0; i < kNumTriangles; ++i)
+    {
+        rays[i] = ray(float3(0.75f * std::ldexp(1.f, -i), 0.f, 0.f), float3(1.f, 0.f, 0.f));
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    auto ray_buffer = apigpu_->CreateBuffer(kNumTriangles * sizeof(ray), rays.data());
+    auto isect_buffer = apigpu_->CreateBuffer(kNumTriangles * sizeof(Intersection), nullptr);
+    auto occl_buffer = apigpu_->CreateBuffer(kNumTriangles * sizeof(int), nullptr);
+
+    Event* e = nullptr;
+    ASSERT_NO_THROW(apigpu_->QueryIntersection(ray_buffer, kNumTriangles, isect_buffer, nullptr, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+    ASSERT_NO_THROW(apigpu_->QueryOcclusion(ray_buffer, kNumTriangles, occl_buffer, nullptr, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(apigpu_->MapBuffer(isect_buffer, kMapRead, 0, kNumTriangles * sizeof(Intersection), (void**)&isect, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+
+    // Closest one is the triangle the ray starts in front of
+    for (int i = 0; i < kNumTriangles; ++i)
+    {
+        EXPECT_EQ(isect[i].primid, i);
+        EXPECT_FLOAT_EQ(isect[i].uvwt.w, 0.25f * std::ldexp(1.f, -i));
+    }
+
+    ASSERT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer, isect, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(apigpu_->MapBuffer(occl_buffer, kMapRead, 0, kNumTriangles * sizeof(int), (void**)&occluded, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+
+    for (int i = 0; i < kNumTriangles; ++i)
+    {
+        EXPECT_EQ(occluded[i], 1);
+    }
+
+    ASSERT_NO_THROW(apigpu_->UnmapBuffer(occl_buffer, occluded, &e));
+    e->Wait(); apigpu_->DeleteEvent(e);
+
+    apigpu_->DeleteBuffer(ray_buffer);
+    apigpu_->DeleteBuffer(isect_buffer);
+    apigpu_->DeleteBuffer(occl_buffer);
+    apigpu_->DetachAll();
+    apigpu_->DeleteShape(shape);
+
+    for (auto fixture_shape : apishapes_gpu_)
+    {
+        apigpu_->AttachShape(fixture_shape);
+    }
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<1>(api);
+}
+TEST_F(ApiConformanceNative, CornellBox_100RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<100>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RandomRays_AnyHit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.force2level", 0.f);
+
+    ExpectAnyRaysOk<10000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_ClosestHit_Events_Bruteforce)
+{
+    int const kNumRays = 10000;
+
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+    Intersection isect_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(apigpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ray* r_gpu = nullptr;
+
+    Event* egpu;
+    EXPECT_NO_THROW(apigpu_->MapBuffer(ray_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        r_gpu[i].o = r_brute[i].o;
+        r_gpu[i].d = r_brute[i].d;
+        r_gpu[i].SetActive(true);
+        r_gpu[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(ray_buffer_gpu, r_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    // Intersect
+    Event* gpu_event = nullptr;
+    EXPECT_NO_THROW(apigpu_->QueryIntersection(ray_buffer_gpu, kNumRays, isect_buffer_gpu, nullptr, &gpu_event));
+
+    EXPECT_NE(gpu_event, nullptr);
+
+    EXPECT_NO_THROW(gpu_event->Complete());
+    EXPECT_NO_THROW(gpu_event->Wait());
+
+    Intersection* isect_gpu = nullptr;
+
+    EXPECT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i] , isect_gpu[i]);
+    }
+
+
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    EXPECT_NO_THROW(apigpu_->DeleteEvent(gpu_event));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer_gpu));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
+}
+
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_UpdateVertices_Refit_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+    api->SetOption("bvh.refit", 1.f);
+
+    ExpectClosestRaysOk<1000>(api);
+
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+
+    DeformShapes(1.3f, -0.1f);
+    ExpectAnyRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_UpdateVertices_Rebuild_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+
+    ExpectClosestRaysOk<1000>(api);
+
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+// Uniquely named directory removed along with its files when going out of scope
+class TempDirectory
+{
+public:
+    TempDirectory()
+    {
+#ifdef _WIN32
+        char base[MAX_PATH];
+        char name[MAX_PATH];
+        if (GetTempPathA(MAX_PATH, base) && GetTempFileNameA(base, "rr", 0, name))
+        {
+            // The name is reserved by an empty file which is replaced by the directory
+            DeleteFileA(name);
+            if (CreateDirectoryA(name, nullptr))
+            {
+                path_ = name;
+            }
+        }
+#else
+        char const* base = std::getenv("TMPDIR");
+        std::string name = std::string(base ? base : "/tmp") + "/rrcacheXXXXXX";
+        if (mkdtemp(&name[0]))
+        {
+            path_ = name;
+        }
+#endif
+    }
+
+    ~TempDirectory()
+    {
+        if (path_.empty())
+        {
+            return;
+        }
+
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        auto find = FindFirstFileA((path_ + "\\*").c_str(), &data);
+        if (find != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                {
+                    DeleteFileA((path_ + "\\" + data.cFileName).c_str());
+                }
+            } while (FindNextFileA(find, &data));
+            FindClose(find);
+        }
+        RemoveDirectoryA(path_.c_str());
+#else
+        if (auto dir = opendir(path_.c_str()))
+        {
+            while (auto entry = readdir(dir))
+            {
+                std::string name = entry->d_name;
+                if (name != "." && name != "..")
+                {
+                    std::remove((path_ + "/" + name).c_str());
+                }
+            }
+            closedir(dir);
+        }
+        rmdir(path_.c_str());
+#endif
+    }
+
+    TempDirectory(TempDirectory const&) = delete;
+    TempDirectory& operator = (TempDirectory const&) = delete;
+
+    std::string const& path() const { return path_; }
+
+private:
+    std::string path_;
+};
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_Cache_Bruteforce)
+{
+    auto api = apigpu_;
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+
+    // Entries left by other runs must not affect the test
+    TempDirectory cache;
+    ASSERT_FALSE(cache.path().empty());
+    api->SetOption("bvh.cache.path", cache.path().c_str());
+
+    ExpectClosestRaysOk<1000>(api);
+
+    // Reattaching forces another build which is served from the cache
+    ASSERT_NO_THROW(api->DetachAll());
+    for (auto shape : apishapes_gpu_)
+    {
+        ASSERT_NO_THROW(api->AttachShape(shape));
+    }
+    ExpectClosestRaysOk<1000>(api);
+
+    // Changed geometry must not be served from the entry of the original one
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+
+    // The directory is removed before the commit in TearDown
+    api->SetOption("bvh.cache.path", "");
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_DetachAttach_Bruteforce)
+{
+    auto api = apigpu_;
+
+    ExpectClosestRaysOk<1000>(api);
+
+    // Detaching frees slots which are taken by shapes attached later
+    auto detached0 = test_shapes_[0];
+    auto detached1 = test_shapes_[1];
+    ASSERT_NO_THROW(api->DetachShape(detached0.shape));
+    ASSERT_NO_THROW(api->DetachShape(detached1.shape));
+    test_shapes_.erase(test_shapes_.begin(), test_shapes_.begin() + 2);
+    ExpectClosestRaysOk<1000>(api);
+
+    // Attach one of them back and change another one within the same commit
+    ASSERT_NO_THROW(api->AttachShape(detached1.shape));
+    test_shapes_.push_back(detached1);
+    DeformShapes(0.8f, 0.1f);
+    ExpectClosestRaysOk<1000>(api);
+
+    ASSERT_NO_THROW(api->AttachShape(detached0.shape));
+    test_shapes_.push_back(detached0);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_SharedMesh_Bruteforce)
+{
+    auto api = apigpu_;
+
+    // Replace the meshes by ones referencing reference data directly
+    for (auto& test_shape : test_shapes_)
+    {
+        ASSERT_NO_THROW(api->DeleteShape(test_shape.shape));
+
+        Shape* shape = nullptr;
+        ASSERT_NO_THROW(shape = api->CreateMeshShared(&test_shape.positions[0], (int)test_shape.positions.size() / 3, 3 * sizeof(float),
+            &test_shape.indices[0], 0, (int)test_shape.indices.size() / 3));
+        ASSERT_NO_THROW(api->AttachShape(shape));
+
+        test_shape.shape = shape;
+    }
+
+    apishapes_gpu_.clear();
+    for (auto& test_shape : test_shapes_)
+    {
+        apishapes_gpu_.push_back(test_shape.shape);
+    }
+
+    ExpectClosestRaysOk<1000>(api);
+
+    // Vertices are changed in place, UpdateVertices only notifies the mesh
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<1000>(api);
+}
+
+inline void ApiConformanceNative::DeformShapes(float scale, float offset)
+{
+    for (auto& test_shape : test_shapes_)
+    {
+        auto& positions = test_shape.positions;
+
+        // Squash along y and shift along x, the amount depends on height
+        for (auto i = 0u; i < positions.size(); i += 3)
+        {
+            positions[i] += offset * positions[i + 1];
+            positions[i + 1] *= scale;
+        }
+
+        ASSERT_NO_THROW(test_shape.shape->UpdateVertices(&positions[0], (int)positions.size() / 3, 3 * sizeof(float)));
+    }
+}
+
+inline void ApiConformanceNative::ExpectClosestIntersectionOk(const Intersection& expected, const Intersection& test) const
+{
+    ASSERT_EQ(test.shapeid, expected.shapeid);
+
+    if (test.shapeid != kNullId)
+    {
+        // Check if the distance is the same
+        const double dist = (test.uvwt.w - expected.uvwt.w) * (test.uvwt.w - expected.uvwt.w);
+        ASSERT_NEAR(0, dist, 1e-5);
+    }
+}
+
+template<int kNumRays>
+inline void ApiConformanceNative::ExpectClosestRaysOk(RadeonRays::IntersectionApi* api)const
+{
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+    Intersection isect_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    // generate the golden test results
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer = api->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    // Intersect
+    EXPECT_NO_THROW(api->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect[i]);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(isect_buffer, isect, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(isect_buffer));
+}
+
+template<int kNumRays>
+inline void ApiConformanceNative::ExpectAnyRaysOk(RadeonRays::IntersectionApi* api) const
+{
+    // Make sure the ray is not on BB boundary
+    // in this case results may differ due to 
+    // different NaNs propagation in BB test
+    // TODO: fix this
+
+    bool any_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    // generate some random vectors
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(api->Commit());
+
+    // generate the golden test results
+    TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, any_brute);
+
+    auto ray_buffer = api->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto result_buffer = api->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ray* rays = nullptr;
+    Event* ev;
+
+    EXPECT_NO_THROW(api->MapBuffer(ray_buffer, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        rays[i].o = r_brute[i].o;
+        rays[i].d = r_brute[i].d;
+
+        rays[i].SetActive(true);
+        rays[i].SetMask(0xFFFFFFFF);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(ray_buffer, rays, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    // Intersect
+    EXPECT_NO_THROW(api->QueryOcclusion(ray_buffer, kNumRays, result_buffer, nullptr, nullptr));
+
+
+    int* results = nullptr;
+    EXPECT_NO_THROW(api->MapBuffer(result_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+    for (auto i = 0; i<kNumRays; ++i)
+    {
+        ASSERT_EQ(any_brute[i], (results[i] > 0) ? true : false);
+    }
+
+    EXPECT_NO_THROW(api->UnmapBuffer(result_buffer, results, &ev));
+    ev->Wait(); api->DeleteEvent(ev);
+
+
+    EXPECT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    EXPECT_NO_THROW(api->DeleteBuffer(result_buffer));
+}
+
+
+
+TEST_F(ApiConformanceNative, CornellBox_1000RaysRandom_ClosestHit_Queue_Bruteforce)
+{
+    int const kNumRays = 1000;
+
+    Intersection isect_brute[kNumRays];
+    ray r_brute[kNumRays];
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r_brute[i].o = float3(rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, rand_float() * 3.f - 1.5f, 1000.f);
+        r_brute[i].d = normalize(float3(rand_float(), rand_float(), rand_float()));
+    }
+
+    EXPECT_NO_THROW(apigpu_->Commit());
+
+    TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), r_brute, kNumRays, isect_brute);
+
+    auto ray_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(ray), nullptr);
+    auto isect_buffer_gpu = apigpu_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ray* r_gpu = nullptr;
+
+    Event* egpu;
+    EXPECT_NO_THROW(apigpu_->MapBuffer(ray_buffer_gpu, kMapWrite, 0, kNumRays * sizeof(ray), (void**)&r_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        r_gpu[i].o = r_brute[i].o;
+        r_gpu[i].d = r_brute[i].d;
+        r_gpu[i].SetActive(true);
+        r_gpu[i].SetMask(0xFFFFFFFF);
+    }
+
+    // Do not wait for the unmap, the query depends on it instead
+    Event* unmap_event = nullptr;
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(ray_buffer_gpu, r_gpu, &unmap_event));
+
+    auto num_queues = apigpu_->GetQueueCount();
+    EXPECT_GE(num_queues, 1u);
+    EXPECT_THROW(apigpu_->QueryIntersection(num_queues, ray_buffer_gpu, kNumRays, isect_buffer_gpu, nullptr, nullptr), Exception);
+
+    // Intersect on the last queue
+    Event* gpu_event = nullptr;
+    EXPECT_NO_THROW(apigpu_->QueryIntersection(num_queues - 1, ray_buffer_gpu, kNumRays, isect_buffer_gpu, unmap_event, &gpu_event));
+    EXPECT_NE(gpu_event, nullptr);
+    EXPECT_NO_THROW(gpu_event->Wait());
+
+    Intersection* isect_gpu = nullptr;
+
+    EXPECT_NO_THROW(apigpu_->MapBuffer(isect_buffer_gpu, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    for (int i = 0; i<kNumRays; ++i)
+    {
+        ExpectClosestIntersectionOk(isect_brute[i], isect_gpu[i]);
+    }
+
+    EXPECT_NO_THROW(apigpu_->UnmapBuffer(isect_buffer_gpu, isect_gpu, &egpu));
+    egpu->Wait(); apigpu_->DeleteEvent(egpu);
+
+    EXPECT_NO_THROW(apigpu_->DeleteEvent(unmap_event));
+    EXPECT_NO_THROW(apigpu_->DeleteEvent(gpu_event));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(ray_buffer_gpu));
+    EXPECT_NO_THROW(apigpu_->DeleteBuffer(isect_buffer_gpu));
+}
+
+TEST_F(ApiConformanceNative, CornellBox_10000RaysRandom_MultiDevice_Bruteforce)
+{
+    // Use the native device twice, the batches are split between both instances
+    std::uint32_t devidx[2] = { 0, 0 };
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.platform == DeviceInfo::kNative)
+        {
+            devidx[0] = devidx[1] = idx;
+        }
+    }
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = IntersectionApi::Create(devidx, 2));
+    ASSERT_NE(api, nullptr);
+
+    for (auto shape : apishapes_gpu_)
+    {
+        ASSERT_NO_THROW(api->AttachShape(shape));
+    }
+
+    api->SetOption("acc.type", "bvh");
+    api->SetOption("bvh.builder", "sah");
+
+    // The second batch is split by measured throughput
+    ExpectClosestRaysOk<10000>(api);
+    ExpectClosestRaysOk<10000>(api);
+    ExpectAnyRaysOk<10000>(api);
+
+    // Both devices keep their own copy of the scene
+    DeformShapes(0.7f, 0.2f);
+    ExpectClosestRaysOk<10000>(api);
+
+    // Shapes are owned by the fixture
+    api->DetachAll();
+    IntersectionApi::Delete(api);
+}
@@ -0,0 +1,178 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RADEONRAYS_WORLD_TEST_H
+#define RADEONRAYS_WORLD_TEST_H
+
+/// This test suite is testing World shape bookkeeping
+/// and change tracking directly, without going through IntersectionApi
+///
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "RadeonRays/src/primitive/mesh.h"
+#include "RadeonRays/src/world/world.h"
+
+using namespace RadeonRays;
+
+// Fixture providing single triangle meshes
+class WorldTest : public ::testing::Test
+{
+public:
+    void SetUp() override
+    {
+        float const vertices[] = { 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f };
+        int const indices[] = { 0, 1, 2 };
+
+        for (int i = 0; i < 4; ++i)
+        {
+            meshes_.emplace_back(new Mesh(vertices, 3, 3 * sizeof(float), indices, 0, nullptr, 1));
+        }
+    }
+
+    static bool Contains(std::vector<Shape const*> const& shapes, Shape const* shape)
+    {
+        return std::find(shapes.cbegin(), shapes.cend(), shape) != shapes.cend();
+    }
+
+    std::vector<std::unique_ptr<Mesh>> meshes_;
+};
+
+TEST_F(WorldTest, DetachKeepsSlots)
+{
+    World world;
+    for (auto& mesh : meshes_)
+    {
+        world.AttachShape(mesh.get());
+    }
+
+    world.DetachShape(meshes_[1].get());
+    ASSERT_EQ(world.GetShapes(), (std::vector<Shape const*>{ meshes_[0].get(), meshes_[2].get(), meshes_[3].get() }));
+
+    // Freed slot is taken by the next shape attached
+    world.AttachShape(meshes_[1].get());
+    ASSERT_EQ(world.GetShapes(), (std::vector<Shape const*>{ meshes_[0].get(), meshes_[1].get(), meshes_[2].get(), meshes_[3].get() }));
+
+    world.DetachAll();
+    ASSERT_TRUE(world.GetShapes().empty());
+
+    world.AttachShape(meshes_[3].get());
+    ASSERT_EQ(world.GetShapes(), (std::vector<Shape const*>{ meshes_[3].get() }));
+}
+
+TEST_F(WorldTest, GetChanges)
+{
+    World world;
+    World::ChangeList changes;
+
+    world.AttachShape(meshes_[0].get());
+    world.AttachShape(meshes_[1].get());
+    world.AttachShape(meshes_[2].get());
+
+    world.GetChanges(changes);
+    ASSERT_EQ(changes.added.size(), 3u);
+    ASSERT_TRUE(changes.removed.empty());
+    ASSERT_TRUE(changes.changed.empty());
+
+    world.OnCommit();
+    world.GetChanges(changes);
+    ASSERT_TRUE(changes.added.empty() && changes.removed.empty() && changes.changed.empty());
+    ASSERT_EQ(world.GetStateChange(), ShapeImpl::kStateChangeNone);
+
+    // Each kind of change since the commit
+    meshes_[0]->SetId(10);
+    meshes_[0]->SetId(11);
+    world.DetachShape(meshes_[1].get());
+    world.AttachShape(meshes_[3].get());
+    // Attached and detached back within the same commit is no change
+    world.DetachShape(meshes_[3].get());
+    // Changed while detached, the change is not reported to the world
+    meshes_[3]->SetId(12);
+
+    world.GetChanges(changes);
+    ASSERT_EQ(changes.added, std::vector<Shape const*>{});
+    ASSERT_EQ(changes.removed, std::vector<Shape const*>{ meshes_[1].get() });
+    ASSERT_EQ(changes.changed, std::vector<Shape const*>{ meshes_[0].get() });
+    ASSERT_EQ(changes.statechange, ShapeImpl::kStateChangeId);
+    ASSERT_EQ(world.GetStateChange(), ShapeImpl::kStateChangeId);
+
+    world.OnCommit();
+    ASSERT_EQ(meshes_[0]->GetStateChange(), ShapeImpl::kStateChangeNone);
+
+    // Shape changed while detached carries its flags when attached back
+    world.AttachShape(meshes_[3].get());
+    world.GetChanges(changes);
+    ASSERT_EQ(changes.added, std::vector<Shape const*>{ meshes_[3].get() });
+    ASSERT_EQ(world.GetStateChange(), ShapeImpl::kStateChangeId);
+}
+
+TEST_F(WorldTest, GetChangesMultipleWorlds)
+{
+    World world0;
+    World::ChangeList changes;
+
+    {
+        World world1;
+
+        for (auto& mesh : meshes_)
+        {
+            world0.AttachShape(mesh.get());
+            world1.AttachShape(mesh.get());
+        }
+
+        world0.OnCommit();
+        world1.OnCommit();
+
+        // Detaching from one world keeps reporting changes to the other
+        world1.DetachShape(meshes_[0].get());
+        meshes_[0]->SetId(10);
+
+        world0.GetChanges(changes);
+        ASSERT_EQ(changes.changed, std::vector<Shape const*>{ meshes_[0].get() });
+
+        // Committing one world keeps the change pending in the other
+        meshes_[1]->SetId(11);
+        world1.OnCommit();
+        ASSERT_EQ(meshes_[1]->GetStateChange(), ShapeImpl::kStateChangeId);
+
+        world0.GetChanges(changes);
+        ASSERT_EQ(changes.changed, (std::vector<Shape const*>{ meshes_[0].get(), meshes_[1].get() }));
+
+        world0.OnCommit();
+        ASSERT_EQ(meshes_[0]->GetStateChange(), ShapeImpl::kStateChangeNone);
+        ASSERT_EQ(meshes_[1]->GetStateChange(), ShapeImpl::kStateChangeNone);
+
+        meshes_[2]->SetId(12);
+        world1.GetChanges(changes);
+        ASSERT_EQ(changes.changed, std::vector<Shape const*>{ meshes_[2].get() });
+    }
+
+    // Shapes stop reporting to the world destroyed
+    meshes_[2]->SetId(13);
+    world0.GetChanges(changes);
+    ASSERT_EQ(changes.changed, std::vector<Shape const*>{ meshes_[2].get() });
+}
+
+#endif // RADEONRAYS_WORLD_TEST_H
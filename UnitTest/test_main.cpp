@@ -42,6 +42,11 @@ THE SOFTWARE.
 
 #endif
 
+#include "calc_buffer_pool_test.h"
+#include "radeon_rays_bvh_test.h"
+#include "radeon_rays_world_test.h"
+#include "radeon_rays_conformance_test_cpu.h"
+
 #include "gtest/gtest.h"
 
 